@@ -0,0 +1,117 @@
+#include "arena.h"
+#include "dictionary.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+// Chunks are bump-allocated and only ever released all together
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  size_t used;
+  _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+struct arena {
+  struct arena_chunk *chunks;
+  size_t chunk_size;
+  size_t used;
+  size_t reserved;
+};
+
+struct arena *arena_new(size_t chunk_size) {
+  struct arena *arena = calloc(1, sizeof(struct arena));
+  if (!arena) {
+    error_callback("%s: calloc() failed\n", __func__);
+    return NULL;
+  }
+
+  arena->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+
+  return arena;
+}
+
+void arena_del(struct arena *arena) {
+  if (!arena) {
+    return;
+  }
+
+  struct arena_chunk *chunk = arena->chunks;
+  while (chunk) {
+    struct arena_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  free(arena);
+}
+
+static struct arena_chunk *add_chunk(struct arena *arena, size_t size) {
+  struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + size);
+  if (!chunk) {
+    error_callback("%s: malloc() failed\n", __func__);
+    return NULL;
+  }
+
+  chunk->size = size;
+  chunk->used = 0;
+  arena->reserved += size;
+
+  // oversized allocations get a chunk of their own behind the current one so
+  // the remaining space of the current chunk is not given up
+  if (size > arena->chunk_size && arena->chunks) {
+    chunk->next = arena->chunks->next;
+    arena->chunks->next = chunk;
+  } else {
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+
+  return chunk;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  if (!arena || !size) {
+    return NULL;
+  }
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  struct arena_chunk *chunk = arena->chunks;
+  if (!chunk || chunk->size - chunk->used < size) {
+    chunk = add_chunk(arena, size > arena->chunk_size ? size
+                                                     : arena->chunk_size);
+    if (!chunk) {
+      return NULL;
+    }
+  }
+
+  void *ptr = chunk->data + chunk->used;
+  chunk->used += size;
+  arena->used += size;
+
+  return ptr;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  if (!copy) {
+    return NULL;
+  }
+
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+
+  return copy;
+}
+
+void arena_usage(const struct arena *arena, size_t *used, size_t *reserved) {
+  if (used) {
+    *used = arena ? arena->used : 0;
+  }
+  if (reserved) {
+    *reserved = arena ? arena->reserved : 0;
+  }
+}
@@ -0,0 +1,16 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena;
+
+struct arena *arena_new(size_t chunk_size);
+void arena_del(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
+
+void arena_usage(const struct arena *arena, size_t *used, size_t *reserved);
+
+#endif // ARENA_H
@@ -0,0 +1,381 @@
+#include "async_restricted_dictionary.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum async_type { ASYNC_SET, ASYNC_RESTRICT, ASYNC_UNRESTRICT };
+
+// A queued request, the key and value or the two pairs share one allocation
+// that starts at first
+struct async_request {
+  enum async_type type;
+  char *first;
+  char *second;
+  void (*done)(void *arg, int ret);
+  void *arg;
+};
+
+// The slot is free for the producer holding ticket t while seq is t, and
+// holds its request once seq is t + 1. Taking the request out makes it free
+// for ticket t + queue size.
+struct async_slot {
+  atomic_uint seq;
+  struct async_request request;
+};
+
+struct async_restricted_dictionary {
+  struct concurrent_restricted_dictionary *c_dict;
+  struct async_slot *slots;
+  unsigned int mask;
+  unsigned int max_batch;
+  // next ticket, taken by the producers. On a line of its own so they do
+  // not slow down the worker.
+  _Alignas(64) atomic_uint tail;
+  // the worker's own from here on
+  _Alignas(64) unsigned int head;
+  struct async_request *batch;
+  int *results;
+  pthread_t worker;
+  // set by the worker before it waits on wake, the producer that clears it
+  // posts wake
+  atomic_int sleeping;
+  atomic_int stopping;
+  sem_t wake;
+  // requests applied, flush() waits on done_cond for it to catch up
+  pthread_mutex_t done_lock;
+  pthread_cond_t done_cond;
+  unsigned int applied;
+};
+
+static int is_valid_pair(const char *pair) {
+  struct restricted_pair split;
+  return restricted_dictionary_split_pair(pair, strlen(pair), &split) == 0;
+}
+
+// Returns -1 when the queue is full
+static int enqueue(struct async_restricted_dictionary *a_dict,
+                   const struct async_request *request) {
+  unsigned int pos = atomic_load_explicit(&a_dict->tail, memory_order_relaxed);
+
+  for (;;) {
+    struct async_slot *slot = &a_dict->slots[pos & a_dict->mask];
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    int diff = (int)(seq - pos);
+    if (diff == 0) {
+      // on failure pos is reloaded
+      if (atomic_compare_exchange_weak_explicit(&a_dict->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        slot->request = *request;
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        return 0;
+      }
+    } else if (diff < 0) {
+      // the worker has not taken the request queue size tickets back yet
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&a_dict->tail, memory_order_relaxed);
+    }
+  }
+}
+
+// Worker only, whether the next request has been queued
+static int queued(const struct async_restricted_dictionary *a_dict) {
+  const struct async_slot *slot = &a_dict->slots[a_dict->head & a_dict->mask];
+  return atomic_load_explicit(&slot->seq, memory_order_acquire) ==
+         a_dict->head + 1;
+}
+
+// Worker only, returns 0 when there is no request to take
+static int dequeue(struct async_restricted_dictionary *a_dict,
+                   struct async_request *request) {
+  if (!queued(a_dict)) {
+    return 0;
+  }
+
+  struct async_slot *slot = &a_dict->slots[a_dict->head & a_dict->mask];
+  *request = slot->request;
+  atomic_store_explicit(&slot->seq, a_dict->head + a_dict->mask + 1,
+                        memory_order_release);
+  a_dict->head++;
+
+  return 1;
+}
+
+// Pairs with the worker's check of the queue after it set sleeping, one of
+// the two sees the other's store
+static void wake_worker(struct async_restricted_dictionary *a_dict) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&a_dict->sleeping) &&
+      atomic_exchange(&a_dict->sleeping, 0)) {
+    sem_post(&a_dict->wake);
+  }
+}
+
+static int apply(struct concurrent_restricted_dictionary *c_dict,
+                 const struct async_request *request) {
+  switch (request->type) {
+  case ASYNC_SET:
+    return concurrent_restricted_dictionary_set(c_dict, request->first,
+                                                request->second);
+  case ASYNC_RESTRICT:
+    return concurrent_restricted_dictionary_restrict(c_dict, request->first,
+                                                     request->second);
+  default:
+    return concurrent_restricted_dictionary_unrestrict(c_dict, request->first,
+                                                       request->second);
+  }
+}
+
+// A set right after the same set finds the dictionary as the first one left
+// it, so it gets the same answer without another check
+static int repeats(const struct async_request *request,
+                   const struct async_request *prev, int prev_ret) {
+  return request->type == ASYNC_SET && prev->type == ASYNC_SET &&
+         (prev_ret == 0 || prev_ret == RESTRICTED_DICTIONARY_ERESTRICTED) &&
+         strcmp(request->first, prev->first) == 0 &&
+         strcmp(request->second, prev->second) == 0;
+}
+
+// Applies the batch in one transaction, the requests in it still succeed or
+// fail one by one. Completions follow the commit, so whoever they wake sees
+// the whole batch.
+static void apply_batch(struct async_restricted_dictionary *a_dict,
+                        unsigned int num) {
+  // without the transaction each request takes the lock on its own
+  int in_transaction =
+      concurrent_restricted_dictionary_begin(a_dict->c_dict) == 0;
+
+  for (unsigned int i = 0; i < num; i++) {
+    if (i && repeats(&a_dict->batch[i], &a_dict->batch[i - 1],
+                     a_dict->results[i - 1])) {
+      a_dict->results[i] = a_dict->results[i - 1];
+    } else {
+      a_dict->results[i] = apply(a_dict->c_dict, &a_dict->batch[i]);
+    }
+  }
+
+  if (in_transaction) {
+    concurrent_restricted_dictionary_commit(a_dict->c_dict);
+  }
+
+  for (unsigned int i = 0; i < num; i++) {
+    struct async_request *request = &a_dict->batch[i];
+    if (request->done) {
+      request->done(request->arg, a_dict->results[i]);
+    }
+    free(request->first);
+  }
+
+  pthread_mutex_lock(&a_dict->done_lock);
+  a_dict->applied += num;
+  pthread_cond_broadcast(&a_dict->done_cond);
+  pthread_mutex_unlock(&a_dict->done_lock);
+}
+
+static void *worker(void *ptr) {
+  struct async_restricted_dictionary *a_dict = ptr;
+
+  for (;;) {
+    unsigned int num = 0;
+    while (num < a_dict->max_batch && dequeue(a_dict, &a_dict->batch[num])) {
+      num++;
+    }
+    if (num) {
+      apply_batch(a_dict, num);
+      continue;
+    }
+
+    // del() waits for what was queued before it
+    if (atomic_load(&a_dict->stopping)) {
+      return NULL;
+    }
+
+    atomic_store(&a_dict->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (queued(a_dict) || atomic_load(&a_dict->stopping)) {
+      // a producer that cleared sleeping first has posted or is about to
+      if (!atomic_exchange(&a_dict->sleeping, 0)) {
+        while (sem_wait(&a_dict->wake) == -1) {
+        }
+      }
+      continue;
+    }
+
+    while (sem_wait(&a_dict->wake) == -1) {
+    }
+  }
+}
+
+struct async_restricted_dictionary *
+async_restricted_dictionary_new(struct concurrent_restricted_dictionary *c_dict,
+                                unsigned int queue_size,
+                                unsigned int max_batch) {
+  if (!c_dict || !queue_size || queue_size > (1u << 31) || !max_batch) {
+    error_callback("%s: invalid input\n", __func__);
+    return NULL;
+  }
+
+  unsigned int num_slots = 2;
+  while (num_slots < queue_size) {
+    num_slots <<= 1;
+  }
+
+  // the size is a multiple of the alignment of tail and head
+  struct async_restricted_dictionary *a_dict =
+      aligned_alloc(_Alignof(struct async_restricted_dictionary),
+                    sizeof(struct async_restricted_dictionary));
+  if (!a_dict) {
+    error_callback("%s: aligned_alloc() failed\n", __func__);
+    return NULL;
+  }
+  memset(a_dict, 0, sizeof(struct async_restricted_dictionary));
+
+  a_dict->c_dict = c_dict;
+  a_dict->mask = num_slots - 1;
+  a_dict->max_batch = max_batch;
+  a_dict->slots = calloc(num_slots, sizeof(struct async_slot));
+  a_dict->batch = malloc(max_batch * sizeof(struct async_request));
+  a_dict->results = malloc(max_batch * sizeof(int));
+  if (!a_dict->slots || !a_dict->batch || !a_dict->results) {
+    error_callback("%s: malloc() failed\n", __func__);
+    free(a_dict->slots);
+    free(a_dict->batch);
+    free(a_dict->results);
+    free(a_dict);
+    return NULL;
+  }
+
+  for (unsigned int i = 0; i < num_slots; i++) {
+    atomic_init(&a_dict->slots[i].seq, i);
+  }
+  sem_init(&a_dict->wake, 0, 0);
+  pthread_mutex_init(&a_dict->done_lock, NULL);
+  pthread_cond_init(&a_dict->done_cond, NULL);
+
+  if (pthread_create(&a_dict->worker, NULL, worker, a_dict) != 0) {
+    error_callback("%s: pthread_create() failed\n", __func__);
+    sem_destroy(&a_dict->wake);
+    pthread_mutex_destroy(&a_dict->done_lock);
+    pthread_cond_destroy(&a_dict->done_cond);
+    free(a_dict->slots);
+    free(a_dict->batch);
+    free(a_dict->results);
+    free(a_dict);
+    return NULL;
+  }
+
+  return a_dict;
+}
+
+void async_restricted_dictionary_del(
+    struct async_restricted_dictionary *a_dict) {
+  if (!a_dict) {
+    return;
+  }
+
+  atomic_store(&a_dict->stopping, 1);
+  wake_worker(a_dict);
+  pthread_join(a_dict->worker, NULL);
+
+  sem_destroy(&a_dict->wake);
+  pthread_mutex_destroy(&a_dict->done_lock);
+  pthread_cond_destroy(&a_dict->done_cond);
+  free(a_dict->slots);
+  free(a_dict->batch);
+  free(a_dict->results);
+  free(a_dict);
+}
+
+// Copies the two strings into one allocation and queues the request
+static int submit(struct async_restricted_dictionary *a_dict, const char *func,
+                  enum async_type type, const char *first, const char *second,
+                  void (*done)(void *arg, int ret), void *arg) {
+  size_t first_len = strlen(first) + 1;
+  size_t second_len = strlen(second) + 1;
+  char *copy = malloc(first_len + second_len);
+  if (!copy) {
+    error_callback("%s: malloc() failed\n", func);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+  memcpy(copy, first, first_len);
+  memcpy(copy + first_len, second, second_len);
+
+  struct async_request request = {type, copy, copy + first_len, done, arg};
+  if (enqueue(a_dict, &request) == -1) {
+    free(copy);
+    return RESTRICTED_DICTIONARY_EAGAIN;
+  }
+
+  wake_worker(a_dict);
+
+  return 0;
+}
+
+int async_restricted_dictionary_set(struct async_restricted_dictionary *a_dict,
+                                    const char *key, const char *val,
+                                    void (*done)(void *arg, int ret),
+                                    void *arg) {
+  if (!a_dict || !key || !val) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return submit(a_dict, __func__, ASYNC_SET, key, val, done, arg);
+}
+
+int async_restricted_dictionary_restrict(
+    struct async_restricted_dictionary *a_dict, const char *slave_pair,
+    const char *master_pair, void (*done)(void *arg, int ret), void *arg) {
+  if (!a_dict || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (!is_valid_pair(slave_pair) || !is_valid_pair(master_pair)) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return submit(a_dict, __func__, ASYNC_RESTRICT, slave_pair, master_pair,
+                done, arg);
+}
+
+int async_restricted_dictionary_unrestrict(
+    struct async_restricted_dictionary *a_dict, const char *slave_pair,
+    const char *master_pair, void (*done)(void *arg, int ret), void *arg) {
+  if (!a_dict || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (!is_valid_pair(slave_pair) || !is_valid_pair(master_pair)) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return submit(a_dict, __func__, ASYNC_UNRESTRICT, slave_pair, master_pair,
+                done, arg);
+}
+
+int async_restricted_dictionary_flush(
+    struct async_restricted_dictionary *a_dict) {
+  if (!a_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // tickets taken so far, the requests of those not queued yet are about to
+  // be
+  unsigned int target = atomic_load(&a_dict->tail);
+
+  pthread_mutex_lock(&a_dict->done_lock);
+  while ((int)(a_dict->applied - target) < 0) {
+    pthread_cond_wait(&a_dict->done_cond, &a_dict->done_lock);
+  }
+  pthread_mutex_unlock(&a_dict->done_lock);
+
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef ASYNC_RESTRICTED_DICTIONARY_H
+#define ASYNC_RESTRICTED_DICTIONARY_H
+
+#include "concurrent_restricted_dictionary.h"
+
+// Sets and rule changes queued by any number of threads and applied to a
+// concurrent_restricted_dictionary by one worker thread. Queueing never takes
+// a lock or waits for the dictionary. The worker takes what is queued in
+// batches and applies each batch in one transaction, so the write lock is
+// taken and the changes are published once per batch, in the order they
+// were queued. Reads and checks go to the concurrent dictionary itself and
+// see a batch once all of it is applied.
+struct async_restricted_dictionary;
+
+// c_dict stays the caller's and must outlive the async dictionary. Up to
+// queue_size requests are queued, rounded up to a power of two, and up to
+// max_batch of them applied at once.
+struct async_restricted_dictionary *
+async_restricted_dictionary_new(struct concurrent_restricted_dictionary *c_dict,
+                                unsigned int queue_size,
+                                unsigned int max_batch);
+// Applies what is queued and stops the worker. No other thread may queue
+// requests any more.
+void async_restricted_dictionary_del(
+    struct async_restricted_dictionary *a_dict);
+
+// Queue a request, the strings are copied. Once the batch of the request is
+// applied, done is called on the worker thread with arg and what the
+// concurrent_restricted_dictionary function returned, done may be NULL.
+// Returns 0 once queued, RESTRICTED_DICTIONARY_EAGAIN while the queue is
+// full and the other codes of restricted_dictionary.h on failure, done is
+// then not called.
+int async_restricted_dictionary_set(struct async_restricted_dictionary *a_dict,
+                                    const char *key, const char *val,
+                                    void (*done)(void *arg, int ret),
+                                    void *arg);
+int async_restricted_dictionary_restrict(
+    struct async_restricted_dictionary *a_dict, const char *slave_pair,
+    const char *master_pair, void (*done)(void *arg, int ret), void *arg);
+int async_restricted_dictionary_unrestrict(
+    struct async_restricted_dictionary *a_dict, const char *slave_pair,
+    const char *master_pair, void (*done)(void *arg, int ret), void *arg);
+
+// Waits until every request queued before the call is applied and its done
+// has returned. Must not be called from done.
+int async_restricted_dictionary_flush(
+    struct async_restricted_dictionary *a_dict);
+
+#endif // ASYNC_RESTRICTED_DICTIONARY_H
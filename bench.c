@@ -0,0 +1,409 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "restricted_dictionary.h"
+
+// Benchmark of restricted_dictionary operations on a synthetic policy, see
+// usage() for the workload knobs. Allocations are counted by replacing
+// malloc, which only works with glibc, elsewhere they are reported as -1.
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long num_allocs;
+
+void *malloc(size_t size) {
+  num_allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+  num_allocs++;
+  return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  num_allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+#define ALLOCS_COUNTED 1
+#else
+static unsigned long num_allocs;
+#define ALLOCS_COUNTED 0
+#endif
+
+enum bench_op {
+  OP_SET,
+  OP_RESTRICT,
+  OP_MULTIRESTRICT,
+  OP_UNRESTRICT,
+  OP_FREEZE,
+  OP_DEL
+};
+
+#define NUM_OPS 6
+
+static const char *op_names[NUM_OPS] = {
+    "set", "restrict", "multiRestrict", "unrestrict", "freeze", "del"};
+
+struct bench_config {
+  unsigned int keys;
+  unsigned int values;
+  unsigned int slaves;
+  unsigned int fan_out;
+  unsigned int ops;
+  unsigned int sets_per_change;
+  unsigned int rounds;
+  unsigned int flags;
+  unsigned int seed;
+  int freeze;
+  int machine;
+};
+
+// Latencies and allocations of one kind of operation
+struct bench_samples {
+  uint64_t *ns;
+  unsigned int num;
+  unsigned int max;
+  unsigned long allocs;
+};
+
+// A rule of the generated policy, indexes into the key and value names
+struct bench_rule {
+  unsigned int slave_key;
+  unsigned int slave_value;
+  unsigned int *master_keys;
+  unsigned int *master_values;
+};
+
+static struct bench_samples samples[NUM_OPS];
+
+static int quiet(const char *format, ...) {
+  (void)format;
+  return 0;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void record(enum bench_op op, uint64_t start, unsigned long allocs) {
+  uint64_t ns = now_ns() - start;
+  struct bench_samples *s = &samples[op];
+
+  s->allocs += num_allocs - allocs;
+  if (s->num == s->max) {
+    s->max = s->max ? s->max * 2 : 1024;
+    s->ns = realloc(s->ns, s->max * sizeof(uint64_t));
+    if (!s->ns) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  s->ns[s->num++] = ns;
+}
+
+static int compare_ns(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const struct bench_samples *s, double p) {
+  unsigned int i = (unsigned int)(p * (s->num - 1) + 0.5);
+  return s->ns[i];
+}
+
+static void pair_name(char *buf, size_t len, unsigned int key,
+                      unsigned int value) {
+  snprintf(buf, len, "key%u=val%u", key, value);
+}
+
+static void make_rules(const struct bench_config *config,
+                       struct bench_rule *rules) {
+  for (unsigned int i = 0; i < config->slaves; i++) {
+    struct bench_rule *rule = &rules[i];
+    rule->slave_key = rand() % config->keys;
+    rule->slave_value = rand() % config->values;
+    rule->master_keys = malloc(config->fan_out * sizeof(unsigned int));
+    rule->master_values = malloc(config->fan_out * sizeof(unsigned int));
+    if (!rule->master_keys || !rule->master_values) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    for (unsigned int j = 0; j < config->fan_out; j++) {
+      rule->master_keys[j] = rand() % config->keys;
+      rule->master_values[j] = rand() % config->values;
+    }
+  }
+}
+
+// Adds every rule, even ones with restrict() and odd ones with
+// multiRestrict()
+static void add_rules(const struct bench_config *config,
+                      struct restricted_dictionary *r_dict,
+                      const struct bench_rule *rules, char **masters) {
+  char slave[64];
+
+  for (unsigned int i = 0; i < config->slaves; i++) {
+    const struct bench_rule *rule = &rules[i];
+    pair_name(slave, sizeof(slave), rule->slave_key, rule->slave_value);
+    for (unsigned int j = 0; j < config->fan_out; j++) {
+      pair_name(masters[j], 64, rule->master_keys[j], rule->master_values[j]);
+    }
+
+    if (i % 2 == 0) {
+      for (unsigned int j = 0; j < config->fan_out; j++) {
+        unsigned long allocs = num_allocs;
+        uint64_t start = now_ns();
+        restricted_dictionary_restrict(r_dict, slave, masters[j]);
+        record(OP_RESTRICT, start, allocs);
+      }
+    } else {
+      unsigned long allocs = num_allocs;
+      uint64_t start = now_ns();
+      restricted_dictionary_multiRestrict(r_dict, slave, masters,
+                                          config->fan_out);
+      record(OP_MULTIRESTRICT, start, allocs);
+    }
+  }
+}
+
+static void freeze(struct restricted_dictionary *r_dict) {
+  unsigned long allocs = num_allocs;
+  uint64_t start = now_ns();
+  restricted_dictionary_freeze(r_dict);
+  record(OP_FREEZE, start, allocs);
+}
+
+// Sets random keys, every sets_per_change sets one rule is dropped and put
+// back
+static void mixed_ops(const struct bench_config *config,
+                      struct restricted_dictionary *r_dict,
+                      const struct bench_rule *rules) {
+  char key[32];
+  char val[32];
+  char slave[64];
+  char master[64];
+
+  for (unsigned int i = 0; i < config->ops; i++) {
+    if (config->slaves && config->sets_per_change &&
+        i % (config->sets_per_change + 1) == config->sets_per_change) {
+      const struct bench_rule *rule = &rules[rand() % config->slaves];
+      unsigned int j = rand() % config->fan_out;
+      pair_name(slave, sizeof(slave), rule->slave_key, rule->slave_value);
+      pair_name(master, sizeof(master), rule->master_keys[j],
+                rule->master_values[j]);
+
+      // a frozen dictionary is thawed for the change and frozen again
+      if (config->freeze) {
+        restricted_dictionary_thaw(r_dict);
+      }
+
+      unsigned long allocs = num_allocs;
+      uint64_t start = now_ns();
+      restricted_dictionary_unrestrict(r_dict, slave, master);
+      record(OP_UNRESTRICT, start, allocs);
+
+      allocs = num_allocs;
+      start = now_ns();
+      restricted_dictionary_restrict(r_dict, slave, master);
+      record(OP_RESTRICT, start, allocs);
+
+      if (config->freeze) {
+        freeze(r_dict);
+      }
+      continue;
+    }
+
+    snprintf(key, sizeof(key), "key%u", rand() % config->keys);
+    snprintf(val, sizeof(val), "val%u", rand() % config->values);
+    unsigned long allocs = num_allocs;
+    uint64_t start = now_ns();
+    restricted_dictionary_set(r_dict, key, val);
+    record(OP_SET, start, allocs);
+  }
+}
+
+static void report(const struct bench_config *config) {
+  if (config->machine) {
+    printf("op,count,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,"
+           "allocs_per_op\n");
+  } else {
+    printf("keys=%u values=%u slaves=%u fan_out=%u ops=%u "
+           "sets_per_change=%u rounds=%u flags=0x%x freeze=%d seed=%u\n",
+           config->keys, config->values, config->slaves, config->fan_out,
+           config->ops, config->sets_per_change, config->rounds,
+           config->flags, config->freeze, config->seed);
+    printf("%-14s %9s %9s %9s %9s %9s %9s %9s %9s\n", "op", "count", "mean",
+           "p50", "p90", "p99", "p99.9", "max", "allocs/op");
+  }
+
+  for (unsigned int op = 0; op < NUM_OPS; op++) {
+    struct bench_samples *s = &samples[op];
+    if (!s->num) {
+      continue;
+    }
+
+    qsort(s->ns, s->num, sizeof(uint64_t), compare_ns);
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < s->num; i++) {
+      total += s->ns[i];
+    }
+    double allocs = ALLOCS_COUNTED ? (double)s->allocs / s->num : -1;
+
+    printf(config->machine ? "%s,%u,%llu,%llu,%llu,%llu,%llu,%llu,%.2f\n"
+                           : "%-14s %9u %9llu %9llu %9llu %9llu %9llu %9llu "
+                             "%9.2f\n",
+           op_names[op], s->num, (unsigned long long)(total / s->num),
+           (unsigned long long)percentile(s, 0.5),
+           (unsigned long long)percentile(s, 0.9),
+           (unsigned long long)percentile(s, 0.99),
+           (unsigned long long)percentile(s, 0.999),
+           (unsigned long long)s->ns[s->num - 1], allocs);
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -k keys             distinct keys (default 1000)\n"
+          "  -v values           distinct values per key (default 16)\n"
+          "  -s slaves           slave pairs to restrict (default 1000)\n"
+          "  -f fan_out          masters per slave (default 4)\n"
+          "  -n ops              operations after the rules are added "
+          "(default 100000)\n"
+          "  -r sets_per_change  sets per rule change, 0 for none "
+          "(default 100)\n"
+          "  -i rounds           dictionaries built and deleted (default 5)\n"
+          "  -a                  allocate rules from an arena\n"
+          "  -b                  keep blocked-set counters\n"
+          "  -z                  freeze the rules once added, and again "
+          "after each change\n"
+          "  -S seed             random seed (default 1)\n"
+          "  -m                  machine-readable CSV output\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  struct bench_config config = {1000, 16, 1000, 4, 100000, 100, 5, 0, 1, 0,
+                                0};
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:v:s:f:n:r:i:abzS:mh")) != -1) {
+    switch (opt) {
+    case 'k':
+      config.keys = strtoul(optarg, NULL, 10);
+      break;
+    case 'v':
+      config.values = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      config.slaves = strtoul(optarg, NULL, 10);
+      break;
+    case 'f':
+      config.fan_out = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      config.ops = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      config.sets_per_change = strtoul(optarg, NULL, 10);
+      break;
+    case 'i':
+      config.rounds = strtoul(optarg, NULL, 10);
+      break;
+    case 'a':
+      config.flags |= RESTRICTED_DICTIONARY_ARENA;
+      break;
+    case 'b':
+      config.flags |= RESTRICTED_DICTIONARY_BLOCKED_SET;
+      break;
+    case 'z':
+      config.freeze = 1;
+      break;
+    case 'S':
+      config.seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'm':
+      config.machine = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (!config.keys || !config.values || !config.fan_out || !config.rounds) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // rejected sets are part of the workload, not worth a message each
+  dictionary_set_error_callback(quiet);
+  srand(config.seed);
+
+  struct bench_rule *rules = calloc(config.slaves, sizeof(struct bench_rule));
+  char **masters = malloc(config.fan_out * sizeof(char *));
+  if ((config.slaves && !rules) || !masters) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (unsigned int i = 0; i < config.fan_out; i++) {
+    masters[i] = malloc(64);
+    if (!masters[i]) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+  }
+  make_rules(&config, rules);
+
+  for (unsigned int round = 0; round < config.rounds; round++) {
+    struct restricted_dictionary *r_dict =
+        restricted_dictionary_new_ex(config.keys, config.flags);
+    if (!r_dict) {
+      fprintf(stderr, "restricted_dictionary_new_ex() failed\n");
+      return 1;
+    }
+
+    add_rules(&config, r_dict, rules, masters);
+    if (config.freeze) {
+      freeze(r_dict);
+    }
+    mixed_ops(&config, r_dict, rules);
+
+    unsigned long allocs = num_allocs;
+    uint64_t start = now_ns();
+    restricted_dictionary_del(r_dict);
+    record(OP_DEL, start, allocs);
+  }
+
+  report(&config);
+
+  for (unsigned int i = 0; i < config.slaves; i++) {
+    free(rules[i].master_keys);
+    free(rules[i].master_values);
+  }
+  for (unsigned int i = 0; i < config.fan_out; i++) {
+    free(masters[i]);
+  }
+  for (unsigned int op = 0; op < NUM_OPS; op++) {
+    free(samples[op].ns);
+  }
+  free(masters);
+  free(rules);
+
+  return 0;
+}
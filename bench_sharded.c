@@ -0,0 +1,337 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "concurrent_restricted_dictionary.h"
+#include "sharded_restricted_dictionary.h"
+
+// Throughput of a concurrent_restricted_dictionary and of a
+// sharded_restricted_dictionary under the same mix of sets and checks, from
+// one thread up to max_threads, doubling each time, next to a plain
+// restricted_dictionary on one thread. See usage() for the workload knobs.
+
+struct bench_config {
+  unsigned int keys;
+  unsigned int values;
+  unsigned int slaves;
+  unsigned int fan_out;
+  unsigned int ops;
+  unsigned int checks;
+  unsigned int max_threads;
+  unsigned int shards;
+  unsigned int seed;
+  int machine;
+  // least speedup of the concurrent dictionary over the plain one at
+  // max_threads, 0 to only report it
+  double min_scaling;
+};
+
+// The two containers behind one set of calls
+struct bench_target {
+  const char *name;
+  void *(*new)(const struct bench_config *config);
+  void (*del)(void *dict);
+  int (*set)(void *dict, const char *key, const char *val);
+  int (*can_set)(void *dict, const char *key, const char *val);
+  int (*add_rule)(void *dict, char *slave_pair, char *master_pair);
+};
+
+struct bench_thread {
+  const struct bench_config *config;
+  const struct bench_target *target;
+  void *dict;
+  unsigned int ops;
+  unsigned int seed;
+};
+
+static int quiet(const char *format, ...) {
+  (void)format;
+  return 0;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void *concurrent_new(const struct bench_config *config) {
+  return concurrent_restricted_dictionary_new(config->keys, 0);
+}
+
+static void concurrent_del(void *dict) {
+  concurrent_restricted_dictionary_del(dict);
+}
+
+static int concurrent_set(void *dict, const char *key, const char *val) {
+  return concurrent_restricted_dictionary_set(dict, key, val);
+}
+
+static int concurrent_can_set(void *dict, const char *key, const char *val) {
+  return concurrent_restricted_dictionary_can_set(dict, key, val);
+}
+
+static int concurrent_restrict(void *dict, char *slave_pair,
+                               char *master_pair) {
+  return concurrent_restricted_dictionary_restrict(dict, slave_pair,
+                                                   master_pair);
+}
+
+static void *plain_new(const struct bench_config *config) {
+  return restricted_dictionary_new(config->keys);
+}
+
+static void plain_del(void *dict) { restricted_dictionary_del(dict); }
+
+static int plain_set(void *dict, const char *key, const char *val) {
+  return restricted_dictionary_set(dict, key, val);
+}
+
+static int plain_can_set(void *dict, const char *key, const char *val) {
+  return restricted_dictionary_can_set(dict, key, val, NULL);
+}
+
+static int plain_restrict(void *dict, char *slave_pair, char *master_pair) {
+  return restricted_dictionary_restrict(dict, slave_pair, master_pair);
+}
+
+static void *sharded_new(const struct bench_config *config) {
+  return sharded_restricted_dictionary_new(config->shards, config->keys, 0);
+}
+
+static void sharded_del(void *dict) { sharded_restricted_dictionary_del(dict); }
+
+static int sharded_set(void *dict, const char *key, const char *val) {
+  return sharded_restricted_dictionary_set(dict, key, val);
+}
+
+static int sharded_can_set(void *dict, const char *key, const char *val) {
+  return sharded_restricted_dictionary_can_set(dict, key, val);
+}
+
+static int sharded_restrict(void *dict, char *slave_pair, char *master_pair) {
+  return sharded_restricted_dictionary_restrict(dict, slave_pair,
+                                                master_pair);
+}
+
+#define NUM_TARGETS 2
+
+static const struct bench_target targets[NUM_TARGETS] = {
+    {"concurrent", concurrent_new, concurrent_del, concurrent_set,
+     concurrent_can_set, concurrent_restrict},
+    {"sharded", sharded_new, sharded_del, sharded_set, sharded_can_set,
+     sharded_restrict},
+};
+
+// The baseline, it is only ever run on one thread
+static const struct bench_target plain = {
+    "plain", plain_new, plain_del, plain_set, plain_can_set, plain_restrict};
+
+static void pair_name(char *buf, size_t len, unsigned int key,
+                      unsigned int value) {
+  snprintf(buf, len, "key%u=val%u", key, value);
+}
+
+// Same policy for every run, it only depends on the seed
+static void add_rules(const struct bench_config *config,
+                      const struct bench_target *target, void *dict) {
+  char slave[64];
+  char master[64];
+  unsigned int seed = config->seed;
+
+  for (unsigned int i = 0; i < config->slaves; i++) {
+    pair_name(slave, sizeof(slave), rand_r(&seed) % config->keys,
+              rand_r(&seed) % config->values);
+    for (unsigned int j = 0; j < config->fan_out; j++) {
+      pair_name(master, sizeof(master), rand_r(&seed) % config->keys,
+                rand_r(&seed) % config->values);
+      target->add_rule(dict, slave, master);
+    }
+  }
+}
+
+// checks out of every 100 operations are can_set(), the rest set()
+static void *bench_thread(void *arg) {
+  struct bench_thread *thread = arg;
+  const struct bench_config *config = thread->config;
+  char key[32];
+  char val[32];
+
+  for (unsigned int i = 0; i < thread->ops; i++) {
+    snprintf(key, sizeof(key), "key%u", rand_r(&thread->seed) % config->keys);
+    snprintf(val, sizeof(val), "val%u",
+             rand_r(&thread->seed) % config->values);
+    if ((unsigned int)rand_r(&thread->seed) % 100 < config->checks) {
+      thread->target->can_set(thread->dict, key, val);
+    } else {
+      thread->target->set(thread->dict, key, val);
+    }
+  }
+
+  return NULL;
+}
+
+// Returns operations per second, 0 on failure
+static double run(const struct bench_config *config,
+                  const struct bench_target *target,
+                  unsigned int num_threads) {
+  void *dict = target->new(config);
+  if (!dict) {
+    fprintf(stderr, "%s: new() failed\n", target->name);
+    return 0;
+  }
+  add_rules(config, target, dict);
+
+  pthread_t *tids = malloc(num_threads * sizeof(pthread_t));
+  struct bench_thread *threads =
+      malloc(num_threads * sizeof(struct bench_thread));
+  if (!tids || !threads) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  uint64_t start = now_ns();
+  for (unsigned int i = 0; i < num_threads; i++) {
+    threads[i] = (struct bench_thread){config, target, dict,
+                                       config->ops / num_threads,
+                                       config->seed + i + 1};
+    pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+  }
+  for (unsigned int i = 0; i < num_threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  uint64_t ns = now_ns() - start;
+
+  target->del(dict);
+  free(threads);
+  free(tids);
+
+  return (double)(config->ops / num_threads) * num_threads * 1e9 / ns;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -k keys         distinct keys (default 10000)\n"
+          "  -v values       distinct values per key (default 16)\n"
+          "  -s slaves       slave pairs to restrict (default 2000)\n"
+          "  -f fan_out      masters per slave (default 4)\n"
+          "  -n ops          operations per run, over all threads "
+          "(default 1000000)\n"
+          "  -c checks       can_set() out of every 100 operations "
+          "(default 50)\n"
+          "  -t max_threads  last thread count, up to 64 (default 64)\n"
+          "  -p shards       shards of the sharded dictionary (default 64)\n"
+          "  -S seed         random seed (default 1)\n"
+          "  -x scaling      fail unless the concurrent dictionary reaches\n"
+          "                  this speedup over the plain one at max_threads\n"
+          "  -m              machine-readable CSV output\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  struct bench_config config = {10000, 16, 2000, 4, 1000000, 50, 64, 64, 1,
+                                0,     0};
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:v:s:f:n:c:t:p:S:x:mh")) != -1) {
+    switch (opt) {
+    case 'k':
+      config.keys = strtoul(optarg, NULL, 10);
+      break;
+    case 'v':
+      config.values = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      config.slaves = strtoul(optarg, NULL, 10);
+      break;
+    case 'f':
+      config.fan_out = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      config.ops = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      config.checks = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      config.max_threads = strtoul(optarg, NULL, 10);
+      break;
+    case 'p':
+      config.shards = strtoul(optarg, NULL, 10);
+      break;
+    case 'S':
+      config.seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'x':
+      config.min_scaling = strtod(optarg, NULL);
+      break;
+    case 'm':
+      config.machine = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (!config.keys || !config.values || !config.fan_out || !config.ops ||
+      config.checks > 100 || !config.max_threads || config.max_threads > 64 ||
+      !config.shards || config.shards > 64) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // rejected sets are part of the workload, not worth a message each
+  dictionary_set_error_callback(quiet);
+
+  double baseline = run(&config, &plain, 1);
+  if (!baseline) {
+    return 1;
+  }
+
+  if (config.machine) {
+    printf("threads,concurrent_ops_per_s,sharded_ops_per_s,scaling\n");
+  } else {
+    printf("keys=%u values=%u slaves=%u fan_out=%u ops=%u checks=%u "
+           "shards=%u seed=%u\n",
+           config.keys, config.values, config.slaves, config.fan_out,
+           config.ops, config.checks, config.shards, config.seed);
+    printf("plain on one thread: %.0f ops/s\n", baseline);
+    printf("%-8s %14s %14s %8s %8s\n", "threads", "concurrent/s",
+           "sharded/s", "speedup", "scaling");
+  }
+
+  // concurrent over plain, at the last thread count
+  double scaling = 0;
+  for (unsigned int num_threads = 1; num_threads <= config.max_threads;
+       num_threads *= 2) {
+    double ops[NUM_TARGETS];
+    for (unsigned int i = 0; i < NUM_TARGETS; i++) {
+      ops[i] = run(&config, &targets[i], num_threads);
+      if (!ops[i]) {
+        return 1;
+      }
+    }
+    scaling = ops[0] / baseline;
+
+    if (config.machine) {
+      printf("%u,%.0f,%.0f,%.2f\n", num_threads, ops[0], ops[1], scaling);
+    } else {
+      printf("%-8u %14.0f %14.0f %8.2f %8.2f\n", num_threads, ops[0], ops[1],
+             ops[1] / ops[0], scaling);
+    }
+  }
+
+  if (scaling < config.min_scaling) {
+    fprintf(stderr, "concurrent scaling %.2f is below %.2f\n", scaling,
+            config.min_scaling);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,1108 @@
+#include "concurrent_restricted_dictionary.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIRROR_INIT_BUCKETS 64
+
+// Memory retired in epoch e is freed once the global epoch reaches e + 2, so
+// three lists are enough
+#define EPOCHS 3
+
+// Readers never look at the restricted_dictionary itself, which writers keep
+// as the authority on what is allowed. They walk a mirror of the set values
+// and the rules that is only ever changed by publishing new objects.
+
+// One link of a bucket chain. A link is never changed once published, a
+// resize builds new chains over the same cells.
+struct mirror_link {
+  void *cell;
+  unsigned int hash;
+  struct mirror_link *next;
+};
+
+struct mirror_table {
+  unsigned int num_buckets;
+  unsigned int num_cells;
+  _Atomic(struct mirror_link *) buckets[];
+};
+
+// The value a key holds, NULL while unset. Cells are never removed, they
+// live as long as the dictionary.
+struct value_cell {
+  char *key;
+  size_t key_len;
+  _Atomic(char *) value;
+};
+
+// Immutable, replaced as a whole on every rule change
+struct rule_list {
+  unsigned int num;
+  struct rule_cell *cells[];
+};
+
+// A pair that takes part or took part in a rule
+struct rule_cell {
+  struct value_cell *key;
+  char *value;
+  size_t value_len;
+  _Atomic(struct rule_list *) masters;
+  _Atomic(struct rule_list *) slaves;
+};
+
+// Per thread state of a reader, records are reused once their thread exits
+struct epoch_record {
+  atomic_int in_use;
+  atomic_int active;
+  atomic_ulong epoch;
+  struct epoch_record *next;
+};
+
+struct retired {
+  struct retired *next;
+  void *ptr;
+  void (*release)(void *);
+};
+
+// What to store in a list slot, or in the value of a cell, when the
+// transaction commits
+struct staged {
+  int is_value;
+  void *slot;
+  void *ptr;
+};
+
+struct concurrent_restricted_dictionary {
+  // recursive, a transaction holds it from begin to commit or rollback
+  pthread_mutex_t write_lock;
+  struct restricted_dictionary *r_dict;
+  _Atomic(struct mirror_table *) values;
+  _Atomic(struct mirror_table *) rules;
+  atomic_ulong epoch;
+  _Atomic(struct epoch_record *) records;
+  pthread_key_t record_key;
+  struct retired *retired[EPOCHS];
+  // changes of the open transaction, kept from readers until commit. Readers
+  // retry what they saw while commit_seq was odd or changed under them.
+  int in_transaction;
+  struct staged *staged;
+  unsigned int num_staged;
+  unsigned int max_staged;
+  atomic_uint commit_seq;
+};
+
+static int is_valid_pair(const char *pair) {
+  struct restricted_pair split;
+  return restricted_dictionary_split_pair(pair, strlen(pair), &split) == 0;
+}
+
+static unsigned int mirror_hash(const char *key, size_t key_len,
+                                const char *value, size_t value_len) {
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < key_len; i++) {
+    hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+  }
+  hash = (hash ^ '=') * 16777619u;
+  for (size_t i = 0; i < value_len; i++) {
+    hash = (hash ^ (unsigned char)value[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static struct mirror_table *table_new(unsigned int num_buckets) {
+  struct mirror_table *table =
+      calloc(1, sizeof(struct mirror_table) +
+                    num_buckets * sizeof(_Atomic(struct mirror_link *)));
+  if (!table) {
+    return NULL;
+  }
+
+  table->num_buckets = num_buckets;
+  for (unsigned int i = 0; i < num_buckets; i++) {
+    atomic_init(&table->buckets[i], NULL);
+  }
+
+  return table;
+}
+
+// Frees the chains of a table but not the cells they point to
+static void table_release(void *ptr) {
+  struct mirror_table *table = ptr;
+  for (unsigned int i = 0; i < table->num_buckets; i++) {
+    struct mirror_link *link =
+        atomic_load_explicit(&table->buckets[i], memory_order_relaxed);
+    while (link) {
+      struct mirror_link *next = link->next;
+      free(link);
+      link = next;
+    }
+  }
+  free(table);
+}
+
+static struct mirror_link *table_bucket(const struct mirror_table *table,
+                                        unsigned int hash) {
+  unsigned int bucket = hash & (table->num_buckets - 1);
+  return atomic_load_explicit(&table->buckets[bucket], memory_order_acquire);
+}
+
+static int table_push(struct mirror_table *table, void *cell,
+                      unsigned int hash) {
+  struct mirror_link *link = malloc(sizeof(struct mirror_link));
+  if (!link) {
+    return -1;
+  }
+
+  _Atomic(struct mirror_link *) *bucket =
+      &table->buckets[hash & (table->num_buckets - 1)];
+  link->cell = cell;
+  link->hash = hash;
+  link->next = atomic_load_explicit(bucket, memory_order_relaxed);
+  atomic_store_explicit(bucket, link, memory_order_release);
+  table->num_cells++;
+
+  return 0;
+}
+
+static struct value_cell *find_value_cell(const struct mirror_table *table,
+                                          const char *key, size_t key_len) {
+  unsigned int hash = mirror_hash(key, key_len, NULL, 0);
+  for (const struct mirror_link *link = table_bucket(table, hash); link;
+       link = link->next) {
+    const struct value_cell *cell = link->cell;
+    if (link->hash == hash && cell->key_len == key_len &&
+        memcmp(cell->key, key, key_len) == 0) {
+      return link->cell;
+    }
+  }
+  return NULL;
+}
+
+static struct rule_cell *find_rule_cell(const struct mirror_table *table,
+                                        const char *key, size_t key_len,
+                                        const char *value, size_t value_len) {
+  unsigned int hash = mirror_hash(key, key_len, value, value_len);
+  for (const struct mirror_link *link = table_bucket(table, hash); link;
+       link = link->next) {
+    const struct rule_cell *cell = link->cell;
+    if (link->hash == hash && cell->key->key_len == key_len &&
+        cell->value_len == value_len &&
+        memcmp(cell->key->key, key, key_len) == 0 &&
+        memcmp(cell->value, value, value_len) == 0) {
+      return link->cell;
+    }
+  }
+  return NULL;
+}
+
+static struct epoch_record *
+get_record(struct concurrent_restricted_dictionary *c_dict) {
+  struct epoch_record *record = pthread_getspecific(c_dict->record_key);
+  if (record) {
+    return record;
+  }
+
+  for (record = atomic_load(&c_dict->records); record; record = record->next) {
+    int unused = 0;
+    if (atomic_compare_exchange_strong(&record->in_use, &unused, 1)) {
+      break;
+    }
+  }
+
+  if (!record) {
+    record = malloc(sizeof(struct epoch_record));
+    if (!record) {
+      return NULL;
+    }
+    atomic_init(&record->in_use, 1);
+    atomic_init(&record->active, 0);
+    atomic_init(&record->epoch, 0);
+    record->next = atomic_load(&c_dict->records);
+    while (!atomic_compare_exchange_weak(&c_dict->records, &record->next,
+                                         record)) {
+    }
+  }
+
+  if (pthread_setspecific(c_dict->record_key, record) != 0) {
+    atomic_store(&record->in_use, 0);
+    return NULL;
+  }
+
+  return record;
+}
+
+static void put_record(void *ptr) {
+  struct epoch_record *record = ptr;
+  atomic_store(&record->in_use, 0);
+}
+
+static struct epoch_record *
+read_enter(struct concurrent_restricted_dictionary *c_dict) {
+  struct epoch_record *record = get_record(c_dict);
+  if (!record) {
+    return NULL;
+  }
+
+  // a stale epoch left from the last read only holds writers back, it can
+  // never let them free something this read may see
+  atomic_store(&record->active, 1);
+  atomic_store(&record->epoch, atomic_load(&c_dict->epoch));
+
+  return record;
+}
+
+static void read_exit(struct epoch_record *record) {
+  atomic_store_explicit(&record->active, 0, memory_order_release);
+}
+
+static void free_retired(struct retired **list) {
+  while (*list) {
+    struct retired *entry = *list;
+    *list = entry->next;
+    entry->release(entry->ptr);
+    free(entry);
+  }
+}
+
+// Called with the write lock held. If the allocation fails there is nothing
+// better to do than to leak ptr.
+static void retire(struct concurrent_restricted_dictionary *c_dict, void *ptr,
+                   void (*release)(void *)) {
+  if (!ptr) {
+    return;
+  }
+
+  struct retired *entry = malloc(sizeof(struct retired));
+  if (!entry) {
+    error_callback("%s: malloc() failed\n", __func__);
+    return;
+  }
+
+  struct retired **list =
+      &c_dict->retired[atomic_load(&c_dict->epoch) % EPOCHS];
+  entry->ptr = ptr;
+  entry->release = release;
+  entry->next = *list;
+  *list = entry;
+}
+
+// Called with the write lock held, moves the epoch on when every active
+// reader has seen the current one
+static void try_advance(struct concurrent_restricted_dictionary *c_dict) {
+  unsigned long epoch = atomic_load(&c_dict->epoch);
+
+  for (struct epoch_record *record = atomic_load(&c_dict->records); record;
+       record = record->next) {
+    if (atomic_load(&record->active) && atomic_load(&record->epoch) != epoch) {
+      return;
+    }
+  }
+
+  atomic_store(&c_dict->epoch, epoch + 1);
+  free_retired(&c_dict->retired[(epoch + 1) % EPOCHS]);
+}
+
+// Called with the write lock held, publishes a table twice the size
+static int table_grow(struct concurrent_restricted_dictionary *c_dict,
+                      _Atomic(struct mirror_table *) *slot) {
+  struct mirror_table *old = atomic_load(slot);
+  struct mirror_table *table = table_new(old->num_buckets * 2);
+  if (!table) {
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < old->num_buckets; i++) {
+    for (const struct mirror_link *link = table_bucket(old, i); link;
+         link = link->next) {
+      if (table_push(table, link->cell, link->hash) == -1) {
+        table_release(table);
+        return -1;
+      }
+    }
+  }
+
+  atomic_store_explicit(slot, table, memory_order_release);
+  retire(c_dict, old, table_release);
+
+  return 0;
+}
+
+// Called with the write lock held
+static int table_insert(struct concurrent_restricted_dictionary *c_dict,
+                        _Atomic(struct mirror_table *) *slot, void *cell,
+                        unsigned int hash) {
+  struct mirror_table *table = atomic_load(slot);
+  if (table->num_cells >= table->num_buckets) {
+    if (table_grow(c_dict, slot) == -1) {
+      return -1;
+    }
+    table = atomic_load(slot);
+  }
+
+  return table_push(table, cell, hash);
+}
+
+static struct value_cell *
+get_value_cell(struct concurrent_restricted_dictionary *c_dict,
+               const char *key, size_t key_len) {
+  struct value_cell *cell =
+      find_value_cell(atomic_load(&c_dict->values), key, key_len);
+  if (cell) {
+    return cell;
+  }
+
+  cell = malloc(sizeof(struct value_cell));
+  if (!cell) {
+    return NULL;
+  }
+
+  cell->key = strndup(key, key_len);
+  if (!cell->key) {
+    free(cell);
+    return NULL;
+  }
+  cell->key_len = key_len;
+  atomic_init(&cell->value, NULL);
+
+  if (table_insert(c_dict, &c_dict->values, cell,
+                   mirror_hash(key, key_len, NULL, 0)) == -1) {
+    free(cell->key);
+    free(cell);
+    return NULL;
+  }
+
+  return cell;
+}
+
+// Looks up the cell of an 'A=B' string, creating it when create is set
+static struct rule_cell *
+get_rule_cell(struct concurrent_restricted_dictionary *c_dict,
+              const char *pair, int create) {
+  const char *equal_sign = strchr(pair, '=');
+  if (!equal_sign) {
+    return NULL;
+  }
+
+  size_t key_len = equal_sign - pair;
+  const char *value = equal_sign + 1;
+  size_t value_len = strlen(value);
+
+  struct rule_cell *cell = find_rule_cell(atomic_load(&c_dict->rules), pair,
+                                          key_len, value, value_len);
+  if (cell || !create) {
+    return cell;
+  }
+
+  struct value_cell *key = get_value_cell(c_dict, pair, key_len);
+  if (!key) {
+    return NULL;
+  }
+
+  cell = malloc(sizeof(struct rule_cell));
+  if (!cell) {
+    return NULL;
+  }
+
+  cell->value = strndup(value, value_len);
+  if (!cell->value) {
+    free(cell);
+    return NULL;
+  }
+  cell->key = key;
+  cell->value_len = value_len;
+  atomic_init(&cell->masters, NULL);
+  atomic_init(&cell->slaves, NULL);
+
+  if (table_insert(c_dict, &c_dict->rules, cell,
+                   mirror_hash(pair, key_len, value, value_len)) == -1) {
+    free(cell->value);
+    free(cell);
+    return NULL;
+  }
+
+  return cell;
+}
+
+static int list_find(const struct rule_list *list,
+                     const struct rule_cell *cell) {
+  for (unsigned int i = 0; list && i < list->num; i++) {
+    if (list->cells[i] == cell) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Returns a copy of list with cell appended
+static struct rule_list *list_with(const struct rule_list *list,
+                                   struct rule_cell *cell) {
+  unsigned int num = list ? list->num : 0;
+  struct rule_list *copy = malloc(sizeof(struct rule_list) +
+                                  (num + 1) * sizeof(struct rule_cell *));
+  if (!copy) {
+    return NULL;
+  }
+
+  if (num) {
+    memcpy(copy->cells, list->cells, num * sizeof(struct rule_cell *));
+  }
+  copy->cells[num] = cell;
+  copy->num = num + 1;
+
+  return copy;
+}
+
+// Returns a copy of list without the entry at pos
+static struct rule_list *list_without(const struct rule_list *list,
+                                      unsigned int pos) {
+  struct rule_list *copy = malloc(sizeof(struct rule_list) +
+                                  list->num * sizeof(struct rule_cell *));
+  if (!copy) {
+    return NULL;
+  }
+
+  memcpy(copy->cells, list->cells, pos * sizeof(struct rule_cell *));
+  memcpy(copy->cells + pos, list->cells + pos + 1,
+         (list->num - pos - 1) * sizeof(struct rule_cell *));
+  copy->num = list->num - 1;
+
+  return copy;
+}
+
+// Called with the write lock held, makes room for num staged changes so a
+// change the dictionary took can always be staged
+static int stage_reserve(struct concurrent_restricted_dictionary *c_dict,
+                         unsigned int num) {
+  if (!c_dict->in_transaction ||
+      c_dict->num_staged + num <= c_dict->max_staged) {
+    return 0;
+  }
+
+  unsigned int max = c_dict->max_staged ? c_dict->max_staged : 16;
+  while (max < c_dict->num_staged + num) {
+    max *= 2;
+  }
+  struct staged *staged = realloc(c_dict->staged, max * sizeof(struct staged));
+  if (!staged) {
+    error_callback("%s: realloc() failed\n", __func__);
+    return -1;
+  }
+
+  c_dict->staged = staged;
+  c_dict->max_staged = max;
+
+  return 0;
+}
+
+// Called with the write lock held, keeps ptr for slot until commit. What was
+// staged for the slot before was never seen and is freed right away.
+static void stage(struct concurrent_restricted_dictionary *c_dict,
+                  int is_value, void *slot, void *ptr) {
+  for (unsigned int i = 0; i < c_dict->num_staged; i++) {
+    if (c_dict->staged[i].slot == slot) {
+      free(c_dict->staged[i].ptr);
+      c_dict->staged[i].ptr = ptr;
+      return;
+    }
+  }
+
+  c_dict->staged[c_dict->num_staged++] = (struct staged){is_value, slot, ptr};
+}
+
+// Called with the write lock held, the list as the writer sees it
+static struct rule_list *
+current_list(const struct concurrent_restricted_dictionary *c_dict,
+             _Atomic(struct rule_list *) *slot) {
+  for (unsigned int i = 0; i < c_dict->num_staged; i++) {
+    if (c_dict->staged[i].slot == slot) {
+      return c_dict->staged[i].ptr;
+    }
+  }
+
+  return atomic_load(slot);
+}
+
+// Called with the write lock held, installs a prepared list
+static void publish(struct concurrent_restricted_dictionary *c_dict,
+                    _Atomic(struct rule_list *) *slot, struct rule_list *list) {
+  if (c_dict->in_transaction) {
+    stage(c_dict, 0, slot, list);
+    return;
+  }
+
+  struct rule_list *old =
+      atomic_exchange_explicit(slot, list, memory_order_acq_rel);
+  retire(c_dict, old, free);
+}
+
+static void publish_value(struct concurrent_restricted_dictionary *c_dict,
+                          struct value_cell *cell, char *value) {
+  if (c_dict->in_transaction) {
+    stage(c_dict, 1, cell, value);
+    return;
+  }
+
+  retire(c_dict,
+         atomic_exchange_explicit(&cell->value, value, memory_order_acq_rel),
+         free);
+}
+
+// Waits out a commit under way and returns the sequence a read started at
+static unsigned int
+read_begin(struct concurrent_restricted_dictionary *c_dict) {
+  unsigned int seq;
+  while ((seq = atomic_load(&c_dict->commit_seq)) & 1) {
+  }
+  return seq;
+}
+
+static int read_retry(struct concurrent_restricted_dictionary *c_dict,
+                      unsigned int seq) {
+  return atomic_load(&c_dict->commit_seq) != seq;
+}
+
+static int holds(const struct rule_cell *cell) {
+  const char *value =
+      atomic_load_explicit(&cell->key->value, memory_order_acquire);
+  return value && cell->value_len == strlen(value) &&
+         memcmp(value, cell->value, cell->value_len) == 0;
+}
+
+struct concurrent_restricted_dictionary *
+concurrent_restricted_dictionary_new(unsigned int size, unsigned int flags) {
+  struct concurrent_restricted_dictionary *c_dict =
+      calloc(1, sizeof(struct concurrent_restricted_dictionary));
+  if (!c_dict) {
+    error_callback("%s: calloc() failed\n", __func__);
+    return NULL;
+  }
+
+  unsigned int num_buckets = MIRROR_INIT_BUCKETS;
+  while (num_buckets < size && num_buckets < (1u << 30)) {
+    num_buckets <<= 1;
+  }
+
+  c_dict->r_dict = restricted_dictionary_new_ex(size, flags);
+  if (!c_dict->r_dict) {
+    error_callback("%s: restricted_dictionary_new_ex() failed\n", __func__);
+    free(c_dict);
+    return NULL;
+  }
+
+  struct mirror_table *values = table_new(num_buckets);
+  struct mirror_table *rules = table_new(MIRROR_INIT_BUCKETS);
+  if (!values || !rules) {
+    error_callback("%s: table_new() failed\n", __func__);
+    goto fail;
+  }
+  atomic_init(&c_dict->values, values);
+  atomic_init(&c_dict->rules, rules);
+  atomic_init(&c_dict->epoch, 0);
+  atomic_init(&c_dict->records, NULL);
+
+  if (pthread_key_create(&c_dict->record_key, put_record) != 0) {
+    error_callback("%s: pthread_key_create() failed\n", __func__);
+    goto fail;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  int err = pthread_mutex_init(&c_dict->write_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (err != 0) {
+    error_callback("%s: pthread_mutex_init() failed\n", __func__);
+    pthread_key_delete(c_dict->record_key);
+    goto fail;
+  }
+  atomic_init(&c_dict->commit_seq, 0);
+
+  return c_dict;
+
+fail:
+  free(values);
+  free(rules);
+  restricted_dictionary_del(c_dict->r_dict);
+  free(c_dict);
+  return NULL;
+}
+
+// No other thread may use the dictionary any more
+void concurrent_restricted_dictionary_del(
+    struct concurrent_restricted_dictionary *c_dict) {
+  if (!c_dict) {
+    return;
+  }
+
+  pthread_key_delete(c_dict->record_key);
+  pthread_mutex_destroy(&c_dict->write_lock);
+
+  for (unsigned int i = 0; i < c_dict->num_staged; i++) {
+    free(c_dict->staged[i].ptr);
+  }
+  free(c_dict->staged);
+
+  for (unsigned int i = 0; i < EPOCHS; i++) {
+    free_retired(&c_dict->retired[i]);
+  }
+
+  struct mirror_table *rules = atomic_load(&c_dict->rules);
+  for (unsigned int i = 0; i < rules->num_buckets; i++) {
+    for (const struct mirror_link *link = table_bucket(rules, i); link;
+         link = link->next) {
+      struct rule_cell *cell = link->cell;
+      free(atomic_load(&cell->masters));
+      free(atomic_load(&cell->slaves));
+      free(cell->value);
+      free(cell);
+    }
+  }
+  table_release(rules);
+
+  struct mirror_table *values = atomic_load(&c_dict->values);
+  for (unsigned int i = 0; i < values->num_buckets; i++) {
+    for (const struct mirror_link *link = table_bucket(values, i); link;
+         link = link->next) {
+      struct value_cell *cell = link->cell;
+      free(atomic_load(&cell->value));
+      free(cell->key);
+      free(cell);
+    }
+  }
+  table_release(values);
+
+  struct epoch_record *record = atomic_load(&c_dict->records);
+  while (record) {
+    struct epoch_record *next = record->next;
+    free(record);
+    record = next;
+  }
+
+  restricted_dictionary_del(c_dict->r_dict);
+  free(c_dict);
+}
+
+int concurrent_restricted_dictionary_get(
+    struct concurrent_restricted_dictionary *c_dict, const char *key,
+    char *buf, size_t len) {
+  if (!c_dict || !key || (!buf && len)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct epoch_record *record = read_enter(c_dict);
+  if (!record) {
+    error_callback("%s: read_enter() failed\n", __func__);
+    return -1;
+  }
+
+  int ret;
+  unsigned int seq;
+  do {
+    seq = read_begin(c_dict);
+    ret = -1;
+    const struct value_cell *cell = find_value_cell(
+        atomic_load_explicit(&c_dict->values, memory_order_acquire), key,
+        strlen(key));
+    const char *value =
+        cell ? atomic_load_explicit(&cell->value, memory_order_acquire)
+             : NULL;
+    if (value) {
+      size_t value_len = strlen(value);
+      if (len) {
+        size_t copy_len = value_len < len ? value_len : len - 1;
+        memcpy(buf, value, copy_len);
+        buf[copy_len] = '\0';
+      }
+      ret = (int)value_len;
+    }
+  } while (read_retry(c_dict, seq));
+
+  read_exit(record);
+
+  return ret;
+}
+
+int concurrent_restricted_dictionary_can_set(
+    struct concurrent_restricted_dictionary *c_dict, const char *key,
+    const char *val) {
+  if (!c_dict || !key || !val) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct epoch_record *record = read_enter(c_dict);
+  if (!record) {
+    error_callback("%s: read_enter() failed\n", __func__);
+    return -1;
+  }
+
+  int allowed;
+  unsigned int seq;
+  do {
+    seq = read_begin(c_dict);
+    allowed = 1;
+    const struct rule_cell *cell = find_rule_cell(
+        atomic_load_explicit(&c_dict->rules, memory_order_acquire), key,
+        strlen(key), val, strlen(val));
+    if (!cell) {
+      continue;
+    }
+
+    const struct rule_list *masters =
+        atomic_load_explicit(&cell->masters, memory_order_acquire);
+    for (unsigned int i = 0; masters && allowed && i < masters->num; i++) {
+      allowed = !holds(masters->cells[i]);
+    }
+
+    // as in restricted_dictionary_set(), a slave on the same key is about to
+    // be replaced and does not count
+    const struct rule_list *slaves =
+        atomic_load_explicit(&cell->slaves, memory_order_acquire);
+    for (unsigned int i = 0; slaves && allowed && i < slaves->num; i++) {
+      allowed =
+          slaves->cells[i]->key == cell->key || !holds(slaves->cells[i]);
+    }
+  } while (read_retry(c_dict, seq));
+
+  read_exit(record);
+
+  return allowed;
+}
+
+int concurrent_restricted_dictionary_set(
+    struct concurrent_restricted_dictionary *c_dict, const char *key,
+    const char *val) {
+  if (!c_dict || !key || !val) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&c_dict->write_lock);
+
+  // everything the mirror needs is allocated before the set, so the two can
+  // not disagree once it succeeded
+  int ret = RESTRICTED_DICTIONARY_ENOMEM;
+  struct value_cell *cell = get_value_cell(c_dict, key, strlen(key));
+  char *copy = strdup(val);
+  if (!cell || !copy || stage_reserve(c_dict, 1) == -1) {
+    error_callback("%s: get_value_cell() failed\n", __func__);
+    free(copy);
+  } else if ((ret = restricted_dictionary_set(c_dict->r_dict, key, val)) !=
+             0) {
+    free(copy);
+  } else {
+    publish_value(c_dict, cell, copy);
+  }
+
+  try_advance(c_dict);
+  pthread_mutex_unlock(&c_dict->write_lock);
+
+  return ret;
+}
+
+int concurrent_restricted_dictionary_set_diagnostics(
+    struct concurrent_restricted_dictionary *c_dict, unsigned int mode,
+    unsigned int rate) {
+  if (!c_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&c_dict->write_lock);
+  int ret = restricted_dictionary_set_diagnostics(c_dict->r_dict, mode, rate);
+  pthread_mutex_unlock(&c_dict->write_lock);
+
+  return ret;
+}
+
+// Called with the write lock held
+static int add_rule(struct concurrent_restricted_dictionary *c_dict,
+                    char *slave_pair, char *master_pair) {
+  if (!is_valid_pair(slave_pair) || !is_valid_pair(master_pair)) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct rule_cell *slave = get_rule_cell(c_dict, slave_pair, 1);
+  struct rule_cell *master = get_rule_cell(c_dict, master_pair, 1);
+  if (!slave || !master) {
+    error_callback("%s: get_rule_cell() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  struct rule_list *masters = current_list(c_dict, &slave->masters);
+  struct rule_list *slaves = current_list(c_dict, &master->slaves);
+  if (list_find(masters, master) != -1) {
+    return restricted_dictionary_restrict(c_dict->r_dict, slave_pair,
+                                          master_pair);
+  }
+
+  masters = list_with(masters, master);
+  slaves = list_with(slaves, slave);
+  if (!masters || !slaves || stage_reserve(c_dict, 2) == -1) {
+    error_callback("%s: list_with() failed\n", __func__);
+    free(masters);
+    free(slaves);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  int ret =
+      restricted_dictionary_restrict(c_dict->r_dict, slave_pair, master_pair);
+  if (ret != 0) {
+    free(masters);
+    free(slaves);
+    return ret;
+  }
+
+  publish(c_dict, &slave->masters, masters);
+  publish(c_dict, &master->slaves, slaves);
+
+  return 0;
+}
+
+int concurrent_restricted_dictionary_restrict(
+    struct concurrent_restricted_dictionary *c_dict, char *slave_pair,
+    char *master_pair) {
+  if (!c_dict || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&c_dict->write_lock);
+  int ret = add_rule(c_dict, slave_pair, master_pair);
+  try_advance(c_dict);
+  pthread_mutex_unlock(&c_dict->write_lock);
+
+  return ret;
+}
+
+int concurrent_restricted_dictionary_multiRestrict(
+    struct concurrent_restricted_dictionary *c_dict, char *slave_pair,
+    char **master_pairs, unsigned int num_masters) {
+  if (!c_dict || !slave_pair || !master_pairs || num_masters <= 0) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  int ret = 0;
+
+  pthread_mutex_lock(&c_dict->write_lock);
+  for (unsigned int i = 0; i < num_masters; i++) {
+    int err = master_pairs[i] ? add_rule(c_dict, slave_pair, master_pairs[i])
+                              : RESTRICTED_DICTIONARY_EINVAL;
+    if (err != 0) {
+      error_callback("%s: add_rule(%d) failed, keep adding next one\n",
+                     __func__, i);
+      ret = err;
+    }
+  }
+  try_advance(c_dict);
+  pthread_mutex_unlock(&c_dict->write_lock);
+
+  return ret;
+}
+
+int concurrent_restricted_dictionary_unrestrict(
+    struct concurrent_restricted_dictionary *c_dict, char *slave_pair,
+    char *master_pair) {
+  if (!c_dict || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&c_dict->write_lock);
+
+  int ret = RESTRICTED_DICTIONARY_ENOTFOUND;
+  struct rule_cell *slave = get_rule_cell(c_dict, slave_pair, 0);
+  struct rule_cell *master = get_rule_cell(c_dict, master_pair, 0);
+  struct rule_list *masters =
+      slave ? current_list(c_dict, &slave->masters) : NULL;
+  struct rule_list *slaves =
+      master ? current_list(c_dict, &master->slaves) : NULL;
+  int master_pos = list_find(masters, master);
+  int slave_pos = list_find(slaves, slave);
+
+  if (master_pos == -1 || slave_pos == -1) {
+    // not a rule of the mirror, let the dictionary say why
+    ret = restricted_dictionary_unrestrict(c_dict->r_dict, slave_pair,
+                                           master_pair);
+    goto out;
+  }
+
+  masters = list_without(masters, master_pos);
+  slaves = list_without(slaves, slave_pos);
+  if (!masters || !slaves || stage_reserve(c_dict, 2) == -1) {
+    error_callback("%s: list_without() failed\n", __func__);
+    free(masters);
+    free(slaves);
+    ret = RESTRICTED_DICTIONARY_ENOMEM;
+    goto out;
+  }
+
+  ret = restricted_dictionary_unrestrict(c_dict->r_dict, slave_pair,
+                                         master_pair);
+  if (ret != 0) {
+    free(masters);
+    free(slaves);
+    goto out;
+  }
+
+  publish(c_dict, &slave->masters, masters);
+  publish(c_dict, &master->slaves, slaves);
+
+out:
+  try_advance(c_dict);
+  pthread_mutex_unlock(&c_dict->write_lock);
+
+  return ret;
+}
+
+int concurrent_restricted_dictionary_unrestrict_all(
+    struct concurrent_restricted_dictionary *c_dict, char *slave_pair) {
+  if (!c_dict || !slave_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&c_dict->write_lock);
+
+  int ret = RESTRICTED_DICTIONARY_ENOMEM;
+  struct rule_cell *slave = get_rule_cell(c_dict, slave_pair, 0);
+  struct rule_list *masters =
+      slave ? current_list(c_dict, &slave->masters) : NULL;
+  struct rule_list **slaves = NULL;
+  unsigned int num_masters = masters ? masters->num : 0;
+  if (!num_masters) {
+    // not a slave of the mirror, let the dictionary say why
+    ret = restricted_dictionary_unrestrict_all(c_dict->r_dict, slave_pair);
+    goto out;
+  }
+
+  slaves = calloc(masters->num, sizeof(struct rule_list *));
+  if (!slaves || stage_reserve(c_dict, masters->num + 1) == -1) {
+    error_callback("%s: calloc() failed\n", __func__);
+    goto out;
+  }
+
+  for (unsigned int i = 0; i < masters->num; i++) {
+    struct rule_list *list =
+        current_list(c_dict, &masters->cells[i]->slaves);
+    slaves[i] = list_without(list, list_find(list, slave));
+    if (!slaves[i]) {
+      error_callback("%s: list_without() failed\n", __func__);
+      goto out;
+    }
+  }
+
+  ret = restricted_dictionary_unrestrict_all(c_dict->r_dict, slave_pair);
+  if (ret != 0) {
+    goto out;
+  }
+
+  // a staged masters list is freed once replaced, num_masters outlives it
+  for (unsigned int i = 0; i < num_masters; i++) {
+    publish(c_dict, &masters->cells[i]->slaves, slaves[i]);
+    slaves[i] = NULL;
+  }
+  publish(c_dict, &slave->masters, NULL);
+
+out:
+  if (slaves) {
+    for (unsigned int i = 0; i < num_masters; i++) {
+      free(slaves[i]);
+    }
+    free(slaves);
+  }
+  try_advance(c_dict);
+  pthread_mutex_unlock(&c_dict->write_lock);
+
+  return ret;
+}
+
+int concurrent_restricted_dictionary_begin(
+    struct concurrent_restricted_dictionary *c_dict) {
+  if (!c_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // held until commit or rollback, other writers wait for the transaction
+  pthread_mutex_lock(&c_dict->write_lock);
+  int ret = restricted_dictionary_begin(c_dict->r_dict);
+  if (ret != RESTRICTED_DICTIONARY_OK) {
+    pthread_mutex_unlock(&c_dict->write_lock);
+    return ret;
+  }
+  c_dict->in_transaction = 1;
+
+  return RESTRICTED_DICTIONARY_OK;
+}
+
+int concurrent_restricted_dictionary_commit(
+    struct concurrent_restricted_dictionary *c_dict) {
+  if (!c_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&c_dict->write_lock);
+  if (!c_dict->in_transaction) {
+    pthread_mutex_unlock(&c_dict->write_lock);
+    error_callback("%s: no transaction is open\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  restricted_dictionary_commit(c_dict->r_dict);
+  c_dict->in_transaction = 0;
+
+  // readers that overlap these stores start over and see all of them
+  atomic_fetch_add(&c_dict->commit_seq, 1);
+  for (unsigned int i = 0; i < c_dict->num_staged; i++) {
+    struct staged *staged = &c_dict->staged[i];
+    if (staged->is_value) {
+      publish_value(c_dict, staged->slot, staged->ptr);
+    } else {
+      publish(c_dict, staged->slot, staged->ptr);
+    }
+  }
+  atomic_fetch_add(&c_dict->commit_seq, 1);
+  c_dict->num_staged = 0;
+
+  try_advance(c_dict);
+  // once for this call and once for begin
+  pthread_mutex_unlock(&c_dict->write_lock);
+  pthread_mutex_unlock(&c_dict->write_lock);
+
+  return RESTRICTED_DICTIONARY_OK;
+}
+
+int concurrent_restricted_dictionary_rollback(
+    struct concurrent_restricted_dictionary *c_dict) {
+  if (!c_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&c_dict->write_lock);
+  if (!c_dict->in_transaction) {
+    pthread_mutex_unlock(&c_dict->write_lock);
+    error_callback("%s: no transaction is open\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // readers never saw the staged objects. Cells created on the way stay,
+  // empty ones read as absent.
+  for (unsigned int i = 0; i < c_dict->num_staged; i++) {
+    free(c_dict->staged[i].ptr);
+  }
+  c_dict->num_staged = 0;
+  c_dict->in_transaction = 0;
+  int ret = restricted_dictionary_rollback(c_dict->r_dict);
+
+  pthread_mutex_unlock(&c_dict->write_lock);
+  pthread_mutex_unlock(&c_dict->write_lock);
+
+  return ret;
+}
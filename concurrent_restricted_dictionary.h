@@ -0,0 +1,58 @@
+#ifndef CONCURRENT_RESTRICTED_DICTIONARY_H
+#define CONCURRENT_RESTRICTED_DICTIONARY_H
+
+#include "restricted_dictionary.h"
+
+// A restricted_dictionary that may be shared between threads. Reads and
+// restriction checks never take a lock, writers are serialized on one mutex.
+// Memory a reader may still see is reclaimed by epochs once every thread
+// inside a read has moved on.
+struct concurrent_restricted_dictionary;
+
+struct concurrent_restricted_dictionary *
+concurrent_restricted_dictionary_new(unsigned int size, unsigned int flags);
+void concurrent_restricted_dictionary_del(
+    struct concurrent_restricted_dictionary *c_dict);
+
+// Copies the value of key into buf, truncated to len - 1 bytes. Returns the
+// full length of the value, or -1 when the key is not set.
+int concurrent_restricted_dictionary_get(
+    struct concurrent_restricted_dictionary *c_dict, const char *key,
+    char *buf, size_t len);
+// Returns 1 when the set would be allowed, 0 when a rule blocks it and -1 on
+// invalid input
+int concurrent_restricted_dictionary_can_set(
+    struct concurrent_restricted_dictionary *c_dict, const char *key,
+    const char *val);
+
+// A transaction keeps the write lock from begin to commit or rollback, so
+// only the thread that began it may change the dictionary meanwhile. Its
+// changes are checked against each other as they are made but readers see
+// none of them until commit, and then all at once.
+int concurrent_restricted_dictionary_begin(
+    struct concurrent_restricted_dictionary *c_dict);
+int concurrent_restricted_dictionary_commit(
+    struct concurrent_restricted_dictionary *c_dict);
+int concurrent_restricted_dictionary_rollback(
+    struct concurrent_restricted_dictionary *c_dict);
+
+// Return codes are those of restricted_dictionary.h
+int concurrent_restricted_dictionary_set_diagnostics(
+    struct concurrent_restricted_dictionary *c_dict, unsigned int mode,
+    unsigned int rate);
+int concurrent_restricted_dictionary_set(
+    struct concurrent_restricted_dictionary *c_dict, const char *key,
+    const char *val);
+int concurrent_restricted_dictionary_restrict(
+    struct concurrent_restricted_dictionary *c_dict, char *slave_pair,
+    char *master_pair);
+int concurrent_restricted_dictionary_multiRestrict(
+    struct concurrent_restricted_dictionary *c_dict, char *slave_pair,
+    char **master_pairs, unsigned int num_masters);
+int concurrent_restricted_dictionary_unrestrict(
+    struct concurrent_restricted_dictionary *c_dict, char *slave_pair,
+    char *master_pair);
+int concurrent_restricted_dictionary_unrestrict_all(
+    struct concurrent_restricted_dictionary *c_dict, char *slave_pair);
+
+#endif // CONCURRENT_RESTRICTED_DICTIONARY_H
@@ -1,9 +1,19 @@
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "async_restricted_dictionary.h"
+#include "concurrent_restricted_dictionary.h"
 #include "restricted_dictionary.h"
+#include "restricted_journal.h"
+#include "restricted_loader.h"
+#include "restricted_snapshot.h"
+#include "sharded_restricted_dictionary.h"
 
 void test_new() {
   // Test Case 1: Create a restricted dictionary with a valid size
@@ -22,6 +32,84 @@ void test_new() {
   assert(r_dict != NULL);
   restricted_dictionary_del(r_dict);
 }
+void test_new_ex() {
+  struct restricted_dictionary *r_dict = NULL;
+  size_t used = 0;
+  size_t reserved = 0;
+
+  // Test Case 1: no arena to report on
+  r_dict = restricted_dictionary_new_ex(10, 0);
+  assert(r_dict != NULL);
+  assert(restricted_dictionary_arena_usage(r_dict, &used, &reserved) == -1);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 2: rules allocated from the arena
+  r_dict = restricted_dictionary_new_ex(10, RESTRICTED_DICTIONARY_ARENA);
+  assert(r_dict != NULL);
+  assert(restricted_dictionary_arena_usage(r_dict, &used, &reserved) == 0);
+  assert(used == 0);
+  for (int i = 0; i < 100; i++) {
+    char master_pair[32];
+    snprintf(master_pair, sizeof(master_pair), "company=C%d", i);
+    assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                          master_pair) == 0);
+  }
+  assert(restricted_dictionary_arena_usage(r_dict, &used, &reserved) == 0);
+  assert(used > 0 && used <= reserved);
+  assert(restricted_dictionary_set(r_dict, "company", "C42") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=C42") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  restricted_dictionary_del(r_dict);
+}
+
+void test_blocked_set() {
+  struct restricted_dictionary *r_dict = NULL;
+  const char *keys[] = {"company", "location"};
+  const char *vals[] = {"Yahoo", "USA"};
+
+  // Test Case 1: counters follow master and slave sets
+  r_dict = restricted_dictionary_new_ex(10, RESTRICTED_DICTIONARY_BLOCKED_SET);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "location=USA") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set_many(r_dict, keys, vals, 2, NULL) == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "location", "EU") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "location", "USA") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "employee", "Billy") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 2: counters follow rule changes
+  r_dict = restricted_dictionary_new_ex(10, RESTRICTED_DICTIONARY_BLOCKED_SET);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy", NULL) == 0);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Yahoo") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Yahoo", NULL) == 0);
+  assert(restricted_dictionary_unrestrict_master(r_dict, "company=Yahoo") ==
+         0);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Yahoo", NULL) == 1);
+  restricted_dictionary_del(r_dict);
+}
+
 void test_del() {
   // Test Case 1: Delete a NULL restricted dictionary
   restricted_dictionary_del(NULL);
@@ -58,6 +146,101 @@ void test_set() {
   restricted_dictionary_del(r_dict);
 }
 
+void test_set_many() {
+  struct restricted_dictionary *r_dict = NULL;
+  struct restricted_dictionary_conflict conflict;
+  const char *keys[] = {"company", "employee", "location"};
+  const char *vals[] = {"Google", "Andy", "USA"};
+  const char *dup_keys[] = {"company", "company"};
+
+  // Test Case 1: invalid input
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_set_many(r_dict, NULL, vals, 3, NULL) == -1);
+  assert(restricted_dictionary_set_many(r_dict, keys, vals, 0, NULL) == -1);
+  assert(restricted_dictionary_set_many(r_dict, dup_keys, vals, 2,
+                                        &conflict) == -1);
+  assert(conflict.index == 1);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 2: batch without rules
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_set_many(r_dict, keys, vals, 3, NULL) == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 3: entries of the batch conflict with each other
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_set_many(r_dict, keys, vals, 3, &conflict) ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(conflict.index == 0 || conflict.index == 1);
+  assert(strcmp(conflict.slave_key, "employee") == 0);
+  assert(strcmp(conflict.master_value, "Google") == 0);
+  // nothing was applied
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 4: batch replaces a master that blocks one of its entries
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Yahoo") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set_many(r_dict, keys, vals, 3, NULL) == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  restricted_dictionary_del(r_dict);
+}
+
+void test_can_set() {
+  struct restricted_dictionary *r_dict = NULL;
+  struct restricted_dictionary_conflict conflict;
+  struct restricted_dictionary_conflict conflicts[3];
+  const char *vals[] = {"Andy", "Billy", "Cindy"};
+  int allowed[3];
+
+  // Test Case 1: invalid input
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_can_set(r_dict, NULL, "Google", NULL) == -1);
+  assert(restricted_dictionary_can_set_many(r_dict, "employee", vals, 3,
+                                            NULL, NULL) == -1);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 2: query both directions without changing anything
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy", NULL) == 1);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy",
+                                       &conflict) == 0);
+  assert(strcmp(conflict.master_key, "company") == 0);
+  assert(strcmp(conflict.master_value, "Google") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Google", NULL) ==
+         1);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Google",
+                                       &conflict) == 0);
+  assert(strcmp(conflict.slave_value, "Andy") == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 3: several candidates at once
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Cindy",
+                                        "location=USA") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_can_set_many(r_dict, "employee", vals, 3,
+                                            allowed, conflicts) == 2);
+  assert(!allowed[0] && allowed[1] && allowed[2]);
+  assert(strcmp(conflicts[0].master_value, "Google") == 0);
+  assert(conflicts[1].master_key == NULL);
+  restricted_dictionary_del(r_dict);
+}
+
 void test_restrict() {
   struct restricted_dictionary *r_dict = NULL;
 
@@ -148,7 +331,8 @@ void test_unrestrict() {
   // Test Case 5: Remove a restriction that does not exist
   r_dict = restricted_dictionary_new(10);
   assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
-                                          "company=Google") == -1);
+                                          "company=Google") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
   restricted_dictionary_del(r_dict);
 
   // Test Case 6: Remove a restriction that slave does not exist
@@ -156,7 +340,8 @@ void test_unrestrict() {
   assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
                                         "company=Google") == 0);
   assert(restricted_dictionary_unrestrict(r_dict, "employee=Billy",
-                                          "company=Google") == -1);
+                                          "company=Google") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
   restricted_dictionary_del(r_dict);
 
   // Test Case 7: Remove a restriction that master does not exist
@@ -164,7 +349,8 @@ void test_unrestrict() {
   assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
                                         "company=Google") == 0);
   assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
-                                          "company=Yahoo") == -1);
+                                          "company=Yahoo") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
   restricted_dictionary_del(r_dict);
 
   // Test Case 8: Remove a restriction
@@ -176,6 +362,65 @@ void test_unrestrict() {
   restricted_dictionary_del(r_dict);
 }
 
+void test_unrestrict_all() {
+
+  struct restricted_dictionary *r_dict = NULL;
+
+  // Test Case 1: invalid input
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_unrestrict_all(r_dict, NULL) == -1);
+  assert(restricted_dictionary_unrestrict_all(r_dict, "employee-Andy") == -1);
+  assert(restricted_dictionary_unrestrict_master(r_dict, NULL) == -1);
+  assert(restricted_dictionary_unrestrict_master(r_dict, "company-Google") ==
+         -1);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 2: pairs that are not restricted
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_unrestrict_all(r_dict, "company=Google") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(restricted_dictionary_unrestrict_master(r_dict, "employee=Andy") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 3: drop every rule of a slave
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "location=USA") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Billy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "location", "USA") == 0);
+  assert(restricted_dictionary_unrestrict_all(r_dict, "employee=Andy") == 0);
+  assert(restricted_dictionary_unrestrict_all(r_dict, "employee=Andy") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Billy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 4: drop every rule referencing a master
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Billy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Billy",
+                                        "company=Yahoo") == 0);
+  assert(restricted_dictionary_unrestrict_master(r_dict, "company=Google") ==
+         0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Billy") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  restricted_dictionary_del(r_dict);
+}
+
 void test_restrict_then_set() {
 
   struct restricted_dictionary *r_dict = NULL;
@@ -185,7 +430,83 @@ void test_restrict_then_set() {
   assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
                                         "company=Google") == 0);
   assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
-  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == -1);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 9: many slaves, then unrestrict one of them
+  r_dict = restricted_dictionary_new(10);
+  for (int i = 0; i < 1000; i++) {
+    char slave_pair[32];
+    snprintf(slave_pair, sizeof(slave_pair), "employee=E%d", i);
+    assert(restricted_dictionary_restrict(r_dict, slave_pair,
+                                          "company=Google") == 0);
+  }
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "E0") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "employee", "E999") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "employee", "E1000") == 0);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=E500",
+                                          "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "E500") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "E501") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 10: a master whose value is the string "NULL"
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=NULL") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Billy") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "NULL") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 11: master value set before the rule refers to it
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  restricted_dictionary_del(r_dict);
+}
+
+void test_set_then_restrict() {
+
+  struct restricted_dictionary *r_dict = NULL;
+
+  // Test Case 1: setting a master is rejected while its slave is present
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 2: master is allowed once the slave has been replaced
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Billy") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 3: master is allowed once the restriction is removed
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
   restricted_dictionary_del(r_dict);
 }
 
@@ -255,14 +576,1851 @@ void test_multiRestrict() {
   restricted_dictionary_del(r_dict);
 }
 
+void test_restrict_pair() {
+
+  struct restricted_dictionary *r_dict = NULL;
+  // pairs point into a larger buffer and are not NUL-terminated
+  const char *buf = "employee=Andy;company=Google;company=Yahoo";
+  struct restricted_pair slave = {buf, 8, buf + 9, 4};
+  struct restricted_pair masters[] = {{buf + 14, 7, buf + 22, 6},
+                                      {buf + 29, 7, buf + 37, 5}};
+  struct restricted_pair empty = {buf, 0, buf + 9, 4};
+
+  // Test Case 1: invalid pairs
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict_pair(r_dict, NULL, &masters[0]) == -1);
+  assert(restricted_dictionary_restrict_pair(r_dict, &empty, &masters[0]) ==
+         -1);
+  assert(restricted_dictionary_unrestrict_pair(r_dict, &slave, &masters[0]) ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 2: restrict, then unrestrict with the string API
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_restrict_pair(r_dict, &slave, &masters[0]) ==
+         0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 3: multiple masters
+  r_dict = restricted_dictionary_new(10);
+  assert(restricted_dictionary_multiRestrict_pairs(r_dict, &slave, masters,
+                                                   2) == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_unrestrict_pair(r_dict, &slave, &masters[1]) ==
+         0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 4: splitting 'A=B' strings, the first '=' splits them
+  struct restricted_pair split;
+  assert(restricted_dictionary_split_pair(buf, 13, &split) == 0);
+  assert(split.key == buf && split.key_len == 8);
+  assert(split.value == buf + 9 && split.value_len == 4);
+  assert(restricted_dictionary_split_pair("a==b", 4, &split) == 0);
+  assert(split.key_len == 1 && split.value_len == 2);
+  assert(restricted_dictionary_split_pair(buf, 9, &split) == -1);
+  assert(restricted_dictionary_split_pair("=Andy", 5, &split) == -1);
+  assert(restricted_dictionary_split_pair("employee", 8, &split) == -1);
+  assert(restricted_dictionary_split_pair(buf, 0, &split) == -1);
+}
+
+// Runs check on a plain dictionary, one keeping the blocked set counters
+// and one allocating from an arena
+static void for_each_mode(void (*check)(unsigned int)) {
+  check(0);
+  check(RESTRICTED_DICTIONARY_BLOCKED_SET);
+  check(RESTRICTED_DICTIONARY_ARENA);
+}
+
+static void check_transaction(unsigned int flags) {
+  struct restricted_dictionary *r_dict =
+      restricted_dictionary_new_ex(10, flags);
+  struct restricted_dictionary_stats stats;
+  assert(r_dict != NULL);
+  assert(restricted_dictionary_set(r_dict, "city", "Hsinchu") == 0);
+  assert(restricted_dictionary_set(r_dict, "team", "red") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Carl",
+                                        "company=Apple") == 0);
+
+  // Test Case 1: a rollback undoes sets and rule changes of every kind
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_begin(r_dict) == RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "city", "Taipei") == 0);
+  const char *keys[] = {"team", "floor"};
+  const char *vals[] = {"blue", "3"};
+  assert(restricted_dictionary_set_many(r_dict, keys, vals, 2, NULL) == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  char *masters[] = {"company=Yahoo", "invalid"};
+  assert(restricted_dictionary_multiRestrict(
+             r_dict, "employee=Bob", masters, 2) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Carl",
+                                          "company=Apple") == 0);
+  // changes inside the transaction see each other
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_rollback(r_dict) == 0);
+  assert(restricted_dictionary_rollback(r_dict) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+  assert(stats.num_rules == 1);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy", NULL) ==
+         1);
+  assert(restricted_dictionary_set(r_dict, "company", "Apple") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Carl", NULL) ==
+         0);
+  // values are back to what they were, probed through rules on them
+  char *probes[] = {"city=Hsinchu", "city=Taipei", "team=red", "team=blue",
+                    "floor=3"};
+  assert(restricted_dictionary_restrict(r_dict, "probe=0", probes[0]) == 0);
+  assert(restricted_dictionary_restrict(r_dict, "probe=1", probes[1]) == 0);
+  assert(restricted_dictionary_restrict(r_dict, "probe=2", probes[2]) == 0);
+  assert(restricted_dictionary_restrict(r_dict, "probe=3", probes[3]) == 0);
+  assert(restricted_dictionary_restrict(r_dict, "probe=4", probes[4]) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "probe", "0", NULL) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "probe", "1", NULL) == 1);
+  assert(restricted_dictionary_can_set(r_dict, "probe", "2", NULL) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "probe", "3", NULL) == 1);
+  assert(restricted_dictionary_can_set(r_dict, "probe", "4", NULL) == 1);
+
+  // Test Case 2: a commit keeps everything
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_set(r_dict, "city", "Taipei") == 0);
+  assert(restricted_dictionary_unrestrict_all(r_dict, "probe=0") == 0);
+  assert(restricted_dictionary_commit(r_dict) == 0);
+  assert(restricted_dictionary_commit(r_dict) == RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_can_set(r_dict, "probe", "0", NULL) == 1);
+  assert(restricted_dictionary_can_set(r_dict, "probe", "1", NULL) == 0);
+
+  // Test Case 3: a transaction left open is dropped with the dictionary
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_set(r_dict, "city", "Tainan") == 0);
+  restricted_dictionary_del(r_dict);
+}
+
+void test_transaction() {
+  for_each_mode(check_transaction);
+}
+
+static void check_fork(unsigned int flags) {
+  struct restricted_dictionary *r_dict =
+      restricted_dictionary_new_ex(10, flags);
+  struct restricted_dictionary_stats stats;
+  assert(r_dict != NULL);
+  assert(restricted_dictionary_set(r_dict, "city", "Hsinchu") == 0);
+  assert(restricted_dictionary_set(r_dict, "team", "red") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Apple") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Carl",
+                                        "company=Apple") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "city=Hsinchu") == 0);
+
+  // Test Case 1: a fork starts out as its parent
+  struct restricted_dictionary *fork = restricted_dictionary_fork(r_dict);
+  assert(fork != NULL);
+  assert(restricted_dictionary_can_set(fork, "employee", "Carl", NULL) == 0);
+  assert(restricted_dictionary_can_set(fork, "employee", "Andy", NULL) == 0);
+  assert(restricted_dictionary_can_set(fork, "employee", "Bob", NULL) == 1);
+
+  // Test Case 2: changes to the fork are not seen by its parent
+  assert(restricted_dictionary_set(fork, "company", "Google") == 0);
+  assert(restricted_dictionary_can_set(fork, "employee", "Carl", NULL) == 1);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Carl", NULL) ==
+         0);
+  assert(restricted_dictionary_unrestrict(fork, "employee=Andy",
+                                          "city=Hsinchu") == 0);
+  assert(restricted_dictionary_unrestrict(fork, "employee=Andy",
+                                          "city=Hsinchu") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(restricted_dictionary_can_set(fork, "employee", "Andy", NULL) == 1);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy", NULL) ==
+         0);
+  // team was set before any rule referred to red
+  assert(restricted_dictionary_restrict(fork, "employee=Bob", "team=red") ==
+         0);
+  assert(restricted_dictionary_set(fork, "employee", "Bob") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Bob", NULL) == 1);
+  const char *keys[] = {"team", "floor"};
+  const char *vals[] = {"blue", "3"};
+  assert(restricted_dictionary_set_many(fork, keys, vals, 2, NULL) == 0);
+  assert(restricted_dictionary_set(fork, "employee", "Bob") == 0);
+  assert(restricted_dictionary_get_stats(fork, &stats) == 0);
+  assert(stats.num_rules == 2);
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+  assert(stats.num_rules == 2);
+  assert(restricted_dictionary_save(fork, "fork.snap") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+
+  // Test Case 3: a fork of a fork, rolled back
+  struct restricted_dictionary *nested = restricted_dictionary_fork(fork);
+  assert(nested != NULL);
+  assert(restricted_dictionary_can_set(nested, "employee", "Carl", NULL) ==
+         1);
+  assert(restricted_dictionary_begin(nested) == 0);
+  assert(restricted_dictionary_unrestrict_master(nested, "team=red") == 0);
+  assert(restricted_dictionary_set(nested, "company", "Apple") == 0);
+  assert(restricted_dictionary_can_set(nested, "employee", "Carl", NULL) ==
+         0);
+  assert(restricted_dictionary_rollback(nested) == 0);
+  assert(restricted_dictionary_can_set(nested, "employee", "Carl", NULL) ==
+         1);
+  assert(restricted_dictionary_get_stats(nested, &stats) == 0);
+  assert(stats.num_rules == 2);
+  assert(restricted_dictionary_restrict(nested, "employee=Bob",
+                                        "floor=3") == 0);
+  assert(restricted_dictionary_can_set(nested, "employee", "Bob", NULL) == 0);
+  assert(restricted_dictionary_can_set(fork, "employee", "Bob", NULL) == 1);
+  restricted_dictionary_del(nested);
+
+  // Test Case 4: the parent is left as it was
+  restricted_dictionary_del(fork);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Carl", NULL) ==
+         0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy", NULL) ==
+         0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Bob") == 0);
+  restricted_dictionary_del(r_dict);
+}
+
+#define FORK_THREADS 8
+
+static void *fork_thread(void *arg) {
+  const struct restricted_dictionary *r_dict = arg;
+  char pair[32];
+
+  for (unsigned int i = 0; i < 200; i++) {
+    struct restricted_dictionary *fork = restricted_dictionary_fork(r_dict);
+    assert(fork != NULL);
+    snprintf(pair, sizeof(pair), "probe=%u", i);
+    assert(restricted_dictionary_restrict(fork, pair, "city=Hsinchu") == 0);
+    assert(restricted_dictionary_can_set(fork, "employee", "Andy", NULL) ==
+           0);
+    assert(restricted_dictionary_set(fork, "city", "Taipei") == 0);
+    assert(restricted_dictionary_can_set(fork, "employee", "Andy", NULL) ==
+           1);
+    restricted_dictionary_del(fork);
+  }
+
+  return NULL;
+}
+
+void test_fork() {
+  for_each_mode(check_fork);
+
+  // Test Case 5: forks of one parent made and used from several threads
+  struct restricted_dictionary *r_dict = restricted_dictionary_new(10);
+  assert(r_dict != NULL);
+  assert(restricted_dictionary_set(r_dict, "city", "Hsinchu") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "city=Hsinchu") == 0);
+  pthread_t threads[FORK_THREADS];
+  for (unsigned int i = 0; i < FORK_THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, fork_thread, r_dict) == 0);
+  }
+  for (unsigned int i = 0; i < FORK_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  restricted_dictionary_del(r_dict);
+}
+
+static void check_group(unsigned int flags) {
+  struct restricted_dictionary *r_dict =
+      restricted_dictionary_new_ex(10, flags);
+  struct restricted_dictionary_conflict conflict;
+  char *masters[] = {"company=Google", "city=Taipei", "floor=3"};
+  char *reordered[] = {"city=Taipei", "company=Google"};
+  assert(r_dict != NULL);
+  // set before any rule refers to the value
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+
+  // Test Case 1: invalid input
+  char *same_key[] = {"company=Google", "company=Yahoo"};
+  char *invalid[] = {"company=Google", "invalid"};
+  assert(restricted_dictionary_restrict_group(r_dict, "employee=Andy",
+                                              same_key, 2) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_restrict_group(r_dict, "company=Yahoo",
+                                              masters, 1) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_restrict_group(r_dict, "employee=Andy",
+                                              invalid, 2) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_restrict_group(r_dict, "employee=Andy",
+                                              masters, 0) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+
+  // Test Case 2: the slave is only refused while every master is present
+  assert(restricted_dictionary_restrict_group(r_dict, "employee=Andy",
+                                              masters, 2) == 0);
+  assert(restricted_dictionary_restrict_group(r_dict, "employee=Andy",
+                                              reordered, 2) == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Bob") == 0);
+  assert(restricted_dictionary_set(r_dict, "city", "Taipei") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy",
+                                       &conflict) == 0);
+  assert(strcmp(conflict.slave_key, "employee") == 0);
+  assert(strcmp(conflict.master_key, "company") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+
+  // Test Case 3: a master is refused while the rest of the group is present
+  assert(restricted_dictionary_set(r_dict, "city", "Hsinchu") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "city", "Taipei",
+                                       &conflict) == 0);
+  assert(strcmp(conflict.slave_value, "Andy") == 0);
+  assert(strcmp(conflict.master_value, "Taipei") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Yahoo", NULL) ==
+         1);
+  // a batch is checked as a whole
+  const char *keys[] = {"company", "city"};
+  const char *vals[] = {"Yahoo", "Taipei"};
+  assert(restricted_dictionary_set_many(r_dict, keys, vals, 2, NULL) == 0);
+  vals[0] = "Google";
+  assert(restricted_dictionary_set_many(r_dict, keys, vals, 2, &conflict) ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(conflict.index == 0);
+
+  // Test Case 4: a rollback undoes adding and removing groups
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_unrestrict_group(r_dict, "employee=Andy",
+                                                reordered, 2) == 0);
+  assert(restricted_dictionary_restrict_group(r_dict, "employee=Andy",
+                                              masters, 3) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Google", NULL) ==
+         1);
+  assert(restricted_dictionary_rollback(r_dict) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Google", NULL) ==
+         0);
+  assert(restricted_dictionary_set(r_dict, "floor", "3") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+
+  // Test Case 5: a fork checks the groups of its parent and cannot change
+  // them
+  struct restricted_dictionary *fork = restricted_dictionary_fork(r_dict);
+  assert(fork != NULL);
+  assert(restricted_dictionary_can_set(fork, "company", "Google", NULL) == 0);
+  assert(restricted_dictionary_set(fork, "employee", "Bob") == 0);
+  assert(restricted_dictionary_set(fork, "company", "Google") == 0);
+  assert(restricted_dictionary_unrestrict_group(fork, "employee=Andy",
+                                                masters, 2) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  restricted_dictionary_del(fork);
+  // nor is there room for them in a snapshot
+  assert(restricted_dictionary_save(r_dict, "group.snap") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+
+  // Test Case 6: removed groups no longer block
+  assert(restricted_dictionary_unrestrict_group(r_dict, "employee=Andy",
+                                                reordered, 2) == 0);
+  assert(restricted_dictionary_unrestrict_group(r_dict, "employee=Andy",
+                                                reordered, 2) ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  struct restricted_dictionary_stats stats;
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+  assert(stats.num_pairs == 0);
+
+  restricted_dictionary_del(r_dict);
+}
+
+void test_group() {
+  for_each_mode(check_group);
+}
+
+static void check_pattern(unsigned int flags) {
+  struct restricted_dictionary *r_dict =
+      restricted_dictionary_new_ex(10, flags);
+  struct restricted_dictionary_conflict conflict;
+  assert(r_dict != NULL);
+  // set before any rule refers to the value
+  assert(restricted_dictionary_set(r_dict, "company", "Acme") == 0);
+
+  // Test Case 1: invalid input
+  assert(restricted_dictionary_restrict_pattern(NULL, "employee=*",
+                                                "company=Acme") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_restrict_pattern(r_dict, "employee",
+                                                "company=Acme") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_restrict_pattern(r_dict, "employee=*",
+                                                "=Acme") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+
+  // Test Case 2: any value of a key is refused while the master is present
+  assert(restricted_dictionary_restrict_pattern(r_dict, "employee=*",
+                                                "company=Acme") == 0);
+  assert(restricted_dictionary_restrict_pattern(r_dict, "employee=*",
+                                                "company=Acme") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_last_conflict(r_dict, &conflict) == 0);
+  assert(strcmp(conflict.slave_key, "employee") == 0);
+  assert(strcmp(conflict.slave_value, "*") == 0);
+  assert(strcmp(conflict.master_value, "Acme") == 0);
+  assert(restricted_dictionary_set(r_dict, "employees", "Andy") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Other") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  // and the other way round
+  assert(restricted_dictionary_can_set(r_dict, "company", "Acme",
+                                       &conflict) == 0);
+  assert(strcmp(conflict.master_key, "company") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Acme") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+
+  // Test Case 3: keys under a prefix
+  assert(restricted_dictionary_restrict_pattern(r_dict, "feature.beta.*=*",
+                                                "tier=free") == 0);
+  assert(restricted_dictionary_set(r_dict, "feature.beta.x", "on") == 0);
+  assert(restricted_dictionary_set(r_dict, "feature.beta.y", "on") == 0);
+  assert(restricted_dictionary_set(r_dict, "tier", "free") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_last_conflict(r_dict, &conflict) == 0);
+  assert(strcmp(conflict.slave_key, "feature.beta.*") == 0);
+  int allowed[2];
+  const char *tiers[] = {"free", "paid"};
+  assert(restricted_dictionary_can_set_many(r_dict, "tier", tiers, 2,
+                                            allowed, NULL) == 1);
+  assert(!allowed[0] && allowed[1]);
+  assert(restricted_dictionary_set(r_dict, "tier", "paid") == 0);
+  assert(restricted_dictionary_set(r_dict, "feature.beta.x", "off") == 0);
+  assert(restricted_dictionary_set(r_dict, "feature.alpha", "on") == 0);
+
+  // Test Case 4: a batch is checked as a whole
+  const char *keys[] = {"feature.beta.x", "feature.beta.y", "tier"};
+  const char *vals[] = {"on", "on", "free"};
+  assert(restricted_dictionary_set_many(r_dict, keys, vals, 3, &conflict) ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(conflict.index == 0);
+  // keys the batch moves out of a pattern do not count
+  const char *emptied[] = {"feature.beta.x", "feature.beta.y", "tier"};
+  const char *emptied_vals[] = {"on", "on", "paid"};
+  assert(restricted_dictionary_restrict_pattern(r_dict, "feature.beta.*=on",
+                                                "tier=trial") == 0);
+  assert(restricted_dictionary_set_many(r_dict, emptied, emptied_vals, 3,
+                                        NULL) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "tier", "trial", NULL) == 0);
+  emptied_vals[0] = "off";
+  emptied_vals[1] = "off";
+  emptied_vals[2] = "trial";
+  assert(restricted_dictionary_set_many(r_dict, emptied, emptied_vals, 3,
+                                        NULL) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "feature.beta.z", "on",
+                                       NULL) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "feature.beta.z", "off",
+                                       NULL) == 1);
+
+  // Test Case 5: a rollback undoes adding and removing rules
+  assert(restricted_dictionary_set(r_dict, "tier", "paid") == 0);
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_unrestrict_pattern(r_dict, "feature.beta.*=*",
+                                                  "tier=free") == 0);
+  assert(restricted_dictionary_restrict_pattern(r_dict, "*=*",
+                                                "region=eu") == 0);
+  assert(restricted_dictionary_set(r_dict, "tier", "free") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "region", "eu", NULL) == 0);
+  assert(restricted_dictionary_rollback(r_dict) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "region", "eu", NULL) == 1);
+  assert(restricted_dictionary_set(r_dict, "tier", "free") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+
+  // Test Case 6: a fork checks the patterns of its parent against its own
+  // values and cannot change them
+  struct restricted_dictionary *fork = restricted_dictionary_fork(r_dict);
+  assert(fork != NULL);
+  assert(restricted_dictionary_set(fork, "tier", "free") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(fork, "feature.beta.x", "gone") == 0);
+  assert(restricted_dictionary_set(fork, "feature.beta.y", "gone") == 0);
+  assert(restricted_dictionary_can_set(fork, "tier", "free", NULL) == 0);
+  assert(restricted_dictionary_unrestrict_pattern(fork, "feature.beta.*=*",
+                                                  "tier=free") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  restricted_dictionary_del(fork);
+  // nor is there room for them in a snapshot
+  assert(restricted_dictionary_save(r_dict, "pattern.snap") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+
+  // Test Case 7: removed rules no longer block
+  assert(restricted_dictionary_unrestrict_pattern(r_dict, "feature.beta.*=*",
+                                                  "tier=free") == 0);
+  assert(restricted_dictionary_unrestrict_pattern(r_dict, "feature.beta.*=*",
+                                                  "tier=free") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(restricted_dictionary_unrestrict_pattern(r_dict, "employee=*",
+                                                  "company=Acme") == 0);
+  assert(restricted_dictionary_unrestrict_pattern(
+             r_dict, "feature.beta.*=on", "tier=trial") == 0);
+  assert(restricted_dictionary_set(r_dict, "tier", "free") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Acme") == 0);
+  // the key a set replaces is not held against it
+  assert(restricted_dictionary_restrict_pattern(r_dict, "feature.beta.*=on",
+                                                "feature.beta.*=off") == 0);
+  assert(restricted_dictionary_set(r_dict, "feature.beta.x", "on") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "feature.beta.y", "gone") == 0);
+  assert(restricted_dictionary_set(r_dict, "feature.beta.x", "on") == 0);
+  assert(restricted_dictionary_unrestrict_pattern(
+             r_dict, "feature.beta.*=on", "feature.beta.*=off") == 0);
+  assert(restricted_dictionary_save(r_dict, "pattern.snap") == 0);
+  remove("pattern.snap");
+
+  restricted_dictionary_del(r_dict);
+}
+
+void test_pattern() {
+  for_each_mode(check_pattern);
+}
+
+// Every candidate is checked the same way whether or not r_dict is frozen
+static void check_frozen_checks(struct restricted_dictionary *r_dict,
+                                const char **keys, unsigned int num_keys,
+                                const char **vals, unsigned int num_vals,
+                                int *expected) {
+  struct restricted_dictionary_conflict conflict;
+  for (unsigned int i = 0; i < num_keys; i++) {
+    for (unsigned int j = 0; j < num_vals; j++) {
+      int allowed =
+          restricted_dictionary_can_set(r_dict, keys[i], vals[j], &conflict);
+      if (expected[i * num_vals + j] == -1) {
+        expected[i * num_vals + j] = allowed;
+      }
+      assert(allowed == expected[i * num_vals + j]);
+    }
+  }
+}
+
+static void check_freeze(unsigned int flags) {
+  struct restricted_dictionary *r_dict =
+      restricted_dictionary_new_ex(10, flags);
+  struct restricted_dictionary_conflict conflict;
+  const char *keys[] = {"employee", "company", "city", "floor", "unknown"};
+  const char *vals[] = {"Andy", "Bob", "Google", "Yahoo", "Taipei", "3"};
+  int expected[5 * 6];
+  char *masters[] = {"company=Google", "company=Yahoo"};
+  char *group[] = {"city=Taipei", "floor=3"};
+  assert(r_dict != NULL);
+  memset(expected, -1, sizeof(expected));
+
+  // Test Case 1: invalid input
+  assert(restricted_dictionary_freeze(NULL) == RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_thaw(NULL) == RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_freeze(r_dict) == RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_rollback(r_dict) == 0);
+  struct restricted_dictionary *fork = restricted_dictionary_fork(r_dict);
+  assert(fork != NULL);
+  assert(restricted_dictionary_freeze(fork) == RESTRICTED_DICTIONARY_EINVAL);
+  restricted_dictionary_del(fork);
+
+  // Test Case 2: a frozen dictionary checks sets as it did before
+  assert(restricted_dictionary_set(r_dict, "city", "Taipei") == 0);
+  assert(restricted_dictionary_multiRestrict(r_dict, "employee=Andy", masters,
+                                             2) == 0);
+  assert(restricted_dictionary_restrict(r_dict, "company=Google",
+                                        "city=Taipei") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Bob",
+                                        "employee=Andy") == 0);
+  assert(restricted_dictionary_restrict_group(r_dict, "company=Yahoo", group,
+                                              2) == 0);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "floor", "3") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Bob") == 0);
+  check_frozen_checks(r_dict, keys, 5, vals, 6, expected);
+  assert(restricted_dictionary_freeze(r_dict) == 0);
+  check_frozen_checks(r_dict, keys, 5, vals, 6, expected);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Yahoo",
+                                       &conflict) == 0);
+  assert(strcmp(conflict.slave_key, "company") == 0);
+  assert(strcmp(conflict.master_value, "Taipei") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  // the slave on the key being set does not count
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  const char *batch_keys[] = {"city", "company"};
+  const char *batch_vals[] = {"Hsinchu", "Google"};
+  assert(restricted_dictionary_set_many(r_dict, batch_keys, batch_vals, 2,
+                                        NULL) == 0);
+  batch_vals[0] = "Taipei";
+  assert(restricted_dictionary_set_many(r_dict, batch_keys, batch_vals, 2,
+                                        &conflict) ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(conflict.index == 0);
+  int allowed[6];
+  assert(restricted_dictionary_can_set_many(r_dict, "employee", vals, 6,
+                                            allowed, NULL) == 5);
+  assert(!allowed[1]);
+
+  // Test Case 3: rules cannot change while frozen
+  assert(restricted_dictionary_restrict(r_dict, "city=Taipei",
+                                        "floor=3") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Yahoo") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_unrestrict_all(r_dict, "employee=Andy") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_unrestrict_group(r_dict, "company=Yahoo",
+                                                group, 2) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_restrict_pattern(r_dict, "employee=*",
+                                                "company=Google") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  // values and keys no rule refers to come and go as before
+  assert(restricted_dictionary_set(r_dict, "building", "A") == 0);
+  assert(restricted_dictionary_freeze(r_dict) == 0);
+  assert(restricted_dictionary_set(r_dict, "building", "B") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "city", "Taipei") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_last_conflict(r_dict, &conflict) == 0);
+  assert(strcmp(conflict.master_key, "city") == 0);
+  struct restricted_dictionary_stats stats;
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+  assert(stats.num_rules == 3);
+
+  // Test Case 4: a thawed dictionary takes rule changes again
+  assert(restricted_dictionary_thaw(r_dict) == 0);
+  assert(restricted_dictionary_unrestrict_all(r_dict, "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "city", "Taipei") == 0);
+  assert(restricted_dictionary_freeze(r_dict) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy", NULL) ==
+         1);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+
+  restricted_dictionary_del(r_dict);
+}
+
+void test_freeze() {
+  for_each_mode(check_freeze);
+}
+
+static void check_ttl(unsigned int flags) {
+  struct restricted_dictionary *r_dict =
+      restricted_dictionary_new_ex(10, flags);
+  struct restricted_dictionary_stats stats;
+  assert(r_dict != NULL);
+
+  // Test Case 1: invalid input
+  assert(restricted_dictionary_restrict_ttl(NULL, "employee=Andy",
+                                            "company=Google", 1) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_restrict_ttl(r_dict, "employee=Andy",
+                                            "company=Google", 0) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_restrict_ttl(r_dict, "employee",
+                                            "company=Google", 1) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_tick(NULL, 1) == RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_restrict_ttl(r_dict, "employee=Andy",
+                                            "company=Google", 1) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_tick(r_dict, 1) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_rollback(r_dict) == 0);
+  struct restricted_dictionary *fork = restricted_dictionary_fork(r_dict);
+  assert(fork != NULL);
+  assert(restricted_dictionary_restrict_ttl(fork, "employee=Andy",
+                                            "company=Google", 1) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_tick(fork, 1) == RESTRICTED_DICTIONARY_EINVAL);
+  restricted_dictionary_del(fork);
+
+  // Test Case 2: a rule is gone once its ticks are counted
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_restrict_ttl(r_dict, "employee=Andy",
+                                            "company=Google", 3) == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_save(r_dict, "ttl.snap") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_tick(r_dict, 2) == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_tick(r_dict, 1) == 1);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") == 0);
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+  assert(stats.num_rules == 0 && stats.num_pairs == 0);
+  // the ends of a rule that ran out are both present again
+  assert(restricted_dictionary_restrict_ttl(r_dict, "company=Yahoo",
+                                            "employee=Andy", 1) == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_tick(r_dict, 1) == 1);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "company=Google",
+                                        "employee=Andy") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+
+  // Test Case 3: restricting again starts the TTL over or ends it
+  assert(restricted_dictionary_restrict_ttl(r_dict, "city=Taipei", "floor=3",
+                                            5) == 0);
+  assert(restricted_dictionary_tick(r_dict, 3) == 0);
+  assert(restricted_dictionary_restrict_ttl(r_dict, "city=Taipei", "floor=3",
+                                            5) == 0);
+  assert(restricted_dictionary_tick(r_dict, 4) == 0);
+  assert(restricted_dictionary_tick(r_dict, 1) == 1);
+  assert(restricted_dictionary_restrict_ttl(r_dict, "city=Taipei", "floor=3",
+                                            2) == 0);
+  assert(restricted_dictionary_restrict(r_dict, "city=Taipei", "floor=3") ==
+         0);
+  assert(restricted_dictionary_tick(r_dict, 10) == 0);
+  // a rule removed before its TTL runs out and restricted again for good
+  assert(restricted_dictionary_restrict_ttl(r_dict, "city=Hsinchu",
+                                            "floor=3", 2) == 0);
+  assert(restricted_dictionary_unrestrict(r_dict, "city=Hsinchu",
+                                          "floor=3") == 0);
+  assert(restricted_dictionary_tick(r_dict, 1) == 0);
+  assert(restricted_dictionary_multiRestrict(
+             r_dict, "city=Hsinchu", (char *[]){"floor=3"}, 1) == 0);
+  assert(restricted_dictionary_tick(r_dict, 5) == 0);
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+  assert(stats.num_rules == 3);
+  assert(restricted_dictionary_save(r_dict, "ttl.snap") == 0);
+  remove("ttl.snap");
+
+  // Test Case 4: removing a rule takes its TTL along
+  assert(restricted_dictionary_restrict_ttl(r_dict, "employee=Andy",
+                                            "company=Google", 10) == 0);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+  assert(restricted_dictionary_save(r_dict, "ttl.snap") == 0);
+  assert(restricted_dictionary_restrict_ttl(r_dict, "employee=Andy",
+                                            "company=Google", 10) == 0);
+  assert(restricted_dictionary_unrestrict_all(r_dict, "employee=Andy") == 0);
+  assert(restricted_dictionary_save(r_dict, "ttl.snap") == 0);
+  assert(restricted_dictionary_restrict_ttl(r_dict, "employee=Andy",
+                                            "company=Google", 10) == 0);
+  assert(restricted_dictionary_unrestrict_master(r_dict, "company=Google") ==
+         0);
+  assert(restricted_dictionary_save(r_dict, "ttl.snap") == 0);
+  remove("ttl.snap");
+
+  // Test Case 5: a rollback keeps the TTL the transaction took away
+  assert(restricted_dictionary_restrict_ttl(r_dict, "employee=Andy",
+                                            "company=Google", 10) == 0);
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_rollback(r_dict) == 0);
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+  assert(restricted_dictionary_rollback(r_dict) == 0);
+  assert(restricted_dictionary_tick(r_dict, 9) == 0);
+  assert(restricted_dictionary_tick(r_dict, 1) == 1);
+  // and a commit ends it
+  assert(restricted_dictionary_restrict_ttl(r_dict, "employee=Andy",
+                                            "company=Google", 10) == 0);
+  assert(restricted_dictionary_begin(r_dict) == 0);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_commit(r_dict) == 0);
+  assert(restricted_dictionary_tick(r_dict, 20) == 0);
+  assert(restricted_dictionary_save(r_dict, "ttl.snap") == 0);
+  remove("ttl.snap");
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+
+  // Test Case 6: a frozen dictionary loses the rules that ran out
+  assert(restricted_dictionary_restrict_ttl(r_dict, "city=Tainan", "floor=3",
+                                            2) == 0);
+  assert(restricted_dictionary_set(r_dict, "floor", "3") == 0);
+  assert(restricted_dictionary_freeze(r_dict) == 0);
+  assert(restricted_dictionary_restrict_ttl(r_dict, "city=Tainan", "floor=3",
+                                            2) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_set(r_dict, "city", "Tainan") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_tick(r_dict, 2) == 1);
+  assert(restricted_dictionary_set(r_dict, "city", "Tainan") == 0);
+  assert(restricted_dictionary_set(r_dict, "city", "Taipei") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_restrict(r_dict, "city=Tainan", "floor=3") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_thaw(r_dict) == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 7: TTLs over every level of the wheel run out on time
+  r_dict = restricted_dictionary_new_ex(10, flags);
+  assert(r_dict != NULL);
+  unsigned int ttls[300];
+  unsigned int seed = 7;
+  char slave[32];
+  for (unsigned int i = 0; i < 300; i++) {
+    // around the first slots of each level too
+    unsigned int spans[] = {1u << 8, 1u << 14, 1u << 20, 1u << 21};
+    ttls[i] = i % 3 ? (unsigned int)rand_r(&seed) % spans[i % 4] + 1
+                    : spans[i % 4] + i % 5 - 2;
+    snprintf(slave, sizeof(slave), "key%u=on", i);
+    assert(restricted_dictionary_restrict_ttl(r_dict, slave, "gate=open",
+                                              ttls[i]) == 0);
+  }
+  assert(restricted_dictionary_restrict_ttl(r_dict, "forever=on", "gate=open",
+                                            1u << 30) == 0);
+  unsigned int now = 0;
+  unsigned int left = 300;
+  while (now < (1u << 21) + 8) {
+    unsigned int ticks = (unsigned int)rand_r(&seed) % 5000 + 1;
+    unsigned int expired = 0;
+    for (unsigned int i = 0; i < 300; i++) {
+      expired += ttls[i] > now && ttls[i] <= now + ticks;
+    }
+    assert(restricted_dictionary_tick(r_dict, ticks) == (int)expired);
+    now += ticks;
+    left -= expired;
+    assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+    assert(stats.num_rules == left + 1);
+  }
+  assert(restricted_dictionary_set(r_dict, "gate", "open") == 0);
+  assert(restricted_dictionary_set(r_dict, "forever", "on") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "key0", "on") == 0);
+
+  restricted_dictionary_del(r_dict);
+}
+
+void test_ttl() {
+  for_each_mode(check_ttl);
+}
+
+void test_get_stats() {
+  struct restricted_dictionary *r_dict = NULL;
+  struct restricted_dictionary_stats stats;
+
+  // Test Case 1: invalid input
+  assert(restricted_dictionary_get_stats(NULL, &stats) == -1);
+
+  // Test Case 2: sizes of an empty dictionary
+  r_dict = restricted_dictionary_new(10);
+  assert(r_dict != NULL);
+  assert(restricted_dictionary_get_stats(r_dict, NULL) == -1);
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+  assert(stats.num_keys == 0);
+  assert(stats.num_pairs == 0);
+  assert(stats.num_rules == 0);
+  assert(stats.checks == 0);
+  size_t empty_memory = stats.memory;
+
+  // Test Case 3: sizes follow the rules
+  char *masters[] = {"company=Google", "company=Yahoo"};
+  assert(restricted_dictionary_multiRestrict(r_dict, "employee=Andy", masters,
+                                             2) == 0);
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+  assert(stats.num_keys == 2);
+  assert(stats.num_values == 3);
+  assert(stats.num_pairs == 3);
+  assert(stats.num_rules == 2);
+  assert(stats.memory > empty_memory);
+
+  // Test Case 4: counters, only kept when built in
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+#ifdef RESTRICTED_DICTIONARY_STATS
+  assert(stats.checks == 2);
+  assert(stats.rejections == 1);
+  assert(stats.masters_scanned >= 1 && stats.masters_scanned <= 2);
+  assert(stats.slaves_scanned == 1);
+  assert(stats.scan_histogram[1] + stats.scan_histogram[2] == 2);
+#else
+  assert(stats.checks == 0);
+  assert(stats.rejections == 0);
+#endif
+
+  assert(restricted_dictionary_unrestrict_all(r_dict, "employee=Andy") == 0);
+  assert(restricted_dictionary_get_stats(r_dict, &stats) == 0);
+  assert(stats.num_pairs == 0);
+  assert(stats.num_rules == 0);
+
+  restricted_dictionary_del(r_dict);
+}
+
+static unsigned int num_errors;
+
+static int count_errors(const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  int ret = vfprintf(stderr, format, ap);
+  va_end(ap);
+  num_errors++;
+  return ret;
+}
+
+void test_diagnostics() {
+  struct restricted_dictionary *r_dict = NULL;
+  struct restricted_dictionary_conflict conflict;
+
+  dictionary_set_error_callback(count_errors);
+  r_dict = restricted_dictionary_new(10);
+  assert(r_dict != NULL);
+
+  // Test Case 1: invalid input
+  assert(restricted_dictionary_set_diagnostics(NULL, 0, 0) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_set_diagnostics(
+             r_dict, RESTRICTED_DICTIONARY_DIAG_SAMPLED, 0) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_set_diagnostics(r_dict, 42, 1) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_last_conflict(r_dict, NULL) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+
+  // Test Case 2: the rule that refused the last set
+  assert(restricted_dictionary_last_conflict(r_dict, &conflict) ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  unsigned int before = num_errors;
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(num_errors == before + 1);
+  assert(restricted_dictionary_last_conflict(r_dict, &conflict) == 0);
+  assert(conflict.index == 0);
+  assert(strcmp(conflict.slave_key, "employee") == 0);
+  assert(strcmp(conflict.slave_value, "Andy") == 0);
+  assert(strcmp(conflict.master_key, "company") == 0);
+  assert(strcmp(conflict.master_value, "Google") == 0);
+
+  // Test Case 3: no reports at all
+  assert(restricted_dictionary_set_diagnostics(
+             r_dict, RESTRICTED_DICTIONARY_DIAG_OFF, 0) == 0);
+  before = num_errors;
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Billy",
+                                          "company=Google") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(num_errors == before);
+  // failures that are not expected outcomes are still reported
+  assert(restricted_dictionary_set(r_dict, NULL, "Andy") ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(num_errors == before + 1);
+
+  // Test Case 4: one report in every three
+  assert(restricted_dictionary_set_diagnostics(
+             r_dict, RESTRICTED_DICTIONARY_DIAG_SAMPLED, 3) == 0);
+  before = num_errors;
+  for (int i = 0; i < 6; i++) {
+    assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+           RESTRICTED_DICTIONARY_ERESTRICTED);
+  }
+  assert(num_errors == before + 2);
+
+  // Test Case 5: at most two reports a second, the loop may straddle two
+  assert(restricted_dictionary_set_diagnostics(
+             r_dict, RESTRICTED_DICTIONARY_DIAG_RATE_LIMITED, 2) == 0);
+  before = num_errors;
+  for (int i = 0; i < 100; i++) {
+    assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+           RESTRICTED_DICTIONARY_ERESTRICTED);
+  }
+  assert(num_errors >= before + 2 && num_errors <= before + 4);
+
+  // Test Case 6: forgotten once the rule is gone
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+  assert(restricted_dictionary_last_conflict(r_dict, &conflict) ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+
+  restricted_dictionary_del(r_dict);
+}
+
+#define SNAPSHOT_PATH "restricted_dictionary_test.snap"
+
+void test_snapshot() {
+  struct restricted_dictionary *r_dict = restricted_dictionary_new(10);
+  struct restricted_dictionary_conflict conflict;
+  assert(r_dict != NULL);
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_set(r_dict, "city", "Taipei") == 0);
+  assert(restricted_dictionary_restrict(r_dict, "employee=Andy",
+                                        "company=Google") == 0);
+  char *masters[] = {"company=Yahoo", "city=Taipei"};
+  assert(restricted_dictionary_multiRestrict(r_dict, "employee=Bob", masters,
+                                             2) == 0);
+  // a pair whose rules are all gone is not saved
+  assert(restricted_dictionary_restrict(r_dict, "employee=Carl",
+                                        "company=Apple") == 0);
+  assert(restricted_dictionary_unrestrict_all(r_dict, "employee=Carl") == 0);
+  assert(restricted_dictionary_save(r_dict, SNAPSHOT_PATH) == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 1: queried in place
+  struct restricted_snapshot *snap = restricted_snapshot_open(SNAPSHOT_PATH);
+  assert(snap != NULL);
+  assert(strcmp(restricted_snapshot_get(snap, "company", NULL), "Google") ==
+         0);
+  assert(strcmp(restricted_snapshot_get(snap, "city", NULL), "Taipei") == 0);
+  assert(restricted_snapshot_get(snap, "employee", NULL) == NULL);
+  assert(restricted_snapshot_can_set(snap, "employee", "Andy", &conflict) ==
+         0);
+  assert(strcmp(conflict.master_key, "company") == 0);
+  assert(strcmp(conflict.master_value, "Google") == 0);
+  assert(restricted_snapshot_can_set(snap, "employee", "Bob", &conflict) ==
+         0);
+  assert(strcmp(conflict.master_value, "Taipei") == 0);
+  assert(restricted_snapshot_can_set(snap, "employee", "Carl", NULL) == 1);
+  assert(restricted_snapshot_can_set(snap, "company", "Yahoo", NULL) == 1);
+  assert(restricted_snapshot_can_set(snap, "nobody", "Andy", NULL) == 1);
+  assert(restricted_snapshot_can_set(snap, NULL, "Andy", NULL) == -1);
+  restricted_snapshot_close(snap);
+
+  // Test Case 2: loaded back into a dictionary that can be changed
+  r_dict = restricted_dictionary_load(SNAPSHOT_PATH, 0);
+  assert(r_dict != NULL);
+  assert(restricted_dictionary_set(r_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "employee", "Bob") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_dictionary_set(r_dict, "city", "Hsinchu") == 0);
+  assert(restricted_dictionary_set(r_dict, "employee", "Bob") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Yahoo", NULL) ==
+         0);
+  assert(restricted_dictionary_unrestrict(r_dict, "employee=Andy",
+                                          "company=Google") == 0);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 3: a damaged file is refused
+  FILE *file = fopen(SNAPSHOT_PATH, "r+b");
+  assert(file != NULL);
+  assert(fseek(file, 12, SEEK_SET) == 0);
+  assert(fputc(0xff, file) != EOF);
+  fclose(file);
+  assert(restricted_snapshot_open(SNAPSHOT_PATH) == NULL);
+  assert(restricted_dictionary_load(SNAPSHOT_PATH, 0) == NULL);
+  remove(SNAPSHOT_PATH);
+  assert(restricted_snapshot_open(SNAPSHOT_PATH) == NULL);
+}
+
+#define RULES_PATH "restricted_dictionary_test.rules"
+
+void test_load_rules() {
+  struct restricted_dictionary *r_dict = restricted_dictionary_new(10);
+  struct restricted_load_result result;
+  assert(r_dict != NULL);
+
+  // Test Case 1: malformed lines are reported by number and skipped
+  const char *rules = "# policy\n"
+                      "employee=Andy company=Google,company=Yahoo\n"
+                      "\n"
+                      "employee company=Google\n"
+                      "employee=Bob\n"
+                      "employee=Carl company=Google,=Apple\n"
+                      "  employee=Dave\tcompany=Apple , city=Taipei\r\n"
+                      "employee=Eve company=Google,";
+  unsigned int before = num_errors;
+  assert(restricted_dictionary_load_rules(r_dict, rules, strlen(rules), 2,
+                                          &result) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(num_errors == before + 4);
+  assert(result.lines == 8);
+  assert(result.rules == 4);
+  assert(result.malformed == 4);
+  assert(restricted_dictionary_set(r_dict, "company", "Yahoo") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy", NULL) ==
+         0);
+  assert(restricted_dictionary_set(r_dict, "city", "Taipei") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Dave", NULL) ==
+         0);
+  // nothing of a malformed line is loaded
+  assert(restricted_dictionary_set(r_dict, "company", "Google") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Carl", NULL) ==
+         1);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Eve", NULL) ==
+         1);
+
+  // Test Case 2: invalid input
+  assert(restricted_dictionary_load_rules(NULL, rules, 1, 1, NULL) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_load_rules(r_dict, NULL, 0, 1, &result) ==
+         RESTRICTED_DICTIONARY_OK);
+  assert(result.lines == 0);
+  assert(restricted_dictionary_load_rules_file(r_dict, RULES_PATH, 0,
+                                               NULL) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  restricted_dictionary_del(r_dict);
+
+  // Test Case 3: a file spanning several chunks, parsed on several threads
+  FILE *file = fopen(RULES_PATH, "w");
+  assert(file != NULL);
+  for (unsigned int i = 0; i < 200000; i++) {
+    if (i % 50000 == 49999) {
+      fprintf(file, "bad line %u\n", i);
+    } else {
+      fprintf(file, "key%u=on key%u=on,key%u=on\n", i % 1000, (i + 1) % 1000,
+              (i + 2) % 1000);
+    }
+  }
+  fclose(file);
+
+  r_dict = restricted_dictionary_new(1000);
+  assert(r_dict != NULL);
+  before = num_errors;
+  assert(restricted_dictionary_load_rules_file(r_dict, RULES_PATH, 4,
+                                               &result) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(num_errors == before + 4);
+  assert(result.lines == 200000);
+  assert(result.malformed == 4);
+  assert(result.rules == 2 * (200000 - 4));
+  assert(restricted_dictionary_set(r_dict, "key5", "on") == 0);
+  assert(restricted_dictionary_can_set(r_dict, "key4", "on", NULL) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "key3", "on", NULL) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "key2", "on", NULL) == 1);
+
+  // Test Case 4: a frozen dictionary takes no rules
+  assert(restricted_dictionary_freeze(r_dict) == 0);
+  assert(restricted_dictionary_load_rules(r_dict, rules, strlen(rules), 1,
+                                          NULL) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_dictionary_load_rules_file(r_dict, RULES_PATH, 1, NULL) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  restricted_dictionary_del(r_dict);
+  remove(RULES_PATH);
+}
+
+#define JOURNAL_PATH "restricted_dictionary_test.journal"
+#define JOURNAL_THREADS 4
+#define JOURNAL_SETS 100
+
+static long file_size(const char *path) {
+  FILE *file = fopen(path, "rb");
+  assert(file != NULL);
+  assert(fseek(file, 0, SEEK_END) == 0);
+  long size = ftell(file);
+  fclose(file);
+  return size;
+}
+
+static void *journal_write(void *arg) {
+  struct restricted_journal *journal = arg;
+  static atomic_uint next;
+  unsigned int id = atomic_fetch_add(&next, 1) % JOURNAL_THREADS;
+  char key[16];
+  char val[16];
+
+  for (unsigned int i = 0; i < JOURNAL_SETS; i++) {
+    snprintf(key, sizeof(key), "t%u", id);
+    snprintf(val, sizeof(val), "%u", i);
+    assert(restricted_journal_set(journal, key, val) == 0);
+  }
+
+  return NULL;
+}
+
+void test_journal() {
+  remove(JOURNAL_PATH);
+  remove(JOURNAL_PATH ".snap");
+
+  // Test Case 1: changes are there after reopening
+  struct restricted_journal *journal =
+      restricted_journal_open(JOURNAL_PATH, 0, 0);
+  assert(journal != NULL);
+  assert(restricted_journal_set(journal, "company", "Yahoo") == 0);
+  assert(restricted_journal_restrict(journal, "employee=Andy",
+                                     "company=Google") == 0);
+  char *masters[] = {"company=Yahoo", "invalid", "city=Taipei"};
+  assert(restricted_journal_multiRestrict(journal, "employee=Bob", masters,
+                                          3) == RESTRICTED_DICTIONARY_EINVAL);
+  assert(restricted_journal_restrict(journal, "employee=Carl",
+                                     "company=Apple") == 0);
+  assert(restricted_journal_unrestrict(journal, "employee=Carl",
+                                       "company=Apple") == 0);
+  assert(restricted_journal_set(journal, "employee", "Andy") == 0);
+  // refused changes are not journaled
+  assert(restricted_journal_set(journal, "company", "Google") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(restricted_journal_unrestrict(journal, "employee=Carl",
+                                       "company=Apple") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  restricted_journal_close(journal);
+  long journal_bytes = file_size(JOURNAL_PATH);
+
+  journal = restricted_journal_open(JOURNAL_PATH, 0, 0);
+  assert(journal != NULL);
+  // replayed and compacted into the snapshot
+  assert(file_size(JOURNAL_PATH) < journal_bytes);
+  const struct restricted_dictionary *r_dict =
+      restricted_journal_dictionary(journal);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Google", NULL) ==
+         0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Bob", NULL) == 0);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Carl", NULL) ==
+         1);
+  assert(restricted_journal_set(journal, "employee", "Dave") == 0);
+  restricted_journal_close(journal);
+
+  // Test Case 2: a torn last record is dropped, the ones before it stay
+  FILE *file = fopen(JOURNAL_PATH, "ab");
+  assert(file != NULL);
+  assert(fwrite("\x40\0\0\0garbage", 1, 11, file) == 11);
+  fclose(file);
+  journal = restricted_journal_open(JOURNAL_PATH, 0, 0);
+  assert(journal != NULL);
+  r_dict = restricted_journal_dictionary(journal);
+  assert(restricted_dictionary_can_set(r_dict, "company", "Google", NULL) ==
+         1);
+  assert(restricted_dictionary_can_set(r_dict, "employee", "Andy", NULL) ==
+         1);
+
+  // Test Case 3: several threads share fsyncs
+  restricted_journal_close(journal);
+  journal = restricted_journal_open(JOURNAL_PATH, 0, 1000);
+  assert(journal != NULL);
+  pthread_t threads[JOURNAL_THREADS];
+  for (unsigned int i = 0; i < JOURNAL_THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, journal_write, journal) == 0);
+  }
+  for (unsigned int i = 0; i < JOURNAL_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  restricted_journal_close(journal);
+
+  journal = restricted_journal_open(JOURNAL_PATH, 0, 0);
+  assert(journal != NULL);
+  struct restricted_snapshot *snap =
+      restricted_snapshot_open(JOURNAL_PATH ".snap");
+  assert(snap != NULL);
+  for (unsigned int i = 0; i < JOURNAL_THREADS; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "t%u", i);
+    assert(strcmp(restricted_snapshot_get(snap, key, ""), "99") == 0);
+  }
+  restricted_snapshot_close(snap);
+  restricted_journal_close(journal);
+
+  // Test Case 4: a journal without the snapshot it applies to is refused
+  remove(JOURNAL_PATH ".snap");
+  assert(restricted_journal_open(JOURNAL_PATH, 0, 0) == NULL);
+  remove(JOURNAL_PATH);
+}
+
+void test_concurrent() {
+  struct concurrent_restricted_dictionary *c_dict = NULL;
+  char buf[16];
+
+  c_dict = concurrent_restricted_dictionary_new(10, 0);
+  assert(c_dict != NULL);
+
+  // Test Case 1: get copies the value out and reports its full length
+  assert(concurrent_restricted_dictionary_get(c_dict, "company", buf,
+                                              sizeof(buf)) == -1);
+  assert(concurrent_restricted_dictionary_set(c_dict, "company", "Google") ==
+         0);
+  assert(concurrent_restricted_dictionary_get(c_dict, "company", buf,
+                                              sizeof(buf)) == 6);
+  assert(strcmp(buf, "Google") == 0);
+  assert(concurrent_restricted_dictionary_get(c_dict, "company", buf, 4) == 6);
+  assert(strcmp(buf, "Goo") == 0);
+
+  // Test Case 2: rules are enforced both ways, as by the plain dictionary
+  assert(concurrent_restricted_dictionary_restrict(c_dict, "employee=Andy",
+                                                   "company=Google") == 0);
+  assert(concurrent_restricted_dictionary_can_set(c_dict, "employee",
+                                                  "Andy") == 0);
+  assert(concurrent_restricted_dictionary_set(c_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(concurrent_restricted_dictionary_set(c_dict, "company", "Yahoo") ==
+         0);
+  assert(concurrent_restricted_dictionary_set(c_dict, "employee", "Andy") ==
+         0);
+  assert(concurrent_restricted_dictionary_can_set(c_dict, "company",
+                                                  "Google") == 0);
+  assert(concurrent_restricted_dictionary_can_set(c_dict, "employee",
+                                                  "Andy") == 1);
+
+  // Test Case 3: removed rules no longer block
+  assert(concurrent_restricted_dictionary_unrestrict(c_dict, "employee=Andy",
+                                                     "company=Google") == 0);
+  assert(concurrent_restricted_dictionary_unrestrict(c_dict, "employee=Andy",
+                                                     "company=Google") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(concurrent_restricted_dictionary_set(c_dict, "company", "Google") ==
+         0);
+  char *masters[] = {"company=Yahoo", "company=Apple", "invalid"};
+  assert(concurrent_restricted_dictionary_multiRestrict(
+             c_dict, "employee=Bob", masters, 3) == -1);
+  assert(concurrent_restricted_dictionary_can_set(c_dict, "company",
+                                                  "Apple") == 1);
+  assert(concurrent_restricted_dictionary_set(c_dict, "employee", "Bob") ==
+         0);
+  assert(concurrent_restricted_dictionary_can_set(c_dict, "company",
+                                                  "Apple") == 0);
+  assert(concurrent_restricted_dictionary_unrestrict_all(c_dict,
+                                                         "employee=Bob") == 0);
+  assert(concurrent_restricted_dictionary_can_set(c_dict, "company",
+                                                  "Apple") == 1);
+
+  // Test Case 4: invalid input
+  assert(concurrent_restricted_dictionary_set(c_dict, NULL, "Google") == -1);
+  assert(concurrent_restricted_dictionary_can_set(NULL, "a", "b") == -1);
+  assert(concurrent_restricted_dictionary_restrict(c_dict, "employee",
+                                                   "company=Google") == -1);
+
+  concurrent_restricted_dictionary_del(c_dict);
+}
+
+#define TRANSACTION_ROUNDS 2000
+
+static atomic_int transaction_done;
+
+static void *transaction_read(void *arg) {
+  struct concurrent_restricted_dictionary *c_dict = arg;
+  while (!atomic_load(&transaction_done)) {
+    // a and b swap within each transaction, one of them always blocks
+    assert(concurrent_restricted_dictionary_can_set(c_dict, "probe", "on") ==
+           0);
+  }
+  return NULL;
+}
+
+void test_concurrent_transaction() {
+  struct concurrent_restricted_dictionary *c_dict =
+      concurrent_restricted_dictionary_new(10, 0);
+  char buf[16];
+  assert(c_dict != NULL);
+
+  // Test Case 1: readers see nothing of a transaction before its commit
+  assert(concurrent_restricted_dictionary_begin(c_dict) == 0);
+  assert(concurrent_restricted_dictionary_set(c_dict, "company", "Google") ==
+         0);
+  assert(concurrent_restricted_dictionary_restrict(c_dict, "employee=Andy",
+                                                   "company=Google") == 0);
+  assert(concurrent_restricted_dictionary_get(c_dict, "company", buf,
+                                              sizeof(buf)) == -1);
+  assert(concurrent_restricted_dictionary_can_set(c_dict, "employee",
+                                                  "Andy") == 1);
+  // while writes within it are checked against it
+  assert(concurrent_restricted_dictionary_set(c_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(concurrent_restricted_dictionary_commit(c_dict) == 0);
+  assert(concurrent_restricted_dictionary_get(c_dict, "company", buf,
+                                              sizeof(buf)) == 6);
+  assert(concurrent_restricted_dictionary_can_set(c_dict, "employee",
+                                                  "Andy") == 0);
+
+  // Test Case 2: a rollback leaves readers and writers where they were
+  assert(concurrent_restricted_dictionary_begin(c_dict) == 0);
+  assert(concurrent_restricted_dictionary_set(c_dict, "company", "Yahoo") ==
+         0);
+  assert(concurrent_restricted_dictionary_set(c_dict, "company", "Apple") ==
+         0);
+  assert(concurrent_restricted_dictionary_unrestrict_all(c_dict,
+                                                         "employee=Andy") == 0);
+  assert(concurrent_restricted_dictionary_rollback(c_dict) == 0);
+  assert(concurrent_restricted_dictionary_rollback(c_dict) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(concurrent_restricted_dictionary_get(c_dict, "company", buf,
+                                              sizeof(buf)) == 6);
+  assert(strcmp(buf, "Google") == 0);
+  assert(concurrent_restricted_dictionary_set(c_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+
+  // Test Case 3: a commit is seen whole
+  char *masters[] = {"a=on", "b=on"};
+  assert(concurrent_restricted_dictionary_set(c_dict, "a", "on") == 0);
+  assert(concurrent_restricted_dictionary_multiRestrict(c_dict, "probe=on",
+                                                        masters, 2) == 0);
+  atomic_store(&transaction_done, 0);
+  pthread_t reader;
+  assert(pthread_create(&reader, NULL, transaction_read, c_dict) == 0);
+  for (unsigned int i = 0; i < TRANSACTION_ROUNDS; i++) {
+    assert(concurrent_restricted_dictionary_begin(c_dict) == 0);
+    assert(concurrent_restricted_dictionary_set(c_dict, i % 2 ? "b" : "a",
+                                                "off") == 0);
+    assert(concurrent_restricted_dictionary_set(c_dict, i % 2 ? "a" : "b",
+                                                "on") == 0);
+    assert(concurrent_restricted_dictionary_commit(c_dict) == 0);
+  }
+  atomic_store(&transaction_done, 1);
+  pthread_join(reader, NULL);
+
+  concurrent_restricted_dictionary_del(c_dict);
+}
+
+#define SHARDED_KEYS 24
+#define SHARDED_OPS 3000
+
+// Random changes made to a plain dictionary and to a sharded one have the
+// same outcome and leave both allowing the same sets
+struct async_result {
+  atomic_int calls;
+  int ret;
+};
+
+static void async_done(void *arg, int ret) {
+  struct async_result *result = arg;
+  result->ret = ret;
+  atomic_fetch_add(&result->calls, 1);
+}
+
+struct async_gate {
+  atomic_int waiting;
+  pthread_mutex_t lock;
+};
+
+// Holds up the worker in the completion of the request until the test lets
+// go of the lock
+static void async_wait(void *arg, int ret) {
+  struct async_gate *gate = arg;
+  (void)ret;
+  atomic_store(&gate->waiting, 1);
+  pthread_mutex_lock(&gate->lock);
+  pthread_mutex_unlock(&gate->lock);
+}
+
+struct async_producer {
+  struct async_restricted_dictionary *a_dict;
+  unsigned int id;
+  atomic_int *calls;
+};
+
+static void async_count(void *arg, int ret) {
+  assert(ret == 0 || ret == RESTRICTED_DICTIONARY_ERESTRICTED);
+  atomic_fetch_add((atomic_int *)arg, 1);
+}
+
+static void *async_producer(void *arg) {
+  struct async_producer *producer = arg;
+  char key[32];
+  char val[32];
+
+  for (unsigned int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key%u", i % 16);
+    snprintf(val, sizeof(val), "val%u", producer->id);
+    int ret;
+    // a full queue is retried
+    while ((ret = async_restricted_dictionary_set(
+                producer->a_dict, key, val, async_count, producer->calls)) ==
+           RESTRICTED_DICTIONARY_EAGAIN) {
+    }
+    assert(ret == 0);
+  }
+
+  return NULL;
+}
+
+void test_async() {
+  struct concurrent_restricted_dictionary *c_dict =
+      concurrent_restricted_dictionary_new(10, 0);
+  struct async_result results[4];
+  memset(results, 0, sizeof(results));
+  assert(c_dict != NULL);
+
+  // Test Case 1: invalid input
+  assert(async_restricted_dictionary_new(NULL, 16, 4) == NULL);
+  assert(async_restricted_dictionary_new(c_dict, 0, 4) == NULL);
+  struct async_restricted_dictionary *a_dict =
+      async_restricted_dictionary_new(c_dict, 16, 4);
+  assert(a_dict != NULL);
+  assert(async_restricted_dictionary_set(a_dict, NULL, "Google", NULL,
+                                         NULL) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(async_restricted_dictionary_restrict(a_dict, "employee",
+                                              "company=Google", NULL,
+                                              NULL) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+  assert(async_restricted_dictionary_flush(NULL) ==
+         RESTRICTED_DICTIONARY_EINVAL);
+
+  // Test Case 2: requests complete in order with what the set returned
+  assert(async_restricted_dictionary_restrict(a_dict, "employee=Andy",
+                                              "company=Google", async_done,
+                                              &results[0]) == 0);
+  assert(async_restricted_dictionary_set(a_dict, "company", "Google",
+                                         async_done, &results[1]) == 0);
+  assert(async_restricted_dictionary_set(a_dict, "employee", "Andy",
+                                         async_done, &results[2]) == 0);
+  assert(async_restricted_dictionary_set(a_dict, "employee", "Andy",
+                                         async_done, &results[3]) == 0);
+  assert(async_restricted_dictionary_flush(a_dict) == 0);
+  for (unsigned int i = 0; i < 4; i++) {
+    assert(atomic_load(&results[i].calls) == 1);
+  }
+  assert(results[0].ret == 0);
+  assert(results[1].ret == 0);
+  assert(results[2].ret == RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(results[3].ret == RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(concurrent_restricted_dictionary_can_set(c_dict, "employee",
+                                                  "Andy") == 0);
+  assert(async_restricted_dictionary_unrestrict(a_dict, "employee=Andy",
+                                                "company=Google", async_done,
+                                                &results[0]) == 0);
+  assert(async_restricted_dictionary_unrestrict(a_dict, "employee=Andy",
+                                                "company=Google", async_done,
+                                                &results[1]) == 0);
+  assert(async_restricted_dictionary_set(a_dict, "employee", "Andy", NULL,
+                                         NULL) == 0);
+  assert(async_restricted_dictionary_flush(a_dict) == 0);
+  assert(results[0].ret == 0);
+  assert(results[1].ret == RESTRICTED_DICTIONARY_ENOTFOUND);
+  char buf[16];
+  assert(concurrent_restricted_dictionary_get(c_dict, "employee", buf,
+                                              sizeof(buf)) == 4);
+
+  // Test Case 3: a full queue turns requests away until the worker catches up
+  struct async_gate gate = {0, PTHREAD_MUTEX_INITIALIZER};
+  pthread_mutex_lock(&gate.lock);
+  assert(async_restricted_dictionary_set(a_dict, "city", "Taipei", async_wait,
+                                         &gate) == 0);
+  while (!atomic_load(&gate.waiting)) {
+    sched_yield();
+  }
+  int ret;
+  unsigned int num_queued = 0;
+  while ((ret = async_restricted_dictionary_set(a_dict, "city", "Hsinchu",
+                                                NULL, NULL)) == 0) {
+    num_queued++;
+  }
+  assert(ret == RESTRICTED_DICTIONARY_EAGAIN);
+  assert(num_queued == 16);
+  pthread_mutex_unlock(&gate.lock);
+  assert(async_restricted_dictionary_flush(a_dict) == 0);
+  assert(async_restricted_dictionary_set(a_dict, "city", "Taipei", NULL,
+                                         NULL) == 0);
+  async_restricted_dictionary_del(a_dict);
+  assert(concurrent_restricted_dictionary_get(c_dict, "city", buf,
+                                              sizeof(buf)) == 6);
+  assert(strcmp(buf, "Taipei") == 0);
+  pthread_mutex_destroy(&gate.lock);
+
+  // Test Case 4: many producers, every request completes once
+  a_dict = async_restricted_dictionary_new(c_dict, 64, 16);
+  assert(a_dict != NULL);
+  assert(concurrent_restricted_dictionary_restrict(c_dict, "key0=val1",
+                                                   "key1=val2") == 0);
+  atomic_int calls = 0;
+  pthread_t tids[4];
+  struct async_producer producers[4];
+  for (unsigned int i = 0; i < 4; i++) {
+    producers[i] = (struct async_producer){a_dict, i, &calls};
+    assert(pthread_create(&tids[i], NULL, async_producer, &producers[i]) ==
+           0);
+  }
+  for (unsigned int i = 0; i < 4; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  assert(async_restricted_dictionary_flush(a_dict) == 0);
+  assert(atomic_load(&calls) == 4000);
+  async_restricted_dictionary_del(a_dict);
+
+  concurrent_restricted_dictionary_del(c_dict);
+}
+
+static void check_sharded(unsigned int num_shards) {
+  struct restricted_dictionary *r_dict =
+      restricted_dictionary_new(SHARDED_KEYS);
+  struct sharded_restricted_dictionary *s_dict =
+      sharded_restricted_dictionary_new(num_shards, SHARDED_KEYS, 0);
+  char *vals[] = {"on", "off"};
+  char key[16];
+  char slave[32];
+  char master[32];
+  char buf[16];
+  const char *expected[SHARDED_KEYS] = {NULL};
+  unsigned int seed = num_shards;
+  assert(r_dict != NULL);
+  assert(s_dict != NULL);
+  restricted_dictionary_set_diagnostics(r_dict, RESTRICTED_DICTIONARY_DIAG_OFF,
+                                        0);
+
+  for (unsigned int i = 0; i < SHARDED_OPS; i++) {
+    unsigned int k = rand_r(&seed) % SHARDED_KEYS;
+    char *val = vals[rand_r(&seed) % 2];
+    snprintf(key, sizeof(key), "key%u", k);
+    snprintf(slave, sizeof(slave), "key%u=%s", k, val);
+    snprintf(master, sizeof(master), "key%u=%s",
+             rand_r(&seed) % SHARDED_KEYS, vals[rand_r(&seed) % 2]);
+    switch (rand_r(&seed) % 8) {
+    case 0:
+    case 1:
+      assert(restricted_dictionary_restrict(r_dict, slave, master) ==
+             sharded_restricted_dictionary_restrict(s_dict, slave, master));
+      break;
+    case 2:
+      assert(restricted_dictionary_unrestrict(r_dict, slave, master) ==
+             sharded_restricted_dictionary_unrestrict(s_dict, slave, master));
+      break;
+    case 3:
+      assert(restricted_dictionary_unrestrict_all(r_dict, slave) ==
+             sharded_restricted_dictionary_unrestrict_all(s_dict, slave));
+      break;
+    default: {
+      int ret = restricted_dictionary_set(r_dict, key, val);
+      assert(sharded_restricted_dictionary_set(s_dict, key, val) == ret);
+      if (ret == 0) {
+        expected[k] = val;
+      }
+      break;
+    }
+    }
+  }
+
+  for (unsigned int k = 0; k < SHARDED_KEYS; k++) {
+    snprintf(key, sizeof(key), "key%u", k);
+    int len = sharded_restricted_dictionary_get(s_dict, key, buf,
+                                                sizeof(buf));
+    assert(expected[k] ? len >= 0 && strcmp(buf, expected[k]) == 0
+                       : len == -1);
+    for (unsigned int v = 0; v < 2; v++) {
+      assert(restricted_dictionary_can_set(r_dict, key, vals[v], NULL) ==
+             sharded_restricted_dictionary_can_set(s_dict, key, vals[v]));
+    }
+  }
+
+  sharded_restricted_dictionary_del(s_dict);
+  restricted_dictionary_del(r_dict);
+}
+
+#define SKEW_ROUNDS 2000
+
+struct skew_writer {
+  struct sharded_restricted_dictionary *s_dict;
+  const char *key;
+  pthread_barrier_t *barrier;
+  int won;
+};
+
+static void *skew_write(void *arg) {
+  struct skew_writer *writer = arg;
+  pthread_barrier_wait(writer->barrier);
+  writer->won =
+      sharded_restricted_dictionary_set(writer->s_dict, writer->key, "on") ==
+      0;
+  return NULL;
+}
+
+void test_sharded() {
+  struct sharded_restricted_dictionary *s_dict = NULL;
+  char buf[16];
+
+  // Test Case 1: invalid input
+  assert(sharded_restricted_dictionary_new(0, 10, 0) == NULL);
+  assert(sharded_restricted_dictionary_new(65, 10, 0) == NULL);
+  s_dict = sharded_restricted_dictionary_new(8, 10, 0);
+  assert(s_dict != NULL);
+  assert(sharded_restricted_dictionary_set(s_dict, NULL, "Google") == -1);
+  assert(sharded_restricted_dictionary_can_set(NULL, "a", "b") == -1);
+  assert(sharded_restricted_dictionary_restrict(s_dict, "employee",
+                                                "company=Google") == -1);
+
+  // Test Case 2: rules are enforced both ways, whatever shards the keys are
+  // in, and hold on to values set before them
+  assert(sharded_restricted_dictionary_set(s_dict, "company", "Google") == 0);
+  assert(sharded_restricted_dictionary_restrict(s_dict, "employee=Andy",
+                                                "company=Google") == 0);
+  assert(sharded_restricted_dictionary_set(s_dict, "employee", "Andy") ==
+         RESTRICTED_DICTIONARY_ERESTRICTED);
+  assert(sharded_restricted_dictionary_set(s_dict, "company", "Yahoo") == 0);
+  assert(sharded_restricted_dictionary_set(s_dict, "employee", "Andy") == 0);
+  assert(sharded_restricted_dictionary_can_set(s_dict, "company",
+                                               "Google") == 0);
+  assert(sharded_restricted_dictionary_get(s_dict, "employee", buf,
+                                           sizeof(buf)) == 4);
+  assert(strcmp(buf, "Andy") == 0);
+
+  // Test Case 3: removed rules no longer block
+  assert(sharded_restricted_dictionary_unrestrict(s_dict, "employee=Andy",
+                                                  "company=Google") == 0);
+  assert(sharded_restricted_dictionary_unrestrict(s_dict, "employee=Andy",
+                                                  "company=Google") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(sharded_restricted_dictionary_set(s_dict, "company", "Google") == 0);
+  char *masters[] = {"company=Yahoo", "company=Apple", "invalid"};
+  assert(sharded_restricted_dictionary_multiRestrict(s_dict, "employee=Bob",
+                                                     masters, 3) == -1);
+  assert(sharded_restricted_dictionary_set(s_dict, "employee", "Bob") == 0);
+  assert(sharded_restricted_dictionary_can_set(s_dict, "company", "Apple") ==
+         0);
+  assert(sharded_restricted_dictionary_unrestrict_all(s_dict,
+                                                      "employee=Bob") == 0);
+  assert(sharded_restricted_dictionary_unrestrict_all(s_dict,
+                                                      "employee=Bob") ==
+         RESTRICTED_DICTIONARY_ENOTFOUND);
+  assert(sharded_restricted_dictionary_can_set(s_dict, "company", "Apple") ==
+         1);
+  sharded_restricted_dictionary_del(s_dict);
+
+  // Test Case 4: same outcomes as the plain dictionary
+  check_sharded(1);
+  check_sharded(5);
+  check_sharded(64);
+
+  // Test Case 5: two keys of different shards that rule each other out are
+  // never both set by writers racing for them
+  s_dict = sharded_restricted_dictionary_new(64, 10, 0);
+  assert(s_dict != NULL);
+  assert(sharded_restricted_dictionary_restrict(s_dict, "b=on", "a=on") == 0);
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, 2);
+  for (unsigned int i = 0; i < SKEW_ROUNDS; i++) {
+    struct skew_writer writers[2] = {{s_dict, "a", &barrier, 0},
+                                     {s_dict, "b", &barrier, 0}};
+    pthread_t threads[2];
+    assert(sharded_restricted_dictionary_set(s_dict, "a", "off") == 0);
+    assert(sharded_restricted_dictionary_set(s_dict, "b", "off") == 0);
+    for (unsigned int j = 0; j < 2; j++) {
+      assert(pthread_create(&threads[j], NULL, skew_write, &writers[j]) ==
+             0);
+    }
+    for (unsigned int j = 0; j < 2; j++) {
+      pthread_join(threads[j], NULL);
+    }
+    assert(writers[0].won + writers[1].won == 1);
+  }
+  pthread_barrier_destroy(&barrier);
+  sharded_restricted_dictionary_del(s_dict);
+}
+
+#define STRESS_KEYS 64
+#define STRESS_READS 200000
+
+struct stress_reader {
+  pthread_t thread;
+  struct concurrent_restricted_dictionary *c_dict;
+  unsigned int seed;
+};
+
+static atomic_int stress_stop;
+
+static void *stress_read(void *arg) {
+  struct stress_reader *reader = arg;
+  char key[16];
+  char buf[16];
+
+  for (unsigned int i = 0; i < STRESS_READS; i++) {
+    snprintf(key, sizeof(key), "key%u", rand_r(&reader->seed) % STRESS_KEYS);
+    assert(concurrent_restricted_dictionary_can_set(reader->c_dict, key,
+                                                    "on") != -1);
+    // a value is never seen half written or after it was freed
+    int len =
+        concurrent_restricted_dictionary_get(reader->c_dict, key, buf, 16);
+    assert(len == -1 || strcmp(buf, "on") == 0 || strcmp(buf, "off") == 0);
+  }
+
+  return NULL;
+}
+
+static void *stress_write(void *arg) {
+  struct concurrent_restricted_dictionary *c_dict = arg;
+  char key[16];
+  char slave[32];
+  char master[32];
+  unsigned int seed = 1;
+
+  while (!atomic_load(&stress_stop)) {
+    unsigned int i = rand_r(&seed) % STRESS_KEYS;
+    unsigned int j = rand_r(&seed) % STRESS_KEYS;
+    snprintf(key, sizeof(key), "key%u", i);
+    snprintf(slave, sizeof(slave), "key%u=on", i);
+    snprintf(master, sizeof(master), "key%u=on", j);
+    switch (rand_r(&seed) % 4) {
+    case 0:
+      concurrent_restricted_dictionary_set(c_dict, key, "on");
+      break;
+    case 1:
+      concurrent_restricted_dictionary_set(c_dict, key, "off");
+      break;
+    case 2:
+      concurrent_restricted_dictionary_restrict(c_dict, slave, master);
+      break;
+    default:
+      concurrent_restricted_dictionary_unrestrict_all(c_dict, slave);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+// num_readers threads read while one writer keeps changing values and rules
+static void stress_run(unsigned int num_readers) {
+  struct concurrent_restricted_dictionary *c_dict =
+      concurrent_restricted_dictionary_new(STRESS_KEYS, 0);
+  assert(c_dict != NULL);
+
+  struct stress_reader readers[16];
+  pthread_t writer;
+  atomic_store(&stress_stop, 0);
+  assert(pthread_create(&writer, NULL, stress_write, c_dict) == 0);
+
+  for (unsigned int i = 0; i < num_readers; i++) {
+    readers[i].c_dict = c_dict;
+    readers[i].seed = i + 1;
+    assert(pthread_create(&readers[i].thread, NULL, stress_read,
+                          &readers[i]) == 0);
+  }
+  for (unsigned int i = 0; i < num_readers; i++) {
+    pthread_join(readers[i].thread, NULL);
+  }
+
+  atomic_store(&stress_stop, 1);
+  pthread_join(writer, NULL);
+  concurrent_restricted_dictionary_del(c_dict);
+}
+
+// Throughput and its scaling are measured by bench_sharded.c, timing has no
+// say in whether the tests pass
+void test_concurrent_stress() {
+  for (unsigned int num_readers = 1; num_readers <= 16; num_readers *= 4) {
+    stress_run(num_readers);
+  }
+}
+
 int main() {
   test_new();
+  test_new_ex();
+  test_blocked_set();
   test_del();
   test_set();
+  test_set_many();
+  test_can_set();
   test_restrict();
   test_unrestrict();
+  test_unrestrict_all();
   test_restrict_then_set();
+  test_set_then_restrict();
   test_multiRestrict();
+  test_restrict_pair();
+  test_transaction();
+  test_fork();
+  test_group();
+  test_pattern();
+  test_freeze();
+  test_ttl();
+  test_get_stats();
+  test_diagnostics();
+  test_snapshot();
+  test_load_rules();
+  test_journal();
+  test_concurrent();
+  test_concurrent_transaction();
+  test_async();
+  test_sharded();
+  test_concurrent_stress();
   printf("All test cases passed!\n");
 
   return 0;
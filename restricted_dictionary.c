@@ -1,309 +1,4053 @@
 #include "restricted_dictionary.h"
-#include "hierarchy_list.h"
+#include "arena.h"
+#include "restricted_dictionary_internal.h"
+#include <limits.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 void restricted_dictionary_set_error_callback(int (*errback)(const char *,
                                                              ...)) {
   dictionary_set_error_callback(errback);
 }
 
-struct restricted_dictionary {
-  struct dictionary *base;
-  struct list_head parent_head;
-};
+#define INTERN_INIT_BUCKETS 64
+#define PAIR_INIT_BUCKETS 64
+#define ID_MAP_INIT_SIZE 16
 
-static int has_restriction(struct restricted_dictionary *r_dict,
-                           const char *key, const char *val) {
+#ifdef RESTRICTED_DICTIONARY_STATS
+// The counters are bumped from const lookups as well
+#define STATS(r_dict) (&((struct restricted_dictionary *)(r_dict))->stats)
+#define STAT_INC(r_dict, field) (STATS(r_dict)->field++)
+#define STAT_CHECK(r_dict, masters, slaves)                                   \
+  stat_check(STATS(r_dict), masters, slaves)
 
-  struct parent *slave = find_parent(&r_dict->parent_head, key, val);
-  if (!slave) {
+static void stat_check(struct restricted_dictionary_stats *stats,
+                       unsigned int masters, unsigned int slaves) {
+  unsigned int scanned = masters + slaves;
+  unsigned int bucket = 0;
+  while (scanned && bucket < RESTRICTED_DICTIONARY_STATS_BUCKETS - 1) {
+    scanned >>= 1;
+    bucket++;
+  }
+
+  stats->checks++;
+  stats->masters_scanned += masters;
+  stats->slaves_scanned += slaves;
+  stats->scan_histogram[bucket]++;
+}
+#else
+#define STAT_INC(r_dict, field) ((void)0)
+#define STAT_CHECK(r_dict, masters, slaves) ((void)0)
+#endif
+
+static unsigned int string_hash(const char *str, unsigned int len) {
+  unsigned int hash = 5381;
+
+  for (unsigned int i = 0; i < len; i++) {
+    hash = hash * 33 + (unsigned char)str[i];
+  }
+
+  return hash;
+}
+
+static unsigned int id_pair_hash(unsigned int key, unsigned int value) {
+  unsigned int hash = key * 0x9e3779b1u ^ value;
+  hash ^= hash >> 15;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+
+  return hash;
+}
+
+static int id_map_find(const struct id_map *map, unsigned int id,
+                       unsigned int *value) {
+  if (!map->max) {
     return 0;
   }
 
-  struct child *current_master;
-  list_for_each_entry(current_master, &slave->child_head, list) {
-    const char *value_in_dict =
-        dictionary_get(r_dict->base, current_master->key, "NULL");
-    if (strcmp("NULL", value_in_dict) != 0 &&
-        strcmp(value_in_dict, current_master->value) == 0) {
+  unsigned int mask = map->max - 1;
+  for (unsigned int slot = id_pair_hash(id, 0) & mask;;
+       slot = (slot + 1) & mask) {
+    if (map->ids[slot] == id) {
+      if (value) {
+        *value = map->values[slot];
+      }
       return 1;
     }
+    if (!map->ids[slot]) {
+      return 0;
+    }
   }
-
-  return 0;
 }
 
-struct restricted_dictionary *restricted_dictionary_new(unsigned int size) {
-  struct restricted_dictionary *r_dict =
-      malloc(sizeof(struct restricted_dictionary));
-  if (!r_dict) {
-    error_callback("%s: malloc() failed\n", __func__);
-    return NULL;
+// Makes room for num more ids, keeping the map at most half full
+static int id_map_reserve(struct id_map *map, unsigned int num) {
+  if ((map->num + num) * 2 <= map->max) {
+    return 0;
   }
 
-  r_dict->base = dictionary_new(size);
-  if (!r_dict->base) {
-    error_callback("%s: dictionary_new() failed\n", __func__);
-    free(r_dict);
-    return NULL;
+  unsigned int max = map->max ? map->max : ID_MAP_INIT_SIZE;
+  while (max < (map->num + num) * 2) {
+    max *= 2;
   }
 
-  INIT_LIST_HEAD(&r_dict->parent_head);
+  unsigned int *ids = calloc(max, sizeof(unsigned int));
+  unsigned int *values = malloc(max * sizeof(unsigned int));
+  if (!ids || !values) {
+    error_callback("%s: calloc() failed\n", __func__);
+    free(ids);
+    free(values);
+    return -1;
+  }
 
-  return r_dict;
+  for (unsigned int i = 0; i < map->max; i++) {
+    if (!map->ids[i]) {
+      continue;
+    }
+    unsigned int slot = id_pair_hash(map->ids[i], 0) & (max - 1);
+    while (ids[slot]) {
+      slot = (slot + 1) & (max - 1);
+    }
+    ids[slot] = map->ids[i];
+    values[slot] = map->values[i];
+  }
+
+  free(map->ids);
+  free(map->values);
+  map->ids = ids;
+  map->values = values;
+  map->max = max;
+
+  return 0;
 }
 
-void restricted_dictionary_del(struct restricted_dictionary *r_dict) {
-  if (!r_dict) {
-    return;
+// Room for an id not in the map yet must have been reserved
+static void id_map_put(struct id_map *map, unsigned int id,
+                       unsigned int value) {
+  unsigned int mask = map->max - 1;
+  unsigned int slot = id_pair_hash(id, 0) & mask;
+  while (map->ids[slot] && map->ids[slot] != id) {
+    slot = (slot + 1) & mask;
   }
 
-  if (r_dict->base) {
-    dictionary_del(r_dict->base);
+  if (!map->ids[slot]) {
+    map->ids[slot] = id;
+    map->num++;
   }
+  map->values[slot] = value;
+}
 
-  unset_parents(&r_dict->parent_head);
+static void id_map_clear(struct id_map *map) {
+  if (map->max) {
+    memset(map->ids, 0, map->max * sizeof(unsigned int));
+  }
+  map->num = 0;
+}
 
-  free(r_dict);
+static void id_map_release(struct id_map *map) {
+  free(map->ids);
+  free(map->values);
+  memset(map, 0, sizeof(struct id_map));
 }
 
-int restricted_dictionary_set(struct restricted_dictionary *r_dict,
-                              const char *key, const char *val) {
-  if (!r_dict || !key || !val) {
-    error_callback("%s: invalid input\n", __func__);
+static int intern_init(struct intern_table *table, struct arena *arena) {
+  memset(table, 0, sizeof(struct intern_table));
+  table->arena = arena;
+
+  table->buckets = calloc(INTERN_INIT_BUCKETS, sizeof(unsigned int));
+  if (!table->buckets) {
+    error_callback("%s: calloc() failed\n", __func__);
     return -1;
   }
 
-  if (has_restriction(r_dict, key, val)) {
-    error_callback("%s: restriction prevents setting key=%s, val=%s\n",
-                   __func__, key, val);
+  table->num_buckets = INTERN_INIT_BUCKETS;
+  table->num_strings = 1;
+
+  return 0;
+}
+
+// Starts a table of the strings the fork adds to those of parent
+static int intern_fork(struct intern_table *table,
+                       const struct intern_table *parent, struct arena *arena) {
+  if (intern_init(table, arena) == -1) {
     return -1;
   }
 
-  return dictionary_set(r_dict->base, key, val);
-}
+  table->parent = parent;
+  table->first = parent->num_strings;
+  table->num_strings = parent->num_strings;
 
-static int is_valid_pair(const char *pair) {
+  return 0;
+}
 
-  char *equal_sign = strchr(pair, '=');
-  if (!equal_sign || equal_sign == pair || *(equal_sign + 1) == '\0') {
-    return 0;
+static void intern_release(struct intern_table *table) {
+  // arena strings go away with the arena, index 0 is unused but in a fork
+  unsigned int num = table->num_strings - table->first;
+  for (unsigned int i = table->packed ? table->packed : !table->first;
+       !table->arena && i < num; i++) {
+    free(table->strings[i]);
   }
 
-  return 1;
+  free(table->blob);
+  free(table->buckets);
+  free(table->strings);
+  free(table->lengths);
+  free(table->hashes);
+  memset(table, 0, sizeof(struct intern_table));
 }
 
-static int split_pair(const char *pair, char **key, char **value) {
+static unsigned int intern_find(const struct intern_table *table,
+                                const char *str, unsigned int len) {
+  unsigned int hash = string_hash(str, len);
 
-  char *equal_sign = strchr(pair, '=');
-  if (!equal_sign) {
-    error_callback("%s: strchr() failed\n", __func__);
-    return -1;
+  for (; table; table = table->parent) {
+    unsigned int mask = table->num_buckets - 1;
+    for (unsigned int slot = hash & mask;; slot = (slot + 1) & mask) {
+      unsigned int id = table->buckets[slot];
+      if (!id) {
+        break;
+      }
+      unsigned int i = id - table->first;
+      if (table->hashes[i] == hash && table->lengths[i] == len &&
+          memcmp(table->strings[i], str, len) == 0) {
+        return id;
+      }
+    }
   }
 
-  *key = strndup(pair, equal_sign - pair);
-  if (!*key) {
-    error_callback("%s: strndup() failed\n", __func__);
-    return -1;
+  return 0;
+}
+
+static const char *intern_string(const struct intern_table *table,
+                                 unsigned int id) {
+  while (id < table->first) {
+    table = table->parent;
   }
-  *value = strdup(equal_sign + 1);
-  if (!*value) {
-    error_callback("%s: strdup() failed\n", __func__);
+
+  return table->strings[id - table->first];
+}
+
+static int intern_grow(struct intern_table *table) {
+  unsigned int num_buckets = table->num_buckets * 2;
+  unsigned int *buckets = calloc(num_buckets, sizeof(unsigned int));
+  if (!buckets) {
+    error_callback("%s: calloc() failed\n", __func__);
     return -1;
   }
 
+  for (unsigned int id = table->first ? table->first : 1;
+       id < table->num_strings; id++) {
+    unsigned int slot = table->hashes[id - table->first] & (num_buckets - 1);
+    while (buckets[slot]) {
+      slot = (slot + 1) & (num_buckets - 1);
+    }
+    buckets[slot] = id;
+  }
+
+  free(table->buckets);
+  table->buckets = buckets;
+  table->num_buckets = num_buckets;
+
   return 0;
 }
 
-static int add_restriction(struct parent *slave_parent,
-                           const char *master_pair) {
-  char *master_key = NULL;
-  char *master_value = NULL;
-  if (split_pair(master_pair, &master_key, &master_value) == -1) {
-    error_callback("%s: split_pair(master) failed\n", __func__);
+static int intern_reserve(struct intern_table *table) {
+  if (table->num_strings - table->first < table->max_strings) {
+    return 0;
+  }
+
+  unsigned int max_strings = table->max_strings ? table->max_strings * 2 : 16;
+
+  char **strings = realloc(table->strings, max_strings * sizeof(char *));
+  if (!strings) {
+    error_callback("%s: realloc() failed\n", __func__);
+    return -1;
+  }
+  table->strings = strings;
+
+  unsigned int *lengths =
+      realloc(table->lengths, max_strings * sizeof(unsigned int));
+  if (!lengths) {
+    error_callback("%s: realloc() failed\n", __func__);
     return -1;
   }
+  table->lengths = lengths;
 
-  struct child *child = set_child(slave_parent, master_key, master_value);
-  if (!child) {
-    error_callback("%s: set_child() failed\n", __func__);
-    free(master_key);
-    free(master_value);
+  unsigned int *hashes =
+      realloc(table->hashes, max_strings * sizeof(unsigned int));
+  if (!hashes) {
+    error_callback("%s: realloc() failed\n", __func__);
     return -1;
   }
+  table->hashes = hashes;
 
-  free(master_key);
-  free(master_value);
+  table->max_strings = max_strings;
 
   return 0;
 }
 
-static struct parent *split_and_set_parent(struct restricted_dictionary *r_dict,
-                                           const char *slave_pair,
-                                           char **slave_key,
-                                           char **slave_value) {
-  if (!is_valid_pair(slave_pair)) {
-    error_callback("%s: invalid slave pair format, expected 'A=B'\n", __func__);
-    return NULL;
+// Returns the id of str, interning a copy of it first if needed, 0 on failure
+static unsigned int intern_get(struct intern_table *table, const char *str,
+                               unsigned int len) {
+  unsigned int id = intern_find(table, str, len);
+  if (id) {
+    return id;
   }
 
-  if (split_pair(slave_pair, slave_key, slave_value) == -1) {
-    error_callback("%s: split_pair(slave) failed\n", __func__);
-    return NULL;
+  // keep the open addressing table at most half full
+  if ((table->num_strings - table->first) * 2 >= table->num_buckets &&
+      intern_grow(table) == -1) {
+    return 0;
   }
 
-  struct parent *slave_parent =
-      set_parent(&r_dict->parent_head, *slave_key, *slave_value);
-  if (!slave_parent) {
-    error_callback("%s: set_parent() failed\n", __func__);
-    free(*slave_key);
-    free(*slave_value);
-    return NULL;
+  if (intern_reserve(table) == -1) {
+    return 0;
+  }
+
+  char *copy = table->arena ? arena_strndup(table->arena, str, len)
+                            : strndup(str, len);
+  if (!copy) {
+    error_callback("%s: strndup() failed\n", __func__);
+    return 0;
+  }
+
+  id = table->num_strings++;
+  unsigned int i = id - table->first;
+  table->string_bytes += len + 1;
+  table->strings[i] = copy;
+  table->lengths[i] = len;
+  table->hashes[i] = string_hash(str, len);
+
+  unsigned int mask = table->num_buckets - 1;
+  unsigned int slot = table->hashes[i] & mask;
+  while (table->buckets[slot]) {
+    slot = (slot + 1) & mask;
   }
+  table->buckets[slot] = id;
 
-  return slave_parent;
+  return id;
 }
 
-int restricted_dictionary_restrict(struct restricted_dictionary *r_dict,
-                                   char *slave_pair, char *master_pair) {
-  if (!r_dict || !slave_pair || !master_pair) {
-    error_callback("%s: invalid input\n", __func__);
-    return -1;
+// Copies every string into one blob in id order and frees the copies they
+// had of their own. Arena strings are packed already and a fork's are left
+// alone.
+static int intern_pack(struct intern_table *table) {
+  if (table->arena || table->first || table->num_strings < 2) {
+    return 0;
   }
 
-  char *slave_key = NULL;
-  char *slave_value = NULL;
-  struct parent *slave_parent =
-      split_and_set_parent(r_dict, slave_pair, &slave_key, &slave_value);
-  if (!slave_parent) {
-    error_callback("%s: split_and_set_parent() failed\n", __func__);
+  char *blob = malloc(table->string_bytes);
+  if (!blob) {
+    error_callback("%s: malloc() failed\n", __func__);
     return -1;
   }
 
-  if (add_restriction(slave_parent, master_pair) == -1) {
-    error_callback("%s: add_restriction() failed\n", __func__);
-    free(slave_key);
-    free(slave_value);
-    return -1;
+  char *cursor = blob;
+  for (unsigned int id = 1; id < table->num_strings; id++) {
+    memcpy(cursor, table->strings[id], table->lengths[id] + 1);
+    if (id >= table->packed) {
+      free(table->strings[id]);
+    }
+    table->strings[id] = cursor;
+    cursor += table->lengths[id] + 1;
   }
 
-  free(slave_key);
-  free(slave_value);
+  free(table->blob);
+  table->blob = blob;
+  table->packed = table->num_strings;
 
   return 0;
 }
 
-int restricted_dictionary_multiRestrict(struct restricted_dictionary *r_dict,
-                                        char *slave_pair, char **master_pairs,
-                                        unsigned int num_masters) {
-  if (!r_dict || !slave_pair || !master_pairs || num_masters <= 0) {
-    error_callback("%s: invalid input\n", __func__);
+static int pair_table_init(struct pair_table *table, struct arena *arena) {
+  memset(table, 0, sizeof(struct pair_table));
+  table->arena = arena;
+
+  table->buckets = calloc(PAIR_INIT_BUCKETS, sizeof(unsigned int));
+  if (!table->buckets) {
+    error_callback("%s: calloc() failed\n", __func__);
     return -1;
   }
 
-  char *slave_key = NULL;
-  char *slave_value = NULL;
-  struct parent *slave_parent =
-      split_and_set_parent(r_dict, slave_pair, &slave_key, &slave_value);
-  if (!slave_parent) {
-    error_callback("%s: split_and_set_parent() failed\n", __func__);
+  table->num_buckets = PAIR_INIT_BUCKETS;
+  table->num_nodes = 1;
+  table->next_group = 1;
+
+  return 0;
+}
+
+// Starts a table of the nodes the fork changes or adds, the counts start
+// from those of parent
+static int pair_table_fork(struct pair_table *table,
+                           const struct pair_table *parent,
+                           struct arena *arena) {
+  if (pair_table_init(table, arena) == -1) {
     return -1;
   }
 
-  int ret = 0;
+  table->parent = parent;
+  table->next_id = parent->parent ? parent->next_id : parent->num_nodes;
+  table->num_pairs = parent->num_pairs;
+  table->num_rules = parent->num_rules;
 
-  for (unsigned i = 0; i < num_masters; i++) {
-    if (!is_valid_pair(master_pairs[i])) {
-      error_callback(
-          "%s: invalid master pair format at index %d, expected 'A=B'\n",
-          __func__, i);
-      ret = -1;
-      continue;
+  return 0;
+}
+
+static void pair_table_release(struct pair_table *table) {
+  // arena edge arrays go away with the arena
+  for (unsigned int id = 1; !table->arena && id < table->num_nodes; id++) {
+    free(table->nodes[id].masters.edges);
+    free(table->nodes[id].slaves.edges);
+    free(table->nodes[id].groups.edges);
+  }
+  for (unsigned int id = 1; !table->arena && id < table->next_group; id++) {
+    free(table->groups[id].members.edges);
+  }
+
+  free(table->nodes);
+  free(table->groups);
+  free(table->buckets);
+  free(table->ids);
+  id_map_release(&table->own_nodes);
+  memset(table, 0, sizeof(struct pair_table));
+}
+
+static unsigned int pair_find(const struct pair_table *table, unsigned int key,
+                              unsigned int value) {
+  unsigned int slot =
+      table->buckets[id_pair_hash(key, value) & (table->num_buckets - 1)];
+  for (; slot; slot = table->nodes[slot].next) {
+    if (table->nodes[slot].key == key && table->nodes[slot].value == value) {
+      return table->ids ? table->ids[slot] : slot;
     }
+  }
 
-    if (add_restriction(slave_parent, master_pairs[i]) != 0) {
-      error_callback("%s: add_restriction(%s) failed, keep adding next one\n",
-                     __func__, master_pairs[i]);
-      ret = -1;
+  if (!table->parent) {
+    return 0;
+  }
+
+  // the fork's own copy would have been found, a mapped id was dropped
+  unsigned int id = pair_find(table->parent, key, value);
+  return id && !id_map_find(&table->own_nodes, id, NULL) ? id : 0;
+}
+
+// The node of pair id for reading, a fork's own copy or its parent's node
+static const struct pair_node *pair_node(const struct pair_table *table,
+                                         unsigned int id) {
+  unsigned int slot = id;
+  while (table->parent && !id_map_find(&table->own_nodes, id, &slot)) {
+    table = table->parent;
+    slot = id;
+  }
+
+  return &table->nodes[slot];
+}
+
+static void pair_table_grow(struct pair_table *table) {
+  unsigned int num_buckets = table->num_buckets * 2;
+  unsigned int *buckets = calloc(num_buckets, sizeof(unsigned int));
+  if (!buckets) {
+    // keep the current table, lookups stay correct but chains get longer
+    return;
+  }
+
+  for (unsigned int i = 0; i < table->num_buckets; i++) {
+    unsigned int id = table->buckets[i];
+    while (id) {
+      struct pair_node *node = &table->nodes[id];
+      unsigned int next = node->next;
+      unsigned int bucket =
+          id_pair_hash(node->key, node->value) & (num_buckets - 1);
+      node->next = buckets[bucket];
+      buckets[bucket] = id;
+      id = next;
     }
   }
 
-  free(slave_key);
-  free(slave_value);
+  free(table->buckets);
+  table->buckets = buckets;
+  table->num_buckets = num_buckets;
+}
+
+static unsigned int edge_order(unsigned int max) {
+  unsigned int order = 0;
+  while (max > 1) {
+    max >>= 1;
+    order++;
+  }
 
-  return ret;
+  return order;
 }
 
-int restricted_dictionary_unrestrict(struct restricted_dictionary *r_dict,
-                                     char *slave_pair, char *master_pair) {
-  if (!r_dict || !slave_pair || !master_pair) {
-    error_callback("%s: invalid input\n", __func__);
-    return -1;
+// Edge arrays always hold a power of two number of edges. In arena mode a
+// released array is kept on a free list of its size class, with the link in
+// its first bytes, and handed out again before the arena is grown.
+static struct rule_edge *alloc_edges(struct pair_table *table,
+                                     unsigned int max) {
+  if (!table->arena) {
+    struct rule_edge *edges = malloc(max * sizeof(struct rule_edge));
+    if (edges) {
+      table->edge_bytes += max * sizeof(struct rule_edge);
+    }
+    return edges;
   }
 
-  if (!is_valid_pair(slave_pair) || !is_valid_pair(master_pair)) {
-    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
-    return -1;
+  unsigned int order = edge_order(max);
+  struct rule_edge *edges = table->free_edges[order];
+  if (edges) {
+    memcpy(&table->free_edges[order], edges, sizeof(struct rule_edge *));
+    return edges;
   }
 
-  char *slave_key = NULL;
-  char *slave_value = NULL;
-  if (split_pair(slave_pair, &slave_key, &slave_value) == -1) {
-    error_callback("%s: split_pair(slave) failed\n", __func__);
-    return -1;
+  return arena_alloc(table->arena, max * sizeof(struct rule_edge));
+}
+
+static void free_edges(struct pair_table *table, struct rule_edge *edges,
+                       unsigned int max) {
+  if (!table->arena) {
+    table->edge_bytes -= edges ? max * sizeof(struct rule_edge) : 0;
+    free(edges);
+    return;
   }
 
-  struct parent *slave_parent =
-      find_parent(&r_dict->parent_head, slave_key, slave_value);
-  if (!slave_parent) {
-    error_callback("%s: slave parent not found\n", __func__);
-    free(slave_key);
-    free(slave_value);
-    return -1;
+  if (!edges) {
+    return;
+  }
+
+  unsigned int order = edge_order(max);
+  memcpy(edges, &table->free_edges[order], sizeof(struct rule_edge *));
+  table->free_edges[order] = edges;
+}
+
+static unsigned int pair_alloc(struct pair_table *table) {
+  if (table->free_list) {
+    unsigned int id = table->free_list;
+    table->free_list = table->nodes[id].next;
+    return id;
+  }
+
+  if (table->num_nodes >= table->max_nodes) {
+    unsigned int max_nodes = table->max_nodes ? table->max_nodes * 2 : 16;
+    struct pair_node *nodes =
+        realloc(table->nodes, max_nodes * sizeof(struct pair_node));
+    if (!nodes) {
+      error_callback("%s: realloc() failed\n", __func__);
+      return 0;
+    }
+    table->nodes = nodes;
+
+    if (table->parent) {
+      unsigned int *ids =
+          realloc(table->ids, max_nodes * sizeof(unsigned int));
+      if (!ids) {
+        error_callback("%s: realloc() failed\n", __func__);
+        return 0;
+      }
+      table->ids = ids;
+    }
+
+    table->max_nodes = max_nodes;
+  }
+
+  return table->num_nodes++;
+}
+
+// Hashes the node at slot into the buckets, growing them first when they
+// are getting crowded
+static void pair_link(struct pair_table *table, unsigned int slot) {
+  unsigned int num = table->parent ? table->own_nodes.num : table->num_pairs;
+  if (num >= table->num_buckets) {
+    pair_table_grow(table);
+  }
+
+  struct pair_node *node = &table->nodes[slot];
+  unsigned int bucket =
+      id_pair_hash(node->key, node->value) & (table->num_buckets - 1);
+  node->next = table->buckets[bucket];
+  table->buckets[bucket] = slot;
+}
+
+static int copy_edges(struct pair_table *table, struct edge_array *to,
+                      const struct edge_array *from) {
+  if (!from->max) {
+    return 0;
   }
 
-  char *master_key = NULL;
-  char *master_value = NULL;
-  if (split_pair(master_pair, &master_key, &master_value) == -1) {
-    error_callback("%s: split_pair(master) failed\n", __func__);
-    free(slave_key);
-    free(slave_value);
+  to->edges = alloc_edges(table, from->max);
+  if (!to->edges) {
+    error_callback("%s: alloc_edges() failed\n", __func__);
     return -1;
   }
+  memcpy(to->edges, from->edges, from->num * sizeof(struct rule_edge));
+
+  return 0;
+}
+
+// The node of pair id for writing. A fork copies its parent's node first,
+// which may move the nodes it already has. NULL on failure.
+static struct pair_node *pair_own(struct pair_table *table, unsigned int id) {
+  unsigned int slot = id;
+  if (!table->parent || id_map_find(&table->own_nodes, id, &slot)) {
+    return &table->nodes[slot];
+  }
+
+  const struct pair_node *from = pair_node(table->parent, id);
+  struct pair_node copy = *from;
+  copy.masters.edges = NULL;
+  copy.slaves.edges = NULL;
+  copy.groups.edges = NULL;
+  if (copy_edges(table, &copy.masters, &from->masters) == -1 ||
+      copy_edges(table, &copy.slaves, &from->slaves) == -1 ||
+      copy_edges(table, &copy.groups, &from->groups) == -1 ||
+      id_map_reserve(&table->own_nodes, 1) == -1 ||
+      !(slot = pair_alloc(table))) {
+    free_edges(table, copy.masters.edges, copy.masters.max);
+    free_edges(table, copy.slaves.edges, copy.slaves.max);
+    free_edges(table, copy.groups.edges, copy.groups.max);
+    return NULL;
+  }
 
-  // Find and remove the master pair as a child of the slave parent
-  struct child *child = find_child(slave_parent, master_key, master_value);
-  if (!child) {
-    error_callback("%s: master pair not found\n", __func__);
-    free(slave_key);
-    free(slave_value);
-    free(master_key);
-    free(master_value);
+  table->nodes[slot] = copy;
+  table->ids[slot] = id;
+  id_map_put(&table->own_nodes, id, slot);
+  pair_link(table, slot);
+
+  return &table->nodes[slot];
+}
+
+// Both ends of a rule for writing
+static int own_rule(struct pair_table *table, unsigned int slave_id,
+                    unsigned int master_id, struct pair_node **slave,
+                    struct pair_node **master) {
+  if (!pair_own(table, slave_id) || !pair_own(table, master_id)) {
     return -1;
   }
 
-  unset_child(slave_parent, master_key, master_value);
+  // owning the master may have moved the slave
+  *slave = pair_own(table, slave_id);
+  *master = pair_own(table, master_id);
+
+  return 0;
+}
 
-  unsigned int num_children = 0;
-  if (getNumOfChildren(slave_parent, &num_children) == -1) {
-    error_callback("%s: getNumOfChildren() failed\n", __func__);
-    free(slave_key);
-    free(slave_value);
-    free(master_key);
-    free(master_value);
+static int grow_key_array(unsigned int **array, unsigned int old_size,
+                          unsigned int new_size) {
+  unsigned int *grown = realloc(*array, new_size * sizeof(unsigned int));
+  if (!grown) {
+    error_callback("%s: realloc() failed\n", __func__);
     return -1;
   }
 
-  if (num_children == 0) {
-    unset_parent(&r_dict->parent_head, slave_key, slave_value);
+  memset(grown + old_size, 0, (new_size - old_size) * sizeof(unsigned int));
+  *array = grown;
+
+  return 0;
+}
+
+// The value id key holds, what a fork did not set is its parent's
+static unsigned int current_value(const struct restricted_dictionary *r_dict,
+                                  unsigned int key) {
+  for (; r_dict->parent; r_dict = r_dict->parent) {
+    unsigned int value;
+    if (id_map_find(&r_dict->own_current, key, &value)) {
+      return value;
+    }
+    // interned by the fork
+    if (key >= r_dict->keys.first) {
+      return 0;
+    }
+  }
+
+  return r_dict->current[key];
+}
+
+// Stores the value id of key as is, see set_current(). A fork must have
+// reserved room for a key it did not set before.
+static void put_current(struct restricted_dictionary *r_dict, unsigned int key,
+                        unsigned int value) {
+  if (r_dict->parent) {
+    id_map_put(&r_dict->own_current, key, value);
+  } else {
+    r_dict->current[key] = value;
+  }
+}
+
+// The string a set key holds in the base dictionary it was set in
+static const char *base_value(const struct restricted_dictionary *r_dict,
+                              unsigned int key) {
+  while (r_dict->parent && !id_map_find(&r_dict->own_current, key, NULL)) {
+    r_dict = r_dict->parent;
+  }
+
+  return dictionary_get(r_dict->base, intern_string(&r_dict->keys, key), "");
+}
+
+// Keeps the per-key arrays as large as the key intern table, a fork makes
+// room for one more key it sets instead
+static int reserve_current(struct restricted_dictionary *r_dict) {
+  if (r_dict->parent) {
+    return id_map_reserve(&r_dict->own_current, 1);
+  }
+
+  if (r_dict->keys.max_strings <= r_dict->max_current) {
+    return 0;
+  }
+
+  unsigned int max_current = r_dict->keys.max_strings;
+  if (grow_key_array(&r_dict->current, r_dict->max_current, max_current) ==
+          -1 ||
+      grow_key_array(&r_dict->batch_value, r_dict->max_current,
+                     max_current) == -1 ||
+      grow_key_array(&r_dict->batch_stamp, r_dict->max_current,
+                     max_current) == -1) {
+    return -1;
   }
 
-  free(slave_key);
-  free(slave_value);
-  free(master_key);
-  free(master_value);
+  r_dict->max_current = max_current;
 
   return 0;
 }
+
+static unsigned int intern_key(struct restricted_dictionary *r_dict,
+                               const char *key, unsigned int len) {
+  unsigned int id = intern_get(&r_dict->keys, key, len);
+  if (!id) {
+    return 0;
+  }
+
+  if (reserve_current(r_dict) == -1) {
+    return 0;
+  }
+
+  return id;
+}
+
+// Returns the pair id of (key, value), creating the node if needed
+static unsigned int pair_get(struct restricted_dictionary *r_dict,
+                             unsigned int key, unsigned int value) {
+  struct pair_table *table = &r_dict->pairs;
+
+  unsigned int id = pair_find(table, key, value);
+  if (id) {
+    return id;
+  }
+
+  // a fork maps the new pair id and may store the key's value below
+  if (table->parent && (id_map_reserve(&table->own_nodes, 1) == -1 ||
+                        id_map_reserve(&r_dict->own_current, 1) == -1)) {
+    return 0;
+  }
+
+  unsigned int slot = pair_alloc(table);
+  if (!slot) {
+    return 0;
+  }
+
+  struct pair_node *node = &table->nodes[slot];
+  memset(node, 0, sizeof(struct pair_node));
+  node->key = key;
+  node->value = value;
+  pair_link(table, slot);
+  table->num_pairs++;
+
+  id = slot;
+  if (table->parent) {
+    id = table->next_id++;
+    table->ids[slot] = id;
+    id_map_put(&table->own_nodes, id, slot);
+  }
+
+  // the value may have been set before any rule interned it
+  if (current_value(r_dict, key) == OTHER_VALUE) {
+    STAT_INC(r_dict, dictionary_gets);
+    if (strcmp(base_value(r_dict, key),
+               intern_string(&r_dict->values, value)) == 0) {
+      put_current(r_dict, key, value);
+    }
+  }
+
+  return id;
+}
+
+// Drops the node once it is neither a slave nor a master of any rule or
+// group, a node already on the free list has key id 0 and is left alone
+static void pair_put(struct pair_table *table, unsigned int id) {
+  const struct pair_node *found = pair_node(table, id);
+  if (!found->key || found->masters.num || found->slaves.num ||
+      found->groups.num) {
+    return;
+  }
+
+  // only the nodes a fork changed or added can have lost all their rules
+  unsigned int slot = id;
+  if (table->parent) {
+    id_map_find(&table->own_nodes, id, &slot);
+    id_map_put(&table->own_nodes, id, UINT_MAX);
+    table->ids[slot] = 0;
+  }
+  struct pair_node *node = &table->nodes[slot];
+
+  if (id == table->blocked_slave || id == table->blocked_master) {
+    table->blocked_slave = 0;
+    table->blocked_master = 0;
+  }
+
+  unsigned int *link =
+      &table->buckets[id_pair_hash(node->key, node->value) &
+                      (table->num_buckets - 1)];
+  while (*link != slot) {
+    link = &table->nodes[*link].next;
+  }
+  *link = node->next;
+
+  free_edges(table, node->masters.edges, node->masters.max);
+  free_edges(table, node->slaves.edges, node->slaves.max);
+  free_edges(table, node->groups.edges, node->groups.max);
+  memset(node, 0, sizeof(struct pair_node));
+
+  node->next = table->free_list;
+  table->free_list = slot;
+  table->num_pairs--;
+}
+
+static int reserve_edge(struct pair_table *table, struct edge_array *array) {
+  if (array->num < array->max) {
+    return 0;
+  }
+
+  unsigned int max = array->max ? array->max * 2 : 4;
+  struct rule_edge *edges = alloc_edges(table, max);
+  if (!edges) {
+    error_callback("%s: alloc_edges() failed\n", __func__);
+    return -1;
+  }
+
+  if (array->num) {
+    memcpy(edges, array->edges, array->num * sizeof(struct rule_edge));
+  }
+  free_edges(table, array->edges, array->max);
+
+  array->edges = edges;
+  array->max = max;
+
+  return 0;
+}
+
+static unsigned int find_edge(const struct edge_array *array,
+                              unsigned int pair) {
+  for (unsigned int i = 0; i < array->num; i++) {
+    if (array->edges[i].pair == pair) {
+      return i;
+    }
+  }
+
+  return UINT_MAX;
+}
+
+static int add_edge(struct pair_table *table, unsigned int slave_id,
+                    unsigned int master_id) {
+  if (find_edge(&pair_node(table, slave_id)->masters, master_id) !=
+      UINT_MAX) {
+    return 0;
+  }
+
+  struct pair_node *slave;
+  struct pair_node *master;
+  if (own_rule(table, slave_id, master_id, &slave, &master) == -1 ||
+      reserve_edge(table, &slave->masters) == -1 ||
+      reserve_edge(table, &master->slaves) == -1) {
+    return -1;
+  }
+
+  unsigned int slave_pos = slave->masters.num++;
+  unsigned int master_pos = master->slaves.num++;
+
+  slave->masters.edges[slave_pos] = (struct rule_edge){
+      master_id, master_pos, master->key, master->value};
+  master->slaves.edges[master_pos] =
+      (struct rule_edge){slave_id, slave_pos, slave->key, slave->value};
+  table->num_rules++;
+
+  return 0;
+}
+
+// Swap-removes edges[pos] and repoints the reverse edge of the one moved in.
+// A fork leaves the reverse edge alone, which would mean copying its node,
+// and looks reverse edges up by pair instead.
+static void remove_edge_at(struct pair_table *table, struct edge_array *array,
+                           unsigned int pos, int is_masters) {
+  array->num--;
+  if (pos == array->num) {
+    return;
+  }
+
+  struct rule_edge *moved = &array->edges[pos];
+  *moved = array->edges[array->num];
+  if (table->parent) {
+    return;
+  }
+
+  struct pair_node *other = &table->nodes[moved->pair];
+  struct edge_array *reverse = is_masters ? &other->slaves : &other->masters;
+  reverse->edges[moved->peer].peer = pos;
+}
+
+// Position of the master's edge back to the slave at slave_pos
+static unsigned int peer_of(const struct pair_table *table,
+                            const struct pair_node *slave,
+                            unsigned int slave_id, unsigned int slave_pos) {
+  const struct rule_edge *edge = &slave->masters.edges[slave_pos];
+  return table->parent
+             ? find_edge(&pair_node(table, edge->pair)->slaves, slave_id)
+             : edge->peer;
+}
+
+// Both nodes must be owned, see own_rule()
+static void remove_edge(struct pair_table *table, unsigned int slave_id,
+                        struct pair_node *slave, struct pair_node *master,
+                        unsigned int pos) {
+  unsigned int master_pos = peer_of(table, slave, slave_id, pos);
+
+  remove_edge_at(table, &slave->masters, pos, 1);
+  remove_edge_at(table, &master->slaves, master_pos, 0);
+  table->num_rules--;
+}
+
+// The group of id, those of a fork are its parent's
+static const struct rule_group *group_at(const struct pair_table *table,
+                                         unsigned int id) {
+  while (table->parent) {
+    table = table->parent;
+  }
+
+  return &table->groups[id];
+}
+
+static unsigned int group_alloc(struct pair_table *table) {
+  if (table->free_groups) {
+    unsigned int id = table->free_groups;
+    table->free_groups = table->groups[id].next_free;
+    return id;
+  }
+
+  if (table->next_group >= table->max_groups) {
+    unsigned int max_groups = table->max_groups ? table->max_groups * 2 : 16;
+    struct rule_group *groups =
+        realloc(table->groups, max_groups * sizeof(struct rule_group));
+    if (!groups) {
+      error_callback("%s: realloc() failed\n", __func__);
+      return 0;
+    }
+    table->groups = groups;
+    table->max_groups = max_groups;
+  }
+
+  return table->next_group++;
+}
+
+// The group of the slave with exactly these masters, in any order, 0 if there
+// is none
+static unsigned int find_group(const struct pair_table *table,
+                               unsigned int slave_id,
+                               const unsigned int *master_ids,
+                               unsigned int num) {
+  const struct edge_array *refs = &pair_node(table, slave_id)->groups;
+  for (unsigned int i = 0; i < refs->num; i++) {
+    const struct edge_array *members =
+        &group_at(table, refs->edges[i].pair)->members;
+    if (refs->edges[i].peer != 0 || members->num != num + 1) {
+      continue;
+    }
+
+    // the pairs of a group are on different keys, so are all different
+    unsigned int j = 0;
+    while (j < num && find_edge(members, master_ids[j]) != UINT_MAX) {
+      j++;
+    }
+    if (j == num) {
+      return refs->edges[i].pair;
+    }
+  }
+
+  return 0;
+}
+
+// Adds a group that does not exist yet, the slave and the masters must be
+// nodes already. Groups only change in a dictionary that is not a fork.
+static int link_group(struct pair_table *table, unsigned int slave_id,
+                      const unsigned int *master_ids, unsigned int num) {
+  unsigned int id = group_alloc(table);
+  if (!id) {
+    return -1;
+  }
+
+  struct rule_group *group = &table->groups[id];
+  unsigned int max = 4;
+  while (max < num + 1) {
+    max *= 2;
+  }
+  group->members = (struct edge_array){alloc_edges(table, max), 0, max};
+
+  // room for every edge first, so the group is added whole or not at all
+  int ret = group->members.edges ? 0 : -1;
+  for (unsigned int i = 0; ret == 0 && i <= num; i++) {
+    unsigned int pair = i ? master_ids[i - 1] : slave_id;
+    ret = reserve_edge(table, &table->nodes[pair].groups);
+  }
+  if (ret == -1) {
+    error_callback("%s: alloc_edges() failed\n", __func__);
+    free_edges(table, group->members.edges, max);
+    group->members = (struct edge_array){NULL, 0, 0};
+    group->next_free = table->free_groups;
+    table->free_groups = id;
+    return -1;
+  }
+
+  for (unsigned int i = 0; i <= num; i++) {
+    unsigned int pair = i ? master_ids[i - 1] : slave_id;
+    struct pair_node *node = &table->nodes[pair];
+    unsigned int pos = node->groups.num++;
+    node->groups.edges[pos] = (struct rule_edge){id, i, 0, 0};
+    group->members.edges[i] =
+        (struct rule_edge){pair, pos, node->key, node->value};
+  }
+  group->members.num = num + 1;
+  table->num_groups++;
+
+  return 0;
+}
+
+// Removes the group and drops the nodes left without rules or groups
+static void unlink_group(struct pair_table *table, unsigned int id) {
+  struct rule_group *group = &table->groups[id];
+
+  for (unsigned int i = 0; i < group->members.num; i++) {
+    const struct rule_edge *member = &group->members.edges[i];
+    struct edge_array *refs = &table->nodes[member->pair].groups;
+
+    // swap-removes the node's edge to the group and repoints the group
+    // member of the one moved in
+    refs->num--;
+    if (member->peer != refs->num) {
+      struct rule_edge moved = refs->edges[refs->num];
+      refs->edges[member->peer] = moved;
+      table->groups[moved.pair].members.edges[moved.peer].peer = member->peer;
+    }
+    pair_put(table, member->pair);
+  }
+
+  free_edges(table, group->members.edges, group->members.max);
+  group->members = (struct edge_array){NULL, 0, 0};
+  group->next_free = table->free_groups;
+  table->free_groups = id;
+  table->num_groups--;
+}
+
+// The patterns of a dictionary, those of a fork are its parent's
+static const struct pattern_table *
+pattern_table(const struct restricted_dictionary *r_dict) {
+  while (r_dict->parent) {
+    r_dict = r_dict->parent;
+  }
+
+  return &r_dict->patterns;
+}
+
+static int key_matches(const struct restricted_dictionary *r_dict,
+                       const struct pattern *pattern, unsigned int key) {
+  const char *str = intern_string(&r_dict->keys, key);
+  if (strncmp(str, pattern->key, pattern->key_len) != 0) {
+    return 0;
+  }
+
+  return pattern->is_prefix || str[pattern->key_len] == '\0';
+}
+
+static int value_matches(const struct pattern *pattern, unsigned int value) {
+  return value && (!pattern->value || pattern->value == value);
+}
+
+static unsigned int trie_child(const struct pattern_table *table,
+                               unsigned int node, unsigned char byte) {
+  unsigned int child = table->nodes[node].child;
+  while (child && table->nodes[child].byte != byte) {
+    child = table->nodes[child].sibling;
+  }
+
+  return child;
+}
+
+static void count_list(const struct pattern_table *table, unsigned int *present,
+                       unsigned int id, unsigned int old_value,
+                       unsigned int value) {
+  for (; id; id = table->patterns[id].next) {
+    present[id] += value_matches(&table->patterns[id], value);
+    present[id] -= value_matches(&table->patterns[id], old_value);
+  }
+}
+
+// Keeps the number of keys each pattern matches in step with key going from
+// old_value to value, walking the trie along the key
+static void update_patterns(struct restricted_dictionary *r_dict,
+                            unsigned int key, unsigned int old_value,
+                            unsigned int value) {
+  const struct pattern_table *table = pattern_table(r_dict);
+  if (!table->num_patterns) {
+    return;
+  }
+
+  const char *str = intern_string(&r_dict->keys, key);
+  for (unsigned int node = 0;; str++) {
+    count_list(table, r_dict->present, table->nodes[node].prefix, old_value,
+               value);
+    if (*str == '\0') {
+      count_list(table, r_dict->present, table->nodes[node].exact, old_value,
+                 value);
+      return;
+    }
+    if (!(node = trie_child(table, node, *str))) {
+      return;
+    }
+  }
+}
+
+// Whether a key other than key matches the pattern. key, 0 when it is not
+// interned, is about to be replaced and the other keys of a batch count with
+// the values value_of() gives them.
+static int pattern_present(const struct restricted_dictionary *r_dict,
+                           unsigned int id, unsigned int key,
+                           const unsigned int *batch, unsigned int num,
+                           unsigned int (*value_of)(
+                               const struct restricted_dictionary *,
+                               unsigned int)) {
+  const struct pattern *pattern = &pattern_table(r_dict)->patterns[id];
+  long present = r_dict->present[id];
+
+  if (key && key_matches(r_dict, pattern, key)) {
+    present -= value_matches(pattern, current_value(r_dict, key));
+  }
+  for (unsigned int i = 0; i < num; i++) {
+    if (batch[i] != key && key_matches(r_dict, pattern, batch[i])) {
+      present += value_matches(pattern, value_of(r_dict, batch[i]));
+      present -= value_matches(pattern, current_value(r_dict, batch[i]));
+    }
+  }
+
+  return present > 0;
+}
+
+// Checks the patterns of one list that match value against the other ends of
+// their rules
+static int list_blocks(const struct restricted_dictionary *r_dict,
+                       unsigned int id, unsigned int key, unsigned int value,
+                       const unsigned int *batch, unsigned int num,
+                       unsigned int (*value_of)(
+                           const struct restricted_dictionary *,
+                           unsigned int),
+                       unsigned int *slave, unsigned int *master) {
+  const struct pattern_table *table = pattern_table(r_dict);
+
+  for (; id; id = table->patterns[id].next) {
+    const struct pattern *pattern = &table->patterns[id];
+    if (!value_matches(pattern, value)) {
+      continue;
+    }
+
+    for (unsigned int i = 0; i < pattern->masters.num; i++) {
+      unsigned int other = pattern->masters.edges[i].pair;
+      if (pattern_present(r_dict, other, key, batch, num, value_of)) {
+        *slave = id;
+        *master = other;
+        return 1;
+      }
+    }
+
+    for (unsigned int i = 0; i < pattern->slaves.num; i++) {
+      unsigned int other = pattern->slaves.edges[i].pair;
+      if (pattern_present(r_dict, other, key, batch, num, value_of)) {
+        *slave = other;
+        *master = id;
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Checks setting key_str to value against the pattern rules, the patterns
+// matching it are found walking the trie along the key. key is the key's id,
+// 0 if it is not interned. A set replaces what the key holds, so that never
+// counts against it. Returns 1 and the offending patterns if the set is
+// refused.
+static int has_pattern_restriction(const struct restricted_dictionary *r_dict,
+                                   const char *key_str, unsigned int key,
+                                   unsigned int value,
+                                   const unsigned int *batch,
+                                   unsigned int num,
+                                   unsigned int (*value_of)(
+                                       const struct restricted_dictionary *,
+                                       unsigned int),
+                                   unsigned int *slave,
+                                   unsigned int *master) {
+  const struct pattern_table *table = pattern_table(r_dict);
+  if (!table->num_patterns) {
+    return 0;
+  }
+
+  for (unsigned int node = 0;; key_str++) {
+    if (list_blocks(r_dict, table->nodes[node].prefix, key, value, batch, num,
+                    value_of, slave, master)) {
+      return 1;
+    }
+    if (*key_str == '\0') {
+      return list_blocks(r_dict, table->nodes[node].exact, key, value, batch,
+                         num, value_of, slave, master);
+    }
+    if (!(node = trie_child(table, node, *key_str))) {
+      return 0;
+    }
+  }
+}
+
+// has_pattern_restriction() for a single set of key to val
+static int pattern_blocks_set(const struct restricted_dictionary *r_dict,
+                              const char *key, const char *val,
+                              unsigned int *slave, unsigned int *master) {
+  if (!pattern_table(r_dict)->num_patterns) {
+    return 0;
+  }
+
+  unsigned int key_id = intern_find(&r_dict->keys, key, strlen(key));
+  unsigned int value_id = intern_find(&r_dict->values, val, strlen(val));
+  return has_pattern_restriction(r_dict, key, key_id,
+                                 value_id ? value_id : OTHER_VALUE, NULL, 0,
+                                 current_value, slave, master);
+}
+
+static unsigned int trie_add(struct pattern_table *table, unsigned int node,
+                             unsigned char byte) {
+  unsigned int child = trie_child(table, node, byte);
+  if (child) {
+    return child;
+  }
+
+  if (table->num_nodes >= table->max_nodes) {
+    unsigned int max_nodes = table->max_nodes * 2;
+    struct trie_node *nodes =
+        realloc(table->nodes, max_nodes * sizeof(struct trie_node));
+    if (!nodes) {
+      error_callback("%s: realloc() failed\n", __func__);
+      return 0;
+    }
+    table->nodes = nodes;
+    table->max_nodes = max_nodes;
+  }
+
+  child = table->num_nodes++;
+  table->nodes[child] = (struct trie_node){0, table->nodes[node].child, 0, 0,
+                                           byte};
+  table->nodes[node].child = child;
+
+  return child;
+}
+
+static unsigned int pattern_alloc(struct restricted_dictionary *r_dict) {
+  struct pattern_table *table = &r_dict->patterns;
+  if (table->free_patterns) {
+    unsigned int id = table->free_patterns;
+    table->free_patterns = table->patterns[id].next;
+    return id;
+  }
+
+  if (table->next_pattern >= table->max_patterns) {
+    unsigned int max = table->max_patterns ? table->max_patterns * 2 : 16;
+    struct pattern *patterns =
+        realloc(table->patterns, max * sizeof(struct pattern));
+    if (!patterns) {
+      error_callback("%s: realloc() failed\n", __func__);
+      return 0;
+    }
+    table->patterns = patterns;
+    table->max_patterns = max;
+
+    if (grow_key_array(&r_dict->present, r_dict->max_present, max) == -1) {
+      return 0;
+    }
+    r_dict->max_present = max;
+  }
+
+  return table->next_pattern++;
+}
+
+// Returns the id of the pattern written as pair, creating it with the number
+// of keys it matches now if needed. 0 on failure.
+static unsigned int pattern_get(struct restricted_dictionary *r_dict,
+                                const struct restricted_pair *pair) {
+  struct pattern_table *table = &r_dict->patterns;
+  if (!table->nodes) {
+    table->nodes = calloc(16, sizeof(struct trie_node));
+    if (!table->nodes) {
+      error_callback("%s: calloc() failed\n", __func__);
+      return 0;
+    }
+    table->num_nodes = 1;
+    table->max_nodes = 16;
+    table->next_pattern = 1;
+  }
+
+  int is_prefix = pair->key[pair->key_len - 1] == '*';
+  unsigned int key_len = pair->key_len - is_prefix;
+  unsigned int value = 0;
+  if (pair->value_len != 1 || pair->value[0] != '*') {
+    value = intern_get(&r_dict->values, pair->value, pair->value_len);
+    if (!value) {
+      return 0;
+    }
+  }
+
+  unsigned int node = 0;
+  for (unsigned int i = 0; i < key_len; i++) {
+    if (!(node = trie_add(table, node, pair->key[i]))) {
+      return 0;
+    }
+  }
+
+  unsigned int *list =
+      is_prefix ? &table->nodes[node].prefix : &table->nodes[node].exact;
+  for (unsigned int id = *list; id; id = table->patterns[id].next) {
+    if (table->patterns[id].value == value) {
+      return id;
+    }
+  }
+
+  char *key = strndup(pair->key, pair->key_len);
+  unsigned int id = key ? pattern_alloc(r_dict) : 0;
+  if (!id) {
+    error_callback("%s: pattern_alloc() failed\n", __func__);
+    free(key);
+    return 0;
+  }
+
+  struct pattern *pattern = &table->patterns[id];
+  *pattern = (struct pattern){key,  key_len, value, is_prefix, node,
+                              *list, {NULL, 0, 0}, {NULL, 0, 0}};
+  *list = id;
+  table->num_patterns++;
+
+  // values set before any rule interned them are not known by id yet
+  unsigned int present = 0;
+  for (unsigned int k = 1; k < r_dict->keys.num_strings; k++) {
+    if (!key_matches(r_dict, pattern, k)) {
+      continue;
+    }
+    if (value && r_dict->current[k] == OTHER_VALUE) {
+      STAT_INC(r_dict, dictionary_gets);
+      if (strcmp(base_value(r_dict, k),
+                 intern_string(&r_dict->values, value)) == 0) {
+        r_dict->current[k] = value;
+      }
+    }
+    present += value_matches(pattern, r_dict->current[k]);
+  }
+  r_dict->present[id] = present;
+
+  return id;
+}
+
+// Drops the pattern once it is in no rule. Inside a transaction, and while
+// one is rolled back, patterns are kept for the undo log to refer to and
+// dropped by pattern_sweep() when it ends.
+static void pattern_put(struct restricted_dictionary *r_dict,
+                        unsigned int id) {
+  struct pattern_table *table = &r_dict->patterns;
+  struct pattern *pattern = &table->patterns[id];
+  if (!pattern->key || pattern->masters.num || pattern->slaves.num ||
+      r_dict->in_transaction || r_dict->num_undo) {
+    return;
+  }
+
+  if (id == table->blocked_slave || id == table->blocked_master) {
+    table->blocked_slave = 0;
+    table->blocked_master = 0;
+  }
+
+  unsigned int *link = pattern->is_prefix ? &table->nodes[pattern->node].prefix
+                                          : &table->nodes[pattern->node].exact;
+  while (*link != id) {
+    link = &table->patterns[*link].next;
+  }
+  *link = pattern->next;
+
+  free(pattern->key);
+  free_edges(&r_dict->pairs, pattern->masters.edges, pattern->masters.max);
+  free_edges(&r_dict->pairs, pattern->slaves.edges, pattern->slaves.max);
+  memset(pattern, 0, sizeof(struct pattern));
+  pattern->next = table->free_patterns;
+  table->free_patterns = id;
+  table->num_patterns--;
+}
+
+static void pattern_sweep(struct restricted_dictionary *r_dict) {
+  for (unsigned int id = 1; id < r_dict->patterns.next_pattern; id++) {
+    pattern_put(r_dict, id);
+  }
+}
+
+static void pattern_table_release(struct restricted_dictionary *r_dict) {
+  struct pattern_table *table = &r_dict->patterns;
+  for (unsigned int id = 1; id < table->next_pattern; id++) {
+    free(table->patterns[id].key);
+    if (!r_dict->arena) {
+      free(table->patterns[id].masters.edges);
+      free(table->patterns[id].slaves.edges);
+    }
+  }
+
+  free(table->nodes);
+  free(table->patterns);
+  memset(table, 0, sizeof(struct pattern_table));
+}
+
+// Adds the rule between two patterns unless it exists, returns 1 when it was
+// added
+static int link_pattern(struct restricted_dictionary *r_dict,
+                        unsigned int slave_id, unsigned int master_id) {
+  struct pattern_table *table = &r_dict->patterns;
+  if (find_edge(&table->patterns[slave_id].masters, master_id) != UINT_MAX) {
+    return 0;
+  }
+
+  struct pattern *slave = &table->patterns[slave_id];
+  struct pattern *master = &table->patterns[master_id];
+  if (reserve_edge(&r_dict->pairs, &slave->masters) == -1 ||
+      reserve_edge(&r_dict->pairs, &master->slaves) == -1) {
+    return -1;
+  }
+
+  unsigned int slave_pos = slave->masters.num++;
+  unsigned int master_pos = master->slaves.num++;
+  slave->masters.edges[slave_pos] =
+      (struct rule_edge){master_id, master_pos, 0, 0};
+  master->slaves.edges[master_pos] =
+      (struct rule_edge){slave_id, slave_pos, 0, 0};
+  table->num_rules++;
+
+  return 1;
+}
+
+static void unlink_pattern(struct restricted_dictionary *r_dict,
+                           unsigned int slave_id, unsigned int pos) {
+  struct pattern_table *table = &r_dict->patterns;
+  struct edge_array *masters = &table->patterns[slave_id].masters;
+  unsigned int master_id = masters->edges[pos].pair;
+  struct edge_array *slaves = &table->patterns[master_id].slaves;
+  unsigned int master_pos = masters->edges[pos].peer;
+
+  masters->num--;
+  if (pos != masters->num) {
+    masters->edges[pos] = masters->edges[masters->num];
+    struct rule_edge *moved = &masters->edges[pos];
+    table->patterns[moved->pair].slaves.edges[moved->peer].peer = pos;
+  }
+
+  slaves->num--;
+  if (master_pos != slaves->num) {
+    slaves->edges[master_pos] = slaves->edges[slaves->num];
+    struct rule_edge *moved = &slaves->edges[master_pos];
+    table->patterns[moved->pair].masters.edges[moved->peer].peer = master_pos;
+  }
+
+  table->num_rules--;
+}
+
+static int is_present(const struct restricted_dictionary *r_dict,
+                      const struct pair_node *node) {
+  return current_value(r_dict, node->key) == node->value;
+}
+
+// Makes room for num more undo entries, so the change they record cannot
+// fail halfway for want of one
+static int undo_reserve(struct restricted_dictionary *r_dict,
+                        unsigned int num) {
+  if (!r_dict->in_transaction || r_dict->num_undo + num <= r_dict->max_undo) {
+    return 0;
+  }
+
+  unsigned int max = r_dict->max_undo ? r_dict->max_undo : 16;
+  while (max < r_dict->num_undo + num) {
+    max *= 2;
+  }
+  struct undo_entry *undo =
+      realloc(r_dict->undo, max * sizeof(struct undo_entry));
+  if (!undo) {
+    error_callback("%s: realloc() failed\n", __func__);
+    return -1;
+  }
+
+  r_dict->undo = undo;
+  r_dict->max_undo = max;
+
+  return 0;
+}
+
+// Records a change outside of a transaction as nothing, room for it must
+// have been reserved
+static void undo_push(struct restricted_dictionary *r_dict,
+                      enum undo_type type, const struct pair_node *slave,
+                      const struct pair_node *master) {
+  if (!r_dict->in_transaction) {
+    return;
+  }
+
+  r_dict->undo[r_dict->num_undo++] = (struct undo_entry){
+      type, slave->key, slave->value, master->key, master->value, NULL, NULL};
+}
+
+// Records a group change with the ids of the masters' keys and values,
+// their nodes may be dropped and allocated again before a rollback
+static int undo_group(struct restricted_dictionary *r_dict,
+                      enum undo_type type, unsigned int slave_id,
+                      const unsigned int *master_ids, unsigned int num) {
+  if (!r_dict->in_transaction) {
+    return 0;
+  }
+
+  unsigned int *masters = malloc(2 * num * sizeof(unsigned int));
+  if (!masters || undo_reserve(r_dict, 1) == -1) {
+    error_callback("%s: malloc() failed\n", __func__);
+    free(masters);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < num; i++) {
+    const struct pair_node *master = pair_node(&r_dict->pairs, master_ids[i]);
+    masters[2 * i] = master->key;
+    masters[2 * i + 1] = master->value;
+  }
+
+  const struct pair_node *slave = pair_node(&r_dict->pairs, slave_id);
+  r_dict->undo[r_dict->num_undo++] = (struct undo_entry){
+      type, slave->key, slave->value, num, 0, NULL, masters};
+
+  return 0;
+}
+
+static void undo_clear(struct restricted_dictionary *r_dict) {
+  for (unsigned int i = 0; i < r_dict->num_undo; i++) {
+    free(r_dict->undo[i].old);
+    free(r_dict->undo[i].masters);
+  }
+  r_dict->num_undo = 0;
+  r_dict->in_transaction = 0;
+}
+
+// Adds the rule and, in blocked set mode, accounts for its two ends being
+// present already
+static int link_rule(struct restricted_dictionary *r_dict,
+                     unsigned int slave_id, unsigned int master_id) {
+  struct pair_table *table = &r_dict->pairs;
+  unsigned int num = pair_node(table, slave_id)->masters.num;
+
+  if (undo_reserve(r_dict, 1) == -1 ||
+      add_edge(table, slave_id, master_id) == -1) {
+    return -1;
+  }
+
+  if (pair_node(table, slave_id)->masters.num == num) {
+    return 0;
+  }
+
+  // both ends are owned once the edge is added
+  struct pair_node *slave = pair_own(table, slave_id);
+  struct pair_node *master = pair_own(table, master_id);
+
+  undo_push(r_dict, UNDO_LINK, slave, master);
+  if (!(r_dict->flags & RESTRICTED_DICTIONARY_BLOCKED_SET)) {
+    return 0;
+  }
+
+  if (is_present(r_dict, master)) {
+    slave->active_masters++;
+  }
+  if (slave->key != master->key && is_present(r_dict, slave)) {
+    master->active_slaves++;
+  }
+
+  return 0;
+}
+
+// Inside a transaction the caller reserves the undo entry. Only a fork can
+// fail, when it runs out of memory copying the nodes.
+static int unlink_rule(struct restricted_dictionary *r_dict,
+                       unsigned int slave_id, unsigned int pos) {
+  struct pair_table *table = &r_dict->pairs;
+  unsigned int master_id = pair_node(table, slave_id)->masters.edges[pos].pair;
+  struct pair_node *slave;
+  struct pair_node *master;
+  if (own_rule(table, slave_id, master_id, &slave, &master) == -1) {
+    return -1;
+  }
+
+  undo_push(r_dict, UNDO_UNLINK, slave, master);
+  if (r_dict->flags & RESTRICTED_DICTIONARY_BLOCKED_SET) {
+    if (is_present(r_dict, master)) {
+      slave->active_masters--;
+    }
+    if (slave->key != master->key && is_present(r_dict, slave)) {
+      master->active_slaves--;
+    }
+  }
+
+  remove_edge(table, slave_id, slave, master, pos);
+
+  return 0;
+}
+
+// Adjusts the counters of every rule the pair takes part in when the pair
+// enters (delta 1) or leaves (delta -1) the dictionary. Never in a fork, which
+// does without the counters.
+static void update_active(struct restricted_dictionary *r_dict,
+                          unsigned int key, unsigned int value, int delta) {
+  if (!value || value == OTHER_VALUE) {
+    return;
+  }
+
+  unsigned int pair_id = pair_find(&r_dict->pairs, key, value);
+  if (!pair_id) {
+    return;
+  }
+
+  struct pair_node *nodes = r_dict->pairs.nodes;
+  const struct pair_node *node = &nodes[pair_id];
+
+  for (unsigned int i = 0; i < node->slaves.num; i++) {
+    nodes[node->slaves.edges[i].pair].active_masters += delta;
+  }
+
+  for (unsigned int i = 0; i < node->masters.num; i++) {
+    if (node->masters.edges[i].key != key) {
+      nodes[node->masters.edges[i].pair].active_slaves += delta;
+    }
+  }
+}
+
+// Records that key now holds value, every change of current[] goes through
+// here so the blocked set stays in step
+static void set_current(struct restricted_dictionary *r_dict, unsigned int key,
+                        unsigned int value) {
+  unsigned int old_value = current_value(r_dict, key);
+  if (old_value == value) {
+    return;
+  }
+
+  if (r_dict->flags & RESTRICTED_DICTIONARY_BLOCKED_SET) {
+    update_active(r_dict, key, old_value, -1);
+    update_active(r_dict, key, value, 1);
+  }
+
+  put_current(r_dict, key, value);
+  update_patterns(r_dict, key, old_value, value);
+}
+
+static unsigned int find_pair(const struct restricted_dictionary *r_dict,
+                              const char *key, const char *val) {
+  unsigned int key_id = intern_find(&r_dict->keys, key, strlen(key));
+  if (!key_id) {
+    return 0;
+  }
+
+  unsigned int value_id = intern_find(&r_dict->values, val, strlen(val));
+  if (!value_id) {
+    return 0;
+  }
+
+  return pair_find(&r_dict->pairs, key_id, value_id);
+}
+
+// Whether setting the member at pos completes the group, every other member
+// holding its value as value_of() sees it. Stops at the first one that does
+// not.
+static int group_blocks(const struct restricted_dictionary *r_dict,
+                        const struct rule_group *group, unsigned int pos,
+                        unsigned int (*value_of)(
+                            const struct restricted_dictionary *,
+                            unsigned int)) {
+  const struct rule_edge *members = group->members.edges;
+  for (unsigned int i = 0; i < group->members.num; i++) {
+    if (i != pos && value_of(r_dict, members[i].key) != members[i].value) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Looks for a group of the node that setting it completes. The offending rule
+// is then the group's slave and the node, or its first master when the node
+// is the slave.
+static int find_blocking_group(const struct restricted_dictionary *r_dict,
+                               const struct pair_node *node,
+                               unsigned int (*value_of)(
+                                   const struct restricted_dictionary *,
+                                   unsigned int),
+                               unsigned int *slave_id,
+                               unsigned int *master_id) {
+  for (unsigned int i = 0; i < node->groups.num; i++) {
+    const struct rule_edge *ref = &node->groups.edges[i];
+    const struct rule_group *group = group_at(&r_dict->pairs, ref->pair);
+    if (group_blocks(r_dict, group, ref->peer, value_of)) {
+      *slave_id = group->members.edges[0].pair;
+      *master_id = group->members.edges[ref->peer ? ref->peer : 1].pair;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Checks pair_id against the values currently in the dictionary, both as a
+// slave of present masters and as a master of present slaves. The slave on
+// the pair's own key does not count since setting the pair replaces it.
+// Returns 1 and the offending rule if the pair cannot be set.
+static int has_restriction(const struct restricted_dictionary *r_dict,
+                           unsigned int pair_id, unsigned int *slave_id,
+                           unsigned int *master_id) {
+  if (!pair_id) {
+    STAT_CHECK(r_dict, 0, 0);
+    return 0;
+  }
+
+  const struct pair_node *node = pair_node(&r_dict->pairs, pair_id);
+
+  // the counters make the common, allowed case a single probe, the edges are
+  // only walked to name the offending rule. Groups are not counted.
+  if ((r_dict->flags & RESTRICTED_DICTIONARY_BLOCKED_SET) &&
+      !node->active_masters && !node->active_slaves && !node->groups.num) {
+    STAT_CHECK(r_dict, 0, 0);
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < node->masters.num; i++) {
+    const struct rule_edge *edge = &node->masters.edges[i];
+    if (current_value(r_dict, edge->key) == edge->value) {
+      STAT_CHECK(r_dict, i + 1, 0);
+      *slave_id = pair_id;
+      *master_id = edge->pair;
+      return 1;
+    }
+  }
+
+  for (unsigned int i = 0; i < node->slaves.num; i++) {
+    const struct rule_edge *edge = &node->slaves.edges[i];
+    if (edge->key != node->key &&
+        current_value(r_dict, edge->key) == edge->value) {
+      STAT_CHECK(r_dict, node->masters.num, i + 1);
+      *slave_id = edge->pair;
+      *master_id = pair_id;
+      return 1;
+    }
+  }
+
+  STAT_CHECK(r_dict, node->masters.num, node->slaves.num);
+  return find_blocking_group(r_dict, node, current_value, slave_id,
+                             master_id);
+}
+
+static void frozen_release(struct frozen_rules *frozen) {
+  free(frozen->buckets);
+  free(frozen->pairs);
+  free(frozen->edges);
+  memset(frozen, 0, sizeof(struct frozen_rules));
+}
+
+// Index of (key, value) in the frozen pairs, 0 if it is in no rule
+static unsigned int frozen_find(const struct frozen_rules *frozen,
+                                unsigned int key, unsigned int value) {
+  unsigned int mask = frozen->num_buckets - 1;
+  for (unsigned int slot = id_pair_hash(key, value) & mask;;
+       slot = (slot + 1) & mask) {
+    unsigned int i = frozen->buckets[slot];
+    if (!i) {
+      return 0;
+    }
+    if (frozen->pairs[i].key == key && frozen->pairs[i].value == value) {
+      return i;
+    }
+  }
+}
+
+// Lays the pair nodes of the dictionary out as frozen rules
+static int frozen_build(const struct restricted_dictionary *r_dict,
+                        struct frozen_rules *frozen) {
+  const struct pair_table *table = &r_dict->pairs;
+  memset(frozen, 0, sizeof(struct frozen_rules));
+
+  // at most half full
+  unsigned int num_buckets = 8;
+  while (num_buckets < 2 * table->num_pairs) {
+    num_buckets <<= 1;
+  }
+  frozen->buckets = calloc(num_buckets, sizeof(unsigned int));
+  frozen->pairs = malloc((table->num_pairs + 2) * sizeof(struct frozen_pair));
+  frozen->edges =
+      malloc((2 * table->num_rules + 1) * sizeof(struct frozen_edge));
+  if (!frozen->buckets || !frozen->pairs || !frozen->edges) {
+    error_callback("%s: malloc() failed\n", __func__);
+    frozen_release(frozen);
+    return -1;
+  }
+  frozen->num_buckets = num_buckets;
+
+  unsigned int i = 1;
+  unsigned int num_edges = 0;
+  for (unsigned int id = 1; id < table->num_nodes; id++) {
+    const struct pair_node *node = &table->nodes[id];
+    // on the free list
+    if (!node->key) {
+      continue;
+    }
+
+    frozen->pairs[i] =
+        (struct frozen_pair){node->key, node->value, num_edges,
+                             node->masters.num, id, node->groups.num != 0};
+    for (unsigned int j = 0; j < node->masters.num; j++) {
+      const struct rule_edge *edge = &node->masters.edges[j];
+      frozen->edges[num_edges++] =
+          (struct frozen_edge){edge->pair, edge->key, edge->value};
+    }
+    for (unsigned int j = 0; j < node->slaves.num; j++) {
+      const struct rule_edge *edge = &node->slaves.edges[j];
+      frozen->edges[num_edges++] =
+          (struct frozen_edge){edge->pair, edge->key, edge->value};
+    }
+
+    unsigned int slot =
+        id_pair_hash(node->key, node->value) & (num_buckets - 1);
+    while (frozen->buckets[slot]) {
+      slot = (slot + 1) & (num_buckets - 1);
+    }
+    frozen->buckets[slot] = i++;
+  }
+  frozen->pairs[i].edges = num_edges;
+  frozen->num_pairs = i - 1;
+  frozen->num_edges = num_edges;
+
+  return 0;
+}
+
+// has_restriction() against the frozen rules, for setting key to value with
+// the other keys holding what value_of() gives them. The edges of a pair are
+// read in one pass over a single array.
+static int has_frozen_restriction(const struct restricted_dictionary *r_dict,
+                                  unsigned int key, unsigned int value,
+                                  unsigned int (*value_of)(
+                                      const struct restricted_dictionary *,
+                                      unsigned int),
+                                  unsigned int *slave_id,
+                                  unsigned int *master_id) {
+  const struct frozen_rules *frozen = &r_dict->frozen;
+  unsigned int i =
+      key && value && value != OTHER_VALUE ? frozen_find(frozen, key, value)
+                                           : 0;
+  if (!i) {
+    STAT_CHECK(r_dict, 0, 0);
+    return 0;
+  }
+
+  const struct frozen_pair *pair = &frozen->pairs[i];
+  const struct frozen_edge *edges = &frozen->edges[pair->edges];
+  unsigned int num_edges = pair[1].edges - pair->edges;
+
+  for (unsigned int j = 0; j < pair->num_masters; j++) {
+    if (value_of(r_dict, edges[j].key) == edges[j].value) {
+      STAT_CHECK(r_dict, j + 1, 0);
+      *slave_id = pair->pair;
+      *master_id = edges[j].pair;
+      return 1;
+    }
+  }
+
+  for (unsigned int j = pair->num_masters; j < num_edges; j++) {
+    if (edges[j].key != key &&
+        value_of(r_dict, edges[j].key) == edges[j].value) {
+      STAT_CHECK(r_dict, pair->num_masters, j - pair->num_masters + 1);
+      *slave_id = edges[j].pair;
+      *master_id = pair->pair;
+      return 1;
+    }
+  }
+
+  STAT_CHECK(r_dict, pair->num_masters, num_edges - pair->num_masters);
+  return pair->has_groups &&
+         find_blocking_group(r_dict, pair_node(&r_dict->pairs, pair->pair),
+                             value_of, slave_id, master_id);
+}
+
+// has_restriction() for setting key to val, through the frozen rules when the
+// dictionary is frozen
+static int blocks_set(const struct restricted_dictionary *r_dict,
+                      const char *key, const char *val,
+                      unsigned int *slave_id, unsigned int *master_id) {
+  if (!r_dict->frozen.buckets) {
+    return has_restriction(r_dict, find_pair(r_dict, key, val), slave_id,
+                           master_id);
+  }
+
+  return has_frozen_restriction(
+      r_dict, intern_find(&r_dict->keys, key, strlen(key)),
+      intern_find(&r_dict->values, val, strlen(val)), current_value, slave_id,
+      master_id);
+}
+
+// Rules cannot change while checks read the frozen copy of them
+static int is_frozen(const struct restricted_dictionary *r_dict,
+                     const char *func) {
+  if (!r_dict->frozen.buckets) {
+    return 0;
+  }
+
+  error_callback("%s: the dictionary is frozen\n", func);
+  return 1;
+}
+
+static void fill_conflict(const struct restricted_dictionary *r_dict,
+                          struct restricted_dictionary_conflict *conflict,
+                          unsigned int index, unsigned int slave_id,
+                          unsigned int master_id) {
+  if (!conflict) {
+    return;
+  }
+
+  memset(conflict, 0, sizeof(struct restricted_dictionary_conflict));
+  conflict->index = index;
+
+  if (slave_id && master_id) {
+    const struct pair_node *slave = pair_node(&r_dict->pairs, slave_id);
+    const struct pair_node *master = pair_node(&r_dict->pairs, master_id);
+    conflict->slave_key = intern_string(&r_dict->keys, slave->key);
+    conflict->slave_value = intern_string(&r_dict->values, slave->value);
+    conflict->master_key = intern_string(&r_dict->keys, master->key);
+    conflict->master_value = intern_string(&r_dict->values, master->value);
+  }
+}
+
+// Whether a refused set or a missing rule is passed on to error_callback
+static int diag_report(struct restricted_dictionary *r_dict) {
+  switch (r_dict->diag_mode) {
+  case RESTRICTED_DICTIONARY_DIAG_OFF:
+    return 0;
+  case RESTRICTED_DICTIONARY_DIAG_SAMPLED:
+    return r_dict->diag_count++ % r_dict->diag_rate == 0;
+  case RESTRICTED_DICTIONARY_DIAG_RATE_LIMITED: {
+    time_t now = time(NULL);
+    if (now != r_dict->diag_window) {
+      r_dict->diag_window = now;
+      r_dict->diag_count = 0;
+    }
+    return r_dict->diag_count++ < r_dict->diag_rate;
+  }
+  default:
+    return 1;
+  }
+}
+
+// Accounts for a set the rule from slave_id to master_id refused and
+// remembers the rule for restricted_dictionary_last_conflict()
+static int refuse(struct restricted_dictionary *r_dict, const char *func,
+                  unsigned int index, unsigned int slave_id,
+                  unsigned int master_id) {
+  STAT_INC(r_dict, rejections);
+  r_dict->blocked_index = index;
+  r_dict->pairs.blocked_slave = slave_id;
+  r_dict->pairs.blocked_master = master_id;
+  r_dict->patterns.blocked_slave = 0;
+  r_dict->patterns.blocked_master = 0;
+
+  if (diag_report(r_dict)) {
+    const struct pair_node *slave = pair_node(&r_dict->pairs, slave_id);
+    const struct pair_node *master = pair_node(&r_dict->pairs, master_id);
+    error_callback("%s: key=%s, val=%s is restricted by key=%s, val=%s\n",
+                   func, intern_string(&r_dict->keys, slave->key),
+                   intern_string(&r_dict->values, slave->value),
+                   intern_string(&r_dict->keys, master->key),
+                   intern_string(&r_dict->values, master->value));
+  }
+
+  return RESTRICTED_DICTIONARY_ERESTRICTED;
+}
+
+// A wildcard value reads as '*'
+static const char *pattern_value(const struct restricted_dictionary *r_dict,
+                                 const struct pattern *pattern) {
+  return pattern->value ? intern_string(&r_dict->values, pattern->value)
+                        : "*";
+}
+
+static void fill_pattern_conflict(
+    const struct restricted_dictionary *r_dict,
+    struct restricted_dictionary_conflict *conflict, unsigned int index,
+    unsigned int slave_id, unsigned int master_id) {
+  if (!conflict) {
+    return;
+  }
+
+  const struct pattern_table *table = pattern_table(r_dict);
+  const struct pattern *slave = &table->patterns[slave_id];
+  const struct pattern *master = &table->patterns[master_id];
+  memset(conflict, 0, sizeof(struct restricted_dictionary_conflict));
+  conflict->index = index;
+  conflict->slave_key = slave->key;
+  conflict->slave_value = pattern_value(r_dict, slave);
+  conflict->master_key = master->key;
+  conflict->master_value = pattern_value(r_dict, master);
+}
+
+// Same as refuse() for a rule between two patterns
+static int refuse_pattern(struct restricted_dictionary *r_dict,
+                          const char *func, unsigned int index,
+                          unsigned int slave_id, unsigned int master_id) {
+  STAT_INC(r_dict, rejections);
+  r_dict->blocked_index = index;
+  r_dict->pairs.blocked_slave = 0;
+  r_dict->pairs.blocked_master = 0;
+  r_dict->patterns.blocked_slave = slave_id;
+  r_dict->patterns.blocked_master = master_id;
+
+  if (diag_report(r_dict)) {
+    const struct pattern_table *table = pattern_table(r_dict);
+    const struct pattern *slave = &table->patterns[slave_id];
+    const struct pattern *master = &table->patterns[master_id];
+    error_callback("%s: key=%s, val=%s is restricted by key=%s, val=%s\n",
+                   func, slave->key, pattern_value(r_dict, slave),
+                   master->key, pattern_value(r_dict, master));
+  }
+
+  return RESTRICTED_DICTIONARY_ERESTRICTED;
+}
+
+static unsigned int timer_hash(unsigned int slave_key, unsigned int slave_value,
+                               unsigned int master_key,
+                               unsigned int master_value) {
+  return id_pair_hash(id_pair_hash(slave_key, slave_value),
+                      id_pair_hash(master_key, master_value));
+}
+
+// The timer of the rule between the two pairs, 0 if it has none
+static unsigned int timer_find(const struct timer_wheel *wheel,
+                               const struct pair_node *slave,
+                               const struct pair_node *master) {
+  if (!wheel->num_timers) {
+    return 0;
+  }
+
+  unsigned int id =
+      wheel->buckets[timer_hash(slave->key, slave->value, master->key,
+                                master->value) &
+                     (wheel->num_buckets - 1)];
+  for (; id; id = wheel->timers[id].chain) {
+    const struct rule_timer *timer = &wheel->timers[id];
+    if (timer->slave_key == slave->key && timer->slave_value == slave->value &&
+        timer->master_key == master->key &&
+        timer->master_value == master->value) {
+      return id;
+    }
+  }
+
+  return 0;
+}
+
+static void timer_rehash(struct timer_wheel *wheel) {
+  unsigned int num_buckets = wheel->num_buckets * 2;
+  unsigned int *buckets = calloc(num_buckets, sizeof(unsigned int));
+  if (!buckets) {
+    // keep the current table, lookups stay correct but chains get longer
+    return;
+  }
+
+  for (unsigned int i = 0; i < wheel->num_buckets; i++) {
+    unsigned int id = wheel->buckets[i];
+    while (id) {
+      struct rule_timer *timer = &wheel->timers[id];
+      unsigned int next = timer->chain;
+      unsigned int bucket =
+          timer_hash(timer->slave_key, timer->slave_value, timer->master_key,
+                     timer->master_value) &
+          (num_buckets - 1);
+      timer->chain = buckets[bucket];
+      buckets[bucket] = id;
+      id = next;
+    }
+  }
+
+  free(wheel->buckets);
+  wheel->buckets = buckets;
+  wheel->num_buckets = num_buckets;
+}
+
+// Makes sure one more timer can be started without failing, the wheel is
+// allocated with the first one
+static int timer_reserve(struct timer_wheel *wheel) {
+  if (!wheel->slots) {
+    wheel->slots = calloc(TIMER_SLOTS, sizeof(unsigned int));
+    wheel->buckets = calloc(16, sizeof(unsigned int));
+    if (!wheel->slots || !wheel->buckets) {
+      error_callback("%s: calloc() failed\n", __func__);
+      free(wheel->slots);
+      free(wheel->buckets);
+      wheel->slots = NULL;
+      wheel->buckets = NULL;
+      return -1;
+    }
+    wheel->num_buckets = 16;
+    wheel->next_timer = 1;
+  }
+
+  if (!wheel->free_timers && wheel->next_timer >= wheel->max_timers) {
+    unsigned int max = wheel->max_timers ? wheel->max_timers * 2 : 16;
+    struct rule_timer *timers =
+        realloc(wheel->timers, max * sizeof(struct rule_timer));
+    if (!timers) {
+      error_callback("%s: realloc() failed\n", __func__);
+      return -1;
+    }
+    wheel->timers = timers;
+    wheel->max_timers = max;
+  }
+
+  if (wheel->num_timers >= wheel->num_buckets) {
+    timer_rehash(wheel);
+  }
+
+  return 0;
+}
+
+// Puts the timer in the slot of the level whose slots span its distance
+// from now, one due now goes in the slot of the current tick
+static void timer_link(struct timer_wheel *wheel, unsigned int id) {
+  struct rule_timer *timer = &wheel->timers[id];
+  unsigned int delta = timer->expires - wheel->now;
+  unsigned int slot = timer->expires & ((1u << TIMER_ROOT_BITS) - 1);
+
+  if (delta >> TIMER_ROOT_BITS) {
+    unsigned int level = 0;
+    unsigned int shift = TIMER_ROOT_BITS;
+    while (level + 1 < TIMER_LEVELS && delta >> (shift + TIMER_LEVEL_BITS)) {
+      level++;
+      shift += TIMER_LEVEL_BITS;
+    }
+    slot = (1u << TIMER_ROOT_BITS) + (level << TIMER_LEVEL_BITS) +
+           ((timer->expires >> shift) & ((1u << TIMER_LEVEL_BITS) - 1));
+  }
+
+  timer->slot = slot;
+  timer->prev = 0;
+  timer->next = wheel->slots[slot];
+  if (timer->next) {
+    wheel->timers[timer->next].prev = id;
+  }
+  wheel->slots[slot] = id;
+}
+
+static void timer_unlink(struct timer_wheel *wheel, unsigned int id) {
+  const struct rule_timer *timer = &wheel->timers[id];
+
+  if (timer->prev) {
+    wheel->timers[timer->prev].next = timer->next;
+  } else {
+    wheel->slots[timer->slot] = timer->next;
+  }
+  if (timer->next) {
+    wheel->timers[timer->next].prev = timer->prev;
+  }
+}
+
+// Gives the rule between the two pairs ttl more ticks, room for the timer
+// must have been reserved
+static void timer_start(struct timer_wheel *wheel,
+                        const struct pair_node *slave,
+                        const struct pair_node *master, unsigned int ttl) {
+  unsigned int id = timer_find(wheel, slave, master);
+  if (id) {
+    timer_unlink(wheel, id);
+  } else {
+    if (wheel->free_timers) {
+      id = wheel->free_timers;
+      wheel->free_timers = wheel->timers[id].next;
+    } else {
+      id = wheel->next_timer++;
+    }
+
+    struct rule_timer *timer = &wheel->timers[id];
+    timer->slave_key = slave->key;
+    timer->slave_value = slave->value;
+    timer->master_key = master->key;
+    timer->master_value = master->value;
+
+    unsigned int bucket = timer_hash(slave->key, slave->value, master->key,
+                                     master->value) &
+                          (wheel->num_buckets - 1);
+    timer->chain = wheel->buckets[bucket];
+    wheel->buckets[bucket] = id;
+    wheel->num_timers++;
+  }
+
+  wheel->timers[id].expires = wheel->now + ttl;
+  timer_link(wheel, id);
+}
+
+static void timer_stop(struct timer_wheel *wheel, unsigned int id) {
+  struct rule_timer *timer = &wheel->timers[id];
+  timer_unlink(wheel, id);
+
+  unsigned int *link =
+      &wheel->buckets[timer_hash(timer->slave_key, timer->slave_value,
+                                 timer->master_key, timer->master_value) &
+                      (wheel->num_buckets - 1)];
+  while (*link != id) {
+    link = &wheel->timers[*link].chain;
+  }
+  *link = timer->chain;
+
+  timer->slave_key = 0;
+  timer->next = wheel->free_timers;
+  wheel->free_timers = id;
+  wheel->num_timers--;
+}
+
+// Moves the timers of the slot the ticks just reached down a level, on the
+// level above too when that slot was the first of its level
+static void timer_cascade(struct timer_wheel *wheel) {
+  unsigned int shift = TIMER_ROOT_BITS;
+
+  for (unsigned int level = 0; level < TIMER_LEVELS; level++) {
+    unsigned int index = (wheel->now >> shift) & ((1u << TIMER_LEVEL_BITS) - 1);
+    unsigned int slot =
+        (1u << TIMER_ROOT_BITS) + (level << TIMER_LEVEL_BITS) + index;
+    unsigned int id = wheel->slots[slot];
+    wheel->slots[slot] = 0;
+    while (id) {
+      unsigned int next = wheel->timers[id].next;
+      timer_link(wheel, id);
+      id = next;
+    }
+
+    if (index) {
+      return;
+    }
+    shift += TIMER_LEVEL_BITS;
+  }
+}
+
+// Removes the rule of a timer that ran out if nothing else removed it
+// first, returns 1 when it did
+static int timer_expire(struct restricted_dictionary *r_dict, unsigned int id) {
+  struct pair_table *table = &r_dict->pairs;
+  const struct rule_timer *timer = &r_dict->wheel.timers[id];
+  unsigned int slave_id =
+      pair_find(table, timer->slave_key, timer->slave_value);
+  unsigned int master_id =
+      pair_find(table, timer->master_key, timer->master_value);
+  timer_stop(&r_dict->wheel, id);
+
+  unsigned int pos =
+      slave_id && master_id
+          ? find_edge(&pair_node(table, slave_id)->masters, master_id)
+          : UINT_MAX;
+  if (pos == UINT_MAX) {
+    return 0;
+  }
+
+  // never a fork, so it cannot fail
+  unlink_rule(r_dict, slave_id, pos);
+  pair_put(table, master_id);
+  pair_put(table, slave_id);
+
+  return 1;
+}
+
+// The rule between the two pairs is unlinked or no longer runs out. Inside
+// a transaction the commit stops the timer so a rollback keeps it, room for
+// the undo entry must have been reserved then.
+static void timer_drop(struct restricted_dictionary *r_dict,
+                       unsigned int slave_id, unsigned int master_id) {
+  unsigned int id = timer_find(&r_dict->wheel,
+                               pair_node(&r_dict->pairs, slave_id),
+                               pair_node(&r_dict->pairs, master_id));
+  if (!id) {
+    return;
+  }
+
+  if (!r_dict->in_transaction) {
+    timer_stop(&r_dict->wheel, id);
+    return;
+  }
+
+  r_dict->undo[r_dict->num_undo++] =
+      (struct undo_entry){UNDO_TIMER, id, 0, 0, 0, NULL, NULL};
+}
+
+static void timer_release(struct timer_wheel *wheel) {
+  free(wheel->slots);
+  free(wheel->timers);
+  free(wheel->buckets);
+  memset(wheel, 0, sizeof(struct timer_wheel));
+}
+
+struct restricted_dictionary *restricted_dictionary_new_ex(unsigned int size,
+                                                           unsigned int flags) {
+  struct restricted_dictionary *r_dict =
+      calloc(1, sizeof(struct restricted_dictionary));
+  if (!r_dict) {
+    error_callback("%s: calloc() failed\n", __func__);
+    return NULL;
+  }
+
+  r_dict->flags = flags;
+
+  if (flags & RESTRICTED_DICTIONARY_ARENA) {
+    r_dict->arena = arena_new(0);
+    if (!r_dict->arena) {
+      error_callback("%s: arena_new() failed\n", __func__);
+      free(r_dict);
+      return NULL;
+    }
+  }
+
+  r_dict->base = dictionary_new(size);
+  if (!r_dict->base) {
+    error_callback("%s: dictionary_new() failed\n", __func__);
+    arena_del(r_dict->arena);
+    free(r_dict);
+    return NULL;
+  }
+
+  if (intern_init(&r_dict->keys, r_dict->arena) == -1 ||
+      intern_init(&r_dict->values, r_dict->arena) == -1 ||
+      pair_table_init(&r_dict->pairs, r_dict->arena) == -1) {
+    error_callback("%s: index initialisation failed\n", __func__);
+    restricted_dictionary_del(r_dict);
+    return NULL;
+  }
+
+  return r_dict;
+}
+
+struct restricted_dictionary *restricted_dictionary_new(unsigned int size) {
+  return restricted_dictionary_new_ex(size, 0);
+}
+
+struct restricted_dictionary *
+restricted_dictionary_fork(const struct restricted_dictionary *r_dict) {
+  if (!r_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return NULL;
+  }
+
+  if (r_dict->in_transaction) {
+    error_callback("%s: a transaction is open\n", __func__);
+    return NULL;
+  }
+
+  struct restricted_dictionary *fork =
+      calloc(1, sizeof(struct restricted_dictionary));
+  if (!fork) {
+    error_callback("%s: calloc() failed\n", __func__);
+    return NULL;
+  }
+
+  // keeping the counters would copy every node a set touches
+  fork->parent = r_dict;
+  fork->flags = r_dict->flags & ~RESTRICTED_DICTIONARY_BLOCKED_SET;
+  fork->diag_mode = r_dict->diag_mode;
+  fork->diag_rate = r_dict->diag_rate;
+
+  if (fork->flags & RESTRICTED_DICTIONARY_ARENA) {
+    fork->arena = arena_new(0);
+    if (!fork->arena) {
+      error_callback("%s: arena_new() failed\n", __func__);
+      free(fork);
+      return NULL;
+    }
+  }
+
+  fork->base = dictionary_new(0);
+  if (!fork->base) {
+    error_callback("%s: dictionary_new() failed\n", __func__);
+    arena_del(fork->arena);
+    free(fork);
+    return NULL;
+  }
+
+  if (intern_fork(&fork->keys, &r_dict->keys, fork->arena) == -1 ||
+      intern_fork(&fork->values, &r_dict->values, fork->arena) == -1 ||
+      pair_table_fork(&fork->pairs, &r_dict->pairs, fork->arena) == -1) {
+    error_callback("%s: index initialisation failed\n", __func__);
+    restricted_dictionary_del(fork);
+    return NULL;
+  }
+
+  // the patterns stay the parent's, what they match is counted per fork
+  const struct restricted_dictionary *root = r_dict;
+  while (root->parent) {
+    root = root->parent;
+  }
+  if (root->max_present) {
+    fork->present = malloc(root->max_present * sizeof(unsigned int));
+    if (!fork->present) {
+      error_callback("%s: malloc() failed\n", __func__);
+      restricted_dictionary_del(fork);
+      return NULL;
+    }
+    memcpy(fork->present, r_dict->present,
+           root->max_present * sizeof(unsigned int));
+    fork->max_present = root->max_present;
+  }
+
+  return fork;
+}
+
+int restricted_dictionary_freeze(struct restricted_dictionary *r_dict) {
+  if (!r_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // a fork's rules are spread over its own nodes and its parent's
+  if (r_dict->parent) {
+    error_callback("%s: cannot freeze a fork\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->in_transaction) {
+    error_callback("%s: a transaction is open\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct frozen_rules frozen;
+  if (frozen_build(r_dict, &frozen) == -1) {
+    error_callback("%s: frozen_build() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  if (intern_pack(&r_dict->keys) == -1 ||
+      intern_pack(&r_dict->values) == -1) {
+    error_callback("%s: intern_pack() failed\n", __func__);
+    frozen_release(&frozen);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  frozen_release(&r_dict->frozen);
+  r_dict->frozen = frozen;
+
+  return 0;
+}
+
+int restricted_dictionary_thaw(struct restricted_dictionary *r_dict) {
+  if (!r_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  frozen_release(&r_dict->frozen);
+
+  return 0;
+}
+
+void restricted_dictionary_del(struct restricted_dictionary *r_dict) {
+  if (!r_dict) {
+    return;
+  }
+
+  if (r_dict->base) {
+    dictionary_del(r_dict->base);
+  }
+
+  pattern_table_release(r_dict);
+  frozen_release(&r_dict->frozen);
+  timer_release(&r_dict->wheel);
+  pair_table_release(&r_dict->pairs);
+  intern_release(&r_dict->keys);
+  intern_release(&r_dict->values);
+  free(r_dict->current);
+  free(r_dict->present);
+  free(r_dict->batch_value);
+  free(r_dict->batch_stamp);
+  id_map_release(&r_dict->own_current);
+  id_map_release(&r_dict->own_batch);
+  undo_clear(r_dict);
+  free(r_dict->undo);
+  arena_del(r_dict->arena);
+
+  free(r_dict);
+}
+
+int restricted_dictionary_arena_usage(
+    const struct restricted_dictionary *r_dict, size_t *used,
+    size_t *reserved) {
+  if (!r_dict || !r_dict->arena) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  arena_usage(r_dict->arena, used, reserved);
+
+  return 0;
+}
+
+static size_t id_map_memory(const struct id_map *map) {
+  return map->max * 2 * sizeof(unsigned int);
+}
+
+static size_t intern_memory(const struct intern_table *table) {
+  return table->num_buckets * sizeof(unsigned int) +
+         table->max_strings * (sizeof(char *) + 2 * sizeof(unsigned int)) +
+         (table->arena ? 0 : table->string_bytes);
+}
+
+int restricted_dictionary_get_stats(const struct restricted_dictionary *r_dict,
+                                    struct restricted_dictionary_stats *stats) {
+  if (!r_dict || !stats) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+#ifdef RESTRICTED_DICTIONARY_STATS
+  *stats = r_dict->stats;
+#else
+  memset(stats, 0, sizeof(struct restricted_dictionary_stats));
+#endif
+
+  const struct pair_table *pairs = &r_dict->pairs;
+  stats->num_keys = r_dict->keys.num_strings - 1;
+  stats->num_values = r_dict->values.num_strings - 1;
+  stats->num_pairs = pairs->num_pairs;
+  stats->num_rules = pairs->num_rules;
+
+  // arena strings and edges are accounted for by the arena
+  size_t arena_reserved = 0;
+  if (r_dict->arena) {
+    size_t arena_used;
+    arena_usage(r_dict->arena, &arena_used, &arena_reserved);
+  }
+  stats->memory = intern_memory(&r_dict->keys) +
+                  intern_memory(&r_dict->values) +
+                  3 * r_dict->max_current * sizeof(unsigned int) +
+                  pairs->max_nodes * sizeof(struct pair_node) +
+                  pairs->max_groups * sizeof(struct rule_group) +
+                  pairs->num_buckets * sizeof(unsigned int) +
+                  pairs->edge_bytes + arena_reserved +
+                  r_dict->patterns.max_nodes * sizeof(struct trie_node) +
+                  r_dict->patterns.max_patterns * sizeof(struct pattern) +
+                  r_dict->max_present * sizeof(unsigned int) +
+                  r_dict->frozen.num_buckets * sizeof(unsigned int) +
+                  (r_dict->frozen.pairs ? r_dict->frozen.num_pairs + 2 : 0) *
+                      sizeof(struct frozen_pair) +
+                  r_dict->frozen.num_edges * sizeof(struct frozen_edge) +
+                  (r_dict->wheel.slots ? TIMER_SLOTS : 0) *
+                      sizeof(unsigned int) +
+                  r_dict->wheel.max_timers * sizeof(struct rule_timer) +
+                  r_dict->wheel.num_buckets * sizeof(unsigned int);
+  // what a fork keeps of its own on top of its parent's
+  if (r_dict->parent) {
+    stats->memory += id_map_memory(&r_dict->own_current) +
+                     id_map_memory(&r_dict->own_batch) +
+                     id_map_memory(&pairs->own_nodes) +
+                     pairs->max_nodes * sizeof(unsigned int);
+  }
+
+  return 0;
+}
+
+int restricted_dictionary_set_diagnostics(struct restricted_dictionary *r_dict,
+                                          unsigned int mode,
+                                          unsigned int rate) {
+  if (!r_dict || mode > RESTRICTED_DICTIONARY_DIAG_RATE_LIMITED ||
+      (mode == RESTRICTED_DICTIONARY_DIAG_SAMPLED && !rate)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  r_dict->diag_mode = mode;
+  r_dict->diag_rate = rate;
+  r_dict->diag_count = 0;
+  r_dict->diag_window = 0;
+
+  return RESTRICTED_DICTIONARY_OK;
+}
+
+int restricted_dictionary_last_conflict(
+    const struct restricted_dictionary *r_dict,
+    struct restricted_dictionary_conflict *conflict) {
+  if (!r_dict || !conflict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->patterns.blocked_slave) {
+    fill_pattern_conflict(r_dict, conflict, r_dict->blocked_index,
+                          r_dict->patterns.blocked_slave,
+                          r_dict->patterns.blocked_master);
+    return RESTRICTED_DICTIONARY_OK;
+  }
+
+  // cleared once either end of the rule is gone
+  if (!r_dict->pairs.blocked_slave) {
+    return RESTRICTED_DICTIONARY_ENOTFOUND;
+  }
+
+  fill_conflict(r_dict, conflict, r_dict->blocked_index,
+                r_dict->pairs.blocked_slave, r_dict->pairs.blocked_master);
+
+  return RESTRICTED_DICTIONARY_OK;
+}
+
+// What the key holds as a string, NULL when it is not set
+static char *copy_value(struct restricted_dictionary *r_dict,
+                        unsigned int key) {
+  unsigned int value = current_value(r_dict, key);
+  if (!value) {
+    return NULL;
+  }
+  if (value != OTHER_VALUE) {
+    return strdup(intern_string(&r_dict->values, value));
+  }
+
+  STAT_INC(r_dict, dictionary_gets);
+  return strdup(base_value(r_dict, key));
+}
+
+// Records what key holds before a set replaces it
+static int undo_value(struct restricted_dictionary *r_dict, unsigned int key) {
+  if (!r_dict->in_transaction) {
+    return 0;
+  }
+
+  if (undo_reserve(r_dict, 1) == -1) {
+    return -1;
+  }
+
+  char *old = copy_value(r_dict, key);
+  if (current_value(r_dict, key) && !old) {
+    error_callback("%s: strdup() failed\n", __func__);
+    return -1;
+  }
+
+  r_dict->undo[r_dict->num_undo++] =
+      (struct undo_entry){UNDO_VALUE, key, 0, 0, 0, old, NULL};
+
+  return 0;
+}
+
+// Forgets the last entry, for a change that failed after all
+static void undo_drop(struct restricted_dictionary *r_dict) {
+  if (r_dict->in_transaction) {
+    r_dict->num_undo--;
+    free(r_dict->undo[r_dict->num_undo].old);
+    free(r_dict->undo[r_dict->num_undo].masters);
+  }
+}
+
+// Removes the group that was added or puts back the one that was removed
+static int undo_apply_group(struct restricted_dictionary *r_dict,
+                            const struct undo_entry *entry) {
+  struct pair_table *table = &r_dict->pairs;
+  unsigned int num = entry->master_key;
+  unsigned int *ids = malloc((num + 1) * sizeof(unsigned int));
+  if (!ids) {
+    return -1;
+  }
+
+  unsigned int found = 0;
+  for (; found <= num; found++) {
+    unsigned int key = found ? entry->masters[2 * found - 2] : entry->key;
+    unsigned int value =
+        found ? entry->masters[2 * found - 1] : entry->value;
+    ids[found] = entry->type == UNDO_GROUP_LINK
+                     ? pair_find(table, key, value)
+                     : pair_get(r_dict, key, value);
+    if (!ids[found]) {
+      break;
+    }
+  }
+
+  int ret = -1;
+  unsigned int group = found > num && entry->type == UNDO_GROUP_LINK
+                           ? find_group(table, ids[0], ids + 1, num)
+                           : 0;
+  if (group) {
+    unlink_group(table, group);
+    ret = 0;
+  } else if (entry->type == UNDO_GROUP_LINK) {
+    ret = -1;
+  } else if (found > num) {
+    ret = link_group(table, ids[0], ids + 1, num);
+  }
+
+  // what linking the group again did not take
+  for (unsigned int i = 0; entry->type == UNDO_GROUP_UNLINK && i < found;
+       i++) {
+    pair_put(table, ids[i]);
+  }
+  free(ids);
+
+  return ret;
+}
+
+static int undo_apply(struct restricted_dictionary *r_dict,
+                      const struct undo_entry *entry) {
+  struct pair_table *table = &r_dict->pairs;
+
+  if (entry->type == UNDO_GROUP_LINK || entry->type == UNDO_GROUP_UNLINK) {
+    return undo_apply_group(r_dict, entry);
+  }
+
+  // the timer was never stopped
+  if (entry->type == UNDO_TIMER) {
+    return 0;
+  }
+
+  // the patterns of the entry are kept until the undo log is cleared
+  if (entry->type == UNDO_PATTERN_LINK) {
+    unlink_pattern(r_dict, entry->key,
+                   find_edge(&r_dict->patterns.patterns[entry->key].masters,
+                             entry->value));
+    return 0;
+  }
+  if (entry->type == UNDO_PATTERN_UNLINK) {
+    return link_pattern(r_dict, entry->key, entry->value) == -1 ? -1 : 0;
+  }
+
+  if (entry->type == UNDO_VALUE) {
+    const char *key = intern_string(&r_dict->keys, entry->key);
+    if (!entry->old) {
+      dictionary_unset(r_dict->base, key);
+      set_current(r_dict, entry->key, 0);
+      return 0;
+    }
+    if (dictionary_set(r_dict->base, key, entry->old) == -1) {
+      return -1;
+    }
+    unsigned int value_id =
+        intern_find(&r_dict->values, entry->old, strlen(entry->old));
+    set_current(r_dict, entry->key, value_id ? value_id : OTHER_VALUE);
+    return 0;
+  }
+
+  if (entry->type == UNDO_LINK) {
+    unsigned int slave_id = pair_find(table, entry->key, entry->value);
+    unsigned int master_id =
+        pair_find(table, entry->master_key, entry->master_value);
+    if (unlink_rule(r_dict, slave_id,
+                    find_edge(&pair_node(table, slave_id)->masters,
+                              master_id)) == -1) {
+      return -1;
+    }
+    pair_put(table, master_id);
+    pair_put(table, slave_id);
+    return 0;
+  }
+
+  unsigned int slave_id = pair_get(r_dict, entry->key, entry->value);
+  unsigned int master_id =
+      slave_id ? pair_get(r_dict, entry->master_key, entry->master_value) : 0;
+  if (!master_id || link_rule(r_dict, slave_id, master_id) == -1) {
+    if (master_id) {
+      pair_put(table, master_id);
+    }
+    if (slave_id) {
+      pair_put(table, slave_id);
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+int restricted_dictionary_begin(struct restricted_dictionary *r_dict) {
+  if (!r_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->in_transaction) {
+    error_callback("%s: a transaction is already open\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  r_dict->in_transaction = 1;
+
+  return RESTRICTED_DICTIONARY_OK;
+}
+
+int restricted_dictionary_commit(struct restricted_dictionary *r_dict) {
+  if (!r_dict || !r_dict->in_transaction) {
+    error_callback("%s: no transaction is open\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // timers of rules the transaction unlinked or kept for good, a rule may
+  // have named its timer more than once
+  for (unsigned int i = 0; i < r_dict->num_undo; i++) {
+    unsigned int id = r_dict->undo[i].key;
+    if (r_dict->undo[i].type == UNDO_TIMER &&
+        r_dict->wheel.timers[id].slave_key) {
+      timer_stop(&r_dict->wheel, id);
+    }
+  }
+  undo_clear(r_dict);
+  pattern_sweep(r_dict);
+
+  return RESTRICTED_DICTIONARY_OK;
+}
+
+int restricted_dictionary_rollback(struct restricted_dictionary *r_dict) {
+  if (!r_dict || !r_dict->in_transaction) {
+    error_callback("%s: no transaction is open\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // undoing is not itself logged. Putting back a removed rule, or in a fork
+  // removing one, may need memory, the other entries are undone all the same
+  // when it is short.
+  r_dict->in_transaction = 0;
+  int ret = RESTRICTED_DICTIONARY_OK;
+  for (unsigned int i = r_dict->num_undo; i-- > 0;) {
+    if (undo_apply(r_dict, &r_dict->undo[i]) == -1) {
+      error_callback("%s: undo_apply(%u) failed\n", __func__, i);
+      ret = RESTRICTED_DICTIONARY_ENOMEM;
+    }
+  }
+  undo_clear(r_dict);
+  pattern_sweep(r_dict);
+
+  return ret;
+}
+
+int restricted_dictionary_set(struct restricted_dictionary *r_dict,
+                              const char *key, const char *val) {
+  if (!r_dict || !key || !val) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int slave_id = 0;
+  unsigned int master_id = 0;
+  if (blocks_set(r_dict, key, val, &slave_id, &master_id)) {
+    return refuse(r_dict, __func__, 0, slave_id, master_id);
+  }
+  if (pattern_blocks_set(r_dict, key, val, &slave_id, &master_id)) {
+    return refuse_pattern(r_dict, __func__, 0, slave_id, master_id);
+  }
+
+  unsigned int key_id = intern_key(r_dict, key, strlen(key));
+  if (!key_id) {
+    error_callback("%s: intern_key() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  if (undo_value(r_dict, key_id) == -1) {
+    error_callback("%s: undo_value() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  if (dictionary_set(r_dict->base, key, val) == -1) {
+    error_callback("%s: dictionary_set() failed\n", __func__);
+    undo_drop(r_dict);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  unsigned int value_id = intern_find(&r_dict->values, val, strlen(val));
+  set_current(r_dict, key_id, value_id ? value_id : OTHER_VALUE);
+
+  return 0;
+}
+
+static int in_batch(const struct restricted_dictionary *r_dict,
+                    unsigned int key) {
+  if (r_dict->parent) {
+    return id_map_find(&r_dict->own_batch, key, NULL);
+  }
+
+  return r_dict->batch_stamp[key] == r_dict->stamp;
+}
+
+// Value the key will hold once the batch under validation is applied
+static unsigned int batch_value(const struct restricted_dictionary *r_dict,
+                                unsigned int key) {
+  unsigned int value;
+  if (r_dict->parent) {
+    return id_map_find(&r_dict->own_batch, key, &value)
+               ? value
+               : current_value(r_dict, key);
+  }
+
+  return r_dict->batch_stamp[key] == r_dict->stamp ? r_dict->batch_value[key]
+                                                   : r_dict->current[key];
+}
+
+static void batch_put(struct restricted_dictionary *r_dict, unsigned int key,
+                      unsigned int value) {
+  if (r_dict->parent) {
+    id_map_put(&r_dict->own_batch, key, value);
+    return;
+  }
+
+  r_dict->batch_stamp[key] = r_dict->stamp;
+  r_dict->batch_value[key] = value;
+}
+
+// Checks a batch against the rules as if all of it were already applied.
+// Returns 0 or the error of the first offending entry, whose index is put in
+// the conflict.
+static int validate_batch(struct restricted_dictionary *r_dict,
+                          const char **keys, const char **vals,
+                          unsigned int *key_ids, unsigned int num,
+                          struct restricted_dictionary_conflict *conflict) {
+  // a fork also makes room for every key of the batch it may set
+  if (r_dict->parent) {
+    id_map_clear(&r_dict->own_batch);
+    if (id_map_reserve(&r_dict->own_batch, num) == -1 ||
+        id_map_reserve(&r_dict->own_current, num) == -1) {
+      fill_conflict(r_dict, conflict, 0, 0, 0);
+      return RESTRICTED_DICTIONARY_ENOMEM;
+    }
+  } else if (++r_dict->stamp == 0) {
+    memset(r_dict->batch_stamp, 0, r_dict->max_current * sizeof(unsigned int));
+    r_dict->stamp = 1;
+  }
+
+  for (unsigned int i = 0; i < num; i++) {
+    if (!keys[i] || !vals[i]) {
+      error_callback("%s: invalid entry at index %u\n", __func__, i);
+      fill_conflict(r_dict, conflict, i, 0, 0);
+      return RESTRICTED_DICTIONARY_EINVAL;
+    }
+
+    key_ids[i] = intern_key(r_dict, keys[i], strlen(keys[i]));
+    if (!key_ids[i]) {
+      error_callback("%s: intern_key() failed at index %u\n", __func__, i);
+      fill_conflict(r_dict, conflict, i, 0, 0);
+      return RESTRICTED_DICTIONARY_ENOMEM;
+    }
+
+    if (in_batch(r_dict, key_ids[i])) {
+      error_callback("%s: key=%s appears twice in the batch, at index %u\n",
+                     __func__, keys[i], i);
+      fill_conflict(r_dict, conflict, i, 0, 0);
+      return RESTRICTED_DICTIONARY_EINVAL;
+    }
+
+    unsigned int value_id =
+        intern_find(&r_dict->values, vals[i], strlen(vals[i]));
+    batch_put(r_dict, key_ids[i], value_id ? value_id : OTHER_VALUE);
+  }
+
+  for (unsigned int i = 0; i < num; i++) {
+    unsigned int value_id = batch_value(r_dict, key_ids[i]);
+    unsigned int slave_id;
+    unsigned int master_id;
+    if (has_pattern_restriction(r_dict, keys[i], key_ids[i], value_id,
+                                key_ids, num, batch_value, &slave_id,
+                                &master_id)) {
+      fill_pattern_conflict(r_dict, conflict, i, slave_id, master_id);
+      return refuse_pattern(r_dict, __func__, i, slave_id, master_id);
+    }
+
+    if (r_dict->frozen.buckets) {
+      if (has_frozen_restriction(r_dict, key_ids[i], value_id, batch_value,
+                                 &slave_id, &master_id)) {
+        fill_conflict(r_dict, conflict, i, slave_id, master_id);
+        return refuse(r_dict, __func__, i, slave_id, master_id);
+      }
+      continue;
+    }
+
+    unsigned int pair_id =
+        value_id == OTHER_VALUE
+            ? 0
+            : pair_find(&r_dict->pairs, key_ids[i], value_id);
+    if (!pair_id) {
+      STAT_CHECK(r_dict, 0, 0);
+      continue;
+    }
+
+    const struct pair_node *node = pair_node(&r_dict->pairs, pair_id);
+    for (unsigned int j = 0; j < node->masters.num; j++) {
+      const struct rule_edge *edge = &node->masters.edges[j];
+      if (batch_value(r_dict, edge->key) == edge->value) {
+        STAT_CHECK(r_dict, j + 1, 0);
+        fill_conflict(r_dict, conflict, i, pair_id, edge->pair);
+        return refuse(r_dict, __func__, i, pair_id, edge->pair);
+      }
+    }
+
+    for (unsigned int j = 0; j < node->slaves.num; j++) {
+      const struct rule_edge *edge = &node->slaves.edges[j];
+      if (edge->key != key_ids[i] &&
+          batch_value(r_dict, edge->key) == edge->value) {
+        STAT_CHECK(r_dict, node->masters.num, j + 1);
+        fill_conflict(r_dict, conflict, i, edge->pair, pair_id);
+        return refuse(r_dict, __func__, i, edge->pair, pair_id);
+      }
+    }
+
+    STAT_CHECK(r_dict, node->masters.num, node->slaves.num);
+    if (find_blocking_group(r_dict, node, batch_value, &slave_id,
+                            &master_id)) {
+      fill_conflict(r_dict, conflict, i, slave_id, master_id);
+      return refuse(r_dict, __func__, i, slave_id, master_id);
+    }
+  }
+
+  return 0;
+}
+
+int restricted_dictionary_set_many(
+    struct restricted_dictionary *r_dict, const char **keys, const char **vals,
+    unsigned int num, struct restricted_dictionary_conflict *conflict) {
+  if (!r_dict || !keys || !vals || !num) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int *key_ids = malloc(2 * num * sizeof(unsigned int));
+  if (!key_ids) {
+    error_callback("%s: malloc() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+  unsigned int *old_ids = key_ids + num;
+
+  int ret = validate_batch(r_dict, keys, vals, key_ids, num, conflict);
+  if (ret != 0) {
+    free(key_ids);
+    return ret;
+  }
+
+  // Values no rule refers to are not interned, keep a copy of those so a
+  // failed dictionary_set() can be undone
+  char **old_vals = calloc(num, sizeof(char *));
+  if (!old_vals) {
+    error_callback("%s: calloc() failed\n", __func__);
+    free(key_ids);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  unsigned int applied = 0;
+
+  // inside a transaction every old value is kept for the undo log
+  if (undo_reserve(r_dict, num) == -1) {
+    fill_conflict(r_dict, conflict, 0, 0, 0);
+    ret = RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  for (unsigned int i = 0; ret == 0 && i < num; i++) {
+    old_ids[i] = current_value(r_dict, key_ids[i]);
+    if (old_ids[i] == OTHER_VALUE ||
+        (old_ids[i] && r_dict->in_transaction)) {
+      old_vals[i] = copy_value(r_dict, key_ids[i]);
+      if (!old_vals[i]) {
+        error_callback("%s: strdup() failed\n", __func__);
+        fill_conflict(r_dict, conflict, i, 0, 0);
+        ret = RESTRICTED_DICTIONARY_ENOMEM;
+        break;
+      }
+    }
+  }
+
+  for (; ret == 0 && applied < num; applied++) {
+    if (dictionary_set(r_dict->base, keys[applied], vals[applied]) == -1) {
+      error_callback("%s: dictionary_set() failed at index %u\n", __func__,
+                     applied);
+      fill_conflict(r_dict, conflict, applied, 0, 0);
+      ret = RESTRICTED_DICTIONARY_ENOMEM;
+      break;
+    }
+    set_current(r_dict, key_ids[applied],
+                batch_value(r_dict, key_ids[applied]));
+  }
+
+  // roll back what was applied before the failure
+  for (unsigned int i = 0; ret != 0 && i < applied; i++) {
+    if (!old_ids[i]) {
+      dictionary_unset(r_dict->base, keys[i]);
+    } else {
+      dictionary_set(r_dict->base, keys[i],
+                     old_ids[i] == OTHER_VALUE
+                         ? old_vals[i]
+                         : intern_string(&r_dict->values, old_ids[i]));
+    }
+    set_current(r_dict, key_ids[i], old_ids[i]);
+  }
+
+  for (unsigned int i = 0; ret == 0 && r_dict->in_transaction && i < num;
+       i++) {
+    r_dict->undo[r_dict->num_undo++] = (struct undo_entry){
+        UNDO_VALUE, key_ids[i], 0, 0, 0, old_vals[i], NULL};
+    old_vals[i] = NULL;
+  }
+
+  for (unsigned int i = 0; i < num; i++) {
+    free(old_vals[i]);
+  }
+  free(old_vals);
+  free(key_ids);
+
+  return ret;
+}
+
+int restricted_dictionary_can_set(
+    const struct restricted_dictionary *r_dict, const char *key,
+    const char *val, struct restricted_dictionary_conflict *conflict) {
+  if (!r_dict || !key || !val) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int slave_id = 0;
+  unsigned int master_id = 0;
+  if (blocks_set(r_dict, key, val, &slave_id, &master_id)) {
+    fill_conflict(r_dict, conflict, 0, slave_id, master_id);
+    return 0;
+  }
+  if (pattern_blocks_set(r_dict, key, val, &slave_id, &master_id)) {
+    fill_pattern_conflict(r_dict, conflict, 0, slave_id, master_id);
+    return 0;
+  }
+
+  return 1;
+}
+
+int restricted_dictionary_can_set_many(
+    const struct restricted_dictionary *r_dict, const char *key,
+    const char **vals, unsigned int num, int *allowed,
+    struct restricted_dictionary_conflict *conflicts) {
+  if (!r_dict || !key || !vals || !allowed) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // the key is resolved once for all candidates, a key no rule refers to
+  // leaves every candidate free
+  unsigned int key_id = intern_find(&r_dict->keys, key, strlen(key));
+  int num_allowed = 0;
+
+  for (unsigned int i = 0; i < num; i++) {
+    unsigned int value_id =
+        key_id && vals[i]
+            ? intern_find(&r_dict->values, vals[i], strlen(vals[i]))
+            : 0;
+    unsigned int slave_id = 0;
+    unsigned int master_id = 0;
+
+    if (r_dict->frozen.buckets) {
+      allowed[i] = vals[i] && !has_frozen_restriction(r_dict, key_id, value_id,
+                                                      current_value, &slave_id,
+                                                      &master_id);
+    } else {
+      unsigned int pair_id =
+          value_id ? pair_find(&r_dict->pairs, key_id, value_id) : 0;
+      allowed[i] = vals[i] && !has_restriction(r_dict, pair_id, &slave_id,
+                                               &master_id);
+    }
+    if (allowed[i] &&
+        pattern_blocks_set(r_dict, key, vals[i], &slave_id, &master_id)) {
+      allowed[i] = 0;
+      if (conflicts) {
+        fill_pattern_conflict(r_dict, &conflicts[i], i, slave_id, master_id);
+      }
+    } else if (conflicts) {
+      fill_conflict(r_dict, &conflicts[i], i, slave_id, master_id);
+    }
+    num_allowed += allowed[i];
+  }
+
+  return num_allowed;
+}
+
+int restricted_dictionary_split_pair(const char *str, size_t len,
+                                     struct restricted_pair *pair) {
+  const char *equal_sign = memchr(str, '=', len);
+  if (!equal_sign || equal_sign == str || equal_sign == str + len - 1) {
+    return -1;
+  }
+
+  pair->key = str;
+  pair->key_len = equal_sign - str;
+  pair->value = equal_sign + 1;
+  pair->value_len = str + len - equal_sign - 1;
+
+  return 0;
+}
+
+static int is_valid_pair_n(const struct restricted_pair *pair) {
+  return pair && pair->key && pair->value && pair->key_len > 0 &&
+         pair->value_len > 0;
+}
+
+// Points pair at the two halves of an 'A=B' string, nothing is copied.
+// The caller reports a malformed string.
+static int split_pair(const char *str, struct restricted_pair *pair) {
+  return restricted_dictionary_split_pair(str, strlen(str), pair);
+}
+
+// Interns both halves of a pair and returns its pair id, 0 on failure
+static unsigned int get_pair(struct restricted_dictionary *r_dict,
+                             const struct restricted_pair *pair) {
+  unsigned int key_id = intern_key(r_dict, pair->key, pair->key_len);
+  if (!key_id) {
+    return 0;
+  }
+
+  unsigned int value_id =
+      intern_get(&r_dict->values, pair->value, pair->value_len);
+  if (!value_id) {
+    return 0;
+  }
+
+  return pair_get(r_dict, key_id, value_id);
+}
+
+static unsigned int find_pair_n(const struct restricted_dictionary *r_dict,
+                                const struct restricted_pair *pair) {
+  unsigned int key_id = intern_find(&r_dict->keys, pair->key, pair->key_len);
+  if (!key_id) {
+    return 0;
+  }
+
+  unsigned int value_id =
+      intern_find(&r_dict->values, pair->value, pair->value_len);
+  if (!value_id) {
+    return 0;
+  }
+
+  return pair_find(&r_dict->pairs, key_id, value_id);
+}
+
+static int add_restriction(struct restricted_dictionary *r_dict,
+                           unsigned int slave_id,
+                           const struct restricted_pair *master_pair) {
+  // the link and the timer of a rule restricted without a TTL
+  if (undo_reserve(r_dict, 2) == -1) {
+    return -1;
+  }
+
+  unsigned int master_id = get_pair(r_dict, master_pair);
+  if (!master_id) {
+    error_callback("%s: get_pair(master) failed\n", __func__);
+    return -1;
+  }
+
+  if (link_rule(r_dict, slave_id, master_id) == -1) {
+    error_callback("%s: link_rule() failed\n", __func__);
+    pair_put(&r_dict->pairs, master_id);
+    return -1;
+  }
+
+  timer_drop(r_dict, slave_id, master_id);
+
+  return 0;
+}
+
+int restricted_dictionary_restrict_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pair) {
+  if (!r_dict || !is_valid_pair_n(slave_pair) ||
+      !is_valid_pair_n(master_pair)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int slave_id = get_pair(r_dict, slave_pair);
+  if (!slave_id) {
+    error_callback("%s: get_pair(slave) failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  if (add_restriction(r_dict, slave_id, master_pair) == -1) {
+    error_callback("%s: add_restriction() failed\n", __func__);
+    pair_put(&r_dict->pairs, slave_id);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  return 0;
+}
+
+int restricted_dictionary_restrict(struct restricted_dictionary *r_dict,
+                                   char *slave_pair, char *master_pair) {
+  if (!r_dict || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct restricted_pair slave;
+  struct restricted_pair master;
+  if (split_pair(slave_pair, &slave) == -1 ||
+      split_pair(master_pair, &master) == -1) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return restricted_dictionary_restrict_pair(r_dict, &slave, &master);
+}
+
+int restricted_dictionary_restrict_ttl_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pair, unsigned int ttl) {
+  if (!r_dict || !is_valid_pair_n(slave_pair) ||
+      !is_valid_pair_n(master_pair) || !ttl) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // a fork never ticks, and a rollback could not take the timer back
+  if (r_dict->parent) {
+    error_callback("%s: cannot set a TTL in a fork\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->in_transaction) {
+    error_callback("%s: a transaction is open\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (timer_reserve(&r_dict->wheel) == -1) {
+    error_callback("%s: timer_reserve() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  int ret = restricted_dictionary_restrict_pair(r_dict, slave_pair,
+                                                master_pair);
+  if (ret != 0) {
+    return ret;
+  }
+
+  struct pair_table *table = &r_dict->pairs;
+  timer_start(&r_dict->wheel, pair_node(table, find_pair_n(r_dict, slave_pair)),
+              pair_node(table, find_pair_n(r_dict, master_pair)), ttl);
+
+  return 0;
+}
+
+int restricted_dictionary_restrict_ttl(struct restricted_dictionary *r_dict,
+                                       char *slave_pair, char *master_pair,
+                                       unsigned int ttl) {
+  if (!r_dict || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct restricted_pair slave;
+  struct restricted_pair master;
+  if (split_pair(slave_pair, &slave) == -1 ||
+      split_pair(master_pair, &master) == -1) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return restricted_dictionary_restrict_ttl_pair(r_dict, &slave, &master, ttl);
+}
+
+int restricted_dictionary_tick(struct restricted_dictionary *r_dict,
+                               unsigned int ticks) {
+  if (!r_dict) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->parent) {
+    error_callback("%s: cannot tick a fork\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->in_transaction) {
+    error_callback("%s: a transaction is open\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // each tick expires one slot of the first level, the levels above only
+  // move their timers down once per slot they span
+  struct timer_wheel *wheel = &r_dict->wheel;
+  int expired = 0;
+  for (; ticks && wheel->num_timers; ticks--) {
+    wheel->now++;
+    unsigned int index = wheel->now & ((1u << TIMER_ROOT_BITS) - 1);
+    if (!index) {
+      timer_cascade(wheel);
+    }
+
+    unsigned int id;
+    while ((id = wheel->slots[index])) {
+      expired += timer_expire(r_dict, id);
+    }
+  }
+  wheel->now += ticks;
+
+  // the frozen copy still holds the rules that ran out
+  if (expired && r_dict->frozen.buckets) {
+    struct frozen_rules frozen;
+    if (frozen_build(r_dict, &frozen) == -1) {
+      // checks go back to the rules themselves, which are right
+      error_callback("%s: frozen_build() failed\n", __func__);
+      frozen_release(&r_dict->frozen);
+      return RESTRICTED_DICTIONARY_ENOMEM;
+    }
+    frozen_release(&r_dict->frozen);
+    r_dict->frozen = frozen;
+  }
+
+  return expired;
+}
+
+int restricted_dictionary_multiRestrict_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pairs, unsigned int num_masters) {
+  if (!r_dict || !is_valid_pair_n(slave_pair) || !master_pairs ||
+      num_masters <= 0) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int slave_id = get_pair(r_dict, slave_pair);
+  if (!slave_id) {
+    error_callback("%s: get_pair(slave) failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  int ret = 0;
+
+  for (unsigned i = 0; i < num_masters; i++) {
+    if (!is_valid_pair_n(&master_pairs[i])) {
+      error_callback("%s: invalid master pair at index %d\n", __func__, i);
+      ret = RESTRICTED_DICTIONARY_EINVAL;
+      continue;
+    }
+
+    if (add_restriction(r_dict, slave_id, &master_pairs[i]) != 0) {
+      error_callback("%s: add_restriction(%d) failed, keep adding next one\n",
+                     __func__, i);
+      ret = RESTRICTED_DICTIONARY_ENOMEM;
+    }
+  }
+
+  pair_put(&r_dict->pairs, slave_id);
+
+  return ret;
+}
+
+int restricted_dictionary_multiRestrict(struct restricted_dictionary *r_dict,
+                                        char *slave_pair, char **master_pairs,
+                                        unsigned int num_masters) {
+  if (!r_dict || !slave_pair || !master_pairs || num_masters <= 0) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct restricted_pair slave;
+  if (split_pair(slave_pair, &slave) == -1) {
+    error_callback("%s: invalid slave pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int slave_id = get_pair(r_dict, &slave);
+  if (!slave_id) {
+    error_callback("%s: get_pair(slave) failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  int ret = 0;
+
+  for (unsigned i = 0; i < num_masters; i++) {
+    struct restricted_pair master;
+    if (split_pair(master_pairs[i], &master) == -1) {
+      error_callback(
+          "%s: invalid master pair format at index %d, expected 'A=B'\n",
+          __func__, i);
+      ret = RESTRICTED_DICTIONARY_EINVAL;
+      continue;
+    }
+
+    if (add_restriction(r_dict, slave_id, &master) != 0) {
+      error_callback("%s: add_restriction(%s) failed, keep adding next one\n",
+                     __func__, master_pairs[i]);
+      ret = RESTRICTED_DICTIONARY_ENOMEM;
+    }
+  }
+
+  pair_put(&r_dict->pairs, slave_id);
+
+  return ret;
+}
+
+int restricted_dictionary_unrestrict_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pair) {
+  if (!r_dict || !is_valid_pair_n(slave_pair) ||
+      !is_valid_pair_n(master_pair)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct pair_table *table = &r_dict->pairs;
+  unsigned int slave_id = find_pair_n(r_dict, slave_pair);
+  if (!slave_id || !pair_node(table, slave_id)->masters.num) {
+    if (diag_report(r_dict)) {
+      error_callback("%s: slave pair not found\n", __func__);
+    }
+    return RESTRICTED_DICTIONARY_ENOTFOUND;
+  }
+
+  unsigned int master_id = find_pair_n(r_dict, master_pair);
+  unsigned int pos =
+      master_id ? find_edge(&pair_node(table, slave_id)->masters, master_id)
+                : UINT_MAX;
+  if (pos == UINT_MAX) {
+    if (diag_report(r_dict)) {
+      error_callback("%s: master pair not found\n", __func__);
+    }
+    return RESTRICTED_DICTIONARY_ENOTFOUND;
+  }
+
+  if (undo_reserve(r_dict, 2) == -1) {
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+  timer_drop(r_dict, slave_id, master_id);
+  if (unlink_rule(r_dict, slave_id, pos) == -1) {
+    error_callback("%s: unlink_rule() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  pair_put(table, master_id);
+  pair_put(table, slave_id);
+
+  return 0;
+}
+
+int restricted_dictionary_unrestrict(struct restricted_dictionary *r_dict,
+                                     char *slave_pair, char *master_pair) {
+  if (!r_dict || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct restricted_pair slave;
+  struct restricted_pair master;
+  if (split_pair(slave_pair, &slave) == -1 ||
+      split_pair(master_pair, &master) == -1) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return restricted_dictionary_unrestrict_pair(r_dict, &slave, &master);
+}
+
+int restricted_dictionary_unrestrict_all_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair) {
+  if (!r_dict || !is_valid_pair_n(slave_pair)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct pair_table *table = &r_dict->pairs;
+  unsigned int slave_id = find_pair_n(r_dict, slave_pair);
+  if (!slave_id || !pair_node(table, slave_id)->masters.num) {
+    if (diag_report(r_dict)) {
+      error_callback("%s: slave pair not found\n", __func__);
+    }
+    return RESTRICTED_DICTIONARY_ENOTFOUND;
+  }
+
+  // removing the last edge never moves another one on the slave side. The
+  // node is looked up again each time since a fork copies it on the first.
+  const struct edge_array *masters = &pair_node(table, slave_id)->masters;
+  if (undo_reserve(r_dict, 2 * masters->num) == -1) {
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+  int ret = 0;
+  while (!ret && (masters = &pair_node(table, slave_id)->masters)->num) {
+    unsigned int master_id = masters->edges[masters->num - 1].pair;
+    timer_drop(r_dict, slave_id, master_id);
+    if (unlink_rule(r_dict, slave_id, masters->num - 1) == -1) {
+      error_callback("%s: unlink_rule() failed\n", __func__);
+      ret = RESTRICTED_DICTIONARY_ENOMEM;
+    }
+    pair_put(table, master_id);
+  }
+
+  pair_put(table, slave_id);
+
+  return ret;
+}
+
+int restricted_dictionary_unrestrict_all(struct restricted_dictionary *r_dict,
+                                         char *slave_pair) {
+  if (!r_dict || !slave_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct restricted_pair slave;
+  if (split_pair(slave_pair, &slave) == -1) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return restricted_dictionary_unrestrict_all_pair(r_dict, &slave);
+}
+
+int restricted_dictionary_unrestrict_master_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *master_pair) {
+  if (!r_dict || !is_valid_pair_n(master_pair)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct pair_table *table = &r_dict->pairs;
+  unsigned int master_id = find_pair_n(r_dict, master_pair);
+  if (!master_id || !pair_node(table, master_id)->slaves.num) {
+    if (diag_report(r_dict)) {
+      error_callback("%s: master pair not found\n", __func__);
+    }
+    return RESTRICTED_DICTIONARY_ENOTFOUND;
+  }
+
+  const struct edge_array *slaves = &pair_node(table, master_id)->slaves;
+  if (undo_reserve(r_dict, 2 * slaves->num) == -1) {
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+  int ret = 0;
+  while (!ret && (slaves = &pair_node(table, master_id)->slaves)->num) {
+    struct rule_edge edge = slaves->edges[slaves->num - 1];
+    timer_drop(r_dict, edge.pair, master_id);
+    // a fork does not keep peer positions up to date
+    unsigned int pos =
+        table->parent
+            ? find_edge(&pair_node(table, edge.pair)->masters, master_id)
+            : edge.peer;
+    if (unlink_rule(r_dict, edge.pair, pos) == -1) {
+      error_callback("%s: unlink_rule() failed\n", __func__);
+      ret = RESTRICTED_DICTIONARY_ENOMEM;
+    }
+    pair_put(table, edge.pair);
+  }
+
+  pair_put(table, master_id);
+
+  return ret;
+}
+
+int restricted_dictionary_unrestrict_master(
+    struct restricted_dictionary *r_dict, char *master_pair) {
+  if (!r_dict || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct restricted_pair master;
+  if (split_pair(master_pair, &master) == -1) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return restricted_dictionary_unrestrict_master_pair(r_dict, &master);
+}
+
+// Checks the pairs of a group and that no two of them are on the same key,
+// which could never all be present
+static int is_valid_group(const struct restricted_pair *slave_pair,
+                          const struct restricted_pair *master_pairs,
+                          unsigned int num_masters) {
+  if (!is_valid_pair_n(slave_pair) || !master_pairs || !num_masters) {
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < num_masters; i++) {
+    if (!is_valid_pair_n(&master_pairs[i])) {
+      return 0;
+    }
+    for (unsigned int j = 0; j <= i; j++) {
+      const struct restricted_pair *other =
+          j < i ? &master_pairs[j] : slave_pair;
+      if (other->key_len == master_pairs[i].key_len &&
+          memcmp(other->key, master_pairs[i].key, other->key_len) == 0) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+int restricted_dictionary_restrict_group_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pairs, unsigned int num_masters) {
+  if (!r_dict || !is_valid_group(slave_pair, master_pairs, num_masters)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->parent) {
+    error_callback("%s: cannot change the rule groups of a fork\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int *ids = malloc((num_masters + 1) * sizeof(unsigned int));
+  if (!ids) {
+    error_callback("%s: malloc() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  unsigned int found = 0;
+  for (; found <= num_masters; found++) {
+    ids[found] =
+        get_pair(r_dict, found ? &master_pairs[found - 1] : slave_pair);
+    if (!ids[found]) {
+      break;
+    }
+  }
+
+  int ret = 0;
+  if (found <= num_masters) {
+    error_callback("%s: get_pair() failed\n", __func__);
+    ret = RESTRICTED_DICTIONARY_ENOMEM;
+  } else if (!find_group(&r_dict->pairs, ids[0], ids + 1, num_masters)) {
+    if (undo_group(r_dict, UNDO_GROUP_LINK, ids[0], ids + 1, num_masters) ==
+        -1) {
+      ret = RESTRICTED_DICTIONARY_ENOMEM;
+    } else if (link_group(&r_dict->pairs, ids[0], ids + 1, num_masters) ==
+               -1) {
+      error_callback("%s: link_group() failed\n", __func__);
+      undo_drop(r_dict);
+      ret = RESTRICTED_DICTIONARY_ENOMEM;
+    }
+  }
+
+  for (unsigned int i = 0; i < found; i++) {
+    pair_put(&r_dict->pairs, ids[i]);
+  }
+  free(ids);
+
+  return ret;
+}
+
+int restricted_dictionary_unrestrict_group_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pairs, unsigned int num_masters) {
+  if (!r_dict || !is_valid_group(slave_pair, master_pairs, num_masters)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->parent) {
+    error_callback("%s: cannot change the rule groups of a fork\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int *ids = malloc((num_masters + 1) * sizeof(unsigned int));
+  if (!ids) {
+    error_callback("%s: malloc() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  unsigned int group = 1;
+  for (unsigned int i = 0; group && i <= num_masters; i++) {
+    ids[i] = find_pair_n(r_dict, i ? &master_pairs[i - 1] : slave_pair);
+    group = ids[i];
+  }
+  if (group) {
+    group = find_group(&r_dict->pairs, ids[0], ids + 1, num_masters);
+  }
+
+  int ret = 0;
+  if (!group) {
+    if (diag_report(r_dict)) {
+      error_callback("%s: group not found\n", __func__);
+    }
+    ret = RESTRICTED_DICTIONARY_ENOTFOUND;
+  } else if (undo_group(r_dict, UNDO_GROUP_UNLINK, ids[0], ids + 1,
+                        num_masters) == -1) {
+    ret = RESTRICTED_DICTIONARY_ENOMEM;
+  } else {
+    unlink_group(&r_dict->pairs, group);
+  }
+  free(ids);
+
+  return ret;
+}
+
+// Splits the pairs of a group given as 'A=B' strings, the masters are
+// allocated
+static int split_group(const char *func, char *slave_pair,
+                       char **master_pairs, unsigned int num_masters,
+                       struct restricted_pair *slave,
+                       struct restricted_pair **masters) {
+  if (!slave_pair || !master_pairs || !num_masters) {
+    error_callback("%s: invalid input\n", func);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (split_pair(slave_pair, slave) == -1) {
+    error_callback("%s: invalid slave pair format, expected 'A=B'\n", func);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  *masters = malloc(num_masters * sizeof(struct restricted_pair));
+  if (!*masters) {
+    error_callback("%s: malloc() failed\n", func);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  for (unsigned int i = 0; i < num_masters; i++) {
+    if (!master_pairs[i] ||
+        split_pair(master_pairs[i], &(*masters)[i]) == -1) {
+      error_callback(
+          "%s: invalid master pair format at index %d, expected 'A=B'\n",
+          func, i);
+      free(*masters);
+      return RESTRICTED_DICTIONARY_EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+int restricted_dictionary_restrict_group(struct restricted_dictionary *r_dict,
+                                         char *slave_pair,
+                                         char **master_pairs,
+                                         unsigned int num_masters) {
+  struct restricted_pair slave;
+  struct restricted_pair *masters;
+  int ret = split_group(__func__, slave_pair, master_pairs, num_masters,
+                        &slave, &masters);
+  if (ret != 0) {
+    return ret;
+  }
+
+  ret = restricted_dictionary_restrict_group_pairs(r_dict, &slave, masters,
+                                                   num_masters);
+  free(masters);
+
+  return ret;
+}
+
+int restricted_dictionary_unrestrict_group(
+    struct restricted_dictionary *r_dict, char *slave_pair,
+    char **master_pairs, unsigned int num_masters) {
+  struct restricted_pair slave;
+  struct restricted_pair *masters;
+  int ret = split_group(__func__, slave_pair, master_pairs, num_masters,
+                        &slave, &masters);
+  if (ret != 0) {
+    return ret;
+  }
+
+  ret = restricted_dictionary_unrestrict_group_pairs(r_dict, &slave, masters,
+                                                     num_masters);
+  free(masters);
+
+  return ret;
+}
+
+// Looks up the pattern written as pair without creating it, 0 if it does not
+// exist
+static unsigned int pattern_find(const struct restricted_dictionary *r_dict,
+                                 const struct restricted_pair *pair) {
+  const struct pattern_table *table = &r_dict->patterns;
+  if (!table->num_patterns) {
+    return 0;
+  }
+
+  int is_prefix = pair->key[pair->key_len - 1] == '*';
+  unsigned int value = 0;
+  if (pair->value_len != 1 || pair->value[0] != '*') {
+    value = intern_find(&r_dict->values, pair->value, pair->value_len);
+    if (!value) {
+      return 0;
+    }
+  }
+
+  unsigned int node = 0;
+  for (unsigned int i = 0; i < pair->key_len - is_prefix; i++) {
+    if (!(node = trie_child(table, node, pair->key[i]))) {
+      return 0;
+    }
+  }
+
+  unsigned int id =
+      is_prefix ? table->nodes[node].prefix : table->nodes[node].exact;
+  while (id && table->patterns[id].value != value) {
+    id = table->patterns[id].next;
+  }
+
+  return id;
+}
+
+int restricted_dictionary_restrict_pattern_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pattern,
+    const struct restricted_pair *master_pattern) {
+  if (!r_dict || !is_valid_pair_n(slave_pattern) ||
+      !is_valid_pair_n(master_pattern)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->parent) {
+    error_callback("%s: cannot change the patterns of a fork\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int slave_id = pattern_get(r_dict, slave_pattern);
+  unsigned int master_id = slave_id ? pattern_get(r_dict, master_pattern) : 0;
+
+  int ret = 0;
+  if (!master_id) {
+    error_callback("%s: pattern_get() failed\n", __func__);
+    ret = RESTRICTED_DICTIONARY_ENOMEM;
+  } else if (undo_reserve(r_dict, 1) == -1 ||
+             (ret = link_pattern(r_dict, slave_id, master_id)) == -1) {
+    error_callback("%s: link_pattern() failed\n", __func__);
+    ret = RESTRICTED_DICTIONARY_ENOMEM;
+  } else {
+    if (ret == 1 && r_dict->in_transaction) {
+      r_dict->undo[r_dict->num_undo++] = (struct undo_entry){
+          UNDO_PATTERN_LINK, slave_id, master_id, 0, 0, NULL, NULL};
+    }
+    ret = 0;
+  }
+
+  if (master_id) {
+    pattern_put(r_dict, master_id);
+  }
+  if (slave_id) {
+    pattern_put(r_dict, slave_id);
+  }
+
+  return ret;
+}
+
+int restricted_dictionary_unrestrict_pattern_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pattern,
+    const struct restricted_pair *master_pattern) {
+  if (!r_dict || !is_valid_pair_n(slave_pattern) ||
+      !is_valid_pair_n(master_pattern)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (r_dict->parent) {
+    error_callback("%s: cannot change the patterns of a fork\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int slave_id = pattern_find(r_dict, slave_pattern);
+  unsigned int master_id =
+      slave_id ? pattern_find(r_dict, master_pattern) : 0;
+  unsigned int pos =
+      master_id ? find_edge(&r_dict->patterns.patterns[slave_id].masters,
+                            master_id)
+                : UINT_MAX;
+  if (pos == UINT_MAX) {
+    if (diag_report(r_dict)) {
+      error_callback("%s: rule not found\n", __func__);
+    }
+    return RESTRICTED_DICTIONARY_ENOTFOUND;
+  }
+
+  if (undo_reserve(r_dict, 1) == -1) {
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+  if (r_dict->in_transaction) {
+    r_dict->undo[r_dict->num_undo++] = (struct undo_entry){
+        UNDO_PATTERN_UNLINK, slave_id, master_id, 0, 0, NULL, NULL};
+  }
+
+  unlink_pattern(r_dict, slave_id, pos);
+  pattern_put(r_dict, master_id);
+  pattern_put(r_dict, slave_id);
+
+  return 0;
+}
+
+int restricted_dictionary_restrict_pattern(
+    struct restricted_dictionary *r_dict, char *slave_pattern,
+    char *master_pattern) {
+  struct restricted_pair slave;
+  struct restricted_pair master;
+  if (!slave_pattern || !master_pattern ||
+      split_pair(slave_pattern, &slave) == -1 ||
+      split_pair(master_pattern, &master) == -1) {
+    error_callback("%s: invalid pattern format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return restricted_dictionary_restrict_pattern_pairs(r_dict, &slave,
+                                                      &master);
+}
+
+int restricted_dictionary_unrestrict_pattern(
+    struct restricted_dictionary *r_dict, char *slave_pattern,
+    char *master_pattern) {
+  struct restricted_pair slave;
+  struct restricted_pair master;
+  if (!slave_pattern || !master_pattern ||
+      split_pair(slave_pattern, &slave) == -1 ||
+      split_pair(master_pattern, &master) == -1) {
+    error_callback("%s: invalid pattern format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return restricted_dictionary_unrestrict_pattern_pairs(r_dict, &slave,
+                                                        &master);
+}
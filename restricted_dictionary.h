@@ -2,13 +2,152 @@
 #define RESTRICTED_DICTIONARY_H
 
 #include "dictionary.h"
+#include <stddef.h>
+
+// Allocate rule nodes and their strings from a per-instance arena that is
+// released as a whole by restricted_dictionary_del()
+#define RESTRICTED_DICTIONARY_ARENA 0x1
+// Keep per-pair counts of present masters and slaves up to date on every set
+// and rule change, so checking a set is a single hash probe
+#define RESTRICTED_DICTIONARY_BLOCKED_SET 0x2
+
+// Return codes of the functions below that return int, failures are negative
+#define RESTRICTED_DICTIONARY_OK 0
+#define RESTRICTED_DICTIONARY_EINVAL (-1)
+// a rule refused the set
+#define RESTRICTED_DICTIONARY_ERESTRICTED (-2)
+// the rule or pair to remove does not exist
+#define RESTRICTED_DICTIONARY_ENOTFOUND (-3)
+#define RESTRICTED_DICTIONARY_ENOMEM (-4)
+// reading, writing or syncing a file failed
+#define RESTRICTED_DICTIONARY_EIO (-5)
+// a bounded queue is full, the request may be made again later
+#define RESTRICTED_DICTIONARY_EAGAIN (-6)
+
+// How refused sets and missing rules are reported through error_callback.
+// Other failures point at a bug or at memory running out and are always
+// reported.
+#define RESTRICTED_DICTIONARY_DIAG_ALL 0
+#define RESTRICTED_DICTIONARY_DIAG_OFF 1
+// one report in every rate
+#define RESTRICTED_DICTIONARY_DIAG_SAMPLED 2
+// at most rate reports per second
+#define RESTRICTED_DICTIONARY_DIAG_RATE_LIMITED 3
 
 struct restricted_dictionary;
 
+// A key/value pair given by pointer and length, the strings need not be
+// NUL-terminated and are copied only the first time a rule refers to them
+struct restricted_pair {
+  const char *key;
+  unsigned int key_len;
+  const char *value;
+  unsigned int value_len;
+};
+
+// Points pair at the two halves of the 'A=B' string of len bytes, which need
+// not be NUL-terminated, nothing is copied. The first '=' splits it and
+// neither half may be empty. Returns 0, or -1 when str is no such pair. The
+// functions taking 'A=B' strings, here and in the modules built on top, all
+// accept what it accepts.
+int restricted_dictionary_split_pair(const char *str, size_t len,
+                                     struct restricted_pair *pair);
+
+// Why a set was or would be rejected, index is the entry of the batch. The
+// pairs are set when a rule caused the rejection and stay valid until the
+// next rule change.
+struct restricted_dictionary_conflict {
+  unsigned int index;
+  const char *slave_key;
+  const char *slave_value;
+  const char *master_key;
+  const char *master_value;
+};
+
+// Number of buckets of the scan histogram
+#define RESTRICTED_DICTIONARY_STATS_BUCKETS 16
+
+// Counters are only kept when the library is built with
+// RESTRICTED_DICTIONARY_STATS defined and read as 0 otherwise, the sizes are
+// always filled in
+struct restricted_dictionary_stats {
+  // restriction checks, one per pair looked at by a set or can_set
+  unsigned long long checks;
+  // masters of the checked pair looked at
+  unsigned long long masters_scanned;
+  // slaves of the checked pair looked at
+  unsigned long long slaves_scanned;
+  // sets refused because of a rule
+  unsigned long long rejections;
+  // lookups in the base dictionary
+  unsigned long long dictionary_gets;
+  // checks by rule edges scanned, bucket 0 counts checks that scanned none
+  // and bucket i > 0 those that scanned [2^(i-1), 2^i), the last one is open
+  unsigned long long scan_histogram[RESTRICTED_DICTIONARY_STATS_BUCKETS];
+  unsigned int num_keys;
+  unsigned int num_values;
+  // pairs taking part in a rule and rules between them
+  unsigned int num_pairs;
+  unsigned int num_rules;
+  // heap memory of the rule tables and interned strings, in bytes
+  size_t memory;
+};
+
 struct restricted_dictionary *restricted_dictionary_new(unsigned int size);
+struct restricted_dictionary *restricted_dictionary_new_ex(unsigned int size,
+                                                           unsigned int flags);
 void restricted_dictionary_del(struct restricted_dictionary *r_dict);
+
+// A dictionary that starts out holding what r_dict holds and shares it
+// instead of copying it. Changing the fork copies only the entries changed,
+// and deleting it frees only those. r_dict must not change or be deleted
+// while it has forks, they may then be made and used from several threads.
+// A fork checks sets without the counters of
+// RESTRICTED_DICTIONARY_BLOCKED_SET and cannot be saved as a snapshot.
+struct restricted_dictionary *
+restricted_dictionary_fork(const struct restricted_dictionary *r_dict);
+
+// Compiles the rules into one hashed table of pairs and one array of their
+// edges, which checks then read instead of the pair nodes, and packs the
+// interned strings into one block. The calls changing rules fail with
+// RESTRICTED_DICTIONARY_EINVAL while frozen, until
+// restricted_dictionary_thaw(). Freezing again compiles the rules anew.
+// Forks and dictionaries in a transaction cannot be frozen.
+int restricted_dictionary_freeze(struct restricted_dictionary *r_dict);
+int restricted_dictionary_thaw(struct restricted_dictionary *r_dict);
+
+int restricted_dictionary_arena_usage(
+    const struct restricted_dictionary *r_dict, size_t *used,
+    size_t *reserved);
+int restricted_dictionary_set_diagnostics(struct restricted_dictionary *r_dict,
+                                          unsigned int mode,
+                                          unsigned int rate);
+int restricted_dictionary_last_conflict(
+    const struct restricted_dictionary *r_dict,
+    struct restricted_dictionary_conflict *conflict);
+int restricted_dictionary_get_stats(const struct restricted_dictionary *r_dict,
+                                    struct restricted_dictionary_stats *stats);
 int restricted_dictionary_set(struct restricted_dictionary *r_dict,
                               const char *key, const char *val);
+int restricted_dictionary_can_set(
+    const struct restricted_dictionary *r_dict, const char *key,
+    const char *val, struct restricted_dictionary_conflict *conflict);
+int restricted_dictionary_can_set_many(
+    const struct restricted_dictionary *r_dict, const char *key,
+    const char **vals, unsigned int num, int *allowed,
+    struct restricted_dictionary_conflict *conflicts);
+int restricted_dictionary_set_many(
+    struct restricted_dictionary *r_dict, const char **keys, const char **vals,
+    unsigned int num, struct restricted_dictionary_conflict *conflict);
+
+// Changes made between begin and commit are undone together by rollback,
+// whatever they returned. Transactions do not nest. The changes are visible
+// to every user of the dictionary as they are made,
+// concurrent_restricted_dictionary.h keeps them from its readers until
+// commit.
+int restricted_dictionary_begin(struct restricted_dictionary *r_dict);
+int restricted_dictionary_commit(struct restricted_dictionary *r_dict);
+int restricted_dictionary_rollback(struct restricted_dictionary *r_dict);
 
 int restricted_dictionary_restrict(struct restricted_dictionary *r_dict,
                                    char *slave_pair, char *master_pair);
@@ -16,10 +155,94 @@ int restricted_dictionary_multiRestrict(struct restricted_dictionary *r_dict,
                                         char *slave_pair, char **master_pairs,
                                         unsigned int num_masters);
 
+// A rule removed as if by restricted_dictionary_unrestrict() once
+// restricted_dictionary_tick() has counted ttl more ticks, how long a tick
+// is is up to the caller. Restricting the rule again with a TTL starts it
+// over, restricting it without one or removing it ends the TTL. Checks never
+// look at TTLs, tick() takes the rules that ran out away and returns how
+// many, in time proportional to the ticks and those rules. Forks and
+// dictionaries in a transaction cannot set TTLs or tick. A transaction that
+// ends a TTL only cancels it on commit, a rollback keeps it running.
+// Dictionaries with TTLs pending cannot be saved as a snapshot.
+int restricted_dictionary_restrict_ttl(struct restricted_dictionary *r_dict,
+                                       char *slave_pair, char *master_pair,
+                                       unsigned int ttl);
+int restricted_dictionary_restrict_ttl_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pair, unsigned int ttl);
+int restricted_dictionary_tick(struct restricted_dictionary *r_dict,
+                               unsigned int ticks);
+
 int restricted_dictionary_unrestrict(struct restricted_dictionary *r_dict,
                                      char *slave_pair, char *master_pair);
 int restricted_dictionary_unrestrict_all(struct restricted_dictionary *r_dict,
                                          char *slave_pair);
+int restricted_dictionary_unrestrict_master(
+    struct restricted_dictionary *r_dict, char *master_pair);
+
+int restricted_dictionary_restrict_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pair);
+int restricted_dictionary_multiRestrict_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pairs, unsigned int num_masters);
+int restricted_dictionary_unrestrict_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pair);
+int restricted_dictionary_unrestrict_all_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair);
+int restricted_dictionary_unrestrict_master_pair(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *master_pair);
+
+// A rule group refuses the slave only while all of its masters are present,
+// and a master only while the slave and the other masters are, where
+// multiRestrict() refuses on any one of them. No two pairs of a group may be
+// on the same key. Adding a group that exists does nothing, removing one
+// takes the same masters in any order. Forks cannot change groups and
+// dictionaries with groups cannot be saved as a snapshot.
+int restricted_dictionary_restrict_group(struct restricted_dictionary *r_dict,
+                                         char *slave_pair,
+                                         char **master_pairs,
+                                         unsigned int num_masters);
+int restricted_dictionary_unrestrict_group(
+    struct restricted_dictionary *r_dict, char *slave_pair,
+    char **master_pairs, unsigned int num_masters);
+int restricted_dictionary_restrict_group_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pairs, unsigned int num_masters);
+int restricted_dictionary_unrestrict_group_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pair,
+    const struct restricted_pair *master_pairs, unsigned int num_masters);
 
+// Rules between patterns of pairs: 'key=*' stands for any value of the key
+// and a key ending in '*' for every key starting with what precedes it, so
+// 'feature.beta.*=*' is refused while 'tier=free' is set, and the other way
+// round. The rest of a pattern is matched as is. A set is checked against
+// the patterns matching its key in time linear in the key's length plus
+// their rules, the key a set replaces is never held against it. Forks
+// follow the patterns of their parent but cannot change them, and
+// dictionaries with patterns cannot be saved as a snapshot.
+int restricted_dictionary_restrict_pattern(
+    struct restricted_dictionary *r_dict, char *slave_pattern,
+    char *master_pattern);
+int restricted_dictionary_unrestrict_pattern(
+    struct restricted_dictionary *r_dict, char *slave_pattern,
+    char *master_pattern);
+int restricted_dictionary_restrict_pattern_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pattern,
+    const struct restricted_pair *master_pattern);
+int restricted_dictionary_unrestrict_pattern_pairs(
+    struct restricted_dictionary *r_dict,
+    const struct restricted_pair *slave_pattern,
+    const struct restricted_pair *master_pattern);
 
 #endif // RESTRICTED_DICTIONARY_H
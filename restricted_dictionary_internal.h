@@ -0,0 +1,321 @@
+#ifndef RESTRICTED_DICTIONARY_INTERNAL_H
+#define RESTRICTED_DICTIONARY_INTERNAL_H
+
+// Layout of struct restricted_dictionary, shared with the modules built on
+// top of it. Nothing here is part of the public API.
+
+#include "restricted_dictionary.h"
+#include <limits.h>
+#include <time.h>
+
+struct arena;
+
+// current[] marker for a key that holds a value no rule refers to
+#define OTHER_VALUE UINT_MAX
+
+// Number of power of two size classes of recycled edge arrays in arena mode
+#define EDGE_ORDERS 32
+
+// Open addressing map from a nonzero id to a value, used by a fork for what
+// it changed of its parent
+struct id_map {
+  unsigned int *ids;
+  unsigned int *values;
+  unsigned int num;
+  unsigned int max;
+};
+
+// Maps each distinct string to a dense id, id 0 is reserved for "none". The
+// table of a fork only holds the strings its parent lacks, from id first on,
+// at index id - first of the arrays.
+struct intern_table {
+  const struct intern_table *parent;
+  unsigned int first;
+  struct arena *arena;
+  unsigned int *buckets;
+  unsigned int num_buckets;
+  char **strings;
+  unsigned int *lengths;
+  unsigned int *hashes;
+  unsigned int num_strings;
+  unsigned int max_strings;
+  // bytes of the copies, NUL included
+  size_t string_bytes;
+  // the strings before index packed were moved into blob by a freeze, those
+  // interned since are allocated one by one
+  char *blob;
+  unsigned int packed;
+};
+
+// One end of a rule, stored in both the slave and the master pair node. The
+// other end's interned key and value are kept inline so a check never has to
+// leave the edge array.
+struct rule_edge {
+  unsigned int pair;
+  unsigned int peer;
+  unsigned int key;
+  unsigned int value;
+};
+
+struct edge_array {
+  struct rule_edge *edges;
+  unsigned int num;
+  unsigned int max;
+};
+
+// A (key, value) pair that takes part in at least one rule or rule group.
+// An edge of groups names a group in pair and the pair's position among its
+// members in peer, key and value are not used.
+struct pair_node {
+  unsigned int key;
+  unsigned int value;
+  unsigned int next;
+  struct edge_array masters;
+  struct edge_array slaves;
+  struct edge_array groups;
+  // with RESTRICTED_DICTIONARY_BLOCKED_SET, the number of masters currently
+  // in the dictionary and of slaves on other keys currently in it
+  unsigned int active_masters;
+  unsigned int active_slaves;
+};
+
+// Pairs that block a set only while all of them are present. The slave is
+// the first member and the masters follow it in the same array, each edge
+// naming its pair in pair and its position among the groups of the pair's
+// node in peer. A free group has no edges and links the next free one.
+struct rule_group {
+  struct edge_array members;
+  unsigned int next_free;
+};
+
+// Pair nodes indexed by pair id and hashed on (key id, value id). The table of
+// a fork holds copies of the nodes it changed and the nodes it added, which
+// get pair ids from next_id on. own_nodes maps their pair ids to their index
+// in nodes and ids maps back. A dropped copy maps to UINT_MAX so its parent's
+// node is not found again. A fork reads the rule groups of its parent and has
+// none of its own.
+struct pair_table {
+  const struct pair_table *parent;
+  struct id_map own_nodes;
+  unsigned int *ids;
+  unsigned int next_id;
+  struct arena *arena;
+  struct rule_edge *free_edges[EDGE_ORDERS];
+  struct pair_node *nodes;
+  unsigned int num_nodes;
+  unsigned int max_nodes;
+  unsigned int free_list;
+  unsigned int *buckets;
+  unsigned int num_buckets;
+  unsigned int num_pairs;
+  unsigned int num_rules;
+  // indexed by group id, 0 is not used
+  struct rule_group *groups;
+  unsigned int next_group;
+  unsigned int max_groups;
+  unsigned int free_groups;
+  unsigned int num_groups;
+  // bytes of the edge arrays when they come from the heap
+  size_t edge_bytes;
+  // ends of the rule that refused the last set, cleared when either node is
+  // dropped
+  unsigned int blocked_slave;
+  unsigned int blocked_master;
+};
+
+// Trie over the keys of patterns, one node per byte with node 0 as the root.
+// The children of a node are linked through sibling. exact and prefix head
+// the lists of patterns whose key ends at the node.
+struct trie_node {
+  unsigned int child;
+  unsigned int sibling;
+  unsigned int exact;
+  unsigned int prefix;
+  unsigned char byte;
+};
+
+// A slave or master of a pattern rule. It matches the keys equal to the
+// first key_len bytes of key or, with is_prefix, starting with them, when
+// they hold value or, with value 0, any value. key is the pattern as written,
+// '*' included. A free pattern has no key and links the next free one.
+struct pattern {
+  char *key;
+  unsigned int key_len;
+  unsigned int value;
+  int is_prefix;
+  unsigned int node;
+  unsigned int next;
+  struct edge_array masters;
+  struct edge_array slaves;
+};
+
+// Patterns indexed by pattern id, 0 is not used. A fork reads the patterns of
+// its parent and has none of its own.
+struct pattern_table {
+  struct trie_node *nodes;
+  unsigned int num_nodes;
+  unsigned int max_nodes;
+  struct pattern *patterns;
+  unsigned int next_pattern;
+  unsigned int max_patterns;
+  unsigned int free_patterns;
+  unsigned int num_patterns;
+  unsigned int num_rules;
+  // ends of the pattern rule that refused the last set
+  unsigned int blocked_slave;
+  unsigned int blocked_master;
+};
+
+// The rules as restricted_dictionary_freeze() compiled them, which checks
+// read instead of the pair nodes. Pairs are hashed on (key id, value id) by
+// open addressing into buckets of indexes of pairs. The masters of pairs[i]
+// are the num_masters edges from edges[pairs[i].edges] on and its slaves
+// follow them up to pairs[i + 1].edges. Entry 0 of pairs is not used and
+// the one after the last pair only ends its edges.
+struct frozen_pair {
+  unsigned int key;
+  unsigned int value;
+  unsigned int edges;
+  unsigned int num_masters;
+  // pair id of the node, which names the offending rule and holds the groups
+  unsigned int pair;
+  unsigned int has_groups;
+};
+
+struct frozen_edge {
+  unsigned int pair;
+  unsigned int key;
+  unsigned int value;
+};
+
+struct frozen_rules {
+  unsigned int *buckets;
+  unsigned int num_buckets;
+  struct frozen_pair *pairs;
+  unsigned int num_pairs;
+  struct frozen_edge *edges;
+  unsigned int num_edges;
+};
+
+// Ticks of the first level of the timer wheel, each level above has
+// TIMER_LEVEL_BITS more bits of ticks per slot, up to the whole 32 bits
+#define TIMER_ROOT_BITS 8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVELS 4
+#define TIMER_SLOTS                                                            \
+  ((1u << TIMER_ROOT_BITS) + TIMER_LEVELS * (1u << TIMER_LEVEL_BITS))
+
+// The TTL of a rule, which is named by the key and value ids of its ends
+// since its pair nodes may be dropped and allocated again before it runs
+// out. A timer is linked into the list of its wheel slot through prev and
+// next, and into the hash chain of its rule through chain. A free timer
+// has no slave key and links the next free one through next.
+struct rule_timer {
+  unsigned int slave_key;
+  unsigned int slave_value;
+  unsigned int master_key;
+  unsigned int master_value;
+  unsigned int expires;
+  unsigned int slot;
+  unsigned int prev;
+  unsigned int next;
+  unsigned int chain;
+};
+
+// Hierarchical timer wheel of the rules with a TTL, indexed by timer id
+// with 0 not used. The first level has a slot per tick for the next 256
+// ticks and each level above a slot per 64 slots of the level below, whose
+// timers move down a level when the ticks reach their slot. slots and the
+// rest are only allocated with the first TTL.
+struct timer_wheel {
+  // ticks so far
+  unsigned int now;
+  unsigned int *slots;
+  struct rule_timer *timers;
+  unsigned int next_timer;
+  unsigned int max_timers;
+  unsigned int free_timers;
+  unsigned int num_timers;
+  unsigned int *buckets;
+  unsigned int num_buckets;
+};
+
+// A change made inside a transaction, undone in reverse order by a rollback.
+// Pairs are kept as key and value ids since their nodes may be dropped and
+// allocated again in between.
+enum undo_type {
+  UNDO_VALUE,
+  UNDO_LINK,
+  UNDO_UNLINK,
+  UNDO_GROUP_LINK,
+  UNDO_GROUP_UNLINK,
+  UNDO_PATTERN_LINK,
+  UNDO_PATTERN_UNLINK,
+  UNDO_TIMER
+};
+
+struct undo_entry {
+  enum undo_type type;
+  // UNDO_PATTERN_*: the slave and master pattern ids. UNDO_TIMER: the timer
+  // id, stopped by the commit and kept by a rollback.
+  unsigned int key;
+  unsigned int value;
+  unsigned int master_key;
+  unsigned int master_value;
+  // UNDO_VALUE: what the key held, NULL when it was not set
+  char *old;
+  // UNDO_GROUP_*: key and value id of each master, master_key of them
+  unsigned int *masters;
+};
+
+struct restricted_dictionary {
+  // what a fork has not changed is read from its parent, base only holds the
+  // values it set
+  const struct restricted_dictionary *parent;
+  struct dictionary *base;
+  unsigned int flags;
+  struct arena *arena;
+  struct intern_table keys;
+  struct intern_table values;
+  // current[key id] is the value id the key holds, 0 if it is not set. A
+  // fork keeps the keys it set in own_current and those of the batch under
+  // validation in own_batch instead.
+  unsigned int *current;
+  struct id_map own_current;
+  struct id_map own_batch;
+  unsigned int max_current;
+  // values of the batch under validation, valid where batch_stamp[key id]
+  // equals stamp
+  unsigned int *batch_value;
+  unsigned int *batch_stamp;
+  unsigned int stamp;
+  struct pair_table pairs;
+  // set while the dictionary is frozen, the rules cannot change then
+  struct frozen_rules frozen;
+  // present[pattern id] is the number of keys the pattern matches now
+  struct pattern_table patterns;
+  unsigned int *present;
+  unsigned int max_present;
+  // rules that are removed once their TTL runs out
+  struct timer_wheel wheel;
+  // batch entry the last refused set was for
+  unsigned int blocked_index;
+  // reporting of refused sets and missing rules, diag_count counts reports
+  // since the last sample or within the second diag_window
+  unsigned int diag_mode;
+  unsigned int diag_rate;
+  unsigned int diag_count;
+  time_t diag_window;
+  // undo log of the open transaction
+  int in_transaction;
+  struct undo_entry *undo;
+  unsigned int num_undo;
+  unsigned int max_undo;
+  // last, so the other members are where every module expects them whether
+  // or not it was built with the define
+#ifdef RESTRICTED_DICTIONARY_STATS
+  struct restricted_dictionary_stats stats;
+#endif
+};
+
+#endif // RESTRICTED_DICTIONARY_INTERNAL_H
@@ -0,0 +1,749 @@
+#include "restricted_journal.h"
+#include "restricted_snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "RDJRNL\0"
+#define JOURNAL_VERSION 1
+// Pending bytes that end the wait for more changes early
+#define JOURNAL_MAX_BATCH (1 << 20)
+
+enum journal_op {
+  OP_SET = 1,
+  OP_RESTRICT,
+  OP_MULTIRESTRICT,
+  OP_UNRESTRICT,
+  OP_UNRESTRICT_ALL
+};
+
+// base_crc is the CRC of the snapshot the records apply to, 0 when there is
+// none. A journal whose base is not the snapshot on disk was folded into it
+// by a compaction that did not get to replace the journal.
+struct journal_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t base_crc;
+};
+
+// Followed by size bytes: the op, then its strings NUL-terminated one after
+// the other
+struct record_header {
+  uint32_t size;
+  uint32_t crc;
+};
+
+struct journal_buffer {
+  char *data;
+  size_t len;
+  size_t max;
+};
+
+struct restricted_journal {
+  struct restricted_dictionary *r_dict;
+  char *path;
+  char *snap_path;
+  char *tmp_path;
+  int fd;
+  unsigned int latency_us;
+  pthread_mutex_t lock;
+  // signaled when the pending batch is worth syncing without waiting longer
+  pthread_cond_t batch_full;
+  pthread_cond_t batch_synced;
+  // records go to pending while the syncing thread writes out writing,
+  // appended and synced count records
+  struct journal_buffer pending;
+  struct journal_buffer writing;
+  unsigned long long appended;
+  unsigned long long synced;
+  int syncing;
+  // set once a write failed, what is in memory may no longer be on disk
+  int failed;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? 0xedb88320u ^ (crc >> 1) : crc >> 1;
+    }
+    crc_table[i] = crc;
+  }
+}
+
+static uint32_t crc_update(uint32_t crc, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// CRC of a whole file, never 0 so it cannot be taken for "no snapshot"
+static int file_crc(const char *path, uint32_t *crc) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    error_callback("%s: open(%s) failed\n", __func__, path);
+    return -1;
+  }
+
+  char block[1 << 16];
+  ssize_t n;
+  *crc = 0;
+  while ((n = read(fd, block, sizeof(block))) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      error_callback("%s: read(%s) failed\n", __func__, path);
+      close(fd);
+      return -1;
+    }
+    *crc = crc_update(*crc, block, n);
+  }
+  close(fd);
+
+  if (!*crc) {
+    *crc = 1;
+  }
+
+  return 0;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+// Makes a rename in the directory of path durable
+static int sync_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash == path ? 1 : slash - path)
+                    : strdup(".");
+  if (!dir) {
+    error_callback("%s: strdup() failed\n", __func__);
+    return -1;
+  }
+
+  int fd = open(dir, O_RDONLY);
+  int ret = fd != -1 && fsync(fd) == 0 ? 0 : -1;
+  if (ret == -1) {
+    error_callback("%s: syncing %s failed\n", __func__, dir);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  free(dir);
+
+  return ret;
+}
+
+static int buffer_reserve(struct journal_buffer *buffer, size_t extra) {
+  if (buffer->len + extra <= buffer->max) {
+    return 0;
+  }
+
+  size_t max = buffer->max ? buffer->max : 4096;
+  while (max < buffer->len + extra) {
+    max *= 2;
+  }
+  char *data = realloc(buffer->data, max);
+  if (!data) {
+    error_callback("%s: realloc() failed\n", __func__);
+    return -1;
+  }
+
+  buffer->data = data;
+  buffer->max = max;
+
+  return 0;
+}
+
+// Appends a record of op on first and the num strings of more, a NULL string
+// is journaled as an empty one. Returns the record's sequence number, 0 on
+// failure.
+static unsigned long long append_record(struct restricted_journal *journal,
+                                        enum journal_op op, const char *first,
+                                        const char *const *more,
+                                        unsigned int num) {
+  size_t size = 1 + strlen(first) + 1;
+  for (unsigned int i = 0; i < num; i++) {
+    size += (more[i] ? strlen(more[i]) : 0) + 1;
+  }
+  if (size > UINT32_MAX ||
+      buffer_reserve(&journal->pending, sizeof(struct record_header) + size) ==
+          -1) {
+    error_callback("%s: buffering the record failed\n", __func__);
+    return 0;
+  }
+
+  char *payload = journal->pending.data + journal->pending.len +
+                  sizeof(struct record_header);
+  char *cursor = payload;
+  *cursor++ = op;
+  cursor = stpcpy(cursor, first) + 1;
+  for (unsigned int i = 0; i < num; i++) {
+    cursor = stpcpy(cursor, more[i] ? more[i] : "") + 1;
+  }
+
+  struct record_header header = {size, crc_update(0, payload, size)};
+  memcpy(journal->pending.data + journal->pending.len, &header,
+         sizeof(header));
+  journal->pending.len += sizeof(header) + size;
+
+  if (journal->pending.len >= JOURNAL_MAX_BATCH) {
+    pthread_cond_signal(&journal->batch_full);
+  }
+
+  return ++journal->appended;
+}
+
+// Writes out and syncs the pending batch. Called with the lock held and
+// syncing set, drops the lock while on disk so others can keep appending.
+static void flush_pending(struct restricted_journal *journal) {
+  struct journal_buffer batch = journal->pending;
+  journal->pending = journal->writing;
+  journal->writing = batch;
+  unsigned long long end = journal->appended;
+
+  pthread_mutex_unlock(&journal->lock);
+  int ret = write_all(journal->fd, batch.data, batch.len) == 0 &&
+                    fdatasync(journal->fd) == 0
+                ? 0
+                : -1;
+  pthread_mutex_lock(&journal->lock);
+
+  journal->writing.len = 0;
+  if (ret == -1) {
+    error_callback("%s: writing %s failed\n", __func__, journal->path);
+    journal->failed = 1;
+  } else {
+    journal->synced = end;
+  }
+  journal->syncing = 0;
+  pthread_cond_broadcast(&journal->batch_synced);
+}
+
+// Group commit: the first thread to find no sync under way leads the next
+// one, the others wait for it to cover their records
+static int wait_synced(struct restricted_journal *journal,
+                       unsigned long long seq) {
+  while (journal->synced < seq && !journal->failed) {
+    if (journal->syncing) {
+      pthread_cond_wait(&journal->batch_synced, &journal->lock);
+      continue;
+    }
+
+    journal->syncing = 1;
+    if (journal->latency_us) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += journal->latency_us / 1000000;
+      deadline.tv_nsec += journal->latency_us % 1000000 * 1000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      while (journal->pending.len < JOURNAL_MAX_BATCH &&
+             pthread_cond_timedwait(&journal->batch_full, &journal->lock,
+                                    &deadline) != ETIMEDOUT) {
+      }
+    }
+    flush_pending(journal);
+  }
+
+  return journal->synced >= seq ? RESTRICTED_DICTIONARY_OK
+                                : RESTRICTED_DICTIONARY_EIO;
+}
+
+// Journals a change already made in memory and waits for it to be on disk,
+// called with the lock held
+static int journal_change(struct restricted_journal *journal,
+                          enum journal_op op, const char *first,
+                          const char *const *more, unsigned int num) {
+  unsigned long long seq = append_record(journal, op, first, more, num);
+  if (!seq) {
+    // memory and disk no longer agree, refuse every change from now on
+    journal->failed = 1;
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  return wait_synced(journal, seq);
+}
+
+// Applies one record, returns -1 when it is not one this version writes
+static int replay_record(struct restricted_dictionary *r_dict,
+                         char *payload, uint32_t size) {
+  if (size < 2 || payload[size - 1] != '\0') {
+    return -1;
+  }
+
+  unsigned int num = 0;
+  for (uint32_t i = 1; i < size; i++) {
+    num += payload[i] == '\0';
+  }
+  char **strings = malloc(num * sizeof(char *));
+  if (!strings) {
+    error_callback("%s: malloc() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+  char *cursor = payload + 1;
+  for (unsigned int i = 0; i < num; i++) {
+    strings[i] = cursor;
+    cursor += strlen(cursor) + 1;
+  }
+
+  // every record was a change that went through, so its outcome is known
+  // and only running out of memory matters
+  int valid = 0;
+  int ret = RESTRICTED_DICTIONARY_OK;
+  switch (payload[0]) {
+  case OP_SET:
+    if ((valid = num == 2)) {
+      ret = restricted_dictionary_set(r_dict, strings[0], strings[1]);
+    }
+    break;
+  case OP_RESTRICT:
+    if ((valid = num == 2)) {
+      ret = restricted_dictionary_restrict(r_dict, strings[0], strings[1]);
+    }
+    break;
+  case OP_MULTIRESTRICT:
+    if ((valid = num >= 2)) {
+      ret = restricted_dictionary_multiRestrict(r_dict, strings[0],
+                                                strings + 1, num - 1);
+    }
+    break;
+  case OP_UNRESTRICT:
+    if ((valid = num == 2)) {
+      ret = restricted_dictionary_unrestrict(r_dict, strings[0], strings[1]);
+    }
+    break;
+  case OP_UNRESTRICT_ALL:
+    if ((valid = num == 1)) {
+      ret = restricted_dictionary_unrestrict_all(r_dict, strings[0]);
+    }
+    break;
+  }
+  free(strings);
+
+  if (!valid) {
+    return -1;
+  }
+  return ret == RESTRICTED_DICTIONARY_ENOMEM ? ret : 0;
+}
+
+// Applies the journal at path on top of the snapshot whose CRC is base_crc.
+// Returns 0 when it holds no records and can be appended to as it is, 1 when
+// it has to be compacted and -1 on failure.
+static int replay(struct restricted_journal *journal, uint32_t base_crc) {
+  int fd = open(journal->path, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      return 1;
+    }
+    error_callback("%s: open(%s) failed\n", __func__, journal->path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    error_callback("%s: fstat(%s) failed\n", __func__, journal->path);
+    close(fd);
+    return -1;
+  }
+
+  size_t size = st.st_size;
+  char *data = malloc(size ? size : 1);
+  if (!data) {
+    error_callback("%s: malloc() failed\n", __func__);
+    close(fd);
+    return -1;
+  }
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd, data + done, size - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+  size = done;
+
+  // a journal cut short while being created holds nothing yet
+  struct journal_header header;
+  if (size < sizeof(header)) {
+    free(data);
+    return 1;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != JOURNAL_VERSION) {
+    error_callback("%s: %s is not a journal\n", __func__, journal->path);
+    free(data);
+    return -1;
+  }
+  if (header.base_crc != base_crc) {
+    free(data);
+    if (!base_crc) {
+      error_callback("%s: snapshot %s is missing\n", __func__,
+                     journal->snap_path);
+      return -1;
+    }
+    return 1;
+  }
+
+  size_t offset = sizeof(header);
+  unsigned long records = 0;
+  while (size - offset >= sizeof(struct record_header)) {
+    struct record_header record;
+    memcpy(&record, data + offset, sizeof(record));
+    char *payload = data + offset + sizeof(record);
+    if (record.size > size - offset - sizeof(record) ||
+        record.crc != crc_update(0, payload, record.size)) {
+      break;
+    }
+
+    int ret = replay_record(journal->r_dict, payload, record.size);
+    if (ret == RESTRICTED_DICTIONARY_ENOMEM) {
+      error_callback("%s: replay_record() failed\n", __func__);
+      free(data);
+      return -1;
+    }
+    if (ret == -1) {
+      break;
+    }
+    offset += sizeof(record) + record.size;
+    records++;
+  }
+  free(data);
+
+  // the tail of the last batch, written but not synced when the process died
+  if (offset < size) {
+    error_callback("%s: dropping %zu bytes at the end of %s\n", __func__,
+                   size - offset, journal->path);
+  }
+
+  return records || offset < size ? 1 : 0;
+}
+
+// Replaces the journal with an empty one on top of the snapshot base_crc
+static int reset_journal(struct restricted_journal *journal,
+                         uint32_t base_crc) {
+  struct journal_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  header.version = JOURNAL_VERSION;
+  header.base_crc = base_crc;
+
+  int fd = open(journal->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    error_callback("%s: open(%s) failed\n", __func__, journal->tmp_path);
+    return -1;
+  }
+  if (write_all(fd, (const char *)&header, sizeof(header)) == -1 ||
+      fsync(fd) == -1 || rename(journal->tmp_path, journal->path) == -1) {
+    error_callback("%s: writing %s failed\n", __func__, journal->tmp_path);
+    close(fd);
+    unlink(journal->tmp_path);
+    return -1;
+  }
+  close(fd);
+
+  return sync_dir(journal->path);
+}
+
+static int open_for_append(struct restricted_journal *journal) {
+  int fd = open(journal->path, O_WRONLY | O_APPEND);
+  if (fd == -1) {
+    error_callback("%s: open(%s) failed\n", __func__, journal->path);
+    return -1;
+  }
+
+  if (journal->fd != -1) {
+    close(journal->fd);
+  }
+  journal->fd = fd;
+
+  return 0;
+}
+
+// Called with the lock held and nothing pending
+static int compact(struct restricted_journal *journal) {
+  int ret = restricted_dictionary_save(journal->r_dict, journal->snap_path);
+  if (ret != RESTRICTED_DICTIONARY_OK) {
+    error_callback("%s: restricted_dictionary_save() failed\n", __func__);
+    return ret;
+  }
+
+  // from here on the old journal no longer matches the snapshot, it has to
+  // be replaced before anything else is appended to it
+  uint32_t base_crc = 0;
+  if (sync_dir(journal->snap_path) == -1 ||
+      file_crc(journal->snap_path, &base_crc) == -1 ||
+      reset_journal(journal, base_crc) == -1 ||
+      open_for_append(journal) == -1) {
+    error_callback("%s: replacing %s failed\n", __func__, journal->path);
+    journal->failed = 1;
+    return RESTRICTED_DICTIONARY_EIO;
+  }
+
+  return RESTRICTED_DICTIONARY_OK;
+}
+
+static char *concat(const char *str, const char *suffix) {
+  size_t len = strlen(str) + strlen(suffix) + 1;
+  char *result = malloc(len);
+  if (result) {
+    snprintf(result, len, "%s%s", str, suffix);
+  }
+  return result;
+}
+
+struct restricted_journal *restricted_journal_open(const char *path,
+                                                   unsigned int flags,
+                                                   unsigned int latency_us) {
+  if (!path) {
+    error_callback("%s: invalid input\n", __func__);
+    return NULL;
+  }
+
+  pthread_once(&crc_once, crc_init);
+
+  struct restricted_journal *journal =
+      calloc(1, sizeof(struct restricted_journal));
+  if (!journal) {
+    error_callback("%s: calloc() failed\n", __func__);
+    return NULL;
+  }
+  journal->fd = -1;
+  journal->latency_us = latency_us;
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->batch_full, NULL);
+  pthread_cond_init(&journal->batch_synced, NULL);
+
+  journal->path = strdup(path);
+  journal->snap_path = concat(path, ".snap");
+  journal->tmp_path = concat(path, ".tmp");
+  if (!journal->path || !journal->snap_path || !journal->tmp_path) {
+    error_callback("%s: strdup() failed\n", __func__);
+    goto fail;
+  }
+
+  uint32_t base_crc = 0;
+  if (access(journal->snap_path, F_OK) == 0) {
+    journal->r_dict = restricted_dictionary_load(journal->snap_path, flags);
+    if (!journal->r_dict || file_crc(journal->snap_path, &base_crc) == -1) {
+      error_callback("%s: loading %s failed\n", __func__, journal->snap_path);
+      goto fail;
+    }
+  } else {
+    journal->r_dict = restricted_dictionary_new_ex(0, flags);
+    if (!journal->r_dict) {
+      error_callback("%s: restricted_dictionary_new_ex() failed\n", __func__);
+      goto fail;
+    }
+  }
+
+  int ret = replay(journal, base_crc);
+  if (ret == -1 || (ret == 0 && open_for_append(journal) == -1) ||
+      (ret == 1 && compact(journal) != RESTRICTED_DICTIONARY_OK)) {
+    error_callback("%s: recovering %s failed\n", __func__, path);
+    goto fail;
+  }
+
+  return journal;
+
+fail:
+  restricted_journal_close(journal);
+  return NULL;
+}
+
+void restricted_journal_close(struct restricted_journal *journal) {
+  if (!journal) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  while (journal->syncing) {
+    pthread_cond_wait(&journal->batch_synced, &journal->lock);
+  }
+  if (journal->pending.len && !journal->failed) {
+    journal->syncing = 1;
+    flush_pending(journal);
+  }
+  pthread_mutex_unlock(&journal->lock);
+
+  if (journal->fd != -1) {
+    close(journal->fd);
+  }
+  restricted_dictionary_del(journal->r_dict);
+  free(journal->pending.data);
+  free(journal->writing.data);
+  free(journal->path);
+  free(journal->snap_path);
+  free(journal->tmp_path);
+  pthread_cond_destroy(&journal->batch_synced);
+  pthread_cond_destroy(&journal->batch_full);
+  pthread_mutex_destroy(&journal->lock);
+  free(journal);
+}
+
+const struct restricted_dictionary *
+restricted_journal_dictionary(const struct restricted_journal *journal) {
+  if (!journal) {
+    error_callback("%s: invalid input\n", __func__);
+    return NULL;
+  }
+
+  return journal->r_dict;
+}
+
+int restricted_journal_set(struct restricted_journal *journal,
+                           const char *key, const char *val) {
+  if (!journal || !key || !val) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  int ret = journal->failed ? RESTRICTED_DICTIONARY_EIO
+                            : restricted_dictionary_set(journal->r_dict, key,
+                                                        val);
+  if (ret == RESTRICTED_DICTIONARY_OK) {
+    ret = journal_change(journal, OP_SET, key, &val, 1);
+  }
+  pthread_mutex_unlock(&journal->lock);
+
+  return ret;
+}
+
+int restricted_journal_restrict(struct restricted_journal *journal,
+                                char *slave_pair, char *master_pair) {
+  if (!journal || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  int ret = journal->failed ? RESTRICTED_DICTIONARY_EIO
+                            : restricted_dictionary_restrict(
+                                  journal->r_dict, slave_pair, master_pair);
+  if (ret == RESTRICTED_DICTIONARY_OK) {
+    const char *more = master_pair;
+    ret = journal_change(journal, OP_RESTRICT, slave_pair, &more, 1);
+  }
+  pthread_mutex_unlock(&journal->lock);
+
+  return ret;
+}
+
+int restricted_journal_multiRestrict(struct restricted_journal *journal,
+                                     char *slave_pair, char **master_pairs,
+                                     unsigned int num_masters) {
+  if (!journal || !slave_pair || !master_pairs || !num_masters) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  if (journal->failed) {
+    pthread_mutex_unlock(&journal->lock);
+    return RESTRICTED_DICTIONARY_EIO;
+  }
+  // masters that fail are skipped and the others still added, so the change
+  // is journaled whatever it returns; replaying it skips the same masters
+  int ret = restricted_dictionary_multiRestrict(journal->r_dict, slave_pair,
+                                                master_pairs, num_masters);
+  int logged = journal_change(journal, OP_MULTIRESTRICT, slave_pair,
+                              (const char *const *)master_pairs, num_masters);
+  pthread_mutex_unlock(&journal->lock);
+
+  return logged != RESTRICTED_DICTIONARY_OK ? logged : ret;
+}
+
+int restricted_journal_unrestrict(struct restricted_journal *journal,
+                                  char *slave_pair, char *master_pair) {
+  if (!journal || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  int ret = journal->failed ? RESTRICTED_DICTIONARY_EIO
+                            : restricted_dictionary_unrestrict(
+                                  journal->r_dict, slave_pair, master_pair);
+  if (ret == RESTRICTED_DICTIONARY_OK) {
+    const char *more = master_pair;
+    ret = journal_change(journal, OP_UNRESTRICT, slave_pair, &more, 1);
+  }
+  pthread_mutex_unlock(&journal->lock);
+
+  return ret;
+}
+
+int restricted_journal_unrestrict_all(struct restricted_journal *journal,
+                                      char *slave_pair) {
+  if (!journal || !slave_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  int ret = journal->failed ? RESTRICTED_DICTIONARY_EIO
+                            : restricted_dictionary_unrestrict_all(
+                                  journal->r_dict, slave_pair);
+  if (ret == RESTRICTED_DICTIONARY_OK) {
+    ret = journal_change(journal, OP_UNRESTRICT_ALL, slave_pair, NULL, 0);
+  }
+  pthread_mutex_unlock(&journal->lock);
+
+  return ret;
+}
+
+int restricted_journal_compact(struct restricted_journal *journal) {
+  if (!journal) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  while (journal->syncing) {
+    pthread_cond_wait(&journal->batch_synced, &journal->lock);
+  }
+  // whoever waits for a pending record is released by this flush
+  if (journal->pending.len && !journal->failed) {
+    journal->syncing = 1;
+    flush_pending(journal);
+  }
+  int ret = journal->failed ? RESTRICTED_DICTIONARY_EIO : compact(journal);
+  pthread_mutex_unlock(&journal->lock);
+
+  return ret;
+}
@@ -0,0 +1,48 @@
+#ifndef RESTRICTED_JOURNAL_H
+#define RESTRICTED_JOURNAL_H
+
+#include "restricted_dictionary.h"
+
+// A restricted_dictionary whose changes survive a crash. Every set and rule
+// change is appended to a journal at path and returns once it is on disk. The
+// state the journal starts from is a snapshot at path.snap (see
+// restricted_snapshot.h).
+//
+// Changes made from several threads at once share an fsync: the first one to
+// wait for the disk waits latency_us more for others to join it, then syncs
+// all of them. With latency_us 0 every change is synced as soon as it is
+// made.
+//
+// Opening replays the journal on top of the snapshot and compacts both into
+// a new snapshot and an empty journal.
+struct restricted_journal;
+
+struct restricted_journal *restricted_journal_open(const char *path,
+                                                   unsigned int flags,
+                                                   unsigned int latency_us);
+// Changes not yet on disk are synced first
+void restricted_journal_close(struct restricted_journal *journal);
+
+// For reads only, and not while another thread changes the journal
+const struct restricted_dictionary *
+restricted_journal_dictionary(const struct restricted_journal *journal);
+
+// Same as the restricted_dictionary functions, plus RESTRICTED_DICTIONARY_EIO
+// once the journal could not be written. A change that fails in memory is
+// not journaled.
+int restricted_journal_set(struct restricted_journal *journal,
+                           const char *key, const char *val);
+int restricted_journal_restrict(struct restricted_journal *journal,
+                                char *slave_pair, char *master_pair);
+int restricted_journal_multiRestrict(struct restricted_journal *journal,
+                                     char *slave_pair, char **master_pairs,
+                                     unsigned int num_masters);
+int restricted_journal_unrestrict(struct restricted_journal *journal,
+                                  char *slave_pair, char *master_pair);
+int restricted_journal_unrestrict_all(struct restricted_journal *journal,
+                                      char *slave_pair);
+
+// Folds the journal into a new snapshot and starts an empty one
+int restricted_journal_compact(struct restricted_journal *journal);
+
+#endif // RESTRICTED_JOURNAL_H
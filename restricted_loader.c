@@ -0,0 +1,457 @@
+#include "restricted_loader.h"
+#include "restricted_dictionary_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Bytes of input parsed at a time, a chunk only ends after a newline
+#define LOADER_CHUNK (1 << 20)
+// Smallest part of a chunk worth a thread of its own
+#define LOADER_MIN_SLICE (64 << 10)
+#define LOADER_MAX_THREADS 64
+
+enum parse_failure { MISSING_MASTERS, INVALID_SLAVE, INVALID_MASTER };
+
+// Line numbers are counted from 0 at the start of the slice until the slice
+// is applied, pairs point into the chunk
+struct parsed_rule {
+  unsigned long line;
+  struct restricted_pair slave;
+  unsigned int first_master;
+  unsigned int num_masters;
+};
+
+struct parse_error {
+  unsigned long line;
+  enum parse_failure failure;
+  unsigned int index;
+};
+
+// Part of a chunk parsed by one thread. The arrays are kept from chunk to
+// chunk.
+struct parse_slice {
+  pthread_t thread;
+  const char *begin;
+  const char *end;
+  unsigned long num_lines;
+  struct parsed_rule *rules;
+  unsigned int num_rules;
+  unsigned int max_rules;
+  struct restricted_pair *masters;
+  unsigned int num_masters;
+  unsigned int max_masters;
+  struct parse_error *errors;
+  unsigned int num_errors;
+  unsigned int max_errors;
+  int failed;
+};
+
+struct loader {
+  struct restricted_dictionary *r_dict;
+  struct parse_slice slices[LOADER_MAX_THREADS];
+  unsigned int num_threads;
+  // lines of the chunks already applied
+  unsigned long lines;
+  unsigned long rules;
+  unsigned long malformed;
+  int ret;
+};
+
+static int grow(void **array, unsigned int *max, size_t size) {
+  unsigned int new_max = *max ? *max * 2 : 64;
+  void *new_array = realloc(*array, new_max * size);
+  if (!new_array) {
+    return -1;
+  }
+
+  *array = new_array;
+  *max = new_max;
+
+  return 0;
+}
+
+static int is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static int add_error(struct parse_slice *slice, unsigned long line,
+                     enum parse_failure failure, unsigned int index) {
+  if (slice->num_errors == slice->max_errors &&
+      grow((void **)&slice->errors, &slice->max_errors,
+           sizeof(struct parse_error)) == -1) {
+    return -1;
+  }
+
+  slice->errors[slice->num_errors++] =
+      (struct parse_error){line, failure, index};
+
+  return 0;
+}
+
+// Returns -1 only when out of memory, a malformed line is recorded and
+// dropped as a whole
+static int parse_line(struct parse_slice *slice, const char *line,
+                      size_t len, unsigned long line_no) {
+  while (len && is_blank(line[len - 1])) {
+    len--;
+  }
+  while (len && is_blank(*line)) {
+    line++;
+    len--;
+  }
+  if (!len || *line == '#') {
+    return 0;
+  }
+
+  size_t slave_len = 0;
+  while (slave_len < len && !is_blank(line[slave_len])) {
+    slave_len++;
+  }
+
+  struct parsed_rule rule = {line_no, {0}, slice->num_masters, 0};
+  if (restricted_dictionary_split_pair(line, slave_len, &rule.slave) == -1) {
+    return add_error(slice, line_no, INVALID_SLAVE, 0);
+  }
+
+  const char *item = line + slave_len;
+  const char *end = line + len;
+  while (item < end && is_blank(*item)) {
+    item++;
+  }
+  if (item == end) {
+    return add_error(slice, line_no, MISSING_MASTERS, 0);
+  }
+
+  for (;;) {
+    const char *comma = memchr(item, ',', end - item);
+    const char *item_end = comma ? comma : end;
+    while (item < item_end && is_blank(*item)) {
+      item++;
+    }
+    while (item_end > item && is_blank(item_end[-1])) {
+      item_end--;
+    }
+
+    if (slice->num_masters == slice->max_masters &&
+        grow((void **)&slice->masters, &slice->max_masters,
+             sizeof(struct restricted_pair)) == -1) {
+      return -1;
+    }
+    if (restricted_dictionary_split_pair(
+            item, item_end - item, &slice->masters[slice->num_masters]) ==
+        -1) {
+      slice->num_masters = rule.first_master;
+      return add_error(slice, line_no, INVALID_MASTER, rule.num_masters);
+    }
+    slice->num_masters++;
+    rule.num_masters++;
+
+    if (!comma) {
+      break;
+    }
+    item = comma + 1;
+  }
+
+  if (slice->num_rules == slice->max_rules &&
+      grow((void **)&slice->rules, &slice->max_rules,
+           sizeof(struct parsed_rule)) == -1) {
+    return -1;
+  }
+  slice->rules[slice->num_rules++] = rule;
+
+  return 0;
+}
+
+static void *parse_slice(void *arg) {
+  struct parse_slice *slice = arg;
+  const char *line = slice->begin;
+
+  while (line < slice->end) {
+    const char *newline = memchr(line, '\n', slice->end - line);
+    const char *line_end = newline ? newline : slice->end;
+    if (parse_line(slice, line, line_end - line, slice->num_lines) == -1) {
+      slice->failed = 1;
+      return NULL;
+    }
+    slice->num_lines++;
+    line = newline ? newline + 1 : slice->end;
+  }
+
+  return NULL;
+}
+
+static void report_error(unsigned long line, const struct parse_error *error) {
+  switch (error->failure) {
+  case MISSING_MASTERS:
+    error_callback("%s: line %lu: no master pairs\n", __func__, line);
+    break;
+  case INVALID_SLAVE:
+    error_callback("%s: line %lu: invalid slave pair, expected 'A=B'\n",
+                   __func__, line);
+    break;
+  case INVALID_MASTER:
+    error_callback("%s: line %lu: invalid master pair %u, expected 'A=B'\n",
+                   __func__, line, error->index + 1);
+    break;
+  }
+}
+
+// Rules go in slice by slice, which is the order of the input
+static void apply_slice(struct loader *loader, struct parse_slice *slice) {
+  for (unsigned int i = 0; i < slice->num_errors; i++) {
+    report_error(loader->lines + slice->errors[i].line + 1, &slice->errors[i]);
+  }
+  loader->malformed += slice->num_errors;
+
+  // one master at a time, so the rules that did go in are counted
+  for (unsigned int i = 0; i < slice->num_rules; i++) {
+    const struct parsed_rule *rule = &slice->rules[i];
+    for (unsigned int j = 0; j < rule->num_masters; j++) {
+      int ret = restricted_dictionary_restrict_pair(
+          loader->r_dict, &rule->slave,
+          &slice->masters[rule->first_master + j]);
+      if (ret != 0) {
+        error_callback("%s: line %lu: adding rule %u failed\n", __func__,
+                       loader->lines + rule->line + 1, j + 1);
+        loader->ret = ret;
+        continue;
+      }
+      loader->rules++;
+    }
+  }
+
+  loader->lines += slice->num_lines;
+}
+
+// Parses [begin, end) on up to num_threads threads, then applies it. The
+// chunk holds whole lines only.
+static int load_chunk(struct loader *loader, const char *begin,
+                      const char *end) {
+  size_t len = end - begin;
+  unsigned int num_slices = len / LOADER_MIN_SLICE;
+  if (num_slices > loader->num_threads) {
+    num_slices = loader->num_threads;
+  }
+  if (!num_slices) {
+    num_slices = 1;
+  }
+
+  const char *slice_begin = begin;
+  for (unsigned int i = 0; i < num_slices; i++) {
+    struct parse_slice *slice = &loader->slices[i];
+    const char *slice_end = end;
+    if (i + 1 < num_slices) {
+      const char *cut = begin + len * (i + 1) / num_slices;
+      if (cut < slice_begin) {
+        cut = slice_begin;
+      }
+      const char *newline = memchr(cut, '\n', end - cut);
+      slice_end = newline ? newline + 1 : end;
+    }
+
+    slice->begin = slice_begin;
+    slice->end = slice_end;
+    slice->num_lines = 0;
+    slice->num_rules = 0;
+    slice->num_masters = 0;
+    slice->num_errors = 0;
+    slice->failed = 0;
+    slice_begin = slice_end;
+  }
+
+  // the calling thread takes the first slice, a slice whose thread could not
+  // be started is parsed after it
+  int started[LOADER_MAX_THREADS] = {0};
+  for (unsigned int i = 1; i < num_slices; i++) {
+    started[i] = pthread_create(&loader->slices[i].thread, NULL, parse_slice,
+                                &loader->slices[i]) == 0;
+  }
+  parse_slice(&loader->slices[0]);
+  for (unsigned int i = 1; i < num_slices; i++) {
+    if (started[i]) {
+      pthread_join(loader->slices[i].thread, NULL);
+    } else {
+      parse_slice(&loader->slices[i]);
+    }
+  }
+
+  for (unsigned int i = 0; i < num_slices; i++) {
+    if (loader->slices[i].failed) {
+      error_callback("%s: out of memory parsing rules\n", __func__);
+      loader->ret = RESTRICTED_DICTIONARY_ENOMEM;
+      return -1;
+    }
+  }
+  for (unsigned int i = 0; i < num_slices; i++) {
+    apply_slice(loader, &loader->slices[i]);
+  }
+
+  return 0;
+}
+
+// Every rule would be refused one by one otherwise
+static int is_frozen(const struct restricted_dictionary *r_dict,
+                     const char *func) {
+  if (!r_dict->frozen.buckets) {
+    return 0;
+  }
+
+  error_callback("%s: the dictionary is frozen\n", func);
+  return 1;
+}
+
+static void loader_init(struct loader *loader,
+                        struct restricted_dictionary *r_dict,
+                        unsigned int num_threads) {
+  memset(loader, 0, sizeof(struct loader));
+  loader->r_dict = r_dict;
+
+  if (!num_threads) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = online > 0 ? online : 1;
+  }
+  loader->num_threads =
+      num_threads < LOADER_MAX_THREADS ? num_threads : LOADER_MAX_THREADS;
+}
+
+static int loader_finish(struct loader *loader,
+                         struct restricted_load_result *result) {
+  for (unsigned int i = 0; i < LOADER_MAX_THREADS; i++) {
+    free(loader->slices[i].rules);
+    free(loader->slices[i].masters);
+    free(loader->slices[i].errors);
+  }
+
+  if (result) {
+    result->lines = loader->lines;
+    result->rules = loader->rules;
+    result->malformed = loader->malformed;
+  }
+
+  if (loader->ret != RESTRICTED_DICTIONARY_OK) {
+    return loader->ret;
+  }
+
+  return loader->malformed ? RESTRICTED_DICTIONARY_EINVAL
+                           : RESTRICTED_DICTIONARY_OK;
+}
+
+int restricted_dictionary_load_rules(struct restricted_dictionary *r_dict,
+                                     const char *buf, size_t len,
+                                     unsigned int num_threads,
+                                     struct restricted_load_result *result) {
+  if (!r_dict || (!buf && len)) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  struct loader loader;
+  loader_init(&loader, r_dict, num_threads);
+
+  const char *end = buf + len;
+  while (buf < end) {
+    const char *chunk_end = end;
+    if ((size_t)(end - buf) > LOADER_CHUNK) {
+      const char *newline =
+          memchr(buf + LOADER_CHUNK, '\n', end - buf - LOADER_CHUNK);
+      chunk_end = newline ? newline + 1 : end;
+    }
+    if (load_chunk(&loader, buf, chunk_end) == -1) {
+      break;
+    }
+    buf = chunk_end;
+  }
+
+  return loader_finish(&loader, result);
+}
+
+int restricted_dictionary_load_rules_file(
+    struct restricted_dictionary *r_dict, const char *path,
+    unsigned int num_threads, struct restricted_load_result *result) {
+  if (!r_dict || !path) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (is_frozen(r_dict, __func__)) {
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    error_callback("%s: open(%s) failed\n", __func__, path);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  size_t max = LOADER_CHUNK;
+  char *data = malloc(max);
+  if (!data) {
+    error_callback("%s: malloc() failed\n", __func__);
+    close(fd);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  struct loader loader;
+  loader_init(&loader, r_dict, num_threads);
+
+  // the buffer is filled before parsing, lines cut at its end are carried
+  // over to the next chunk
+  size_t used = 0;
+  int eof = 0;
+  while (!eof) {
+    while (used < max) {
+      ssize_t n = read(fd, data + used, max - used);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        error_callback("%s: read(%s) failed\n", __func__, path);
+        loader.ret = RESTRICTED_DICTIONARY_EINVAL;
+      }
+      if (n <= 0) {
+        eof = 1;
+        break;
+      }
+      used += n;
+    }
+    if (loader.ret != RESTRICTED_DICTIONARY_OK || !used) {
+      break;
+    }
+
+    size_t whole = used;
+    if (!eof) {
+      while (whole && data[whole - 1] != '\n') {
+        whole--;
+      }
+    }
+
+    if (!whole) {
+      // a line longer than the buffer
+      char *new_data = realloc(data, max * 2);
+      if (!new_data) {
+        error_callback("%s: realloc() failed\n", __func__);
+        loader.ret = RESTRICTED_DICTIONARY_ENOMEM;
+        break;
+      }
+      data = new_data;
+      max *= 2;
+      continue;
+    }
+
+    if (load_chunk(&loader, data, data + whole) == -1) {
+      break;
+    }
+    used -= whole;
+    memmove(data, data + whole, used);
+  }
+
+  free(data);
+  close(fd);
+
+  return loader_finish(&loader, result);
+}
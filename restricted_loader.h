@@ -0,0 +1,35 @@
+#ifndef RESTRICTED_LOADER_H
+#define RESTRICTED_LOADER_H
+
+#include "restricted_dictionary.h"
+#include <stddef.h>
+
+// Bulk loading of rule files. Each line holds a slave pair, whitespace and a
+// comma separated list of its master pairs:
+//
+//   employee=Andy company=Google,company=Yahoo
+//
+// Blank lines and lines starting with '#' are skipped. Input is read in
+// chunks whose lines are split and validated on several threads, the rules
+// are then added in file order. A malformed line is reported with its line
+// number and skipped, loading goes on with the next one.
+
+struct restricted_load_result {
+  unsigned long lines;
+  // rules added, one per master
+  unsigned long rules;
+  unsigned long malformed;
+};
+
+// num_threads 0 uses one thread per online CPU, result may be NULL. Returns
+// RESTRICTED_DICTIONARY_EINVAL when some line was malformed, the others are
+// loaded all the same.
+int restricted_dictionary_load_rules(struct restricted_dictionary *r_dict,
+                                     const char *buf, size_t len,
+                                     unsigned int num_threads,
+                                     struct restricted_load_result *result);
+int restricted_dictionary_load_rules_file(
+    struct restricted_dictionary *r_dict, const char *path,
+    unsigned int num_threads, struct restricted_load_result *result);
+
+#endif // RESTRICTED_LOADER_H
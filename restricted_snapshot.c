@@ -0,0 +1,729 @@
+#include "restricted_snapshot.h"
+#include "restricted_dictionary_internal.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "RDSNAP\0"
+#define SNAPSHOT_VERSION 1
+// read back in another byte order this no longer matches
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+// snapshot_key offset of a key that is not set
+#define NO_STRING UINT32_MAX
+
+enum snapshot_section {
+  SECTION_KEYS,
+  SECTION_VALUES,
+  SECTION_KEY_BUCKETS,
+  SECTION_VALUE_BUCKETS,
+  SECTION_CURRENT,
+  SECTION_PAIRS,
+  SECTION_PAIR_BUCKETS,
+  SECTION_EDGES,
+  SECTION_BLOB,
+  NUM_SECTIONS
+};
+
+// Ids are those of the intern tables, pairs are renumbered densely. Every
+// array has an unused entry 0 so an id indexes it directly, buckets are open
+// addressing tables of ids at most half full.
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t num_keys;
+  uint32_t num_values;
+  uint32_t num_pairs;
+  uint32_t num_edges;
+  uint32_t key_buckets;
+  uint32_t value_buckets;
+  uint32_t pair_buckets;
+  uint32_t blob_size;
+  uint64_t size;
+  uint64_t sections[NUM_SECTIONS];
+};
+
+// A NUL-terminated string of the blob
+struct snapshot_string {
+  uint32_t offset;
+  uint32_t len;
+};
+
+// What a key holds, value is the interned id or 0 when no rule refers to it
+struct snapshot_key {
+  uint32_t value;
+  uint32_t offset;
+};
+
+// The masters of a pair are the num_masters edges from edges on, its slaves
+// follow them
+struct snapshot_pair {
+  uint32_t key;
+  uint32_t value;
+  uint32_t edges;
+  uint32_t num_masters;
+  uint32_t num_slaves;
+};
+
+struct snapshot_edge {
+  uint32_t pair;
+  uint32_t key;
+  uint32_t value;
+};
+
+struct restricted_snapshot {
+  const unsigned char *base;
+  size_t size;
+  const struct snapshot_header *header;
+  const struct snapshot_string *keys;
+  const struct snapshot_string *values;
+  const uint32_t *key_buckets;
+  const uint32_t *value_buckets;
+  const struct snapshot_key *current;
+  const struct snapshot_pair *pairs;
+  const uint32_t *pair_buckets;
+  const struct snapshot_edge *edges;
+  const char *blob;
+};
+
+static uint32_t snapshot_hash(const char *str, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t snapshot_pair_hash(uint32_t key, uint32_t value) {
+  uint32_t hash = key * 0x9e3779b1u ^ value;
+  hash ^= hash >> 15;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  return hash;
+}
+
+// Smallest power of two that keeps num ids at most half of the buckets
+static uint32_t bucket_count(uint32_t num) {
+  uint32_t buckets = 8;
+  while (buckets < 2 * (uint64_t)num) {
+    buckets <<= 1;
+  }
+  return buckets;
+}
+
+static void bucket_insert(uint32_t *buckets, uint32_t num_buckets,
+                          uint32_t hash, uint32_t id) {
+  uint32_t slot = hash & (num_buckets - 1);
+  while (buckets[slot]) {
+    slot = (slot + 1) & (num_buckets - 1);
+  }
+  buckets[slot] = id;
+}
+
+static uint32_t find_string(const struct restricted_snapshot *snap,
+                            const uint32_t *buckets, uint32_t num_buckets,
+                            const struct snapshot_string *strings,
+                            const char *str) {
+  size_t len = strlen(str);
+  uint32_t mask = num_buckets - 1;
+
+  for (uint32_t slot = snapshot_hash(str, len) & mask;;
+       slot = (slot + 1) & mask) {
+    uint32_t id = buckets[slot];
+    if (!id) {
+      return 0;
+    }
+    if (strings[id].len == len &&
+        memcmp(snap->blob + strings[id].offset, str, len) == 0) {
+      return id;
+    }
+  }
+}
+
+static uint32_t find_pair(const struct restricted_snapshot *snap,
+                          uint32_t key, uint32_t value) {
+  uint32_t mask = snap->header->pair_buckets - 1;
+
+  for (uint32_t slot = snapshot_pair_hash(key, value) & mask;;
+       slot = (slot + 1) & mask) {
+    uint32_t id = snap->pair_buckets[slot];
+    if (!id) {
+      return 0;
+    }
+    if (snap->pairs[id].key == key && snap->pairs[id].value == value) {
+      return id;
+    }
+  }
+}
+
+static size_t align8(size_t offset) { return (offset + 7) & ~(size_t)7; }
+
+// Appends a string to the blob, *blob_size is only advanced when blob is NULL
+static uint32_t blob_add(char *blob, uint32_t *blob_size, const char *str,
+                         uint32_t len) {
+  uint32_t offset = *blob_size;
+  if (blob) {
+    memcpy(blob + offset, str, len);
+    blob[offset + len] = '\0';
+  }
+  *blob_size += len + 1;
+  return offset;
+}
+
+// Value the key holds as a string, NULL when it is not set
+static const char *current_string(const struct restricted_dictionary *r_dict,
+                                  unsigned int key) {
+  unsigned int value = r_dict->current[key];
+  if (!value) {
+    return NULL;
+  }
+  if (value != OTHER_VALUE) {
+    return r_dict->values.strings[value];
+  }
+  return dictionary_get(r_dict->base, r_dict->keys.strings[key], NULL);
+}
+
+// Lays out the whole image in one allocation, NULL on failure
+static unsigned char *build_image(const struct restricted_dictionary *r_dict,
+                                  size_t *size) {
+  const struct pair_table *table = &r_dict->pairs;
+  struct snapshot_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.num_keys = r_dict->keys.num_strings - 1;
+  header.num_values = r_dict->values.num_strings - 1;
+
+  // internal pair ids have holes where nodes were dropped
+  uint32_t *pair_ids = calloc(table->num_nodes, sizeof(uint32_t));
+  if (!pair_ids) {
+    error_callback("%s: calloc() failed\n", __func__);
+    return NULL;
+  }
+
+  uint64_t blob_size = 0;
+  uint64_t num_edges = 0;
+  for (unsigned int id = 1; id < table->num_nodes; id++) {
+    if (table->nodes[id].key) {
+      pair_ids[id] = ++header.num_pairs;
+      num_edges += table->nodes[id].masters.num + table->nodes[id].slaves.num;
+    }
+  }
+  for (unsigned int id = 1; id <= header.num_keys; id++) {
+    blob_size += r_dict->keys.lengths[id] + 1;
+    if (r_dict->current[id] == OTHER_VALUE) {
+      blob_size += strlen(current_string(r_dict, id)) + 1;
+    }
+  }
+  for (unsigned int id = 1; id <= header.num_values; id++) {
+    blob_size += r_dict->values.lengths[id] + 1;
+  }
+  if (blob_size >= NO_STRING || num_edges >= UINT32_MAX) {
+    error_callback("%s: dictionary too large for a snapshot\n", __func__);
+    free(pair_ids);
+    return NULL;
+  }
+  header.num_edges = num_edges;
+  header.blob_size = blob_size;
+  header.key_buckets = bucket_count(header.num_keys);
+  header.value_buckets = bucket_count(header.num_values);
+  header.pair_buckets = bucket_count(header.num_pairs);
+
+  size_t lengths[NUM_SECTIONS] = {
+      (header.num_keys + 1) * sizeof(struct snapshot_string),
+      (header.num_values + 1) * sizeof(struct snapshot_string),
+      header.key_buckets * sizeof(uint32_t),
+      header.value_buckets * sizeof(uint32_t),
+      (header.num_keys + 1) * sizeof(struct snapshot_key),
+      (header.num_pairs + 1) * sizeof(struct snapshot_pair),
+      header.pair_buckets * sizeof(uint32_t),
+      header.num_edges * sizeof(struct snapshot_edge),
+      header.blob_size};
+  size_t offset = align8(sizeof(header));
+  for (unsigned int i = 0; i < NUM_SECTIONS; i++) {
+    header.sections[i] = offset;
+    offset = align8(offset + lengths[i]);
+  }
+  header.size = offset;
+
+  unsigned char *image = calloc(1, offset);
+  if (!image) {
+    error_callback("%s: calloc() failed\n", __func__);
+    free(pair_ids);
+    return NULL;
+  }
+  memcpy(image, &header, sizeof(header));
+
+  struct snapshot_string *keys =
+      (void *)(image + header.sections[SECTION_KEYS]);
+  struct snapshot_string *values =
+      (void *)(image + header.sections[SECTION_VALUES]);
+  uint32_t *key_buckets =
+      (void *)(image + header.sections[SECTION_KEY_BUCKETS]);
+  uint32_t *value_buckets =
+      (void *)(image + header.sections[SECTION_VALUE_BUCKETS]);
+  struct snapshot_key *current =
+      (void *)(image + header.sections[SECTION_CURRENT]);
+  struct snapshot_pair *pairs =
+      (void *)(image + header.sections[SECTION_PAIRS]);
+  uint32_t *pair_buckets =
+      (void *)(image + header.sections[SECTION_PAIR_BUCKETS]);
+  struct snapshot_edge *edges =
+      (void *)(image + header.sections[SECTION_EDGES]);
+  char *blob = (char *)image + header.sections[SECTION_BLOB];
+  uint32_t blob_used = 0;
+
+  for (unsigned int id = 1; id <= header.num_values; id++) {
+    const char *str = r_dict->values.strings[id];
+    uint32_t len = r_dict->values.lengths[id];
+    values[id] = (struct snapshot_string){blob_add(blob, &blob_used, str, len),
+                                          len};
+    bucket_insert(value_buckets, header.value_buckets,
+                  snapshot_hash(str, len), id);
+  }
+
+  for (unsigned int id = 1; id <= header.num_keys; id++) {
+    const char *str = r_dict->keys.strings[id];
+    uint32_t len = r_dict->keys.lengths[id];
+    keys[id] = (struct snapshot_string){blob_add(blob, &blob_used, str, len),
+                                        len};
+    bucket_insert(key_buckets, header.key_buckets, snapshot_hash(str, len),
+                  id);
+
+    unsigned int value = r_dict->current[id];
+    current[id].value = value == OTHER_VALUE ? 0 : value;
+    if (!value) {
+      current[id].offset = NO_STRING;
+    } else if (value != OTHER_VALUE) {
+      current[id].offset = values[value].offset;
+    } else {
+      const char *other = current_string(r_dict, id);
+      current[id].offset = blob_add(blob, &blob_used, other, strlen(other));
+    }
+  }
+
+  uint32_t edge = 0;
+  for (unsigned int id = 1; id < table->num_nodes; id++) {
+    const struct pair_node *node = &table->nodes[id];
+    if (!pair_ids[id]) {
+      continue;
+    }
+
+    pairs[pair_ids[id]] = (struct snapshot_pair){
+        node->key, node->value, edge, node->masters.num, node->slaves.num};
+    bucket_insert(pair_buckets, header.pair_buckets,
+                  snapshot_pair_hash(node->key, node->value), pair_ids[id]);
+
+    for (unsigned int i = 0; i < node->masters.num; i++, edge++) {
+      const struct rule_edge *from = &node->masters.edges[i];
+      edges[edge] = (struct snapshot_edge){pair_ids[from->pair], from->key,
+                                           from->value};
+    }
+    for (unsigned int i = 0; i < node->slaves.num; i++, edge++) {
+      const struct rule_edge *from = &node->slaves.edges[i];
+      edges[edge] = (struct snapshot_edge){pair_ids[from->pair], from->key,
+                                           from->value};
+    }
+  }
+
+  free(pair_ids);
+  *size = header.size;
+
+  return image;
+}
+
+int restricted_dictionary_save(const struct restricted_dictionary *r_dict,
+                               const char *path) {
+  if (!r_dict || !path) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // the image is laid out from the tables of a dictionary that owns them
+  if (r_dict->parent) {
+    error_callback("%s: cannot save a fork\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // the format has no room for rule groups, patterns or TTLs
+  if (r_dict->pairs.num_groups) {
+    error_callback("%s: cannot save rule groups\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+  if (r_dict->patterns.num_patterns) {
+    error_callback("%s: cannot save patterns\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+  if (r_dict->wheel.num_timers) {
+    error_callback("%s: cannot save rules with a TTL\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  size_t size = 0;
+  unsigned char *image = build_image(r_dict, &size);
+  if (!image) {
+    error_callback("%s: build_image() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+
+  // written aside and renamed over path, so a crash never leaves half a
+  // snapshot behind
+  size_t tmp_len = strlen(path) + 5;
+  char *tmp = malloc(tmp_len);
+  if (!tmp) {
+    error_callback("%s: malloc() failed\n", __func__);
+    free(image);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+  snprintf(tmp, tmp_len, "%s.tmp", path);
+
+  int ret = RESTRICTED_DICTIONARY_OK;
+  FILE *file = fopen(tmp, "wb");
+  if (!file) {
+    error_callback("%s: fopen(%s) failed\n", __func__, tmp);
+    ret = RESTRICTED_DICTIONARY_EIO;
+  } else {
+    if (fwrite(image, 1, size, file) != size || fflush(file) != 0 ||
+        fsync(fileno(file)) != 0) {
+      error_callback("%s: writing %s failed\n", __func__, tmp);
+      ret = RESTRICTED_DICTIONARY_EIO;
+    }
+    if (fclose(file) != 0 && ret == RESTRICTED_DICTIONARY_OK) {
+      error_callback("%s: fclose(%s) failed\n", __func__, tmp);
+      ret = RESTRICTED_DICTIONARY_EIO;
+    }
+    if (ret == RESTRICTED_DICTIONARY_OK && rename(tmp, path) != 0) {
+      error_callback("%s: rename(%s) failed\n", __func__, tmp);
+      ret = RESTRICTED_DICTIONARY_EIO;
+    }
+    if (ret != RESTRICTED_DICTIONARY_OK) {
+      unlink(tmp);
+    }
+  }
+
+  free(tmp);
+  free(image);
+
+  return ret;
+}
+
+static int section_fits(const struct snapshot_header *header, size_t size,
+                        unsigned int section, uint64_t num, size_t elem) {
+  uint64_t offset = header->sections[section];
+  return offset % 8 == 0 && offset <= size && num <= (size - offset) / elem;
+}
+
+static int ids_fit(const uint32_t *buckets, uint32_t num_buckets,
+                   uint32_t num) {
+  for (uint32_t i = 0; i < num_buckets; i++) {
+    if (buckets[i] > num) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int string_fits(const struct restricted_snapshot *snap,
+                       const struct snapshot_string *str) {
+  return str->offset < snap->header->blob_size &&
+         str->len < snap->header->blob_size - str->offset &&
+         snap->blob[str->offset + str->len] == '\0';
+}
+
+// Points snap at the sections of the image after checking every offset and
+// id in it, so queries never have to
+static int attach_image(struct restricted_snapshot *snap,
+                        const unsigned char *base, size_t size) {
+  const struct snapshot_header *header = (const void *)base;
+  if (size < sizeof(struct snapshot_header) ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION ||
+      header->byte_order != SNAPSHOT_BYTE_ORDER || header->size != size) {
+    return -1;
+  }
+
+  // the tables must have an empty bucket for probes to end on
+  uint32_t buckets[] = {header->key_buckets, header->value_buckets,
+                        header->pair_buckets};
+  uint32_t nums[] = {header->num_keys, header->num_values, header->num_pairs};
+  for (unsigned int i = 0; i < 3; i++) {
+    if (!buckets[i] || (buckets[i] & (buckets[i] - 1)) ||
+        nums[i] >= buckets[i]) {
+      return -1;
+    }
+  }
+
+  if (!section_fits(header, size, SECTION_KEYS, header->num_keys + 1ull,
+                    sizeof(struct snapshot_string)) ||
+      !section_fits(header, size, SECTION_VALUES, header->num_values + 1ull,
+                    sizeof(struct snapshot_string)) ||
+      !section_fits(header, size, SECTION_KEY_BUCKETS, header->key_buckets,
+                    sizeof(uint32_t)) ||
+      !section_fits(header, size, SECTION_VALUE_BUCKETS,
+                    header->value_buckets, sizeof(uint32_t)) ||
+      !section_fits(header, size, SECTION_CURRENT, header->num_keys + 1ull,
+                    sizeof(struct snapshot_key)) ||
+      !section_fits(header, size, SECTION_PAIRS, header->num_pairs + 1ull,
+                    sizeof(struct snapshot_pair)) ||
+      !section_fits(header, size, SECTION_PAIR_BUCKETS, header->pair_buckets,
+                    sizeof(uint32_t)) ||
+      !section_fits(header, size, SECTION_EDGES, header->num_edges,
+                    sizeof(struct snapshot_edge)) ||
+      !section_fits(header, size, SECTION_BLOB, header->blob_size, 1)) {
+    return -1;
+  }
+
+  snap->base = base;
+  snap->size = size;
+  snap->header = header;
+  snap->keys = (const void *)(base + header->sections[SECTION_KEYS]);
+  snap->values = (const void *)(base + header->sections[SECTION_VALUES]);
+  snap->key_buckets =
+      (const void *)(base + header->sections[SECTION_KEY_BUCKETS]);
+  snap->value_buckets =
+      (const void *)(base + header->sections[SECTION_VALUE_BUCKETS]);
+  snap->current = (const void *)(base + header->sections[SECTION_CURRENT]);
+  snap->pairs = (const void *)(base + header->sections[SECTION_PAIRS]);
+  snap->pair_buckets =
+      (const void *)(base + header->sections[SECTION_PAIR_BUCKETS]);
+  snap->edges = (const void *)(base + header->sections[SECTION_EDGES]);
+  snap->blob = (const char *)base + header->sections[SECTION_BLOB];
+
+  if (!ids_fit(snap->key_buckets, header->key_buckets, header->num_keys) ||
+      !ids_fit(snap->value_buckets, header->value_buckets,
+               header->num_values) ||
+      !ids_fit(snap->pair_buckets, header->pair_buckets, header->num_pairs)) {
+    return -1;
+  }
+
+  for (uint32_t id = 1; id <= header->num_keys; id++) {
+    const struct snapshot_key *current = &snap->current[id];
+    if (!string_fits(snap, &snap->keys[id]) ||
+        current->value > header->num_values ||
+        (current->offset != NO_STRING &&
+         current->offset >= header->blob_size)) {
+      return -1;
+    }
+  }
+  for (uint32_t id = 1; id <= header->num_values; id++) {
+    if (!string_fits(snap, &snap->values[id])) {
+      return -1;
+    }
+  }
+  // the blob ends in a NUL, so every offset in it starts a C string
+  if (header->blob_size && snap->blob[header->blob_size - 1] != '\0') {
+    return -1;
+  }
+
+  for (uint32_t id = 1; id <= header->num_pairs; id++) {
+    const struct snapshot_pair *pair = &snap->pairs[id];
+    if (!pair->key || pair->key > header->num_keys || !pair->value ||
+        pair->value > header->num_values ||
+        (uint64_t)pair->edges + pair->num_masters + pair->num_slaves >
+            header->num_edges) {
+      return -1;
+    }
+  }
+  for (uint32_t i = 0; i < header->num_edges; i++) {
+    const struct snapshot_edge *edge = &snap->edges[i];
+    if (!edge->pair || edge->pair > header->num_pairs ||
+        edge->key > header->num_keys || edge->value > header->num_values) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+struct restricted_snapshot *restricted_snapshot_open(const char *path) {
+  if (!path) {
+    error_callback("%s: invalid input\n", __func__);
+    return NULL;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    error_callback("%s: open(%s) failed\n", __func__, path);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+    error_callback("%s: fstat(%s) failed\n", __func__, path);
+    close(fd);
+    return NULL;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    error_callback("%s: mmap(%s) failed\n", __func__, path);
+    return NULL;
+  }
+
+  struct restricted_snapshot *snap =
+      calloc(1, sizeof(struct restricted_snapshot));
+  if (!snap) {
+    error_callback("%s: calloc() failed\n", __func__);
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  if (attach_image(snap, base, st.st_size) == -1) {
+    error_callback("%s: %s is not a valid snapshot\n", __func__, path);
+    munmap(base, st.st_size);
+    free(snap);
+    return NULL;
+  }
+
+  return snap;
+}
+
+void restricted_snapshot_close(struct restricted_snapshot *snap) {
+  if (!snap) {
+    return;
+  }
+
+  munmap((void *)snap->base, snap->size);
+  free(snap);
+}
+
+const char *restricted_snapshot_get(const struct restricted_snapshot *snap,
+                                    const char *key, const char *def) {
+  if (!snap || !key) {
+    error_callback("%s: invalid input\n", __func__);
+    return def;
+  }
+
+  uint32_t id = find_string(snap, snap->key_buckets, snap->header->key_buckets,
+                            snap->keys, key);
+  if (!id || snap->current[id].offset == NO_STRING) {
+    return def;
+  }
+
+  return snap->blob + snap->current[id].offset;
+}
+
+static void fill_conflict(const struct restricted_snapshot *snap,
+                          struct restricted_dictionary_conflict *conflict,
+                          uint32_t slave, uint32_t master) {
+  if (!conflict) {
+    return;
+  }
+
+  const struct snapshot_pair *s = &snap->pairs[slave];
+  const struct snapshot_pair *m = &snap->pairs[master];
+  conflict->index = 0;
+  conflict->slave_key = snap->blob + snap->keys[s->key].offset;
+  conflict->slave_value = snap->blob + snap->values[s->value].offset;
+  conflict->master_key = snap->blob + snap->keys[m->key].offset;
+  conflict->master_value = snap->blob + snap->values[m->value].offset;
+}
+
+int restricted_snapshot_can_set(
+    const struct restricted_snapshot *snap, const char *key, const char *val,
+    struct restricted_dictionary_conflict *conflict) {
+  if (!snap || !key || !val) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  uint32_t key_id = find_string(snap, snap->key_buckets,
+                                snap->header->key_buckets, snap->keys, key);
+  uint32_t value_id =
+      key_id ? find_string(snap, snap->value_buckets,
+                           snap->header->value_buckets, snap->values, val)
+             : 0;
+  uint32_t pair_id = value_id ? find_pair(snap, key_id, value_id) : 0;
+  if (!pair_id) {
+    return 1;
+  }
+
+  const struct snapshot_pair *pair = &snap->pairs[pair_id];
+  const struct snapshot_edge *edge = &snap->edges[pair->edges];
+
+  for (uint32_t i = 0; i < pair->num_masters; i++, edge++) {
+    if (snap->current[edge->key].value == edge->value) {
+      fill_conflict(snap, conflict, pair_id, edge->pair);
+      return 0;
+    }
+  }
+
+  for (uint32_t i = 0; i < pair->num_slaves; i++, edge++) {
+    if (edge->key != pair->key &&
+        snap->current[edge->key].value == edge->value) {
+      fill_conflict(snap, conflict, edge->pair, pair_id);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+struct restricted_dictionary *restricted_dictionary_load(const char *path,
+                                                         unsigned int flags) {
+  struct restricted_snapshot *snap = restricted_snapshot_open(path);
+  if (!snap) {
+    error_callback("%s: restricted_snapshot_open() failed\n", __func__);
+    return NULL;
+  }
+
+  const struct snapshot_header *header = snap->header;
+  struct restricted_dictionary *r_dict =
+      restricted_dictionary_new_ex(header->num_keys, flags);
+  if (!r_dict) {
+    error_callback("%s: restricted_dictionary_new_ex() failed\n", __func__);
+    restricted_snapshot_close(snap);
+    return NULL;
+  }
+
+  // values first, a rule added later never refuses what is already set
+  for (uint32_t id = 1; id <= header->num_keys; id++) {
+    if (snap->current[id].offset != NO_STRING &&
+        restricted_dictionary_set(r_dict, snap->blob + snap->keys[id].offset,
+                                  snap->blob + snap->current[id].offset) !=
+            0) {
+      goto fail;
+    }
+  }
+
+  // rules straight from the ids, nothing is parsed
+  for (uint32_t id = 1; id <= header->num_pairs; id++) {
+    const struct snapshot_pair *pair = &snap->pairs[id];
+    struct restricted_pair slave = {snap->blob + snap->keys[pair->key].offset,
+                                    snap->keys[pair->key].len,
+                                    snap->blob +
+                                        snap->values[pair->value].offset,
+                                    snap->values[pair->value].len};
+
+    for (uint32_t i = 0; i < pair->num_masters; i++) {
+      const struct snapshot_pair *other =
+          &snap->pairs[snap->edges[pair->edges + i].pair];
+      struct restricted_pair master = {
+          snap->blob + snap->keys[other->key].offset,
+          snap->keys[other->key].len,
+          snap->blob + snap->values[other->value].offset,
+          snap->values[other->value].len};
+      if (restricted_dictionary_restrict_pair(r_dict, &slave, &master) != 0) {
+        goto fail;
+      }
+    }
+  }
+
+  restricted_snapshot_close(snap);
+
+  return r_dict;
+
+fail:
+  error_callback("%s: rebuilding %s failed\n", __func__, path);
+  restricted_dictionary_del(r_dict);
+  restricted_snapshot_close(snap);
+  return NULL;
+}
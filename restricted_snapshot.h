@@ -0,0 +1,28 @@
+#ifndef RESTRICTED_SNAPSHOT_H
+#define RESTRICTED_SNAPSHOT_H
+
+#include "restricted_dictionary.h"
+
+// A read-only image of a restricted_dictionary, its set values and its rules,
+// that is queried in place. Opened from a file the image is mapped and no
+// entry is copied or allocated.
+struct restricted_snapshot;
+
+int restricted_dictionary_save(const struct restricted_dictionary *r_dict,
+                               const char *path);
+// Builds a dictionary holding what the snapshot at path holds
+struct restricted_dictionary *restricted_dictionary_load(const char *path,
+                                                         unsigned int flags);
+
+struct restricted_snapshot *restricted_snapshot_open(const char *path);
+void restricted_snapshot_close(struct restricted_snapshot *snap);
+
+// The returned string lives as long as the snapshot is open
+const char *restricted_snapshot_get(const struct restricted_snapshot *snap,
+                                    const char *key, const char *def);
+// Same as restricted_dictionary_can_set() against the saved state
+int restricted_snapshot_can_set(
+    const struct restricted_snapshot *snap, const char *key, const char *val,
+    struct restricted_dictionary_conflict *conflict);
+
+#endif // RESTRICTED_SNAPSHOT_H
@@ -0,0 +1,549 @@
+#include "sharded_restricted_dictionary.h"
+#include "concurrent_restricted_dictionary.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SHARDS 64
+#define COPIES_INIT_SIZE 16
+
+// The shards other than a key's own that hold a copy of its value, because
+// some of their rules refer to the key. Copies are never dropped, a shard
+// that has had a rule on a key keeps it up to date from then on.
+struct copy_entry {
+  char *key;
+  size_t key_len;
+  unsigned int hash;
+  uint64_t shards;
+};
+
+struct shard {
+  // taken before the write lock of c_dict, also guards copies
+  pthread_mutex_t lock;
+  struct concurrent_restricted_dictionary *c_dict;
+  // open addressing on the keys of this shard, at most half full
+  struct copy_entry *copies;
+  unsigned int num_copies;
+  unsigned int max_copies;
+};
+
+struct sharded_restricted_dictionary {
+  unsigned int num_shards;
+  struct shard shards[];
+};
+
+static int is_valid_pair(const char *pair) {
+  struct restricted_pair split;
+  return restricted_dictionary_split_pair(pair, strlen(pair), &split) == 0;
+}
+
+static unsigned int key_hash(const char *key, size_t key_len) {
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < key_len; i++) {
+    hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// The high bits of the hash pick the shard, the tables of a shard index with
+// the low ones
+static unsigned int shard_of(const struct sharded_restricted_dictionary *s_dict,
+                             unsigned int hash) {
+  return (unsigned int)(((uint64_t)hash * s_dict->num_shards) >> 32);
+}
+
+static uint64_t shard_bit(unsigned int shard) { return (uint64_t)1 << shard; }
+
+static struct copy_entry *copies_find(const struct shard *shard,
+                                      const char *key, size_t key_len,
+                                      unsigned int hash) {
+  if (!shard->max_copies) {
+    return NULL;
+  }
+
+  unsigned int mask = shard->max_copies - 1;
+  for (unsigned int slot = hash & mask;; slot = (slot + 1) & mask) {
+    struct copy_entry *entry = &shard->copies[slot];
+    if (!entry->key) {
+      return NULL;
+    }
+    if (entry->hash == hash && entry->key_len == key_len &&
+        memcmp(entry->key, key, key_len) == 0) {
+      return entry;
+    }
+  }
+}
+
+// Called with the shard locked
+static uint64_t copies_of(const struct shard *shard, const char *key,
+                          size_t key_len, unsigned int hash) {
+  const struct copy_entry *entry = copies_find(shard, key, key_len, hash);
+  return entry ? entry->shards : 0;
+}
+
+static int copies_grow(struct shard *shard) {
+  unsigned int max = shard->max_copies ? shard->max_copies * 2
+                                       : COPIES_INIT_SIZE;
+  struct copy_entry *copies = calloc(max, sizeof(struct copy_entry));
+  if (!copies) {
+    error_callback("%s: calloc() failed\n", __func__);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < shard->max_copies; i++) {
+    if (!shard->copies[i].key) {
+      continue;
+    }
+    unsigned int slot = shard->copies[i].hash & (max - 1);
+    while (copies[slot].key) {
+      slot = (slot + 1) & (max - 1);
+    }
+    copies[slot] = shard->copies[i];
+  }
+
+  free(shard->copies);
+  shard->copies = copies;
+  shard->max_copies = max;
+
+  return 0;
+}
+
+// Called with the shard locked, returns the entry of key, adding one with no
+// copies if needed, NULL on failure
+static struct copy_entry *copies_get(struct shard *shard, const char *key,
+                                     size_t key_len, unsigned int hash) {
+  struct copy_entry *entry = copies_find(shard, key, key_len, hash);
+  if (entry) {
+    return entry;
+  }
+
+  if ((shard->num_copies + 1) * 2 > shard->max_copies &&
+      copies_grow(shard) == -1) {
+    return NULL;
+  }
+
+  unsigned int mask = shard->max_copies - 1;
+  unsigned int slot = hash & mask;
+  while (shard->copies[slot].key) {
+    slot = (slot + 1) & mask;
+  }
+
+  entry = &shard->copies[slot];
+  entry->key = strndup(key, key_len);
+  if (!entry->key) {
+    error_callback("%s: strndup() failed\n", __func__);
+    return NULL;
+  }
+  entry->key_len = key_len;
+  entry->hash = hash;
+  entry->shards = 0;
+  shard->num_copies++;
+
+  return entry;
+}
+
+static void lock_shards(struct sharded_restricted_dictionary *s_dict,
+                        uint64_t shards) {
+  for (unsigned int i = 0; i < s_dict->num_shards; i++) {
+    if (shards & shard_bit(i)) {
+      pthread_mutex_lock(&s_dict->shards[i].lock);
+    }
+  }
+}
+
+static void unlock_shards(struct sharded_restricted_dictionary *s_dict,
+                          uint64_t shards) {
+  for (unsigned int i = 0; i < s_dict->num_shards; i++) {
+    if (shards & shard_bit(i)) {
+      pthread_mutex_unlock(&s_dict->shards[i].lock);
+    }
+  }
+}
+
+// Locks the shard of a key and the shards holding a copy of it, always in
+// shard order so writers never deadlock. Returns the shards locked.
+static uint64_t lock_key(struct sharded_restricted_dictionary *s_dict,
+                         const char *key, size_t key_len, unsigned int hash) {
+  unsigned int owner = shard_of(s_dict, hash);
+  struct shard *shard = &s_dict->shards[owner];
+
+  pthread_mutex_lock(&shard->lock);
+  uint64_t want = shard_bit(owner) | copies_of(shard, key, key_len, hash);
+  if (!(want & (shard_bit(owner) - 1))) {
+    lock_shards(s_dict, want & ~shard_bit(owner));
+    return want;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  // a shard before the owner holds a copy, start over in order. Copies are
+  // only ever added, so this ends.
+  for (;;) {
+    lock_shards(s_dict, want);
+    uint64_t copies = copies_of(shard, key, key_len, hash);
+    if (!(copies & ~want)) {
+      return want;
+    }
+    unlock_shards(s_dict, want);
+    want |= copies;
+  }
+}
+
+// Called with the shards locked. A change spanning shards is made in a
+// transaction on each, so none of their readers sees part of it.
+static int begin_shards(struct sharded_restricted_dictionary *s_dict,
+                        uint64_t shards) {
+  for (unsigned int i = 0; i < s_dict->num_shards; i++) {
+    if (!(shards & shard_bit(i))) {
+      continue;
+    }
+    int ret = concurrent_restricted_dictionary_begin(s_dict->shards[i].c_dict);
+    if (ret != 0) {
+      while (i-- > 0) {
+        if (shards & shard_bit(i)) {
+          concurrent_restricted_dictionary_rollback(s_dict->shards[i].c_dict);
+        }
+      }
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+static void end_shards(struct sharded_restricted_dictionary *s_dict,
+                       uint64_t shards, int commit) {
+  for (unsigned int i = 0; i < s_dict->num_shards; i++) {
+    if (!(shards & shard_bit(i))) {
+      continue;
+    }
+    if (commit) {
+      concurrent_restricted_dictionary_commit(s_dict->shards[i].c_dict);
+    } else {
+      concurrent_restricted_dictionary_rollback(s_dict->shards[i].c_dict);
+    }
+  }
+}
+
+// Copies the value key holds in from to to, nothing when it is not set
+static int copy_value(struct shard *from, struct shard *to, const char *key) {
+  char buf[64];
+  int len = concurrent_restricted_dictionary_get(from->c_dict, key, buf,
+                                                 sizeof(buf));
+  if (len < 0) {
+    return 0;
+  }
+  if ((size_t)len < sizeof(buf)) {
+    return concurrent_restricted_dictionary_set(to->c_dict, key, buf);
+  }
+
+  // the lock of from is held, the value cannot change in between
+  char *value = malloc(len + 1);
+  if (!value) {
+    error_callback("%s: malloc() failed\n", __func__);
+    return RESTRICTED_DICTIONARY_ENOMEM;
+  }
+  concurrent_restricted_dictionary_get(from->c_dict, key, value, len + 1);
+  int ret = concurrent_restricted_dictionary_set(to->c_dict, key, value);
+  free(value);
+
+  return ret;
+}
+
+struct sharded_restricted_dictionary *
+sharded_restricted_dictionary_new(unsigned int num_shards, unsigned int size,
+                                  unsigned int flags) {
+  if (!num_shards || num_shards > MAX_SHARDS) {
+    error_callback("%s: invalid input\n", __func__);
+    return NULL;
+  }
+
+  struct sharded_restricted_dictionary *s_dict =
+      calloc(1, sizeof(struct sharded_restricted_dictionary) +
+                    num_shards * sizeof(struct shard));
+  if (!s_dict) {
+    error_callback("%s: calloc() failed\n", __func__);
+    return NULL;
+  }
+
+  for (unsigned int i = 0; i < num_shards; i++) {
+    struct shard *shard = &s_dict->shards[i];
+    shard->c_dict =
+        concurrent_restricted_dictionary_new(size / num_shards + 1, flags);
+    if (!shard->c_dict) {
+      error_callback("%s: concurrent_restricted_dictionary_new() failed\n",
+                     __func__);
+      sharded_restricted_dictionary_del(s_dict);
+      return NULL;
+    }
+    pthread_mutex_init(&shard->lock, NULL);
+    s_dict->num_shards = i + 1;
+  }
+
+  return s_dict;
+}
+
+void sharded_restricted_dictionary_del(
+    struct sharded_restricted_dictionary *s_dict) {
+  if (!s_dict) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < s_dict->num_shards; i++) {
+    struct shard *shard = &s_dict->shards[i];
+    for (unsigned int j = 0; j < shard->max_copies; j++) {
+      free(shard->copies[j].key);
+    }
+    free(shard->copies);
+    pthread_mutex_destroy(&shard->lock);
+    concurrent_restricted_dictionary_del(shard->c_dict);
+  }
+
+  free(s_dict);
+}
+
+int sharded_restricted_dictionary_get(
+    struct sharded_restricted_dictionary *s_dict, const char *key, char *buf,
+    size_t len) {
+  if (!s_dict || !key) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int owner = shard_of(s_dict, key_hash(key, strlen(key)));
+  return concurrent_restricted_dictionary_get(s_dict->shards[owner].c_dict,
+                                              key, buf, len);
+}
+
+int sharded_restricted_dictionary_can_set(
+    struct sharded_restricted_dictionary *s_dict, const char *key,
+    const char *val) {
+  if (!s_dict || !key) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // the shard holds every rule on the key and the values they refer to
+  unsigned int owner = shard_of(s_dict, key_hash(key, strlen(key)));
+  return concurrent_restricted_dictionary_can_set(
+      s_dict->shards[owner].c_dict, key, val);
+}
+
+int sharded_restricted_dictionary_set(
+    struct sharded_restricted_dictionary *s_dict, const char *key,
+    const char *val) {
+  if (!s_dict || !key || !val) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  size_t key_len = strlen(key);
+  unsigned int hash = key_hash(key, key_len);
+  unsigned int owner = shard_of(s_dict, hash);
+  uint64_t held = lock_key(s_dict, key, key_len, hash);
+
+  int ret;
+  if (held == shard_bit(owner)) {
+    ret = concurrent_restricted_dictionary_set(s_dict->shards[owner].c_dict,
+                                               key, val);
+  } else if ((ret = begin_shards(s_dict, held)) == 0) {
+    ret = concurrent_restricted_dictionary_set(s_dict->shards[owner].c_dict,
+                                               key, val);
+    // a copy is never refused, the rules of its shard on the key are also
+    // the owner's and the values they refer to are the same in both
+    for (unsigned int i = 0; ret == 0 && i < s_dict->num_shards; i++) {
+      if (i != owner && (held & shard_bit(i))) {
+        ret = concurrent_restricted_dictionary_set(s_dict->shards[i].c_dict,
+                                                   key, val);
+      }
+    }
+    end_shards(s_dict, held, ret == 0);
+  }
+
+  unlock_shards(s_dict, held);
+
+  return ret;
+}
+
+// Adds the rule to the shards of both pairs. Where they differ each shard
+// gets a copy of the other's key before its first rule on it.
+static int add_rule(struct sharded_restricted_dictionary *s_dict,
+                    char *slave_pair, char *master_pair) {
+  if (!is_valid_pair(slave_pair) || !is_valid_pair(master_pair)) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  size_t slave_len = strchr(slave_pair, '=') - slave_pair;
+  size_t master_len = strchr(master_pair, '=') - master_pair;
+  unsigned int slave_hash = key_hash(slave_pair, slave_len);
+  unsigned int master_hash = key_hash(master_pair, master_len);
+  unsigned int slave_shard = shard_of(s_dict, slave_hash);
+  unsigned int master_shard = shard_of(s_dict, master_hash);
+  struct concurrent_restricted_dictionary *slave_dict =
+      s_dict->shards[slave_shard].c_dict;
+  struct concurrent_restricted_dictionary *master_dict =
+      s_dict->shards[master_shard].c_dict;
+  uint64_t held = shard_bit(slave_shard) | shard_bit(master_shard);
+
+  lock_shards(s_dict, held);
+  if (slave_shard == master_shard) {
+    int ret = concurrent_restricted_dictionary_restrict(slave_dict,
+                                                        slave_pair,
+                                                        master_pair);
+    unlock_shards(s_dict, held);
+    return ret;
+  }
+
+  char *slave_key = strndup(slave_pair, slave_len);
+  char *master_key = strndup(master_pair, master_len);
+  struct copy_entry *slave_copies =
+      copies_get(&s_dict->shards[slave_shard], slave_pair, slave_len,
+                 slave_hash);
+  struct copy_entry *master_copies =
+      copies_get(&s_dict->shards[master_shard], master_pair, master_len,
+                 master_hash);
+  int ret = RESTRICTED_DICTIONARY_ENOMEM;
+  if (!slave_key || !master_key || !slave_copies || !master_copies) {
+    error_callback("%s: copies_get() failed\n", __func__);
+  } else if ((ret = begin_shards(s_dict, held)) == 0) {
+    if (!(slave_copies->shards & shard_bit(master_shard))) {
+      ret = copy_value(&s_dict->shards[slave_shard],
+                       &s_dict->shards[master_shard], slave_key);
+    }
+    if (ret == 0 && !(master_copies->shards & shard_bit(slave_shard))) {
+      ret = copy_value(&s_dict->shards[master_shard],
+                       &s_dict->shards[slave_shard], master_key);
+    }
+    if (ret == 0) {
+      ret = concurrent_restricted_dictionary_restrict(slave_dict, slave_pair,
+                                                      master_pair);
+    }
+    if (ret == 0) {
+      ret = concurrent_restricted_dictionary_restrict(master_dict, slave_pair,
+                                                      master_pair);
+    }
+    end_shards(s_dict, held, ret == 0);
+  }
+
+  if (ret == 0) {
+    slave_copies->shards |= shard_bit(master_shard);
+    master_copies->shards |= shard_bit(slave_shard);
+  }
+
+  unlock_shards(s_dict, held);
+  free(slave_key);
+  free(master_key);
+
+  return ret;
+}
+
+int sharded_restricted_dictionary_restrict(
+    struct sharded_restricted_dictionary *s_dict, char *slave_pair,
+    char *master_pair) {
+  if (!s_dict || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  return add_rule(s_dict, slave_pair, master_pair);
+}
+
+int sharded_restricted_dictionary_multiRestrict(
+    struct sharded_restricted_dictionary *s_dict, char *slave_pair,
+    char **master_pairs, unsigned int num_masters) {
+  if (!s_dict || !slave_pair || !master_pairs || num_masters <= 0) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // the masters may each be in another shard, every rule is added on its own
+  int ret = 0;
+  for (unsigned int i = 0; i < num_masters; i++) {
+    int err = master_pairs[i] ? add_rule(s_dict, slave_pair, master_pairs[i])
+                              : RESTRICTED_DICTIONARY_EINVAL;
+    if (err != 0) {
+      error_callback("%s: add_rule(%d) failed, keep adding next one\n",
+                     __func__, i);
+      ret = err;
+    }
+  }
+
+  return ret;
+}
+
+int sharded_restricted_dictionary_unrestrict(
+    struct sharded_restricted_dictionary *s_dict, char *slave_pair,
+    char *master_pair) {
+  if (!s_dict || !slave_pair || !master_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (!is_valid_pair(slave_pair) || !is_valid_pair(master_pair)) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  unsigned int slave_shard = shard_of(
+      s_dict, key_hash(slave_pair, strchr(slave_pair, '=') - slave_pair));
+  unsigned int master_shard = shard_of(
+      s_dict, key_hash(master_pair, strchr(master_pair, '=') - master_pair));
+  uint64_t held = shard_bit(slave_shard) | shard_bit(master_shard);
+
+  // the copies stay, other rules may still need them
+  lock_shards(s_dict, held);
+  int ret = begin_shards(s_dict, held);
+  if (ret == 0) {
+    ret = concurrent_restricted_dictionary_unrestrict(
+        s_dict->shards[slave_shard].c_dict, slave_pair, master_pair);
+    if (ret == 0 && master_shard != slave_shard) {
+      ret = concurrent_restricted_dictionary_unrestrict(
+          s_dict->shards[master_shard].c_dict, slave_pair, master_pair);
+    }
+    end_shards(s_dict, held, ret == 0);
+  }
+  unlock_shards(s_dict, held);
+
+  return ret;
+}
+
+int sharded_restricted_dictionary_unrestrict_all(
+    struct sharded_restricted_dictionary *s_dict, char *slave_pair) {
+  if (!s_dict || !slave_pair) {
+    error_callback("%s: invalid input\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  if (!is_valid_pair(slave_pair)) {
+    error_callback("%s: invalid pair format, expected 'A=B'\n", __func__);
+    return RESTRICTED_DICTIONARY_EINVAL;
+  }
+
+  // the masters are in the slave's shard or in a shard holding a copy of its
+  // key, which may hold rules on its other values only
+  size_t key_len = strchr(slave_pair, '=') - slave_pair;
+  unsigned int hash = key_hash(slave_pair, key_len);
+  unsigned int owner = shard_of(s_dict, hash);
+  uint64_t held = lock_key(s_dict, slave_pair, key_len, hash);
+
+  int ret = begin_shards(s_dict, held);
+  if (ret == 0) {
+    ret = concurrent_restricted_dictionary_unrestrict_all(
+        s_dict->shards[owner].c_dict, slave_pair);
+    for (unsigned int i = 0; ret == 0 && i < s_dict->num_shards; i++) {
+      if (i == owner || !(held & shard_bit(i))) {
+        continue;
+      }
+      int err = concurrent_restricted_dictionary_unrestrict_all(
+          s_dict->shards[i].c_dict, slave_pair);
+      if (err != RESTRICTED_DICTIONARY_ENOTFOUND) {
+        ret = err;
+      }
+    }
+    end_shards(s_dict, held, ret == 0);
+  }
+  unlock_shards(s_dict, held);
+
+  return ret;
+}
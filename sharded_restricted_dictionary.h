@@ -0,0 +1,49 @@
+#ifndef SHARDED_RESTRICTED_DICTIONARY_H
+#define SHARDED_RESTRICTED_DICTIONARY_H
+
+#include "restricted_dictionary.h"
+
+// Keys spread by hash over up to 64 shards, each a
+// concurrent_restricted_dictionary with its own lock and rules, so writers of
+// keys in different shards do not wait for each other.
+//
+// A rule is kept by the shards of both its pairs, and a shard keeps a copy of
+// the value of every key of another shard its rules refer to. A set or check
+// therefore only looks at the shard of its key. A set locks that shard and
+// the shards holding a copy of the key, in shard order. Checks and gets take
+// no lock.
+struct sharded_restricted_dictionary;
+
+// size is spread over the shards
+struct sharded_restricted_dictionary *
+sharded_restricted_dictionary_new(unsigned int num_shards, unsigned int size,
+                                  unsigned int flags);
+// No other thread may use the dictionary any more
+void sharded_restricted_dictionary_del(
+    struct sharded_restricted_dictionary *s_dict);
+
+// Same as the concurrent_restricted_dictionary functions
+int sharded_restricted_dictionary_get(
+    struct sharded_restricted_dictionary *s_dict, const char *key, char *buf,
+    size_t len);
+int sharded_restricted_dictionary_can_set(
+    struct sharded_restricted_dictionary *s_dict, const char *key,
+    const char *val);
+
+// Return codes are those of restricted_dictionary.h
+int sharded_restricted_dictionary_set(
+    struct sharded_restricted_dictionary *s_dict, const char *key,
+    const char *val);
+int sharded_restricted_dictionary_restrict(
+    struct sharded_restricted_dictionary *s_dict, char *slave_pair,
+    char *master_pair);
+int sharded_restricted_dictionary_multiRestrict(
+    struct sharded_restricted_dictionary *s_dict, char *slave_pair,
+    char **master_pairs, unsigned int num_masters);
+int sharded_restricted_dictionary_unrestrict(
+    struct sharded_restricted_dictionary *s_dict, char *slave_pair,
+    char *master_pair);
+int sharded_restricted_dictionary_unrestrict_all(
+    struct sharded_restricted_dictionary *s_dict, char *slave_pair);
+
+#endif // SHARDED_RESTRICTED_DICTIONARY_H